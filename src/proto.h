@@ -1,11 +1,30 @@
 #ifndef PROTO_H
 #define PROTO_H
 
-#define PROTO_VERSION 1
+#define PROTO_VERSION 3
 #define SDPORT 8207
+#define RBD_MAX_TRANSFER (1024*1024)   /* max payload of a message, in bytes */
 
 enum rbdmsg_type { CMD=1, REP };
-enum rbdmsg_code { CMD_READ=1, CMD_WRITE, CMD_GETSZ, CMD_CLOSE, REP_OK=128, REP_ERR };
+enum rbdmsg_code { CMD_READ=1, CMD_WRITE, CMD_GETSZ, CMD_CLOSE, CMD_HELLO, CMD_STATS, REP_OK=128, REP_ERR };
+
+/* optional protocol features, negotiated with CMD_HELLO */
+#define RBD_FEAT_CRC 0x01              /* per block CRC32C of payloads */
+#define RBD_FEAT_ZLIB 0x02             /* zlib compressed payloads */
+#define RBD_FEAT_SESSION 0x04          /* writes sent again are not done twice */
+
+/* message flags */
+#define RBDMSG_ZLIB 0x01               /* the data in the payload is compressed.
+                                        * fsop_size keeps its raw size */
+#define RBDMSG_JSON 0x02               /* CMD_STATS: the report in JSON, not text */
+#define RBDMSG_REPLAYED 0x04           /* reply to a write of the session that
+                                        * was done before, not done again */
+
+/* with RBD_FEAT_CRC, CMD_WRITE payloads and CMD_READ replies carry the
+ * data followed by the CRC32C of every RBD_CRC_BLOCK bytes block of it. 
+ * checksums are always of the raw data, and are not compressed */
+#define RBD_CRC_BLOCK 512
+#define RBD_CRC_SIZE(n) ((((n) + RBD_CRC_BLOCK - 1) / RBD_CRC_BLOCK) * 4)
 
 struct rbdmsg_hdr {
     unsigned int version;              /* protocol version */
@@ -16,6 +35,30 @@ struct rbdmsg_hdr {
 
     unsigned int fsop_offset_sectors;  /* only used for file operation */
     unsigned int fsop_size;            /* commands */
+
+    unsigned int resize_gen;           /* storage resize generation, set in
+                                        * every reply. when it changes the 
+                                        * client must fetch the size again */
+    unsigned int flags;                /* RBDMSG_* flags */
+};
+
+/* CMD_STATS replies carry a report of the request stats of the SD, as
+ * text, for people and tools, not for the module */
+
+/* CMD_HELLO payload, both in the command and in the reply. the client 
+ * sends the features it wants, the SD answers with those it accepted.
+ * clients that do not want RBD_FEAT_SESSION may send only the first 
+ * RBD_HELLO_MINSIZE bytes, and get as many back
+ *
+ * with RBD_FEAT_SESSION, the client names a session that it keeps on 
+ * new connections, with message ids that go on increasing. a CMD_WRITE 
+ * sent again with the id of one of the last writes of the session is 
+ * answered as it was then, flagged RBDMSG_REPLAYED, and not done again */
+struct rbdmsg_hello {
+    unsigned int features;             /* RBD_FEAT_* flags */
+    unsigned int max_transfer;         /* max data size of a message */
+    unsigned long long session;        /* chosen by the client, not 0 */
 };
+#define RBD_HELLO_MINSIZE 8
 
 #endif
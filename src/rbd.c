@@ -21,6 +21,14 @@
 #include <asm/uaccess.h>        /* copy_to_user, etc */
 #include <asm/semaphore.h>      /* up, down, etc */
 #include <linux/configfs.h>
+#include <linux/crc32c.h>       /* crc32c */
+#include <linux/vmalloc.h>      /* vmalloc */
+#include <linux/zlib.h>         /* zlib_deflate, zlib_inflate */
+#include <linux/random.h>       /* get_random_bytes */
+#include <linux/percpu.h>       /* per_cpu_ptr */
+#include <linux/time.h>         /* do_gettimeofday */
+#include <linux/wait.h>         /* wait_event_timeout */
+#include <net/sock.h>           /* sk_rcvtimeo, sk_sndtimeo */
 
 #include "rbd.h"
 
@@ -36,6 +44,7 @@ module_param(debug, int, S_IRUGO);
 
 LIST_HEAD(rbd_devices);
 int rbd_lastminor = 0;      /* to save las minor used */
+static struct workqueue_struct *rbd_wq;     /* reconnects to the SDs */
 
 unsigned int inet_addr(char *str)
 {
@@ -46,65 +55,337 @@ unsigned int inet_addr(char *str)
     return *(unsigned int*)arr;
 } 
 
-int sd_connect(struct rbd_dev *dev)
+static inline u32 rbd_crc(const void *buf, size_t len)
 {
-    struct sockaddr_in saddr;
-    int r = -1;
+    return ~crc32c(~0, buf, len);
+}
+
+/* checksum every RBD_CRC_BLOCK bytes block of buf into crcs */
+static void rbd_crc_blocks(const char *buf, unsigned long size, u32 *crcs)
+{
+    unsigned long len;
+
+    for (; size; size -= len, buf += len) {
+        len = min(size, (unsigned long)RBD_CRC_BLOCK);
+        *crcs++ = rbd_crc(buf, len);
+    }
+}
+
+static inline u64 rbd_now_us(void)
+{
+    struct timeval tv;
+
+    do_gettimeofday(&tv);
+    return (u64)tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+/* zlib streams and buffer for RBD_FEAT_ZLIB */
+static int rbd_zip_init(struct rbd_sd *sd)
+{
+    sd->zbuf = vmalloc(RBD_MAX_TRANSFER);
+    sd->zdef.workspace = vmalloc(zlib_deflate_workspacesize());
+    sd->zinf.workspace = vmalloc(zlib_inflate_workspacesize());
+    if (!sd->zbuf || !sd->zdef.workspace || !sd->zinf.workspace)
+        return -ENOMEM;
+    if (zlib_deflateInit(&sd->zdef, 1) != Z_OK || zlib_inflateInit(&sd->zinf) != Z_OK)
+        return -EINVAL;
+    sd->zskip = sd->zbackoff = 0;
+    return 0;
+}
+
+static void rbd_zip_free(struct rbd_sd *sd)
+{
+    if (sd->zdef.workspace) {
+        zlib_deflateEnd(&sd->zdef);
+        vfree(sd->zdef.workspace);
+        sd->zdef.workspace = NULL;
+    }
+    if (sd->zinf.workspace) {
+        zlib_inflateEnd(&sd->zinf);
+        vfree(sd->zinf.workspace);
+        sd->zinf.workspace = NULL;
+    }
+    vfree(sd->zbuf);
+    sd->zbuf = NULL;
+}
 
-    sd_disconnect(dev);
+/* 
+ * compress nbytes of buf into sd->zbuf. returns the compressed size, or 0 
+ * if the data must be sent raw: it does not shrink below RBD_ZIP_MAXRATIO,
+ * or the previous ones did not and we are backing off
+ */
+static unsigned long rbd_zip(struct rbd_sd *sd, char *buf, unsigned long nbytes)
+{
+    struct z_stream_s *z = &sd->zdef;
+    u64 t;
+    int ret;
+
+    sd->zraw_bytes += nbytes;
+    if (sd->zskip) {
+        sd->zskip--;
+        sd->zwire_bytes += nbytes;
+        return 0;
+    }
 
-    printk(KERN_WARNING "RBD: connecting to SD\n");
+    t = rbd_now_us();
+    zlib_deflateReset(z);
+    z->next_in = buf;
+    z->avail_in = nbytes;
+    z->next_out = sd->zbuf;
+    z->avail_out = nbytes / 100 * RBD_ZIP_MAXRATIO;
+    ret = zlib_deflate(z, Z_FINISH);
+    sd->zip_us += rbd_now_us() - t;
+    if (ret != Z_STREAM_END) {
+        sd->zbackoff = sd->zbackoff ? min_t(unsigned int, sd->zbackoff * 2, RBD_ZIP_MAXBACKOFF) : 1;
+        sd->zskip = sd->zbackoff;
+        sd->zwire_bytes += nbytes;
+        return 0;
+    }
+    sd->zbackoff = 0;
+    sd->zwire_bytes += z->total_out;
+    return z->total_out;
+}
+
+/* uncompress len bytes of sd->zbuf into exactly nbytes of buf */
+static int rbd_unzip(struct rbd_sd *sd, unsigned long len, char *buf, unsigned long nbytes)
+{
+    struct z_stream_s *z = &sd->zinf;
+    u64 t = rbd_now_us();
+    int ret;
+
+    zlib_inflateReset(z);
+    z->next_in = sd->zbuf;
+    z->avail_in = len;
+    z->next_out = buf;
+    z->avail_out = nbytes;
+    ret = zlib_inflate(z, Z_FINISH);
+    sd->unzip_us += rbd_now_us() - t;
+    if (ret != Z_STREAM_END || z->total_out != nbytes)
+        return -1;
+    sd->zraw_bytes += nbytes;
+    sd->zwire_bytes += len;
+    return 0;
+}
+
+static int rbd_sock_sendv(struct socket *sock, struct kvec *iov, int n);
+static int rbd_sock_recv(struct socket *sock, void *buf, size_t size);
+
+/*
+ * negotiate optional protocol features on sock, a new connection to sd,
+ * into *features. only done when some feature is wanted, so that older
+ * SDs keep working
+ */
+static int sd_hello(struct rbd_sd *sd, struct socket *sock, unsigned int *features)
+{
+    struct rbdmsg_hdr msg, rsp;
+    struct rbdmsg_hello hello;
+    struct kvec iov[2];
+    unsigned int want = sd->dev->want_features;
+    size_t size = want & RBD_FEAT_SESSION ? sizeof(hello) : RBD_HELLO_MINSIZE;
 
-    r = sock_create(AF_INET, SOCK_STREAM, IPPROTO_TCP, &dev->sd_socket);
+    *features = 0;
+    if (!want)
+        return 0;
+
+    msg.version = PROTO_VERSION;
+    msg.type = CMD;
+    msg.code = CMD_HELLO;
+    msg.id = 0;                 /* sd->msguid is the transfers' */
+    msg.flags = 0;
+    msg.payload_size = size;
+    hello.features = want;
+    hello.max_transfer = RBD_MAX_TRANSFER;
+    hello.session = sd->session;
+
+    iov[0].iov_base = &msg;
+    iov[0].iov_len = sizeof(msg);
+    iov[1].iov_base = &hello;
+    iov[1].iov_len = size;
+    if (rbd_sock_sendv(sock, iov, 2) < 0)
+        return -1;
+    if (rbd_sock_recv(sock, &rsp, sizeof(rsp)) < 0 || rsp.payload_size != size)
+        return -1;
+    if (rbd_sock_recv(sock, &hello, size) < 0)
+        return -1;
+    *features = hello.features;
+    if (*features != want)
+        printk(KERN_WARNING "RBD: SD %s:%d only accepted features %x of %x\n", 
+               sd->host, sd->port, *features, want);
+    return 0;
+}
+
+/* 
+ * timeout of the sends and receives on the SD connection, so that they
+ * end by deadline (in jiffies, 0 for none)
+ */
+static void sd_timeout(struct rbd_sd *sd, unsigned long deadline)
+{
+    long t = MAX_SCHEDULE_TIMEOUT;
+
+    if (!sd->socket)
+        return;
+    if (deadline)
+        t = time_before(jiffies, deadline) ? deadline - jiffies : 1;
+    sd->socket->sk->sk_sndtimeo = sd->socket->sk->sk_rcvtimeo = t;
+}
+
+static void sd_release(struct rbd_sd *sd)
+{
+    sock_release(sd->socket);
+    sd->socket = NULL;
+}
+
+/*
+ * the connection failed: drop it, and leave the connect work to make a
+ * new one, so that the I/O path never waits on a connect. must be called
+ * with sd->mutex held
+ */
+static void sd_broken(struct rbd_sd *sd)
+{
+    if (sd->socket)
+        sd_release(sd);
+    if (sd->broken)
+        return;
+    printk(KERN_WARNING "RBD: SD %s:%d | connection lost\n", sd->host, sd->port);
+    sd->broken = 1;
+    queue_work(rbd_wq, &sd->connect_work);
+}
+
+/*
+ * make a new connection to sd and negotiate its features, without 
+ * sd->mutex: transfers to the other SDs, which take every mutex, go on
+ * meanwhile. returns the socket, or NULL
+ */
+static struct socket *sd_open(struct rbd_sd *sd, unsigned int *features)
+{
+    struct sockaddr_in saddr;
+    struct socket *sock;
+    int r;
+
+    printk(KERN_WARNING "RBD: connecting to SD %s:%d\n", sd->host, sd->port);
+
+    r = sock_create(AF_INET, SOCK_STREAM, IPPROTO_TCP, &sock);
     if (r < 0) {
         printk(KERN_ERR "RBD: error %d creating socket\n", r);
-        return -1;
+        return NULL;
     }
+    sock->sk->sk_sndtimeo = sock->sk->sk_rcvtimeo = RBD_CONNECT_TIMEOUT;
 
     memset(&saddr, 0, sizeof(saddr));
     saddr.sin_family = AF_INET;
-    saddr.sin_port = htons(dev->sd_port);
-    saddr.sin_addr.s_addr = dev->sd_addr;
+    saddr.sin_port = htons(sd->port);
+    saddr.sin_addr.s_addr = sd->addr;
 
-    r = dev->sd_socket->ops->connect(dev->sd_socket, (struct sockaddr *)&saddr, sizeof(saddr), O_RDWR);
+    r = sock->ops->connect(sock, (struct sockaddr *)&saddr, sizeof(saddr), O_RDWR);
     if (r && (r != -EINPROGRESS)) {
         printk(KERN_ERR "RBD: connecting to SD %d\n", r);
-        return -1;
+        sock_release(sock);
+        return NULL;
+    }
+    if (sd_hello(sd, sock, features)) {
+        printk(KERN_ERR "RBD: feature negotiation with SD failed\n");
+        sock_release(sock);
+        return NULL;
     }
+    return sock;
+}
+
+/* make sock, from sd_open, the connection to sd. must be called with 
+ * sd->mutex held */
+static void sd_attach(struct rbd_sd *sd, struct socket *sock, unsigned int features)
+{
+    sd_disconnect(sd);
+    sd->socket = sock;
+    sd->features = features;
+    sd->conngen++;
+}
 
+int sd_connect(struct rbd_sd *sd)
+{
+    struct socket *sock;
+    unsigned int features;
+
+    if (!(sock = sd_open(sd, &features)))
+        return -1;
+    down(&sd->mutex);
+    sd_attach(sd, sock, features);
+    up(&sd->mutex);
     return 0;
 }
 
-int sd_disconnect(struct rbd_dev *dev)
+/*
+ * connect again to an SD that was lost, retrying after a backoff that
+ * doubles on every failure. then wake up the transfers waiting to send
+ * their pieces again. the device may be disabled while it connects: 
+ * that clears sd->broken
+ */
+static void sd_connect_work(void *arg)
+{
+    struct rbd_sd *sd = arg;
+    struct socket *sock;
+    unsigned int features;
+
+    if (!sd->broken)
+        return;
+    sock = sd_open(sd, &features);
+
+    down(&sd->mutex);
+    if (!sd->broken) {
+        if (sock)
+            sock_release(sock);
+    } else if (!sock) {
+        queue_delayed_work(rbd_wq, &sd->connect_work, sd->backoff);
+        sd->backoff = min(sd->backoff * 2, (unsigned long)RBD_BACKOFF_MAX);
+    } else {
+        sd_attach(sd, sock, features);
+        sd->broken = 0;
+        sd->backoff = RBD_BACKOFF_MIN;
+        per_cpu_ptr(sd->dev->stats, get_cpu())->reconnects++;
+        put_cpu();
+        wake_up(&sd->wait);
+    }
+    up(&sd->mutex);
+}
+
+int sd_disconnect(struct rbd_sd *sd)
 {
     struct rbdmsg_hdr msg;
+    struct kvec iov;
     
-    if (!dev->sd_socket) 
+    if (!sd->socket) 
         return -1;
 
-    if (debug) printk(KERN_INFO "RBD: disconnecting from SD %u\n", (unsigned int)dev->sd_socket);
+    if (debug) printk(KERN_INFO "RBD: disconnecting from SD %u\n", (unsigned int)sd->socket);
 
     msg.version = PROTO_VERSION;
     msg.type = CMD;
     msg.code = CMD_CLOSE;
-    msg.id = ++dev->sd_msguid;
+    msg.id = ++sd->msguid;
+    msg.flags = 0;
     msg.payload_size = 0;    
     
-    sd_send(dev, &msg, sizeof(msg));
-    dev->sd_socket = NULL;
+    iov.iov_base = &msg;
+    iov.iov_len = sizeof(msg);
+    rbd_sock_sendv(sd->socket, &iov, 1);    /* a failed close is not reconnected */
+    sd_release(sd);
 
     return 0;
 }
 
-int sd_send(struct rbd_dev *dev, void *buf, size_t size)
+/*
+ * send a message made of several buffers (usually header and payload) 
+ * with as few kernel_sendmsg calls as possible
+ */
+static int rbd_sock_sendv(struct socket *sock, struct kvec *iov, int n)
 {
-    struct kvec iov;
     struct msghdr msg;
     int rv, sent=0;
+    size_t size = 0;
     unsigned flags = 0;
-    
-    iov.iov_base = buf;
-    iov.iov_len  = size;
+    int i;
+
+    for (i = 0; i < n; i++)
+        size += iov[i].iov_len;
     
     msg.msg_name = 0;
     msg.msg_namelen = 0;
@@ -113,151 +394,1027 @@ int sd_send(struct rbd_dev *dev, void *buf, size_t size)
     msg.msg_flags = flags | MSG_NOSIGNAL;
     
     do {
-        rv = kernel_sendmsg(dev->sd_socket, &msg, &iov, 1, size);
-        if (rv == -EAGAIN) {
-            /* TODO: impose a retry limit */
-            if (debug) printk(KERN_WARNING "RBD: send | EAGAIN\n");
-            continue;
-        }
+        rv = kernel_sendmsg(sock, &msg, iov, n, size - sent);
         if (rv == -EINTR) {
             if (debug) printk(KERN_WARNING "RBD: send | EINTR\n");
             flush_signals(current);
             rv = 0;
         }
-        if (rv == -EPIPE || rv == -ENOTCONN || rv == -ECONNRESET) {
-            /* TODO: impose a retry limit */
-            if (debug) printk(KERN_WARNING "RBD: send | ENOTCONN\n");
-            sd_connect(dev);
-            continue;
+        if (rv == -EAGAIN) {    /* the send timeout passed */
+            if (debug) printk(KERN_WARNING "RBD: send | timeout\n");
+            rv = -ETIMEDOUT;
         }
         if (rv < 0) {
-            if (debug) printk(KERN_WARNING "RBD: send | unknown error: %d\n", rv);
+            if (debug) printk(KERN_WARNING "RBD: send | error: %d\n", rv);
             return rv;
         }
         sent += rv;
-        iov.iov_base += rv;
-        iov.iov_len  -= rv;
+        /* skip what was sent */
+        while (n && rv >= iov->iov_len) {
+            rv -= iov->iov_len;
+            iov++;
+            n--;
+        }
+        if (n) {
+            iov->iov_base += rv;
+            iov->iov_len  -= rv;
+        }
     } while (sent < size);
 
     return sent;
 }
 
-
-int sd_recv(struct rbd_dev *dev, void *buf, size_t size)
+int sd_sendv(struct rbd_sd *sd, struct kvec *iov, int n)
 {
-    mm_segment_t oldfs;
-    struct iovec iov;
-    struct msghdr msg;
     int rv;
 
-    iov.iov_len = size;
+    if (!sd->socket)
+        return -ENOTCONN;
+    if ((rv = rbd_sock_sendv(sd->socket, iov, n)) < 0)
+        sd_broken(sd);
+    return rv;
+}
+
+int sd_send(struct rbd_sd *sd, void *buf, size_t size)
+{
+    struct kvec iov;
+
     iov.iov_base = buf;
+    iov.iov_len  = size;
+    return sd_sendv(sd, &iov, 1);
+}
 
-    msg.msg_control = NULL;
-    msg.msg_controllen = 0;
-    msg.msg_iovlen = 1;
-    msg.msg_iov = &iov;
-    msg.msg_name = NULL;
-    msg.msg_namelen = 0;
-    msg.msg_flags = MSG_WAITALL | MSG_NOSIGNAL;
 
-    oldfs = get_fs();
-    set_fs(KERNEL_DS);
+/*
+ * receive exactly size bytes, resuming after partial reads
+ */
+static int rbd_sock_recv(struct socket *sock, void *buf, size_t size)
+{
+    struct kvec iov;
+    struct msghdr msg;
+    int rv, received = 0;
 
-read_again:
-    rv = sock_recvmsg(dev->sd_socket, &msg, size, msg.msg_flags);
-    if (rv == -EAGAIN || rv == -ERESTARTSYS) {
-        if (debug) printk(KERN_WARNING "RBD: recv | EAGAIN\n");
-        goto read_again;
-    }
-    if (rv == -ENOTCONN) {
-        if (debug) printk(KERN_WARNING "RBD: recv | ENOTCONN\n");
-        sd_connect(dev);
-        goto read_again;
-    }
-    if (rv < 0) {
-        if (debug) printk(KERN_WARNING "RBD: recv | unknown error: %d\n", rv);
-    }
+    while (received < size) {
+        iov.iov_base = buf + received;
+        iov.iov_len = size - received;
 
-/* TODO: add this checks if necessary
-    } else {
-        iov.iov_base += rv;
-        iov.iov_len  -= rv;
+        msg.msg_control = NULL;
+        msg.msg_controllen = 0;
+        msg.msg_name = NULL;
+        msg.msg_namelen = 0;
+        msg.msg_flags = MSG_WAITALL | MSG_NOSIGNAL;
 
-        if (iov.iov_len > 0) {
-            goto read_again;
+        rv = kernel_recvmsg(sock, &msg, &iov, 1, iov.iov_len, msg.msg_flags);
+        if (rv == -EINTR || rv == -ERESTARTSYS) {
+            if (debug) printk(KERN_WARNING "RBD: recv | EINTR\n");
+            flush_signals(current);
+            continue;
+        }
+        if (rv == -EAGAIN) {    /* the receive timeout passed */
+            if (debug) printk(KERN_WARNING "RBD: recv | timeout\n");
+            rv = -ETIMEDOUT;
         }
+        if (rv == 0) {
+            if (debug) printk(KERN_WARNING "RBD: recv | connection closed by SD\n");
+            rv = -ECONNRESET;
+        }
+        if (rv < 0) {
+            if (debug) printk(KERN_WARNING "RBD: recv | error: %d\n", rv);
+            return rv;
+        }
+        received += rv;
     }
-    set_fs(oldfs);
-*/
+
+    return received;
+}
+
+int sd_recv(struct rbd_sd *sd, void *buf, size_t size)
+{
+    int rv;
+
+    if (!sd->socket)
+        return -ENOTCONN;
+    if ((rv = rbd_sock_recv(sd->socket, buf, size)) < 0)
+        sd_broken(sd);
     return rv;
 }
 
-int rbd_write(struct rbd_dev *dev, unsigned long sector, unsigned long nbytes, char *buf)
+/* 
+ * ask the SD for the storage size (in sectors). must be called with 
+ * sd->mutex held 
+ */
+static int sd_getsz(struct rbd_sd *sd, unsigned long *size)
 {
     struct rbdmsg_hdr msg, rsp;
 
     msg.version = PROTO_VERSION;
     msg.type = CMD;
-    msg.code = CMD_WRITE;
-    msg.id = ++dev->sd_msguid;
-    msg.payload_size = nbytes;    
-    msg.fsop_offset_sectors = sector;  /* initial sector */
-    msg.fsop_size = nbytes;            /* size in bytes */
+    msg.code = CMD_GETSZ;
+    msg.id = ++sd->msguid;
+    msg.flags = 0;
+    msg.payload_size = 0;    
     
-    down(&dev->sd_mutex);
-    if (debug) printk(KERN_NOTICE "RBD: write | dev %s | msg.id %d | offset %d | nbytes %d\n", 
-                      dev->name, msg.id, msg.fsop_offset_sectors, msg.fsop_size);
-    sd_send(dev, &msg, sizeof(msg));
-    sd_send(dev, buf, nbytes);
-    sd_recv(dev, &rsp, sizeof(rsp));
-    up(&dev->sd_mutex);
+    sd_timeout(sd, jiffies + RBD_CONNECT_TIMEOUT);
+    if (sd_send(sd, &msg, sizeof(msg)) < 0 || sd_recv(sd, &rsp, sizeof(rsp)) < 0)
+        return -1;
+    if (sizeof(*size) != rsp.payload_size) {
+        sd_broken(sd);
+        return -1;
+    }
+    if (sd_recv(sd, size, rsp.payload_size) < 0)
+        return -1;
+    sd->resize_gen = rsp.resize_gen;
+    return 0;
+}
+
+/*
+ * device size (in sectors). striped across several SDs, it is as many 
+ * whole stripe units of each one as the smallest of them holds
+ */
+static int rbd_getsz(struct rbd_dev *dev, unsigned long *size)
+{
+    unsigned long unit = dev->stripe_unit / RBD_SECSIZE;
+    unsigned long sdsize, smallest = ~0UL;
+    int i, ret = 0;
+
+    for (i = 0; i < dev->nsd && !ret; i++) {
+        down(&dev->sd[i].mutex);
+        ret = sd_getsz(&dev->sd[i], &sdsize);
+        up(&dev->sd[i].mutex);
+        smallest = min(smallest, sdsize);
+    }
+    if (ret)
+        return ret;
+    *size = dev->nsd == 1 ? smallest : smallest / unit * unit * dev->nsd;
+    return 0;
+}
 
+/* 
+ * the SD tags every reply with its resize generation. when it differs 
+ * from the one we got the size with, the storage was resized online
+ */
+static void rbd_check_resize(struct rbd_sd *sd, struct rbdmsg_hdr *rsp)
+{
+    struct rbd_dev *dev = sd->dev;
+
+    if (dev->active && rsp->resize_gen != sd->resize_gen)
+        schedule_work(&dev->resize_work);
+}
+
+/*
+ * split nbytes of buf, starting at a device sector, in pieces for the SDs.
+ * stripe unit k is stored on SD k % nsd, as its unit k / nsd. returns the
+ * number of pieces
+ */
+static int rbd_map(struct rbd_dev *dev, unsigned long sector, unsigned long nbytes, 
+                   char *buf, struct rbd_piece *p)
+{
+    unsigned long unit = dev->stripe_unit / RBD_SECSIZE;
+    unsigned long stripe, off, len;
+    int n;
+
+    if (dev->nsd == 1) {
+        p->sd = &dev->sd[0];
+        p->sector = sector;
+        p->nbytes = nbytes;
+        p->buf = buf;
+        return 1;
+    }
+
+    for (n = 0; nbytes; n++, p++) {
+        stripe = sector / unit;
+        off = sector % unit;
+        len = min(nbytes, (unit - off) * RBD_SECSIZE);
+        p->sd = &dev->sd[stripe % dev->nsd];
+        p->sector = stripe / dev->nsd * unit + off;
+        p->nbytes = len;
+        p->buf = buf;
+        sector += len / RBD_SECSIZE;
+        buf += len;
+        nbytes -= len;
+    }
+    return n;
+}
+
+/* send the read or write request of a piece, without waiting for the reply */
+static int rbd_send(struct rbd_piece *p, int write)
+{
+    struct rbd_sd *sd = p->sd;
+    struct rbdmsg_hdr msg;
+    struct kvec iov[3];
+    unsigned long zlen = 0;
+    u64 now = rbd_now_us();
+    int n = 1;
+
+    msg.version = PROTO_VERSION;
+    msg.type = CMD;
+    msg.code = write ? CMD_WRITE : CMD_READ;
+    if (!p->id)                           /* the same when sent again */
+        p->id = ++sd->msguid;
+    msg.id = p->id;
+    p->conngen = sd->conngen - 1;         /* not sent yet */
+    p->sent = 0;
+    msg.flags = 0;
+    msg.payload_size = 0;    
+    msg.fsop_offset_sectors = p->sector;  /* initial sector */
+    msg.fsop_size = p->nbytes;            /* size in bytes */
+    
+    if (debug) printk(KERN_NOTICE "RBD: %s | dev %s | SD %s:%d | msg.id %d | offset %d | nbytes %d\n", 
+                      write ? "write" : "read", sd->dev->name, sd->host, sd->port, 
+                      msg.id, msg.fsop_offset_sectors, msg.fsop_size);
+    iov[0].iov_base = &msg;
+    iov[0].iov_len = sizeof(msg);
+    if (write) {
+        iov[1].iov_base = p->buf;
+        iov[1].iov_len = p->nbytes;
+        msg.payload_size = p->nbytes;
+        n = 2;
+        if (sd->features & RBD_FEAT_ZLIB && (zlen = rbd_zip(sd, p->buf, p->nbytes))) {
+            iov[1].iov_base = sd->zbuf;
+            iov[1].iov_len = zlen;
+            msg.payload_size = zlen;
+            msg.flags |= RBDMSG_ZLIB;
+        }
+        if (sd->features & RBD_FEAT_CRC) {
+            rbd_crc_blocks(p->buf, p->nbytes, sd->crcbuf);
+            iov[2].iov_base = sd->crcbuf;
+            iov[2].iov_len = RBD_CRC_SIZE(p->nbytes);
+            msg.payload_size += RBD_CRC_SIZE(p->nbytes);
+            n = 3;
+        }
+    }
+    if (sd_sendv(sd, iov, n) < 0)
+        return -EIO;
+    p->conngen = sd->conngen;
+    p->sent = now;
+    atomic_inc(&sd->dev->inflight);
+    return 0;
+}
+
+/* wait for the reply to a piece, and receive its data if it was a read. 
+ * -ENOTCONN if it was lost with the connection, and can be sent again */
+static int rbd_recv(struct rbd_piece *p, int write)
+{
+    struct rbd_sd *sd = p->sd;
+    struct rbd_dev *dev = sd->dev;
+    struct rbdmsg_hdr rsp;
+    unsigned long nbytes = p->nbytes, crcsize = 0, zlen = 0, i;
+    int ret = 0;
+
+    /* not sent, or lost with a connection that was reset after sending it */
+    if (!sd->socket || p->conngen != sd->conngen)
+        return -ENOTCONN;
+
+    if (sd_recv(sd, &rsp, sizeof(rsp)) < 0)
+        return -ENOTCONN;
+    if (rsp.id != p->id) {
+        printk(KERN_ERR "RBD: recv | dev %s | reply %u to request %u\n", dev->name, rsp.id, p->id);
+        sd_broken(sd);
+        return -ENOTCONN;
+    }
+    rbd_check_resize(sd, &rsp);
+
+    if (write) {
+        if (rsp.flags & RBDMSG_REPLAYED && debug)
+            printk(KERN_INFO "RBD: write | dev %s | msg.id %u | done before, not again\n", 
+                   dev->name, p->id);
+        if (rsp.code == REP_ERR) {
+            printk(KERN_ERR "RBD: write | dev %s | SD %s:%d | sector %lu | refused by SD\n", 
+                   dev->name, sd->host, sd->port, p->sector);
+            return -EIO;
+        }
+        return 0;
+    }
+
+    if (sd->features & RBD_FEAT_CRC)
+        crcsize = RBD_CRC_SIZE(nbytes);
+    if (rsp.flags & RBDMSG_ZLIB && rsp.payload_size >= crcsize)
+        zlen = rsp.payload_size - crcsize;
+    if (rsp.code == REP_ERR)
+        ret = -EIO;
+    else if (zlen && sd->zbuf && zlen < nbytes) {
+        if (sd_recv(sd, sd->zbuf, zlen) < 0 || 
+            (crcsize && sd_recv(sd, sd->crcbuf, crcsize) < 0))
+            ret = -ENOTCONN;
+        else if (rbd_unzip(sd, zlen, p->buf, nbytes)) {
+            printk(KERN_ERR "RBD: read | dev %s | sector %lu | bad compressed payload\n", dev->name, p->sector);
+            ret = -EIO;
+        }
+    } else if (zlen || rsp.payload_size != nbytes + crcsize) {
+        /* can't tell where the next message starts: start over */
+        printk(KERN_ERR "RBD: read | dev %s | unexpected payload size %u\n", dev->name, rsp.payload_size);
+        sd_broken(sd);
+        ret = -ENOTCONN;
+    } else if (sd_recv(sd, p->buf, nbytes) < 0 || 
+             (crcsize && sd_recv(sd, sd->crcbuf, crcsize) < 0))
+        ret = -ENOTCONN;
+    for (i = 0; !ret && i < crcsize / 4; i++) {
+        if (sd->crcbuf[i] != rbd_crc(p->buf + i * RBD_CRC_BLOCK, 
+                                     min(nbytes - i * RBD_CRC_BLOCK, (unsigned long)RBD_CRC_BLOCK))) {
+            printk(KERN_ERR "RBD: read | dev %s | SD %s:%d | sector %lu | checksum error\n", 
+                   dev->name, sd->host, sd->port, p->sector + i * RBD_CRC_BLOCK / RBD_SECSIZE);
+            ret = -EIO;
+        }
+    }
+
+    return ret;
+}
+
+
+/* count the round trip of a piece that was sent, if it was answered */
+static void rbd_piece_done(struct rbd_dev *dev, struct rbd_piece *p, int write, int ret)
+{
+    u64 now, us = 0;
+    int b;
+
+    if (!p->sent)
+        return;
+    atomic_dec(&dev->inflight);
+    if (ret)
+        return;
+    now = rbd_now_us();
+    if (now > p->sent)          /* the clock may have been set back */
+        us = now - p->sent;
+    b = us >> 32 ? RBD_LAT_BUCKETS - 1 : min(fls((u32)us), RBD_LAT_BUCKETS - 1);
+    per_cpu_ptr(dev->stats, get_cpu())->lat[write][b]++;
+    put_cpu();
+}
+
+/* wait for the SDs of the pieces still to do to be connected again. 
+ * -ETIMEDOUT if the deadline passes first */
+static int rbd_wait_sds(struct rbd_piece *p, int n, unsigned long deadline)
+{
+    long t = MAX_SCHEDULE_TIMEOUT;
+    int i;
+
+    for (i = 0; i < n; i++) {
+        if (p[i].done)
+            continue;
+        if (deadline && !time_before(jiffies, deadline))
+            return -ETIMEDOUT;
+        if (deadline)
+            t = deadline - jiffies;
+        wait_event_timeout(p[i].sd->wait, !p[i].sd->broken, t);
+    }
+    if (deadline && !time_before(jiffies, deadline))
+        return -ETIMEDOUT;
+    return 0;
+}
+
+/*
+ * send every piece before waiting for any reply, so that all the SDs 
+ * work on them at the same time. replies come back in order on each 
+ * connection, so they are received in the order the pieces were sent.
+ * the pieces lost with a connection are sent again when the connect 
+ * work has it back, until the device timeout passes
+ */
+static int rbd_xfer(struct rbd_dev *dev, struct rbd_piece *p, int n, int write)
+{
+    unsigned long deadline = dev->timeout ? jiffies + dev->timeout * HZ : 0;
+    int ret = 0, left = n, i, r;
+
+    for (i = 0; i < n; i++) {
+        p[i].id = 0;
+        p[i].done = 0;
+    }
+    while (1) {
+        for (i = 0; i < dev->nsd; i++) {
+            down(&dev->sd[i].mutex);
+            sd_timeout(&dev->sd[i], deadline);
+        }
+        /* a piece not sent is found not answered below */
+        for (i = 0; i < n; i++)
+            if (!p[i].done)
+                rbd_send(&p[i], write);
+        for (i = 0; i < n; i++) {
+            if (p[i].done)
+                continue;
+            r = rbd_recv(&p[i], write);
+            rbd_piece_done(dev, &p[i], write, r);
+            if (r == -ENOTCONN)
+                continue;
+            if (r)
+                ret = -EIO;
+            p[i].done = 1;
+            left--;
+        }
+        for (i = dev->nsd - 1; i >= 0; i--)
+            up(&dev->sd[i].mutex);
+        if (!left)
+            return ret;
+        if (rbd_wait_sds(p, n, deadline)) {
+            printk(KERN_ERR "RBD: dev %s | %d pieces not done in %lus, failed\n", 
+                   dev->name, left, dev->timeout);
+            return -EIO;
+        }
+        if (debug) printk(KERN_INFO "RBD: dev %s | sending %d pieces again\n", dev->name, left);
+    }
+}
+
+/* transfer nbytes of a linear buffer at a device sector, in messages of
+ * RBD_MAX_TRANSFER bytes at most. p must hold the pieces of one */
+static int rbd_io(struct rbd_dev *dev, struct rbd_piece *p, unsigned long sector, 
+                  unsigned long nbytes, char *buf, int write)
+{
+    unsigned long len;
+    int ret = 0;
+
+    for (; !ret && nbytes; sector += len / RBD_SECSIZE, buf += len, nbytes -= len) {
+        len = min(nbytes, (unsigned long)RBD_MAX_TRANSFER);
+        ret = rbd_xfer(dev, p, rbd_map(dev, sector, len, buf, p), write);
+    }
+    return ret;
+}
+
+/* local write-back cache ------------------------------------------------------------ */
+
+/*
+ * With a cache (see the cache attribute), writes are appended as records
+ * to a log on a local file or block device, opened O_SYNC, and completed
+ * as soon as they are there. Partial 4K blocks are completed with their
+ * current data first, so that records hold whole blocks. A flush work
+ * sends the records to the SDs in log order, coalescing the ones that
+ * follow each other on the device, but never past a barrier request, so
+ * the SDs always hold the device as it was at some point. Small reads
+ * are logged too, as clean records that are not flushed.
+ *
+ * An index, kept in memory, has the slot of the latest copy of every
+ * block in the log. Reads take the blocks they find there from the log,
+ * and the rest from the SDs. Only the request work touches the index and
+ * takes the log slots back, up to the records already flushed, so the
+ * flush work only shares the log positions with it.
+ *
+ * The first block of the log records the first record that may not be
+ * flushed yet. It is rewritten after every flush, before the slots of the
+ * flushed records can be reused. Enabling the device reads the records 
+ * from there on, as long as they are whole and numbered in sequence, to
+ * rebuild the index and flush them again.
+ */
+
+static loff_t rbd_cache_pos(struct rbd_cache *c, unsigned long slot)
+{
+    return (loff_t)(slot + 1) * RBD_CACHE_BLOCK;
+}
+
+/* read or write exactly nbytes at pos of the cache */
+static int rbd_cache_io(struct rbd_cache *c, void *buf, unsigned long nbytes, loff_t pos, int write)
+{
+    mm_segment_t fs = get_fs();
+    ssize_t rv;
+
+    set_fs(KERNEL_DS);
+    while (nbytes) {
+        if (write)
+            rv = vfs_write(c->file, (const char __user *)buf, nbytes, &pos);
+        else
+            rv = vfs_read(c->file, (char __user *)buf, nbytes, &pos);
+        if (rv <= 0)
+            break;
+        buf += rv;
+        nbytes -= rv;
+    }
+    set_fs(fs);
+    return nbytes ? -EIO : 0;
+}
+
+static unsigned long rbd_cache_lookup(struct rbd_cache *c, unsigned long block)
+{
+    unsigned long s;
+
+    for (s = c->hash[block & c->hashmask]; s != RBD_CACHE_NONE; s = c->next[s])
+        if (c->block[s] == block)
+            return s;
+    return RBD_CACHE_NONE;
+}
+
+static void rbd_cache_unlink(struct rbd_cache *c, unsigned long slot)
+{
+    unsigned long *p = &c->hash[c->block[slot] & c->hashmask];
+
+    while (*p != slot)
+        p = &c->next[*p];
+    *p = c->next[slot];
+    c->block[slot] = RBD_CACHE_NONE;
+}
+
+/* the latest copy of block is now in slot */
+static void rbd_cache_insert(struct rbd_cache *c, unsigned long block, unsigned long slot)
+{
+    unsigned long old = rbd_cache_lookup(c, block);
+
+    if (old != RBD_CACHE_NONE)
+        rbd_cache_unlink(c, old);
+    c->block[slot] = block;
+    c->next[slot] = c->hash[block & c->hashmask];
+    c->hash[block & c->hashmask] = slot;
+}
+
+/* take back the slots of flushed records. with c->mutex held */
+static void rbd_cache_reclaim(struct rbd_cache *c)
+{
+    while (c->head != c->flushed) {
+        if (c->block[c->head] != RBD_CACHE_NONE)
+            rbd_cache_unlink(c, c->head);
+        c->head = c->head + 1 == c->nslots ? 0 : c->head + 1;
+        c->used--;
+    }
+}
+
+static unsigned long rbd_cache_dirty(struct rbd_cache *c)
+{
+    return (c->tail + c->nslots - c->flushed) % c->nslots;
+}
+
+/* the SDs have every record up to slot pos, numbered seq */
+static int rbd_cache_commit(struct rbd_cache *c, unsigned long pos, u64 seq, unsigned long nbytes)
+{
+    c->super.head = pos;
+    c->super.seq = seq;
+    if (rbd_cache_io(c, &c->super, sizeof(c->super), 0, 1)) {
+        c->error = 1;
+        return -EIO;
+    }
+    down(&c->mutex);
+    c->flushed = pos;
+    c->flush_seq = seq;
+    c->flushed_bytes += nbytes;
+    up(&c->mutex);
+    wake_up(&c->wait);
+    return 0;
+}
+
+/*
+ * flush work: send the records not flushed yet to the SDs, in runs of
+ * records contiguous on the device that end at a barrier. retried every
+ * second while the SDs fail
+ */
+static void rbd_cache_flush_work(void *arg)
+{
+    struct rbd_dev *dev = arg;
+    struct rbd_cache *c = dev->cache;
+    struct rbd_cache_rec h;
+    unsigned long pos, end, start = 0, n;
+    u64 seq;
+    int ret = 0;
+
+    down(&c->flush_mutex);
+    while (!ret && !c->error) {
+        down(&c->mutex);
+        pos = c->flushed;
+        end = c->tail;
+        seq = c->flush_seq;
+        up(&c->mutex);
+        if (pos == end)
+            break;
+
+        for (n = 0; pos != end; ) {
+            if ((ret = rbd_cache_io(c, &h, sizeof(h), rbd_cache_pos(c, pos), 0)))
+                break;
+            if (h.magic != RBD_CREC_MAGIC || h.seq != seq) {
+                printk(KERN_ERR "RBD: cache | dev %s | bad record at slot %lu\n", dev->name, pos);
+                c->error = 1;
+                ret = -EIO;
+                break;
+            }
+            if (h.flags & RBD_CREC_WRAP) {
+                pos = 0;
+                seq++;
+                continue;
+            }
+            if (!(h.flags & RBD_CREC_CLEAN)) {
+                if (n && (h.block != start + n || n + h.nblocks > RBD_CACHE_MAXBLOCKS))
+                    break;
+                if ((ret = rbd_cache_io(c, c->fbuf + n * RBD_CACHE_BLOCK, h.nblocks * RBD_CACHE_BLOCK, 
+                                        rbd_cache_pos(c, pos + 1), 0)))
+                    break;
+                if (!n)
+                    start = h.block;
+                n += h.nblocks;
+            }
+            pos += 1 + h.nblocks;
+            if (pos == c->nslots)
+                pos = 0;
+            seq++;
+            if (h.flags & RBD_CREC_BARRIER)
+                break;
+        }
+
+        if (!ret && n && (ret = rbd_io(dev, c->pieces, start * RBD_CACHE_SECTORS, 
+                                       n * RBD_CACHE_BLOCK, c->fbuf, 1))) {
+            printk(KERN_WARNING "RBD: cache | dev %s | flush failed, retrying\n", dev->name);
+            if (!c->closing)
+                queue_delayed_work(c->wq, &c->flush_work, HZ);
+        }
+        if (!ret)
+            ret = rbd_cache_commit(c, pos, seq, n * RBD_CACHE_BLOCK);
+    }
+    if (ret)
+        wake_up(&c->wait);
+    up(&c->flush_mutex);
+}
+
+/*
+ * slot for a record of need slots, waiting for flushes to make room. a
+ * record that does not fit before the end of the log goes at slot 0,
+ * after a wrap record
+ */
+static long rbd_cache_reserve(struct rbd_dev *dev, unsigned long need)
+{
+    struct rbd_cache *c = dev->cache;
+    struct rbd_cache_rec h;
+    unsigned long waste, slot;
+
+    while (1) {
+        down(&c->mutex);
+        rbd_cache_reclaim(c);
+        waste = c->tail + need > c->nslots ? c->nslots - c->tail : 0;
+        if (c->nslots - c->used > waste + need)
+            break;
+        up(&c->mutex);
+        c->waits++;
+        queue_work(c->wq, &c->flush_work);
+        wait_event(c->wait, c->flushed != c->head || c->error);
+        if (c->error)
+            return -EIO;
+    }
+    slot = c->tail;
+    up(&c->mutex);
+
+    if (waste) {
+        memset(&h, 0, sizeof(h));
+        h.magic = RBD_CREC_MAGIC;
+        h.flags = RBD_CREC_WRAP;
+        h.seq = c->seq;
+        if (rbd_cache_io(c, &h, sizeof(h), rbd_cache_pos(c, slot), 1))
+            return -EIO;
+        down(&c->mutex);
+        c->used += waste;
+        c->tail = slot = 0;
+        c->seq++;
+        up(&c->mutex);
+    }
+    return slot;
+}
+
+/* log the nblocks blocks in c->buf, after the header slot, as a record */
+static int rbd_cache_append(struct rbd_dev *dev, unsigned long block, unsigned int nblocks, u32 flags)
+{
+    struct rbd_cache *c = dev->cache;
+    struct rbd_cache_rec *h = (struct rbd_cache_rec *)c->buf;
+    unsigned long need = nblocks + 1, i;
+    long slot;
+
+    if ((slot = rbd_cache_reserve(dev, need)) < 0)
+        return slot;
+    memset(h, 0, sizeof(*h));
+    h->magic = RBD_CREC_MAGIC;
+    h->flags = flags;
+    h->seq = c->seq;
+    h->block = block;
+    h->nblocks = nblocks;
+    h->crc = rbd_crc(c->buf + RBD_CACHE_BLOCK, nblocks * RBD_CACHE_BLOCK);
+    if (rbd_cache_io(c, c->buf, need * RBD_CACHE_BLOCK, rbd_cache_pos(c, slot), 1)) {
+        printk(KERN_ERR "RBD: cache | dev %s | error writing slot %ld\n", dev->name, slot);
+        return -EIO;
+    }
+    for (i = 0; i < nblocks; i++)
+        rbd_cache_insert(c, block + i, slot + 1 + i);
+
+    down(&c->mutex);
+    c->tail = slot + need == c->nslots ? 0 : slot + need;
+    c->used += need;
+    c->seq++;
+    up(&c->mutex);
+    if (!(flags & RBD_CREC_CLEAN))
+        queue_work(c->wq, &c->flush_work);
+    return 0;
+}
+
+/* read a whole block, from the log if it is there */
+static int rbd_cache_read_block(struct rbd_dev *dev, unsigned long block, char *buf)
+{
+    struct rbd_cache *c = dev->cache;
+    unsigned long slot = rbd_cache_lookup(c, block);
+
+    if (slot != RBD_CACHE_NONE)
+        return rbd_cache_io(c, buf, RBD_CACHE_BLOCK, rbd_cache_pos(c, slot), 0);
+    return rbd_io(dev, dev->pieces, block * RBD_CACHE_SECTORS, RBD_CACHE_BLOCK, buf, 0);
+}
+
+/* copy the data of a request from a linear buffer, or to it */
+static void rbd_req_copy(struct request *req, char *buf, int to_req)
+{
+    struct bio *bio;
+    struct bio_vec *bvec;
+    char *p;
+    int i;
+
+    rq_for_each_bio(bio, req) {
+        bio_for_each_segment(bvec, bio, i) {
+            p = kmap(bvec->bv_page) + bvec->bv_offset;
+            if (to_req)
+                memcpy(p, buf, bvec->bv_len);
+            else
+                memcpy(buf, p, bvec->bv_len);
+            kunmap(bvec->bv_page);
+            buf += bvec->bv_len;
+        }
+    }
+}
+
+/* transfer a request through the cache. its blocks go in c->buf, after
+ * the header slot, with the request at its offset in the first one */
+static int rbd_cache_transfer(struct rbd_dev *dev, struct request *req)
+{
+    struct rbd_cache *c = dev->cache;
+    unsigned long nbytes = req->nr_sectors * RBD_SECSIZE;
+    unsigned long first = req->sector / RBD_CACHE_SECTORS;
+    unsigned long last = (req->sector + req->nr_sectors - 1) / RBD_CACHE_SECTORS;
+    unsigned long within = req->sector % RBD_CACHE_SECTORS * RBD_SECSIZE;
+    unsigned int nblocks = last - first + 1;
+    char *data = c->buf + RBD_CACHE_BLOCK;
+    unsigned long b, slot, run;
+    unsigned int cached = 0;
+    int ret = 0;
+
+    if (rq_data_dir(req)) {
+        if (within)
+            ret = rbd_cache_read_block(dev, first, data);
+        if (!ret && (within + nbytes) % RBD_CACHE_BLOCK && (nblocks > 1 || !within))
+            ret = rbd_cache_read_block(dev, last, data + (nblocks - 1) * RBD_CACHE_BLOCK);
+        if (ret)
+            return ret;
+        rbd_req_copy(req, data + within, 0);
+        c->writes++;
+        return rbd_cache_append(dev, first, nblocks, blk_barrier_rq(req) ? RBD_CREC_BARRIER : 0);
+    }
+
+    for (b = first; b <= last; b++)
+        cached += rbd_cache_lookup(c, b) != RBD_CACHE_NONE;
+    if (cached < nblocks && (ret = rbd_io(dev, dev->pieces, req->sector, nbytes, data + within, 0)))
+        return ret;
+    /* the blocks in the log are newer, in runs of consecutive slots */
+    for (b = first; !ret && b <= last; b += run) {
+        run = 1;
+        if ((slot = rbd_cache_lookup(c, b)) == RBD_CACHE_NONE)
+            continue;
+        while (b + run <= last && rbd_cache_lookup(c, b + run) == slot + run)
+            run++;
+        ret = rbd_cache_io(c, data + (b - first) * RBD_CACHE_BLOCK, run * RBD_CACHE_BLOCK, 
+                           rbd_cache_pos(c, slot), 0);
+    }
+    if (ret)
+        return ret;
+    rbd_req_copy(req, data + within, 1);
+
+    if (cached == nblocks) {
+        c->hits++;
+        return 0;
+    }
+    c->misses++;
+    if (!within && !(nbytes % RBD_CACHE_BLOCK) && nbytes <= RBD_CACHE_MAXFILL)
+        rbd_cache_append(dev, first, nblocks, RBD_CREC_CLEAN);
+    return 0;
+}
+
+/* SDs of the device, to tell whether a log is of it */
+static void rbd_cache_targets(struct rbd_dev *dev, char *buf, int size)
+{
+    int len = 0, i;
+
+    memset(buf, 0, size);
+    for (i = 0; i < dev->nsd && len < size; i++)
+        len += snprintf(buf + len, size - len, "%s:%d ", dev->sd[i].host, dev->sd[i].port);
+    buf[size - 1] = '\0';
+}
+
+/*
+ * rebuild the index from the records that may not be flushed, or start
+ * an empty log if the cache has none
+ */
+static int rbd_cache_recover(struct rbd_dev *dev)
+{
+    struct rbd_cache *c = dev->cache;
+    struct rbd_cache_rec *h = (struct rbd_cache_rec *)c->buf;
+    char targets[sizeof(c->super.targets)];
+    unsigned long pos, i;
+    u64 seq;
+
+    rbd_cache_targets(dev, targets, sizeof(targets));
+    if (rbd_cache_io(c, &c->super, sizeof(c->super), 0, 0))
+        return -EIO;
+    if (memcmp(c->super.magic, RBD_CACHE_MAGIC, sizeof(c->super.magic))) {
+        printk(KERN_INFO "RBD: cache | dev %s | new log of %lu blocks\n", dev->name, c->nslots);
+        memset(&c->super, 0, sizeof(c->super));
+        memcpy(c->super.magic, RBD_CACHE_MAGIC, sizeof(c->super.magic));
+        c->super.version = RBD_CACHE_VERSION;
+        c->super.nslots = c->nslots;
+        memcpy(c->super.targets, targets, sizeof(targets));
+        c->super.seq = 1;
+        if (rbd_cache_io(c, &c->super, sizeof(c->super), 0, 1))
+            return -EIO;
+    }
+    if (c->super.version != RBD_CACHE_VERSION || c->super.nslots != c->nslots || 
+        c->super.head >= c->nslots || memcmp(c->super.targets, targets, sizeof(targets))) {
+        printk(KERN_ERR "RBD: cache | dev %s | the log is of another device (%s)\n", 
+               dev->name, c->super.targets);
+        return -EINVAL;
+    }
+
+    pos = c->head = c->flushed = c->super.head;
+    seq = c->flush_seq = c->super.seq;
+    c->used = 0;
+    while (1) {
+        if (rbd_cache_io(c, h, sizeof(*h), rbd_cache_pos(c, pos), 0))
+            return -EIO;
+        if (h->magic != RBD_CREC_MAGIC || h->seq != seq)
+            break;
+        if (h->flags & RBD_CREC_WRAP) {
+            if (!pos || c->used + c->nslots - pos >= c->nslots)
+                break;
+            c->used += c->nslots - pos;
+            pos = 0;
+            seq++;
+            continue;
+        }
+        if (h->nblocks > RBD_CACHE_MAXBLOCKS || pos + 1 + h->nblocks > c->nslots || 
+            c->used + 1 + h->nblocks >= c->nslots)
+            break;
+        if (rbd_cache_io(c, c->buf + RBD_CACHE_BLOCK, h->nblocks * RBD_CACHE_BLOCK, 
+                         rbd_cache_pos(c, pos + 1), 0))
+            return -EIO;
+        if (h->crc != rbd_crc(c->buf + RBD_CACHE_BLOCK, h->nblocks * RBD_CACHE_BLOCK))
+            break;              /* torn: it was never completed */
+        for (i = 0; i < h->nblocks; i++)
+            rbd_cache_insert(c, h->block + i, pos + 1 + i);
+        c->used += 1 + h->nblocks;
+        pos += 1 + h->nblocks;
+        if (pos == c->nslots)
+            pos = 0;
+        seq++;
+    }
+    c->tail = pos;
+    c->seq = seq;
+    if (c->used)
+        printk(KERN_INFO "RBD: cache | dev %s | %lu blocks to flush again\n", dev->name, c->used);
     return 0;
 }
 
+static void rbd_cache_close(struct rbd_dev *dev)
+{
+    struct rbd_cache *c = dev->cache;
 
-int rbd_read(struct rbd_dev *dev, unsigned long sector, unsigned long nbytes, char *buf)
-{  
-    struct rbdmsg_hdr msg, rsp;
+    if (!c)
+        return;
+    if (c->wq) {
+        c->closing = 1;
+        cancel_delayed_work(&c->flush_work);
+        flush_workqueue(c->wq);
+        destroy_workqueue(c->wq);
+    }
+    if (c->file)
+        filp_close(c->file, NULL);
+    vfree(c->block);
+    vfree(c->next);
+    vfree(c->hash);
+    vfree(c->buf);
+    vfree(c->fbuf);
+    kfree(c->pieces);
+    kfree(c);
+    dev->cache = NULL;
+}
 
-    msg.version = PROTO_VERSION;
-    msg.type = CMD;
-    msg.code = CMD_READ;
-    msg.id = ++dev->sd_msguid;
-    msg.payload_size = 0;    
-    msg.fsop_offset_sectors = sector;  /* initial sector */
-    msg.fsop_size = nbytes;            /* size in bytes */
-    
-    down(&dev->sd_mutex);
-    if (debug) printk(KERN_NOTICE "RBD: read | dev %s | msg.id %d | offset %d | nbytes %d\n", 
-                      dev->name, msg.id, msg.fsop_offset_sectors, msg.fsop_size);
-    sd_send(dev, &msg, sizeof(msg));
-    sd_recv(dev, &rsp, sizeof(rsp));
-    sd_recv(dev, buf, rsp.payload_size);
-    up(&dev->sd_mutex);
+/* open the cache of the device and recover its log. the device must hold
+ * whole blocks */
+static int rbd_cache_open(struct rbd_dev *dev)
+{
+    struct rbd_cache *c;
+    unsigned long hsize, i;
+    loff_t size;
+    int ret = -ENOMEM;
 
+    if (dev->size % RBD_CACHE_SECTORS) {
+        printk(KERN_ERR "RBD: cache | dev %s | size is not a multiple of %d\n", dev->name, RBD_CACHE_BLOCK);
+        return -EINVAL;
+    }
+    if (!(c = kmalloc(sizeof(*c), GFP_KERNEL)))
+        return -ENOMEM;
+    memset(c, 0, sizeof(*c));
+    dev->cache = c;
+    init_MUTEX(&c->mutex);
+    init_MUTEX(&c->flush_mutex);
+    init_waitqueue_head(&c->wait);
+    INIT_WORK(&c->flush_work, rbd_cache_flush_work, dev);
+
+    c->file = filp_open(dev->cache_path, O_RDWR | O_LARGEFILE | O_SYNC, 0);
+    if (IS_ERR(c->file)) {
+        ret = PTR_ERR(c->file);
+        c->file = NULL;
+        printk(KERN_ERR "RBD: cache | dev %s | error %d opening %s\n", dev->name, ret, dev->cache_path);
+        goto err;
+    }
+    size = i_size_read(c->file->f_mapping->host);
+    c->nslots = size / RBD_CACHE_BLOCK - 1;
+    if (size / RBD_CACHE_BLOCK < 4 * RBD_CACHE_MAXBLOCKS + 1) {
+        printk(KERN_ERR "RBD: cache | dev %s | %s must hold %d blocks at least\n", 
+               dev->name, dev->cache_path, 4 * RBD_CACHE_MAXBLOCKS + 1);
+        ret = -ENOSPC;
+        goto err;
+    }
+    for (hsize = 1; hsize < c->nslots; hsize <<= 1)
+        ;
+    c->hashmask = hsize - 1;
+    c->block = vmalloc(c->nslots * sizeof(unsigned long));
+    c->next = vmalloc(c->nslots * sizeof(unsigned long));
+    c->hash = vmalloc(hsize * sizeof(unsigned long));
+    c->buf = vmalloc((RBD_CACHE_MAXBLOCKS + 1) * RBD_CACHE_BLOCK);
+    c->fbuf = vmalloc(RBD_CACHE_MAXBLOCKS * RBD_CACHE_BLOCK);
+    c->pieces = kmalloc((RBD_MAX_TRANSFER / dev->stripe_unit + 1) * sizeof(struct rbd_piece), GFP_KERNEL);
+    if (!c->block || !c->next || !c->hash || !c->buf || !c->fbuf || !c->pieces)
+        goto err;
+    for (i = 0; i < c->nslots; i++)
+        c->block[i] = RBD_CACHE_NONE;
+    for (i = 0; i < hsize; i++)
+        c->hash[i] = RBD_CACHE_NONE;
+
+    if ((ret = rbd_cache_recover(dev)))
+        goto err;
+    if (!(c->wq = create_singlethread_workqueue("rbdcache"))) {
+        ret = -ENOMEM;
+        goto err;
+    }
+    /* what was not flushed before goes first */
+    if (rbd_cache_dirty(c))
+        queue_work(c->wq, &c->flush_work);
     return 0;
+
+err:
+    rbd_cache_close(dev);
+    return ret;
 }
 
+/* wait until the SDs have every write made through the cache */
+static int rbd_cache_drain(struct rbd_dev *dev)
+{
+    struct rbd_cache *c = dev->cache;
+
+    queue_work(c->wq, &c->flush_work);
+    if (wait_event_interruptible(c->wait, !rbd_cache_dirty(c) || c->error))
+        return -EINTR;
+    return c->error ? -EIO : 0;
+}
 
 /*
- * transfer the data
+ * transfer the data of a whole request, split in pieces by SD
  */
-static void rbd_transfer(struct rbd_dev *dev, unsigned long sector, unsigned long nsect, char *buf, int write)
+static int rbd_transfer(struct rbd_dev *dev, struct request *req)
 {
-    unsigned long offset = sector;
-    unsigned long nbytes = nsect*RBD_SECSIZE;
-
-    if ((offset + nsect) > dev->size) {
-        if (debug) printk(KERN_WARNING "RBD: transfer - out of range request | dev %s | sector %ld | nbytes %ld | dev->size %ld\n", 
-                          dev->name, sector, nbytes, dev->size);
-        return;
+    struct rbd_piece *p = dev->pieces;
+    struct bio *bio;
+    struct bio_vec *bvec;
+    unsigned long sector = req->sector;
+    unsigned long nbytes = req->nr_sectors * RBD_SECSIZE;
+    int write = rq_data_dir(req);
+    char *buf = NULL, *next = NULL;
+    int linear = 1, ret, i;
+
+    if ((sector + req->nr_sectors) > dev->size) {
+        if (debug) printk(KERN_WARNING "RBD: transfer - out of range request | dev %s | sector %ld | nsect %ld | dev->size %ld\n", 
+                          dev->name, sector, req->nr_sectors, dev->size);
+        return -EIO;
+    }
+    if (dev->cache)
+        return rbd_cache_transfer(dev, req);
+
+    /* the data goes straight from the pages of the request when they are
+     * one run of kernel memory, as the SDs see a linear buffer: then the
+     * request is split only at stripe units, like any other. otherwise,
+     * and for pages in high memory, which would have to stay kmapped for
+     * as long as the SDs take and could use up the pkmap entries the rest
+     * of the kernel needs, it is copied through dev->xbuf, one page mapped
+     * at a time. either way dev->pieces holds its pieces */
+    rq_for_each_bio(bio, req) {
+        bio_for_each_segment(bvec, bio, i) {
+            if (PageHighMem(bvec->bv_page)) {
+                linear = 0;
+                continue;
+            }
+            if (!buf)
+                buf = next = page_address(bvec->bv_page) + bvec->bv_offset;
+            else if (next != page_address(bvec->bv_page) + bvec->bv_offset)
+                linear = 0;
+            next += bvec->bv_len;
+        }
     }
+    if (linear)
+        return rbd_xfer(dev, p, rbd_map(dev, sector, nbytes, buf, p), write);
+
     if (write)
-        rbd_write(dev, sector, nbytes, buf);
-    else
-        rbd_read(dev, sector, nbytes, buf);
+        rbd_req_copy(req, dev->xbuf, 0);
+    ret = rbd_io(dev, p, sector, nbytes, dev->xbuf, write);
+    if (!ret && !write)
+        rbd_req_copy(req, dev->xbuf, 1);
+    return ret;
 }
 
 
@@ -269,6 +1426,8 @@ static void request_work(void *arg)
     request_queue_t *q = arg;
     struct request *req;
     struct rbd_dev *dev = q->queuedata;
+    struct rbd_stats *s;
+    int ret;
 
     down(&dev->rqwk_mutex);
     while ((req = elv_next_request(q)) != NULL) {
@@ -277,10 +1436,22 @@ static void request_work(void *arg)
             end_request(req, 0);
             continue;
         }
-        if (debug) printk(KERN_INFO "RBD: request | dev %s | rw %ld | sec %d | current_nr_sectors %d\n", 
-                          dev->name, rq_data_dir(req), (int)req->sector, req->current_nr_sectors);
-        rbd_transfer(dev, req->sector, req->current_nr_sectors, req->buffer, rq_data_dir(req));
-        end_request(req, 1);
+        if (debug) printk(KERN_INFO "RBD: request | dev %s | rw %ld | sec %d | nr_sectors %d\n", 
+                          dev->name, rq_data_dir(req), (int)req->sector, (int)req->nr_sectors);
+        ret = rbd_transfer(dev, req);
+        s = per_cpu_ptr(dev->stats, get_cpu());
+        s->ops[rq_data_dir(req)]++;
+        if (ret)
+            s->errors[rq_data_dir(req)]++;
+        else
+            s->bytes[rq_data_dir(req)] += (unsigned long long)req->hard_nr_sectors * RBD_SECSIZE;
+        put_cpu();
+        spin_lock_irq(q->queue_lock);
+        if (!end_that_request_first(req, !ret, req->hard_nr_sectors)) {
+            blkdev_dequeue_request(req);
+            end_that_request_last(req, !ret);
+        }
+        spin_unlock_irq(q->queue_lock);
     }
     up(&dev->rqwk_mutex);
 }
@@ -288,24 +1459,41 @@ static void request_work(void *arg)
 static void setup_work(void *arg) 
 {
     struct rbd_dev *dev = arg;
-    struct rbdmsg_hdr msg, rsp;
-    unsigned long size;
+    unsigned long size = 0;
 
-    msg.version = PROTO_VERSION;
-    msg.type = CMD;
-    msg.code = CMD_GETSZ;
-    msg.id = ++dev->sd_msguid;
-    msg.payload_size = 0;    
-    
-    sd_send(dev, &msg, sizeof(msg));
-    sd_recv(dev, &rsp, sizeof(rsp));
-    if (sizeof(size) == rsp.payload_size) 
-        sd_recv(dev, &size, rsp.payload_size);
+    rbd_getsz(dev, &size);
     if (debug) printk(KERN_INFO "RBD: getsz | dev %s | value %lu\n", dev->name, size);
     dev->size = size;
     up(&dev->setupwk_mutex);
 }
 
+/*
+ * the storage was resized on the SD: update the capacity of the live disk
+ */
+static void resize_work(void *arg) 
+{
+    struct rbd_dev *dev = arg;
+    struct block_device *bdev;
+    unsigned long size;
+    int ret;
+
+    ret = rbd_getsz(dev, &size);
+    if (ret || !dev->gd || size == dev->size)
+        return;
+
+    printk(KERN_INFO "RBD: resize | dev %s | %lu -> %lu sectors\n", dev->name, dev->size, size);
+    dev->size = size;
+    set_capacity(dev->gd, size);
+
+    bdev = bdget_disk(dev->gd, 0);
+    if (bdev) {
+        mutex_lock(&bdev->bd_inode->i_mutex);
+        i_size_write(bdev->bd_inode, (loff_t)size * RBD_SECSIZE);
+        mutex_unlock(&bdev->bd_inode->i_mutex);
+        bdput(bdev);
+    }
+}
+
 /*
  * attend request y pass it to the workqueue
  */
@@ -335,15 +1523,26 @@ static struct block_device_operations rbd_ops = {
 struct rbd_dev *init_device(void)
 {
     struct rbd_dev *dev;
+    int i;
 
     dev = kmalloc(sizeof(struct rbd_dev), GFP_KERNEL);
     if (!dev)
         return NULL;
     memset(dev, 0, sizeof(struct rbd_dev));
-
-    dev->sd_msguid = 0;
-    strcpy(dev->sd_host, "127.0.0.1");
-    dev->sd_port = SDPORT;
+    dev->stats = alloc_percpu(struct rbd_stats);
+    if (!dev->stats) {
+        kfree(dev);
+        return NULL;
+    }
+    atomic_set(&dev->inflight, 0);
+
+    for (i = 0; i < RBD_MAXTARGETS; i++)
+        dev->sd[i].dev = dev;
+    strcpy(dev->sd[0].host, "127.0.0.1");
+    dev->sd[0].port = SDPORT;
+    dev->nsd = 1;
+    dev->stripe_unit = RBD_STRIPE_UNIT;
+    dev->timeout = RBD_TIMEOUT;
     dev->first_minor = rbd_lastminor;
     rbd_lastminor += RBD_MINORS;
 
@@ -353,25 +1552,56 @@ struct rbd_dev *init_device(void)
 /* installs block device and enables it */
 static int enable_device(struct rbd_dev *dev)
 {
-    int ret;
+    struct rbd_sd *sd;
+    int ret, i;
 
     INIT_WORK(&dev->setup_work, setup_work, dev);
+    INIT_WORK(&dev->resize_work, resize_work, dev);
     init_MUTEX_LOCKED(&dev->setupwk_mutex);
-    
-    /* connect to SD */
-    init_MUTEX(&dev->sd_mutex);
-    dev->sd_addr = inet_addr(dev->sd_host);
+    dev->name = dev->cfs_item.ci_name;
 
-    down(&dev->sd_mutex);
-    ret = sd_connect(dev);
-    up(&dev->sd_mutex);
-    if (ret)
-        return -1;
+    /* a request is a linear buffer of RBD_MAX_TRANSFER bytes at most (see
+     * rbd_transfer): one piece per stripe unit it touches */
+    dev->pieces = kmalloc((RBD_MAX_TRANSFER / dev->stripe_unit + 1) * 
+                          sizeof(struct rbd_piece), GFP_KERNEL);
+    dev->xbuf = vmalloc(RBD_MAX_TRANSFER);
+    if (!dev->pieces || !dev->xbuf)
+        return -ENOMEM;
+
+    /* connect to the SDs */
+    for (i = 0; i < dev->nsd; i++) {
+        sd = &dev->sd[i];
+        init_MUTEX(&sd->mutex);
+        INIT_WORK(&sd->connect_work, sd_connect_work, sd);
+        init_waitqueue_head(&sd->wait);
+        sd->broken = 0;
+        sd->backoff = RBD_BACKOFF_MIN;
+        sd->crcbuf = kmalloc(RBD_CRC_SIZE(RBD_MAX_TRANSFER), GFP_KERNEL);
+        if (!sd->crcbuf)
+            return -ENOMEM;
+        if (dev->want_features & RBD_FEAT_ZLIB && (ret = rbd_zip_init(sd))) {
+            rbd_zip_free(sd);
+            return ret;
+        }
+
+        sd->addr = inet_addr(sd->host);
+        /* a new session, that lasts until the device is disabled */
+        do
+            get_random_bytes(&sd->session, sizeof(sd->session));
+        while (!sd->session);
+
+        if (sd_connect(sd))
+            return -1;
+    }
 
     /* get storage size from SD and set device size locally */
     schedule_work(&dev->setup_work); 
     down(&dev->setupwk_mutex);
 
+    /* writes left in the cache are flushed before any new one */
+    if (dev->cache_path[0] && (ret = rbd_cache_open(dev)))
+        return ret;
+
     /* initialize the requests queue */
     spin_lock_init(&dev->req_lock);
     dev->queue = blk_init_queue(rbd_request, &dev->req_lock);
@@ -380,7 +1610,13 @@ static int enable_device(struct rbd_dev *dev)
     init_MUTEX(&dev->rqwk_mutex);
 
     blk_queue_hardsect_size(dev->queue, RBD_SECSIZE);
+    blk_queue_max_sectors(dev->queue, RBD_MAX_TRANSFER / RBD_SECSIZE);
+    blk_queue_max_phys_segments(dev->queue, RBD_MAX_SEGMENTS);
+    blk_queue_max_hw_segments(dev->queue, RBD_MAX_SEGMENTS);
     dev->queue->queuedata = dev;
+    /* a barrier must not be reordered with writes still in the cache */
+    if (dev->cache)
+        blk_queue_ordered(dev->queue, QUEUE_ORDERED_DRAIN, NULL);
 
     dev->gd = alloc_disk(RBD_MINORS);
     if (!dev->gd) {
@@ -393,7 +1629,6 @@ static int enable_device(struct rbd_dev *dev)
     dev->gd->fops = &rbd_ops;
     dev->gd->queue = dev->queue;
     dev->gd->private_data = dev;
-    dev->name = dev->cfs_item.ci_name;
     snprintf(dev->gd->disk_name, 32, "rbd%s", dev->name);
     set_capacity(dev->gd, dev->size);
 
@@ -406,9 +1641,34 @@ static int enable_device(struct rbd_dev *dev)
 
 static int disable_device(struct rbd_dev *dev)
 {
-    down(&dev->sd_mutex);
-    sd_disconnect(dev);
-    up(&dev->sd_mutex);
+    struct rbd_sd *sd;
+    int i;
+
+    dev->active = 0;
+    flush_scheduled_work();    /* a resize_work may be pending */
+
+    if (dev->cache) {
+        if (rbd_cache_drain(dev))
+            printk(KERN_WARNING "RBD: cache | dev %s | not flushed, left in %s\n", 
+                   dev->name, dev->cache_path);
+        rbd_cache_close(dev);
+    }
+
+    for (i = 0; i < dev->nsd; i++) {
+        sd = &dev->sd[i];
+        if (sd->crcbuf) {      /* got as far as enable_device set it up */
+            down(&sd->mutex);
+            sd->broken = 0;     /* the connect work stops */
+            sd_disconnect(sd);
+            up(&sd->mutex);
+            cancel_delayed_work(&sd->connect_work);
+            flush_workqueue(rbd_wq);
+        }
+        kfree(sd->crcbuf);
+        sd->crcbuf = NULL;
+        rbd_zip_free(sd);
+        memset(&sd->mutex, 0, sizeof(sd->mutex));
+    }
 
     if (dev->gd) {
         del_gendisk(dev->gd);
@@ -419,12 +1679,15 @@ static int disable_device(struct rbd_dev *dev)
         blk_cleanup_queue(dev->queue);
         dev->queue = NULL;
     }
+    kfree(dev->pieces);
+    dev->pieces = NULL;
+    vfree(dev->xbuf);
+    dev->xbuf = NULL;
     memset(&dev->rq_work, 0, sizeof(dev->rq_work));
     memset(&dev->setup_work, 0, sizeof(dev->setup_work));
+    memset(&dev->resize_work, 0, sizeof(dev->resize_work));
     memset(&dev->setupwk_mutex, 0, sizeof(dev->setupwk_mutex));
     memset(&dev->rqwk_mutex, 0, sizeof(dev->rqwk_mutex));
-    memset(&dev->sd_mutex, 0, sizeof(dev->sd_mutex));
-    memset(&dev->sd_mutex, 0, sizeof(spinlock_t));
 
     dev->active = 0;
     return 0;
@@ -432,15 +1695,19 @@ static int disable_device(struct rbd_dev *dev)
 
 static void free_device(struct rbd_dev *dev) 
 {
+    int i;
+
     printk(KERN_WARNING "free_device\n");
 
     disable_device(dev);
 
-    if (dev->sd_socket)
-        kfree(dev->sd_socket);
+    for (i = 0; i < dev->nsd; i++)
+        if (dev->sd[i].socket)
+            kfree(dev->sd[i].socket);
 
     list_del(&dev->devices);
     
+    free_percpu(dev->stats);
     kfree(dev);
 }
 
@@ -478,18 +1745,18 @@ static ssize_t rbddev_active_write(struct rbd_dev *dev, const char *page, size_t
 
 static ssize_t rbddev_host_read(struct rbd_dev *dev, char *page)
 {
-    return sprintf(page, "%s\n", dev->sd_host);
+    return sprintf(page, "%s\n", dev->sd[0].host);
 };
 
 static ssize_t rbddev_host_write(struct rbd_dev *dev, const char *page, size_t count)
 {
-    memset(&dev->sd_host, 0, sizeof(dev->sd_host));
-    return snprintf(dev->sd_host, sizeof(dev->sd_host)-1, page);
+    memset(&dev->sd[0].host, 0, sizeof(dev->sd[0].host));
+    return snprintf(dev->sd[0].host, sizeof(dev->sd[0].host)-1, page);
 };
 
 static ssize_t rbddev_port_read(struct rbd_dev *dev, char *page)
 {
-    return sprintf(page, "%d\n", dev->sd_port);
+    return sprintf(page, "%d\n", dev->sd[0].port);
 };
 
 static ssize_t rbddev_port_write(struct rbd_dev *dev, const char *page, size_t count)
@@ -504,11 +1771,318 @@ static ssize_t rbddev_port_write(struct rbd_dev *dev, const char *page, size_t c
     if (tmp > 65535)
         return -ERANGE;
 
-    dev->sd_port = tmp;
+    dev->sd[0].port = tmp;
+
+    return count;
+};
+
+static ssize_t rbddev_checksum_read(struct rbd_dev *dev, char *page)
+{
+    return sprintf(page, "%d\n", !!(dev->want_features & RBD_FEAT_CRC));
+};
+
+static ssize_t rbddev_checksum_write(struct rbd_dev *dev, const char *page, size_t count)
+{
+    unsigned long tmp;
+    char *p = (char *) page;
+
+    tmp = simple_strtoul(p, &p, 10);
+    if (!p || (*p && (*p != '\n')))
+        return -EINVAL;
+
+    if (dev->active)
+        return -EBUSY;
+
+    if (tmp)
+        dev->want_features |= RBD_FEAT_CRC;
+    else
+        dev->want_features &= ~RBD_FEAT_CRC;
+
+    return count;
+};
+
+static ssize_t rbddev_compress_read(struct rbd_dev *dev, char *page)
+{
+    return sprintf(page, "%d\n", !!(dev->want_features & RBD_FEAT_ZLIB));
+};
+
+static ssize_t rbddev_compress_write(struct rbd_dev *dev, const char *page, size_t count)
+{
+    unsigned long tmp;
+    char *p = (char *) page;
+
+    tmp = simple_strtoul(p, &p, 10);
+    if (!p || (*p && (*p != '\n')))
+        return -EINVAL;
+
+    if (dev->active)
+        return -EBUSY;
+
+    if (tmp)
+        dev->want_features |= RBD_FEAT_ZLIB;
+    else
+        dev->want_features &= ~RBD_FEAT_ZLIB;
+
+    return count;
+};
+
+/* with sessions, writes sent again after a reconnect are not done twice */
+static ssize_t rbddev_session_read(struct rbd_dev *dev, char *page)
+{
+    return sprintf(page, "%d\n", !!(dev->want_features & RBD_FEAT_SESSION));
+};
+static ssize_t rbddev_session_write(struct rbd_dev *dev, const char *page, size_t count)
+{
+    unsigned long tmp;
+    char *p = (char *) page;
+
+    tmp = simple_strtoul(p, &p, 10);
+    if (!p || (*p && (*p != '\n')))
+        return -EINVAL;
+
+    if (dev->active)
+        return -EBUSY;
+
+    if (tmp)
+        dev->want_features |= RBD_FEAT_SESSION;
+    else
+        dev->want_features &= ~RBD_FEAT_SESSION;
+
+    return count;
+};
+
+/* seconds a transfer waits for the SDs before failing, 0 for ever */
+static ssize_t rbddev_timeout_read(struct rbd_dev *dev, char *page)
+{
+    return sprintf(page, "%lu\n", dev->timeout);
+};
+
+static ssize_t rbddev_timeout_write(struct rbd_dev *dev, const char *page, size_t count)
+{
+    unsigned long tmp;
+    char *p = (char *) page;
+
+    tmp = simple_strtoul(p, &p, 10);
+    if (!p || (*p && (*p != '\n')))
+        return -EINVAL;
+    if (tmp > MAX_JIFFY_OFFSET / HZ)
+        return -EINVAL;
+
+    dev->timeout = tmp;
+
+    return count;
+};
+
+/* raw and on the wire data sizes of all the SDs, their ratio in 
+ * hundredths, and the time spent compressing and uncompressing */
+static ssize_t rbddev_compress_stats_read(struct rbd_dev *dev, char *page)
+{
+    unsigned long long raw = 0, wire = 0, raw_bytes, wire_bytes, zip_us = 0, unzip_us = 0;
+    unsigned long hundredths = 0;
+    int i;
+
+    for (i = 0; i < dev->nsd; i++) {
+        raw += dev->sd[i].zraw_bytes;
+        wire += dev->sd[i].zwire_bytes;
+        zip_us += dev->sd[i].zip_us;
+        unzip_us += dev->sd[i].unzip_us;
+    }
+    raw_bytes = raw;
+    wire_bytes = wire;
+
+    while (wire >> 32) {        /* do_div takes a 32 bits divisor */
+        raw >>= 1;
+        wire >>= 1;
+    }
+    if (wire) {
+        raw *= 100;
+        do_div(raw, (u32)wire);
+        hundredths = raw;
+    }
+    return sprintf(page, "raw %llu\nwire %llu\nratio %lu.%02lu\nzip_us %llu\nunzip_us %llu\n", 
+                   raw_bytes, wire_bytes, hundredths / 100, hundredths % 100, zip_us, unzip_us);
+};
+
+/* SDs to stripe the device across, as "HOST:PORT HOST:PORT ..." */
+static ssize_t rbddev_targets_read(struct rbd_dev *dev, char *page)
+{
+    ssize_t len = 0;
+    int i;
+
+    for (i = 0; i < dev->nsd; i++)
+        len += sprintf(page + len, "%s:%d%c", dev->sd[i].host, dev->sd[i].port, 
+                       i == dev->nsd - 1 ? '\n' : ' ');
+    return len;
+};
+
+static ssize_t rbddev_targets_write(struct rbd_dev *dev, const char *page, size_t count)
+{
+    char host[RBD_MAXTARGETS][16];
+    int port[RBD_MAXTARGETS];
+    const char *end = page + count;
+    char *p = (char *) page;
+    unsigned long tmp;
+    int n = 0, len, i;
+
+    if (dev->active)
+        return -EBUSY;
+
+    while (p < end) {
+        if (*p == ' ' || *p == ',' || *p == '\n') {
+            p++;
+            continue;
+        }
+        if (n == RBD_MAXTARGETS)
+            return -E2BIG;
+        for (len = 0; p + len < end && p[len] != ':' && p[len] != ' '; len++)
+            ;
+        if (p + len == end || p[len] != ':' || !len || len >= sizeof(host[n]))
+            return -EINVAL;
+        memcpy(host[n], p, len);
+        host[n][len] = '\0';
+        p += len + 1;
+        tmp = simple_strtoul(p, &p, 10);
+        if (p < end && *p != ' ' && *p != ',' && *p != '\n')
+            return -EINVAL;
+        if (!tmp || tmp > 65535)
+            return -ERANGE;
+        port[n++] = tmp;
+    }
+    if (!n)
+        return -EINVAL;
+
+    for (i = 0; i < n; i++) {
+        strcpy(dev->sd[i].host, host[i]);
+        dev->sd[i].port = port[i];
+    }
+    dev->nsd = n;
+
+    return count;
+};
+
+static ssize_t rbddev_stripe_unit_read(struct rbd_dev *dev, char *page)
+{
+    return sprintf(page, "%lu\n", dev->stripe_unit);
+};
+
+static ssize_t rbddev_stripe_unit_write(struct rbd_dev *dev, const char *page, size_t count)
+{
+    unsigned long tmp;
+    char *p = (char *) page;
+
+    tmp = simple_strtoul(p, &p, 10);
+    if (!p || (*p && (*p != '\n')))
+        return -EINVAL;
+
+    if (!tmp || tmp % RBD_SECSIZE)
+        return -EINVAL;
+
+    if (dev->active)
+        return -EBUSY;
+
+    dev->stripe_unit = tmp;
+
+    return count;
+};
+
+/* file or block device to cache the device on */
+static ssize_t rbddev_cache_read(struct rbd_dev *dev, char *page)
+{
+    return sprintf(page, "%s\n", dev->cache_path);
+};
+
+static ssize_t rbddev_cache_write(struct rbd_dev *dev, const char *page, size_t count)
+{
+    size_t len = count;
+
+    if (dev->active)
+        return -EBUSY;
+
+    while (len && (page[len - 1] == '\n' || page[len - 1] == ' '))
+        len--;
+    if (len >= sizeof(dev->cache_path))
+        return -ENAMETOOLONG;
+    memcpy(dev->cache_path, page, len);
+    dev->cache_path[len] = '\0';
+
+    return count;
+};
+
+static ssize_t rbddev_cache_stats_read(struct rbd_dev *dev, char *page)
+{
+    struct rbd_cache *c = dev->cache;
+
+    if (!c)
+        return sprintf(page, "none\n");
+    return sprintf(page, "slots %lu\nused %lu\ndirty %lu\nhits %llu\nmisses %llu\n"
+                   "writes %llu\nflushed %llu\nwaits %llu\n", c->nslots, c->used, 
+                   rbd_cache_dirty(c), c->hits, c->misses, c->writes, c->flushed_bytes, c->waits);
+};
+
+/* write 1 to wait until the SDs have every write made through the cache */
+static ssize_t rbddev_cache_flush_write(struct rbd_dev *dev, const char *page, size_t count)
+{
+    unsigned long tmp;
+    char *p = (char *) page;
+    int ret;
+
+    tmp = simple_strtoul(p, &p, 10);
+    if (!p || (*p && (*p != '\n')))
+        return -EINVAL;
+
+    if (tmp && dev->cache && (ret = rbd_cache_drain(dev)))
+        return ret;
 
     return count;
 };
 
+/* I/O counters of every CPU added up. ops and bytes are of the requests
+ * completed, inflight the pieces waiting for an SD reply */
+static ssize_t rbddev_stats_read(struct rbd_dev *dev, char *page)
+{
+    unsigned long ops[2] = { 0, 0 }, errors[2] = { 0, 0 }, reconnects = 0;
+    unsigned long long bytes[2] = { 0, 0 };
+    struct rbd_stats *s;
+    int cpu, d;
+
+    for_each_possible_cpu(cpu) {
+        s = per_cpu_ptr(dev->stats, cpu);
+        for (d = 0; d < 2; d++) {
+            ops[d] += s->ops[d];
+            errors[d] += s->errors[d];
+            bytes[d] += s->bytes[d];
+        }
+        reconnects += s->reconnects;
+    }
+    return sprintf(page, "inflight %d\nread_ops %lu\nread_bytes %llu\nread_errors %lu\n"
+                   "write_ops %lu\nwrite_bytes %llu\nwrite_errors %lu\nreconnects %lu\n",
+                   atomic_read(&dev->inflight), ops[0], bytes[0], errors[0], 
+                   ops[1], bytes[1], errors[1], reconnects);
+};
+
+/* histograms of the SD round trips, as "UNDER_US READS WRITES" lines */
+static ssize_t rbddev_latency_read(struct rbd_dev *dev, char *page)
+{
+    unsigned long lat[2];
+    struct rbd_stats *s;
+    ssize_t len = 0;
+    int cpu, b;
+
+    for (b = 0; b < RBD_LAT_BUCKETS; b++) {
+        lat[0] = lat[1] = 0;
+        for_each_possible_cpu(cpu) {
+            s = per_cpu_ptr(dev->stats, cpu);
+            lat[0] += s->lat[0][b];
+            lat[1] += s->lat[1][b];
+        }
+        if (b < RBD_LAT_BUCKETS - 1)
+            len += sprintf(page + len, "%lu %lu %lu\n", 1UL << b, lat[0], lat[1]);
+        else
+            len += sprintf(page + len, "inf %lu %lu\n", lat[0], lat[1]);
+    }
+    return len;
+};
+
 struct rbddev_attribute {
     struct configfs_attribute attr;
     ssize_t (*show)(struct rbd_dev *, char *);
@@ -533,10 +2107,89 @@ static struct rbddev_attribute rbddev_attr_port = {
     .store = rbddev_port_write,
 };
 
+static struct rbddev_attribute rbddev_attr_checksum = {
+    .attr  = { .ca_owner = THIS_MODULE, .ca_name = "checksum", .ca_mode = S_IRUGO | S_IWUSR },
+    .show  = rbddev_checksum_read,
+    .store = rbddev_checksum_write,
+};
+
+static struct rbddev_attribute rbddev_attr_compress = {
+    .attr  = { .ca_owner = THIS_MODULE, .ca_name = "compress", .ca_mode = S_IRUGO | S_IWUSR },
+    .show  = rbddev_compress_read,
+    .store = rbddev_compress_write,
+};
+
+static struct rbddev_attribute rbddev_attr_session = {
+    .attr  = { .ca_owner = THIS_MODULE, .ca_name = "session", .ca_mode = S_IRUGO | S_IWUSR },
+    .show  = rbddev_session_read,
+    .store = rbddev_session_write,
+};
+
+static struct rbddev_attribute rbddev_attr_timeout = {
+    .attr  = { .ca_owner = THIS_MODULE, .ca_name = "timeout", .ca_mode = S_IRUGO | S_IWUSR },
+    .show  = rbddev_timeout_read,
+    .store = rbddev_timeout_write,
+};
+
+static struct rbddev_attribute rbddev_attr_compress_stats = {
+    .attr  = { .ca_owner = THIS_MODULE, .ca_name = "compress_stats", .ca_mode = S_IRUGO },
+    .show  = rbddev_compress_stats_read,
+};
+
+static struct rbddev_attribute rbddev_attr_targets = {
+    .attr  = { .ca_owner = THIS_MODULE, .ca_name = "targets", .ca_mode = S_IRUGO | S_IWUSR },
+    .show  = rbddev_targets_read,
+    .store = rbddev_targets_write,
+};
+
+static struct rbddev_attribute rbddev_attr_stripe_unit = {
+    .attr  = { .ca_owner = THIS_MODULE, .ca_name = "stripe_unit", .ca_mode = S_IRUGO | S_IWUSR },
+    .show  = rbddev_stripe_unit_read,
+    .store = rbddev_stripe_unit_write,
+};
+
+static struct rbddev_attribute rbddev_attr_cache = {
+    .attr  = { .ca_owner = THIS_MODULE, .ca_name = "cache", .ca_mode = S_IRUGO | S_IWUSR },
+    .show  = rbddev_cache_read,
+    .store = rbddev_cache_write,
+};
+
+static struct rbddev_attribute rbddev_attr_cache_stats = {
+    .attr  = { .ca_owner = THIS_MODULE, .ca_name = "cache_stats", .ca_mode = S_IRUGO },
+    .show  = rbddev_cache_stats_read,
+};
+
+static struct rbddev_attribute rbddev_attr_cache_flush = {
+    .attr  = { .ca_owner = THIS_MODULE, .ca_name = "cache_flush", .ca_mode = S_IWUSR },
+    .store = rbddev_cache_flush_write,
+};
+
+static struct rbddev_attribute rbddev_attr_stats = {
+    .attr  = { .ca_owner = THIS_MODULE, .ca_name = "stats", .ca_mode = S_IRUGO },
+    .show  = rbddev_stats_read,
+};
+
+static struct rbddev_attribute rbddev_attr_latency = {
+    .attr  = { .ca_owner = THIS_MODULE, .ca_name = "latency", .ca_mode = S_IRUGO },
+    .show  = rbddev_latency_read,
+};
+
 static struct configfs_attribute *rbddev_attrs[] = {
     &rbddev_attr_active.attr,
     &rbddev_attr_host.attr,
     &rbddev_attr_port.attr,
+    &rbddev_attr_checksum.attr,
+    &rbddev_attr_compress.attr,
+    &rbddev_attr_compress_stats.attr,
+    &rbddev_attr_targets.attr,
+    &rbddev_attr_stripe_unit.attr,
+    &rbddev_attr_cache.attr,
+    &rbddev_attr_cache_stats.attr,
+    &rbddev_attr_cache_flush.attr,
+    &rbddev_attr_stats.attr,
+    &rbddev_attr_latency.attr,
+    &rbddev_attr_timeout.attr,
+    &rbddev_attr_session.attr,
     NULL,
 };
 
@@ -654,9 +2307,17 @@ static int __init rbd_init(void)
     
     if (debug) printk(KERN_INFO "rbd_init | major=%d\n", major);
 
+    rbd_wq = create_singlethread_workqueue("rbd_connect");
+    if (!rbd_wq) {
+        unregister_blkdev(major, DEVICE_NAME);
+        return -ENOMEM;
+    }
+
     ret = configfs_init();
-    if (ret)
+    if (ret) {
+        destroy_workqueue(rbd_wq);
         return ret;
+    }
 
     return 0;
 }
@@ -665,6 +2326,7 @@ static int __init rbd_init(void)
 static void rbd_exit(void)
 {
     configfs_unregister_subsystem(&rbd_cfs_subsys);
+    destroy_workqueue(rbd_wq);
     unregister_blkdev(major, DEVICE_NAME);
 }
     
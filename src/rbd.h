@@ -8,6 +8,7 @@
 #include <linux/genhd.h>        /* struct gendisk */
 #include <linux/fs.h>           /* struct inode, file */
 #include <linux/list.h>         /* struct list_head */
+#include <linux/percpu.h>       /* alloc_percpu */
 
 #include <linux/net.h>
 #include <linux/tcp.h>
@@ -16,13 +17,142 @@
 #include <linux/socket.h>
 
 #include <linux/configfs.h>
+#include <linux/zlib.h>
 
 #include "proto.h"
 
 #define DEVICE_NAME "rbd"
 #define RBD_MINORS 16
 #define RBD_SECSIZE 512
+#define RBD_ZIP_MAXRATIO 87             /* max compressed size, in % of raw */
+#define RBD_ZIP_MAXBACKOFF 64           /* max writes sent raw after a miss */
+#define RBD_MAXTARGETS 8                /* SDs a device can be striped across */
+#define RBD_STRIPE_UNIT (64*1024)       /* default stripe unit, in bytes */
+#define RBD_MAX_SEGMENTS 128            /* max segments of a request */
+#define RBD_LAT_BUCKETS 24              /* round trips by log2 of us, to 8s */
+#define RBD_TIMEOUT 30                  /* default seconds to complete a transfer */
+#define RBD_CONNECT_TIMEOUT (5*HZ)      /* to connect, and for the handshake */
+#define RBD_BACKOFF_MIN (HZ/10)         /* between failed connects, doubling */
+#define RBD_BACKOFF_MAX (8*HZ)
+
+/* local write-back cache: a log of records on a file or block device */
+#define RBD_CACHE_MAGIC "RBDCACHE"
+#define RBD_CACHE_VERSION 1
+#define RBD_CACHE_BLOCK 4096            /* cache unit, and log slot size */
+#define RBD_CACHE_SECTORS (RBD_CACHE_BLOCK / RBD_SECSIZE)
+#define RBD_CACHE_MAXBLOCKS (RBD_MAX_TRANSFER / RBD_CACHE_BLOCK + 1)  /* of a
+                                         * record: a whole unaligned request */
+#define RBD_CACHE_MAXFILL (64*1024)     /* bigger reads are not cached */
+#define RBD_CACHE_NONE (~0UL)
+
+#define RBD_CREC_MAGIC 0x52424352
+#define RBD_CREC_CLEAN 0x01             /* read from the SDs, not to flush */
+#define RBD_CREC_BARRIER 0x02           /* not coalesced with later records */
+#define RBD_CREC_WRAP 0x04              /* the log goes on at slot 0 */
+
+/* first block of the cache. head is the slot of the first record that
+ * may not be on the SDs yet, seq its sequence number */
+struct rbd_cache_super {
+    char magic[8];
+    u32 version;
+    u32 nslots;
+    char targets[128];                  /* SDs of the device it caches */
+    u32 head;
+    u64 seq;
+};
+
+/* record header, in the slot before its data. records are numbered, so
+ * that the ones left from earlier rounds of the log are told apart */
+struct rbd_cache_rec {
+    u32 magic;
+    u32 flags;                          /* RBD_CREC_* */
+    u64 seq;
+    u64 block;                          /* first device block */
+    u32 nblocks;
+    u32 crc;                            /* CRC32C of the data */
+};
+
+struct rbd_cache {
+    struct file *file;
+    struct rbd_cache_super super;
+    unsigned long nslots;
+    unsigned long head;                 /* first slot in use */
+    unsigned long flushed;              /* first record not flushed */
+    unsigned long tail;                 /* where the next record goes */
+    unsigned long used;                 /* slots from head to tail */
+    u64 seq;                            /* of the next record */
+    u64 flush_seq;                      /* of the record at flushed */
+    unsigned long *block;               /* device block in each slot */
+    unsigned long *next;                /* hash chains, through the slots */
+    unsigned long *hash;                /* first slot of every chain */
+    unsigned long hashmask;
+    struct semaphore mutex;             /* positions, against the flusher */
+    struct semaphore flush_mutex;
+    wait_queue_head_t wait;             /* for flushes */
+    struct workqueue_struct *wq;
+    struct work_struct flush_work;
+    int error;                          /* the log is unusable */
+    int closing;
+    char *buf;                          /* a record, header slot first */
+    char *fbuf;                         /* data of the records being flushed */
+    struct rbd_piece *pieces;           /* of flushes */
+    unsigned long long hits, misses;    /* reads served locally, or not */
+    unsigned long long writes;
+    unsigned long long flushed_bytes;   /* written to the SDs */
+    unsigned long long waits;           /* writes that waited for room */
+};
+
+/* I/O counters of a device, one copy per CPU. indexed by direction, as
+ * rq_data_dir: 0 for reads, 1 for writes */
+struct rbd_stats {
+    unsigned long ops[2];               /* requests completed */
+    unsigned long errors[2];
+    unsigned long long bytes[2];
+    unsigned long reconnects;           /* to any SD, after a failure */
+    unsigned long lat[2][RBD_LAT_BUCKETS];  /* SD round trips, bucket b 
+                                               under 2^b us */
+};
+
+struct rbd_dev;
+
+/* connection to one of the SDs behind a device */
+struct rbd_sd {
+    struct rbd_dev *dev;
+    struct semaphore mutex; 
+    char host[16];                      /* SD address in dotted values format */
+	int addr;                           /* SD address in integer format */
+	int port;                           /* SD port */
+    struct socket *socket;
+    unsigned int conngen;               /* incremented on every connect */
+	unsigned int msguid;                /* UID of last message sent */
+	unsigned int resize_gen;            /* SD resize generation of size */
+    int broken;                         /* lost, the connect work is on it */
+    unsigned long backoff;              /* jiffies to the next connect */
+    struct work_struct connect_work;
+    wait_queue_head_t wait;             /* for the connect work */
+    unsigned int features;              /* RBD_FEAT_* accepted by the SD */
+    u64 session;                        /* kept on reconnects, with msguid */
+    u32 *crcbuf;                        /* block checksums of a transfer */
+    char *zbuf;                         /* compressed payload of a transfer */
+    struct z_stream_s zdef, zinf;       /* zlib streams, with their workspaces */
+    unsigned int zskip, zbackoff;       /* writes to send raw without trying */
+    unsigned long long zraw_bytes;      /* data size before compression */
+    unsigned long long zwire_bytes;     /* data size on the wire */
+    unsigned long long zip_us;          /* time spent compressing */
+    unsigned long long unzip_us;        /* and uncompressing */
+};
 
+/* the part of a request that goes to one SD */
+struct rbd_piece {
+    struct rbd_sd *sd;
+    unsigned long sector;               /* initial sector on the SD */
+    unsigned long nbytes;
+    char *buf;
+    unsigned int id;                    /* message UID, kept when sent again */
+    unsigned int conngen;               /* connection it was sent on */
+    u64 sent;                           /* us it was sent at, 0 if not */
+    int done;                           /* answered, or failed for good */
+};
 
 struct rbd_dev {
     char *name;                         /* name of this device */
@@ -36,6 +166,7 @@ struct rbd_dev {
 
     struct work_struct rq_work;   
 	struct work_struct setup_work;   
+	struct work_struct resize_work;   
     struct semaphore setupwk_mutex; 
 	struct semaphore rqwk_mutex; 
 
@@ -43,12 +174,21 @@ struct rbd_dev {
 
     struct config_item cfs_item;        /* configfs item */
 
-    struct semaphore sd_mutex; 
-    char sd_host[16];                   /* SD address in dotted values format */
-	int sd_addr;                        /* SD address in integer format */
-	int sd_port;                        /* SD port */
-    struct socket *sd_socket;
-	unsigned int sd_msguid;             /* UID of last message sent */
+    struct rbd_sd sd[RBD_MAXTARGETS];   /* stripe unit k is on SD k % nsd */
+    int nsd;
+    unsigned long stripe_unit;          /* in bytes */
+    struct rbd_piece *pieces;           /* of the request in progress */
+    char *xbuf;                         /* its data, unless its pages are one
+                                         * run of low memory */
+    unsigned int want_features;         /* RBD_FEAT_* asked to the SDs */
+    unsigned long timeout;              /* seconds to complete a transfer, 
+                                           0 waits for the SDs forever */
+
+    char cache_path[128];               /* local write-back cache, if any */
+    struct rbd_cache *cache;
+
+    struct rbd_stats *stats;            /* per CPU */
+    atomic_t inflight;                  /* pieces sent, waiting for reply */
 
 	struct gendisk *gd; 
 };
@@ -57,12 +197,12 @@ struct rbd_dev {
 
 static int __init rbd_init(void);
 static void rbd_exit(void);
-static void rbd_transfer(struct rbd_dev *dev, unsigned long sector,
-		unsigned long nsect, char *buffer, int write);
+static int rbd_transfer(struct rbd_dev *dev, struct request *req);
 static void rbd_request(request_queue_t *q);
-int sd_connect(struct rbd_dev *dev);
-int sd_disconnect(struct rbd_dev *dev);
-int sd_send(struct rbd_dev *dev, void *buf, size_t size);
-int sd_recv(struct rbd_dev *dev, void *buf, size_t size);
+int sd_connect(struct rbd_sd *sd);
+int sd_disconnect(struct rbd_sd *sd);
+int sd_sendv(struct rbd_sd *sd, struct kvec *iov, int n);
+int sd_send(struct rbd_sd *sd, void *buf, size_t size);
+int sd_recv(struct rbd_sd *sd, void *buf, size_t size);
 
 #endif
@@ -0,0 +1,442 @@
+/*
+ * Remote Block Device - client library
+ *
+ * Every connection has a table of the requests in flight on it, indexed
+ * by tag, and a receiver thread that takes the replies in whatever order
+ * they come and completes their requests. Submitters send on the
+ * connection with the fewest requests in flight, one message at a time,
+ * and wait when every window is full. A connection that fails completes
+ * its requests with -ECONNRESET and takes no more.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#include "sd.h"
+#include "rbdclient.h"
+
+struct rbdc_conn {
+    struct rbdc *c;
+    int fd;
+    struct sd_shm *shm;            /* with a shared memory host */
+    pthread_t receiver;
+    pthread_mutex_t send_lock;     /* one message at a time */
+    struct rbdc_io **slot;         /* requests in flight, by tag % depth */
+    unsigned int next_tag;
+    int inflight;
+    int broken;
+};
+
+struct rbdc {
+    int nconns, depth;
+    struct rbdc_conn conn[RBDC_MAXCONNS];
+    unsigned long sectors;
+    pthread_mutex_t lock;          /* slots, windows, completion queue */
+    pthread_cond_t room;           /* a window has room */
+    pthread_cond_t done;           /* a request completed on the queue */
+    struct rbdc_io *head, *tail;   /* completion queue */
+    int queued;                    /* submitted requests without callback,
+                                    * not reaped yet */
+};
+
+static int rbdc_sendv(struct rbdc_conn *cn, struct iovec *iov, int n)
+{
+    ssize_t rv;
+
+    if (cn->shm)
+        return shm_writev(cn->shm, iov, n);
+    while (n) {
+        if ((rv = writev(cn->fd, iov, n)) <= 0) {
+            if (rv == -1 && errno == EINTR)
+                continue;
+            return -1;
+        }
+        while (n && (size_t)rv >= iov->iov_len) {
+            rv -= iov->iov_len;
+            iov++;
+            n--;
+        }
+        if (n) {
+            iov->iov_base = (char *)iov->iov_base + rv;
+            iov->iov_len -= rv;
+        }
+    }
+    return 0;
+}
+
+static int rbdc_recv(struct rbdc_conn *cn, void *buf, size_t size)
+{
+    ssize_t rv;
+
+    if (cn->shm)
+        return shm_read(cn->shm, buf, size, size) < 0 ? -1 : 0;
+    while (size) {
+        if ((rv = recv(cn->fd, buf, size, MSG_WAITALL)) <= 0) {
+            if (rv == -1 && errno == EINTR)
+                continue;
+            return -1;
+        }
+        buf = (char *)buf + rv;
+        size -= rv;
+    }
+    return 0;
+}
+
+static void rbdc_msg(struct rbdmsg_hdr *msg, int code, unsigned int id, unsigned long sector,
+                     unsigned int size)
+{
+    memset(msg, 0, sizeof(*msg));
+    msg->version = PROTO_VERSION;
+    msg->type = CMD;
+    msg->code = code;
+    msg->id = id;
+    msg->fsop_offset_sectors = sector;
+    msg->fsop_size = size;
+    msg->payload_size = code == CMD_WRITE ? size : 0;
+}
+
+static int rbdc_connect(struct rbdc_conn *cn, const char *host, int port)
+{
+    struct sockaddr_in addr;
+    int fd, yes = 1;
+
+    if (host[0] == '/')
+        return (cn->shm = shm_connect(host, SHM_POLL_US)) ? 0 : -1;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = inet_addr(host);
+    if ((fd = socket(AF_INET, SOCK_STREAM, 0)) == -1)
+        return -1;
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
+        close(fd);
+        return -1;
+    }
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof(yes));
+    cn->fd = fd;
+    return 0;
+}
+
+/* make the receiver of cn, and any sender, give up on it */
+static void rbdc_shutdown(struct rbdc_conn *cn)
+{
+    shutdown(cn->shm ? cn->shm->fd : cn->fd, SHUT_RDWR);
+}
+
+/* io is over, with result. called with the lock held */
+static void rbdc_complete(struct rbdc *c, struct rbdc_io *io, int result)
+{
+    io->result = result;
+    if (io->done) {
+        pthread_mutex_unlock(&c->lock);
+        io->done(io);
+        pthread_mutex_lock(&c->lock);
+        return;
+    }
+    io->next = NULL;
+    if (c->tail)
+        c->tail->next = io;
+    else
+        c->head = io;
+    c->tail = io;
+    pthread_cond_broadcast(&c->done);
+}
+
+/* take the request of tag off the table of cn. called with the lock held */
+static struct rbdc_io *rbdc_take(struct rbdc_conn *cn, unsigned int tag)
+{
+    struct rbdc_io **slot = &cn->slot[tag % cn->c->depth];
+    struct rbdc_io *io = *slot;
+
+    if (!io || io->tag != tag)
+        return NULL;
+    *slot = NULL;
+    cn->inflight--;
+    pthread_cond_broadcast(&cn->c->room);
+    return io;
+}
+
+static void *rbdc_receiver(void *arg)
+{
+    struct rbdc_conn *cn = arg;
+    struct rbdc *c = cn->c;
+    struct rbdmsg_hdr rsp;
+    struct rbdc_io *io;
+    char skip[4096];
+    unsigned int n;
+    int i, result;
+
+    while (!rbdc_recv(cn, &rsp, sizeof(rsp))) {
+        pthread_mutex_lock(&c->lock);
+        io = cn->slot[rsp.id % c->depth];
+        if (io && io->tag != rsp.id)
+            io = NULL;
+        pthread_mutex_unlock(&c->lock);
+        if (!io || rsp.type != REP || rsp.payload_size > RBD_MAX_TRANSFER)
+            break;              /* not a reply to us: lost track */
+
+        /* the slot is ours until the request is taken off the table */
+        result = rsp.code == REP_ERR ? -EIO : 0;
+        if (rsp.payload_size && (io->code != CMD_READ || rsp.payload_size != io->size)) {
+            result = -EPROTO;
+            for (n = rsp.payload_size; n; n -= i) {
+                i = n < sizeof(skip) ? n : sizeof(skip);
+                if (rbdc_recv(cn, skip, i))
+                    goto out;
+            }
+        } else if (rsp.payload_size && rbdc_recv(cn, io->buf, rsp.payload_size))
+            break;
+        else if (!result && io->code == CMD_READ && rsp.payload_size != io->size)
+            result = -EPROTO;
+
+        pthread_mutex_lock(&c->lock);
+        if ((io = rbdc_take(cn, rsp.id)))
+            rbdc_complete(c, io, result);
+        pthread_mutex_unlock(&c->lock);
+    }
+
+out:
+    /* the connection is lost: so are its requests */
+    rbdc_shutdown(cn);
+    pthread_mutex_lock(&c->lock);
+    cn->broken = 1;
+    for (i = 0; i < c->depth; i++)
+        if (cn->slot[i] && (io = rbdc_take(cn, cn->slot[i]->tag)))
+            rbdc_complete(c, io, -ECONNRESET);
+    pthread_cond_broadcast(&c->room);
+    pthread_mutex_unlock(&c->lock);
+    return NULL;
+}
+
+/* size of the volume, asked on cn before its receiver is started */
+static int rbdc_getsz(struct rbdc_conn *cn, unsigned long *sectors)
+{
+    struct rbdmsg_hdr msg;
+    struct iovec iov;
+
+    rbdc_msg(&msg, CMD_GETSZ, 0, 0, 0);
+    iov.iov_base = &msg;
+    iov.iov_len = sizeof(msg);
+    if (rbdc_sendv(cn, &iov, 1) || rbdc_recv(cn, &msg, sizeof(msg)))
+        return -1;
+    if (msg.code == REP_ERR || msg.payload_size != sizeof(*sectors)) {
+        errno = EPROTO;
+        return -1;
+    }
+    return rbdc_recv(cn, sectors, sizeof(*sectors));
+}
+
+/* client with conns connections to the SD at host and port, or to the
+ * shared memory socket at host if it is a path, and up to depth requests
+ * in flight on each one */
+rbdc_t *rbdc_open(const char *host, int port, int conns, int depth)
+{
+    struct rbdc_conn *cn;
+    struct rbdc *c;
+    int i;
+
+    if (conns < 1 || conns > RBDC_MAXCONNS || depth < 1 || depth > RBDC_MAXDEPTH) {
+        errno = EINVAL;
+        return NULL;
+    }
+    if (!(c = calloc(1, sizeof(*c))))
+        return NULL;
+    c->depth = depth;
+    pthread_mutex_init(&c->lock, NULL);
+    pthread_cond_init(&c->room, NULL);
+    pthread_cond_init(&c->done, NULL);
+    for (i = 0; i < conns; i++) {
+        cn = &c->conn[i];
+        cn->c = c;
+        cn->fd = -1;
+        pthread_mutex_init(&cn->send_lock, NULL);
+        if (!(cn->slot = calloc(depth, sizeof(*cn->slot))) || rbdc_connect(cn, host, port) ||
+            (!i && rbdc_getsz(cn, &c->sectors)) ||
+            pthread_create(&cn->receiver, NULL, rbdc_receiver, cn)) {
+            if (cn->shm)
+                shm_close(cn->shm);
+            else if (cn->fd != -1)
+                close(cn->fd);
+            free(cn->slot);
+            break;
+        }
+        c->nconns++;
+    }
+    if (c->nconns < conns) {
+        i = errno;
+        rbdc_close(c);
+        errno = i;
+        return NULL;
+    }
+    return c;
+}
+
+/* wait for the requests in flight, and close every connection */
+void rbdc_close(rbdc_t *c)
+{
+    struct rbdc_conn *cn;
+    struct rbdmsg_hdr msg;
+    struct iovec iov;
+    int i;
+
+    for (i = 0; i < c->nconns; i++) {
+        cn = &c->conn[i];
+        pthread_mutex_lock(&c->lock);
+        while (cn->inflight && !cn->broken)
+            pthread_cond_wait(&c->room, &c->lock);
+        pthread_mutex_unlock(&c->lock);
+
+        rbdc_msg(&msg, CMD_CLOSE, 0, 0, 0);
+        iov.iov_base = &msg;
+        iov.iov_len = sizeof(msg);
+        pthread_mutex_lock(&cn->send_lock);
+        if (!cn->broken)
+            rbdc_sendv(cn, &iov, 1);
+        pthread_mutex_unlock(&cn->send_lock);
+        rbdc_shutdown(cn);
+        pthread_join(cn->receiver, NULL);
+        if (cn->shm)
+            shm_close(cn->shm);
+        else
+            close(cn->fd);
+        free(cn->slot);
+        pthread_mutex_destroy(&cn->send_lock);
+    }
+    pthread_mutex_destroy(&c->lock);
+    pthread_cond_destroy(&c->room);
+    pthread_cond_destroy(&c->done);
+    free(c);
+}
+
+unsigned long rbdc_sectors(rbdc_t *c)
+{
+    return c->sectors;
+}
+
+/* send io on the connection with the fewest requests in flight, waiting
+ * for room if every window is full. -1 if it could not be sent; otherwise
+ * it completes, with its result, through its callback or the queue */
+int rbdc_submit(rbdc_t *c, struct rbdc_io *io)
+{
+    struct rbdc_conn *cn;
+    struct rbdmsg_hdr msg;
+    struct iovec iov[2];
+    int i;
+
+    if ((io->code != CMD_READ && io->code != CMD_WRITE) || io->size > RBD_MAX_TRANSFER) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    pthread_mutex_lock(&c->lock);
+    while (1) {
+        cn = NULL;
+        for (i = 0; i < c->nconns; i++)
+            if (!c->conn[i].broken && (!cn || c->conn[i].inflight < cn->inflight))
+                cn = &c->conn[i];
+        if (!cn || cn->inflight < c->depth)
+            break;
+        pthread_cond_wait(&c->room, &c->lock);
+    }
+    if (!cn) {
+        pthread_mutex_unlock(&c->lock);
+        errno = ENOTCONN;
+        return -1;
+    }
+    /* a free slot, past those of requests still in flight */
+    while (cn->slot[cn->next_tag % c->depth])
+        cn->next_tag++;
+    io->tag = cn->next_tag++;
+    io->result = 0;
+    cn->slot[io->tag % c->depth] = io;
+    cn->inflight++;
+    if (!io->done)
+        c->queued++;
+    pthread_mutex_unlock(&c->lock);
+
+    rbdc_msg(&msg, io->code, io->tag, io->sector, io->size);
+    iov[0].iov_base = &msg;
+    iov[0].iov_len = sizeof(msg);
+    iov[1].iov_base = io->buf;
+    iov[1].iov_len = msg.payload_size;
+    pthread_mutex_lock(&cn->send_lock);
+    if (rbdc_sendv(cn, iov, msg.payload_size ? 2 : 1))
+        rbdc_shutdown(cn);      /* its receiver completes io */
+    pthread_mutex_unlock(&cn->send_lock);
+    return 0;
+}
+
+/* take up to max completed requests off the queue, waiting for min of
+ * them at least, or for as many as there are to come */
+int rbdc_reap(rbdc_t *c, struct rbdc_io **ios, int min, int max)
+{
+    int n = 0;
+
+    pthread_mutex_lock(&c->lock);
+    while (n < max) {
+        if (!c->head) {
+            if (n >= min || !c->queued)
+                break;
+            pthread_cond_wait(&c->done, &c->lock);
+            continue;
+        }
+        ios[n++] = c->head;
+        if (!(c->head = c->head->next))
+            c->tail = NULL;
+        c->queued--;
+    }
+    pthread_mutex_unlock(&c->lock);
+    return n;
+}
+
+static void rbdc_sync_done(struct rbdc_io *io)
+{
+    sem_post(io->priv);
+}
+
+static int rbdc_sync(rbdc_t *c, int code, void *buf, unsigned int size, unsigned long sector)
+{
+    struct rbdc_io io;
+    sem_t done;
+
+    memset(&io, 0, sizeof(io));
+    io.code = code;
+    io.sector = sector;
+    io.buf = buf;
+    io.size = size;
+    io.done = rbdc_sync_done;
+    io.priv = &done;
+    sem_init(&done, 0, 0);
+    if (rbdc_submit(c, &io)) {
+        sem_destroy(&done);
+        return -1;
+    }
+    while (sem_wait(&done) == -1 && errno == EINTR)
+        ;
+    sem_destroy(&done);
+    if (io.result) {
+        errno = -io.result;
+        return -1;
+    }
+    return 0;
+}
+
+/* read size bytes at sector into buf, and wait for them */
+int rbdc_read(rbdc_t *c, void *buf, unsigned int size, unsigned long sector)
+{
+    return rbdc_sync(c, CMD_READ, buf, size, sector);
+}
+
+/* write size bytes of buf at sector, and wait until they are written */
+int rbdc_write(rbdc_t *c, const void *buf, unsigned int size, unsigned long sector)
+{
+    return rbdc_sync(c, CMD_WRITE, (void *)buf, size, sector);
+}
@@ -0,0 +1,54 @@
+/*
+ * Remote Block Device - client library
+ *
+ * Talks to an SD from user space, over one or more TCP connections, or
+ * through the shared memory transport of an SD on the same host (see
+ * sdshm.c). Requests are tagged with their message id, so that up to a
+ * window of them are in flight on every connection at once.
+ *
+ * An rbdc_io is submitted with rbdc_submit, and completes either through
+ * its done callback, called on the receiver thread of its connection, or
+ * on the completion queue of the client, taken with rbdc_reap when it has
+ * no callback. rbdc_read and rbdc_write wait for a single request.
+ *
+ * Data is sent from, and received straight into, the buffers of the
+ * requests, with no copy in the library; the shared memory transport
+ * still copies it through its rings. There is no zero-copy buffer
+ * registration: that needs the SD to read and write payloads in place in
+ * the shared region, which its protocol does not do.
+ */
+
+#ifndef RBDCLIENT_H
+#define RBDCLIENT_H
+
+#include "proto.h"
+
+#define RBDC_MAXCONNS 16
+#define RBDC_MAXDEPTH 256
+
+typedef struct rbdc rbdc_t;
+
+struct rbdc_io {
+    int code;                      /* CMD_READ or CMD_WRITE */
+    unsigned long sector;          /* where, in 512 bytes sectors */
+    void *buf;                     /* data to write, or room for the data read */
+    unsigned int size;             /* up to RBD_MAX_TRANSFER bytes */
+    void (*done)(struct rbdc_io *);/* NULL to complete on the queue. must not
+                                    * wait for other requests */
+    void *priv;                    /* for the caller */
+    int result;                    /* 0, or a negative errno */
+
+    /* owned by the library while the request is in flight */
+    unsigned int tag;
+    struct rbdc_io *next;
+};
+
+rbdc_t *rbdc_open(const char *host, int port, int conns, int depth);
+void rbdc_close(rbdc_t *);
+unsigned long rbdc_sectors(rbdc_t *);
+int rbdc_submit(rbdc_t *, struct rbdc_io *);
+int rbdc_reap(rbdc_t *, struct rbdc_io **, int, int);
+int rbdc_read(rbdc_t *, void *, unsigned int, unsigned long);
+int rbdc_write(rbdc_t *, const void *, unsigned int, unsigned long);
+
+#endif
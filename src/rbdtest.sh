@@ -131,3 +131,48 @@ mkfs.ext2 /dev/rbdb1 >/dev/null 2>/dev/null && success || fail
 
 testing "mount - rbd1"
 umount /mnt && mount /dev/rbdb1 /mnt && success || fail
+
+testing "configuracion dispositivo distribuido (RAID-0)"
+umount /mnt
+mkdir /config/rbd/c
+echo -n "$sd_host:$sd_port1 $sd_host:$sd_port2" > /config/rbd/c/targets
+echo -n "4096" > /config/rbd/c/stripe_unit
+echo -n "1" > /config/rbd/c/active
+sleep 2
+[ -b /dev/rbdc ] && success || fail
+
+testing "tamaño dispositivo distribuido"
+[ `blockdev --getsz /dev/rbdc` -eq $((`blockdev --getsz /dev/rbda` * 2)) ] && success || fail
+
+testing "lectura/escritura distribuida"
+dd if=$testfile of=/tmp/rbdtest3 bs=512 count=40 2>/dev/null
+dd if=/tmp/rbdtest3 of=/dev/rbdc bs=512 count=40 seek=4 oflag=direct 2>/dev/null
+dd if=/dev/rbdc of=/tmp/rbdtest4 bs=512 count=40 skip=4 iflag=direct 2>/dev/null
+diff /tmp/rbdtest3 /tmp/rbdtest4 >/dev/null && success || fail
+
+testing "estadisticas del dispositivo"
+grep -q "^inflight 0$" /config/rbd/c/stats && ! grep -q "^write_ops 0$" /config/rbd/c/stats && \
+    [ `awk '{ n += $3 } END { print n }' /config/rbd/c/latency` -gt 0 ] && success || fail
+
+testing "configuracion dispositivo con cache local"
+dd if=/dev/zero of=/tmp/rbdcache bs=1M count=8 2>/dev/null
+mkdir /config/rbd/d
+echo -n "$sd_host" > /config/rbd/d/host
+echo -n "$sd_port1" > /config/rbd/d/port
+echo -n "/tmp/rbdcache" > /config/rbd/d/cache
+echo -n "1" > /config/rbd/d/session
+echo -n "1" > /config/rbd/d/active
+sleep 2
+[ -b /dev/rbdd ] && success || fail
+
+testing "lectura/escritura con cache"
+dd if=$testfile of=/tmp/rbdtest5 bs=512 count=40 2>/dev/null
+dd if=/tmp/rbdtest5 of=/dev/rbdd bs=512 count=40 seek=3 oflag=direct 2>/dev/null
+dd if=/dev/rbdd of=/tmp/rbdtest6 bs=512 count=40 skip=3 iflag=direct 2>/dev/null
+diff /tmp/rbdtest5 /tmp/rbdtest6 >/dev/null && success || fail
+
+testing "vaciado de la cache al SD"
+echo -n "1" > /config/rbd/d/cache_flush
+grep -q "^dirty 0$" /config/rbd/d/cache_stats || fail
+dd if=/dev/rbda of=/tmp/rbdtest6 bs=512 count=40 skip=3 iflag=direct 2>/dev/null
+diff /tmp/rbdtest5 /tmp/rbdtest6 >/dev/null && success || fail
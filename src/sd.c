@@ -3,6 +3,7 @@
  *
  */
 
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
@@ -15,16 +16,64 @@
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <sys/wait.h>
+#include <sys/prctl.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
 #include "proto.h"
 #include "sd.h"
 
+#define SD_BACKLOG 1024     /* pending connections per listener */
+#define SD_MAXREACTORS 64
+#define SD_MAXEVENTS 64     /* epoll events handled per wakeup */
+
+/* reactor thread: one core, one listener, its own connections and buffers */
+struct sd_reactor {
+    pthread_t thread;
+    int id;
+    int port;
+    int listenfd;
+    int epfd;
+    int nconns;             /* connections currently attended */
+    storage_t st;           /* private storage handle and buffer pool */
+};
+
 storage_t sd_storage;
+struct sd_repl_config sd_repl;
 pid_t childpid;
+struct sd_reactor sd_reactors[SD_MAXREACTORS];
+int sd_tracefd = -1;               /* trace shared by every worker */
 
 void usage(void) {
-    printf("Usage: sd [-p PORT] FILE\n\n");
-    printf("PORT - device TCP listening port. default: %d\n", SDPORT);
-    printf("FILE - storage daemon file\n");
+    printf("Usage: sd [-d] [-H] [-m META] [-p PORT] [-t THREADS] [-R HOST:PORT]... [-q QUORUM]\n");
+    printf("          [-T TRACE] [-S SOCKET] [-L LEVEL] [-U SHMSOCKET] [-P POLL]\n");
+    printf("          [-Q QOS] FILE\n\n");
+    printf("-d      - direct I/O: bypass the host page cache (O_DIRECT)\n");
+    printf("-H      - back payload buffers with huge pages\n");
+    printf("META    - metadata sidecar file, for FILEs created with sdfile -m\n");
+    printf("PORT    - device TCP listening port. default: %d\n", SDPORT);
+    printf("THREADS - number of reactor threads, each one pinned to a core with\n");
+    printf("          its own SO_REUSEPORT listener. default: 0 (one process per\n");
+    printf("          connection)\n");
+    printf("HOST:PORT - replica SD to forward writes to, up to %d. replicas must \n", SD_MAXREPLICAS);
+    printf("          hold a volume of the same size. HOST is an IPv4 address\n");
+    printf("QUORUM  - copies, counting the local one, that must succeed before a\n");
+    printf("          write is acknowledged. default: all of them\n");
+    printf("TRACE   - file to record every request attended in, for sdreplay\n");
+    printf("SOCKET  - Unix socket to serve request stats on, as text, or as JSON\n");
+    printf("          to clients that send \"json\" first. \"qos RULE\" applies a\n");
+    printf("          QoS rule first\n");
+    printf("LEVEL   - log level: 0 errors, 1 warnings, 2 connections, 3 every\n");
+    printf("          request. default: %d\n", SD_LOG_INFO);
+    printf("SHMSOCKET - Unix socket for clients on this host to connect to, to\n");
+    printf("          exchange messages through shared memory instead of TCP\n");
+    printf("POLL    - microseconds to busy poll a shared memory ring before\n");
+    printf("          sleeping on it, on hosts with more than one CPU. default: %d\n", SHM_POLL_US);
+    printf("QOS     - file of QoS rules, one per line:\n");
+    printf("          ADDR|*|volume [iops=N] [bps=N] [burst=MS] [weight=N] [depth=N]\n");
+    printf("FILE    - storage daemon file or block device\n");
     exit(2);
 }
 
@@ -32,36 +81,382 @@ void sigchld_handler(int s)
 {
 }
 
-
-int main(int argc, char **argv)
+/* create a listening socket bound to port
+ *
+ * reuseport - allow several sockets to listen on the same port, so the 
+ *             kernel spreads incoming connections among them
+ */
+int sd_listen(int port, int reuseport)
 {
-    int sockfd, new_fd;  
+    int sockfd;
+    int yes = 1;
     struct sockaddr_in locaddr;    
-    struct sockaddr_in remaddr; 
-    socklen_t sin_size;
-    struct sigaction sa;
-    int yes=1;
-    int sd_port = SDPORT;
-    int c;
-    int rv = 0;
-    int status;
-    pid_t pid;
 
     if ((sockfd = socket(PF_INET, SOCK_STREAM, 0)) == -1) {
         perror("SD: error creating socket");
-        exit(1);
+        return -1;
     }
 
     if (setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(int)) == -1) {
         perror("SD: error stting socket as reusable");
+        close(sockfd);
+        return -1;
+    }
+
+    if (reuseport && setsockopt(sockfd, SOL_SOCKET, SO_REUSEPORT, &yes, sizeof(int)) == -1) {
+        perror("SD: error setting SO_REUSEPORT");
+        close(sockfd);
+        return -1;
+    }
+
+    locaddr.sin_family = AF_INET;         
+    locaddr.sin_port = htons(port);     
+    locaddr.sin_addr.s_addr = INADDR_ANY; 
+    memset(&(locaddr.sin_zero), '\0', 8); 
+
+    if (bind(sockfd, (struct sockaddr *)&locaddr, sizeof(struct sockaddr))== -1) {
+        perror("SD: bind error");
+        close(sockfd);
+        return -1;
+    }
+
+    if (listen(sockfd, SD_BACKLOG) == -1) {
+        perror("SD: listen error");
+        close(sockfd);
+        return -1;
+    }
+
+    return sockfd;
+}
+
+/* attend a connection in a process of its own until it is closed. never
+ * returns */
+static void sd_conn_run(sd_conn_t *conn, const char *from)
+{
+    int rv = 0;
+
+    if (sd_repl.nreplicas && !(sd_storage.repl = repl_new(&sd_repl)))
         exit(1);
+    if (sd_tracefd != -1 && !(sd_storage.trace = trace_new(sd_tracefd, getpid())))
+        exit(1);
+    sd_storage.stats = stats_claim(getpid());
+    while(!rv) {
+        rv = storage_process(&sd_storage, conn);
     }
+    trace_flush(sd_storage.trace);
+    stats_release(sd_storage.stats);
+    sd_log(SD_LOG_INFO, "SD: closing connection from: %s\n", from);
+    sd_log_flush();
+    arena_stats(sd_storage.arena, stdout);
+    sd_conn_stats(conn, stdout);
+    if (conn->shm)
+        shm_close(conn->shm);
+    else
+        close(conn->sockfd);
+    exit(0);
+}
+
+/* shared memory transport: accept clients on the Unix socket at path, and
+ * attend each one in a process of its own, as TCP connections are without
+ * reactors. never returns */
+static void sd_shm_run(const char *path, unsigned int poll_us)
+{
+    sd_conn_t *conn;
+    int lfd, fd, status;
+    pid_t pid;
 
-    while ((c = getopt(argc, argv, "p:")) != -1) 
+    prctl(PR_SET_PDEATHSIG, SIGTERM);
+    if ((lfd = shm_listen(path)) == -1) {
+        perror("SD: shared memory socket");
+        exit(1);
+    }
+    while (1) {
+        if ((fd = accept(lfd, NULL, NULL)) == -1) {
+            if (errno != EINTR)
+                perror("SD: shared memory socket");
+            continue;
+        }
+        sd_log(SD_LOG_INFO, "SD: new connection on: %s\n", path);
+        while ((pid = waitpid(WAIT_ANY, &status, WNOHANG)) > 0) {
+            stats_reap(pid);
+            qos_reap(pid);
+        }
+        sd_log_flush();
+        if (!fork()) {
+            close(lfd);
+            if (!(conn = sd_conn_new(fd)) || !(conn->shm = shm_accept(fd, poll_us))) {
+                perror("SD: error setting up shared memory");
+                exit(1);
+            }
+            sd_conn_run(conn, path);
+        }
+        close(fd);
+    }
+}
+
+/* accept every pending connection on the reactor listener */
+static void reactor_accept(struct sd_reactor *r)
+{
+    struct sockaddr_in remaddr; 
+    socklen_t sin_size;
+    struct epoll_event ev;
+    sd_conn_t *conn;
+    int new_fd;
+
+    while (1) {
+        sin_size = sizeof(struct sockaddr_in);
+        new_fd = accept4(r->listenfd, (struct sockaddr *)&remaddr, &sin_size, SOCK_NONBLOCK);
+        if (new_fd == -1) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+                perror("SD: unable to accept connections");
+            return;
+        }
+        sd_log(SD_LOG_INFO, "SD: reactor %d | new connection from: %s\n", r->id, inet_ntoa(remaddr.sin_addr));
+
+        if (!(conn = sd_conn_new(new_fd))) {
+            close(new_fd);
+            continue;
+        }
+        conn->nonblock = 1;
+        conn->events = EPOLLIN;
+        ev.events = EPOLLIN;
+        ev.data.ptr = conn;
+        if (epoll_ctl(r->epfd, EPOLL_CTL_ADD, new_fd, &ev) == -1) {
+            perror("SD: epoll_ctl");
+            sd_conn_free(conn);
+            close(new_fd);
+            continue;
+        }
+        r->nconns++;
+    }
+}
+
+/* QoS holds the next request of conn: take its socket out of the epoll
+ * set, and wake up on its timer when the request is to be tried again */
+static int reactor_park(struct sd_reactor *r, sd_conn_t *conn)
+{
+    struct itimerspec its;
+    struct epoll_event ev;
+
+    if (conn->timerfd == -1) {
+        if ((conn->timerfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC)) == -1)
+            return -1;
+        ev.events = EPOLLIN;
+        ev.data.ptr = conn;
+        if (epoll_ctl(r->epfd, EPOLL_CTL_ADD, conn->timerfd, &ev) == -1)
+            return -1;
+    }
+    memset(&its, 0, sizeof(its));
+    its.it_value.tv_sec = conn->parked / 1000000000ULL;
+    its.it_value.tv_nsec = conn->parked % 1000000000ULL;
+    if (timerfd_settime(conn->timerfd, 0, &its, NULL) == -1)
+        return -1;
+    if (conn->events && epoll_ctl(r->epfd, EPOLL_CTL_DEL, conn->sockfd, NULL) == -1)
+        return -1;
+    conn->events = 0;
+    return 0;
+}
+
+/* the timer of a parked connection went off: attend its socket again */
+static int reactor_unpark(struct sd_reactor *r, sd_conn_t *conn)
+{
+    struct epoll_event ev;
+    unsigned long long n;
+
+    if (read(conn->timerfd, &n, sizeof(n)) == -1 && errno != EAGAIN)
+        return -1;
+    ev.events = conn->events = EPOLLIN;
+    ev.data.ptr = conn;
+    return epoll_ctl(r->epfd, EPOLL_CTL_ADD, conn->sockfd, &ev);
+}
+
+/* reactor main loop. requests are attended as their connections become
+ * readable, every request already received on a connection at a time.
+ * connections with replies left to send wait to be writable instead, and
+ * those that QoS holds wait on their timer, out of the epoll set */
+static void *reactor_run(void *arg)
+{
+    struct sd_reactor *r = arg;
+    struct epoll_event events[SD_MAXEVENTS];
+    struct epoll_event ev;
+    cpu_set_t cpus;
+    sd_conn_t *conn;
+    int ncpus, n, i;
+
+    ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+    if (ncpus > 0) {
+        CPU_ZERO(&cpus);
+        CPU_SET(r->id % ncpus, &cpus);
+        if (pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus))
+            fprintf(stderr, "SD: reactor %d | unable to pin to cpu %d\n", r->id, r->id % ncpus);
+    }
+
+    ev.events = EPOLLIN;
+    ev.data.ptr = NULL;          /* the listener has no connection */
+    if (epoll_ctl(r->epfd, EPOLL_CTL_ADD, r->listenfd, &ev) == -1) {
+        perror("SD: epoll_ctl");
+        return NULL;
+    }
+
+    printf("SD: reactor %d | accept | port=%d\n", r->id, r->port);
+    while (1) {
+        n = epoll_wait(r->epfd, events, SD_MAXEVENTS, -1);
+        if (n == -1) {
+            if (errno == EINTR)
+                continue;
+            perror("SD: epoll_wait");
+            return NULL;
+        }
+        for (i = 0; i < n; i++) {
+            conn = events[i].data.ptr;
+            if (!conn) {
+                reactor_accept(r);
+                continue;
+            }
+            if ((!conn->events && reactor_unpark(r, conn)) || storage_process(&r->st, conn) ||
+                (conn->parked && reactor_park(r, conn))) {
+                sd_log(SD_LOG_INFO, "SD: reactor %d | closing connection %d\n", r->id, conn->sockfd);
+                sd_log_flush();
+                arena_stats(r->st.arena, stdout);
+                sd_conn_stats(conn, stdout);
+                trace_flush(r->st.trace);
+                close(conn->sockfd);   /* also removes it from the epoll set */
+                sd_conn_free(conn);
+                r->nconns--;
+                continue;
+            }
+            if (conn->parked)
+                continue;
+            ev.events = conn->txhead < conn->txtail ? EPOLLOUT : EPOLLIN;
+            if (ev.events != conn->events) {
+                ev.data.ptr = conn;
+                if (epoll_ctl(r->epfd, EPOLL_CTL_MOD, conn->sockfd, &ev) == -1)
+                    perror("SD: epoll_ctl");
+                conn->events = ev.events;
+            }
+        }
+    }
+    return NULL;
+}
+
+/* start nthreads reactors listening on port and wait for them */
+int sd_reactors_run(int port, int nthreads)
+{
+    struct sd_reactor *r;
+    int i;
+
+    for (i = 0; i < nthreads; i++) {
+        r = &sd_reactors[i];
+        r->id = i;
+        r->port = port;
+        r->nconns = 0;
+        if ((r->listenfd = sd_listen(port, 1)) == -1)
+            return -1;
+        fcntl(r->listenfd, F_SETFL, fcntl(r->listenfd, F_GETFL) | O_NONBLOCK);
+        if ((r->epfd = epoll_create(SD_MAXEVENTS)) == -1) {
+            perror("SD: epoll_create");
+            return -1;
+        }
+        if (storage_dup(&r->st, &sd_storage)) {
+            perror("SD: error opening storage for reactor");
+            return -1;
+        }
+        if (sd_repl.nreplicas && !(r->st.repl = repl_new(&sd_repl))) {
+            perror("SD: error setting up replication for reactor");
+            return -1;
+        }
+        /* connections of reactor i are numbered from (i + 1) << 24, above
+         * those of connection processes, numbered from their pid */
+        if (sd_tracefd != -1 && !(r->st.trace = trace_new(sd_tracefd, (i + 1) << 24))) {
+            perror("SD: error setting up tracing for reactor");
+            return -1;
+        }
+        r->st.stats = stats_claim(-1 - i);
+        if (pthread_create(&r->thread, NULL, reactor_run, r)) {
+            perror("SD: error starting reactor");
+            return -1;
+        }
+    }
+
+    for (i = 0; i < nthreads; i++)
+        pthread_join(sd_reactors[i].thread, NULL);
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    int sockfd, new_fd;  
+    sd_conn_t *conn;
+    struct sockaddr_in remaddr; 
+    socklen_t sin_size;
+    struct sigaction sa;
+    int sd_port = SDPORT;
+    int nthreads = 0;
+    int direct = 0;
+    int hugepages = 0;
+    char *mpath = NULL;
+    char *tpath = NULL;
+    char *spath = NULL;
+    char *upath = NULL;
+    char *qpath = NULL;
+    unsigned int poll_us = SHM_POLL_US;
+    int quorum = 0;
+    struct sd_ec *ec;
+    struct sd_tier *tier;
+    int nshards;
+    long recovered;
+    int c, i;
+    int status;
+    pid_t pid;
+
+    while ((c = getopt(argc, argv, "dHm:p:t:R:q:T:S:L:U:P:Q:")) != -1) 
         switch (c) {
+            case 'H':
+                hugepages = 1;
+                break;
+            case 'm':
+                mpath = optarg;
+                break;
+            case 'R':
+                if (repl_parse(&sd_repl, optarg)) {
+                    fprintf(stderr, "SD: bad replica %s (at most %d, as IP:PORT)\n", optarg, SD_MAXREPLICAS);
+                    return 2;
+                }
+                break;
+            case 'q':
+                quorum = atoi(optarg);
+                break;
+            case 'T':
+                tpath = optarg;
+                break;
+            case 'S':
+                spath = optarg;
+                break;
+            case 'L':
+                sd_log_level = atoi(optarg);
+                break;
+            case 'U':
+                upath = optarg;
+                break;
+            case 'P':
+                poll_us = atoi(optarg);
+                break;
+            case 'Q':
+                qpath = optarg;
+                break;
+            case 'd':
+                direct = 1;
+                break;
             case 'p':
                 sd_port = atoi(optarg);
                 break;
+            case 't':
+                nthreads = atoi(optarg);
+                if (nthreads < 0 || nthreads > SD_MAXREACTORS) {
+                    fprintf(stderr, "SD: THREADS must be between 0 and %d\n", SD_MAXREACTORS);
+                    return 2;
+                }
+                break;
             default:
                 return 2;
         }
@@ -69,27 +464,112 @@ int main(int argc, char **argv)
     if (argc == optind) 
         usage();
 
-    if (storage_load(&sd_storage, argv[optind])) {
+    if (storage_load(&sd_storage, argv[optind], mpath)) {
         perror("SD: error loading SD file");
         exit(1);
     } else
         printf("SD: storage file loaded succesfully: %s\n", argv[optind]);
+    if (stats_init()) {
+        perror("SD: error mapping stats");
+        exit(1);
+    }
+    if (session_init()) {
+        perror("SD: error mapping sessions");
+        exit(1);
+    }
+    if (qos_init() || (qpath && qos_load(qpath))) {
+        perror("SD: error setting up QoS");
+        exit(1);
+    }
+    if (direct)
+        sd_storage.flags |= STORAGE_DIRECT;
+    if (hugepages)
+        sd_storage.flags |= STORAGE_HUGEPAGES;
 
-    locaddr.sin_family = AF_INET;         
-    locaddr.sin_port = htons(sd_port);     
-    locaddr.sin_addr.s_addr = INADDR_ANY; 
-    memset(&(locaddr.sin_zero), '\0', 8); 
+    if (sd_repl.nreplicas) {
+        sd_repl.quorum = quorum ? quorum : sd_repl.nreplicas + 1;
+        if (sd_repl.quorum < 1 || sd_repl.quorum > sd_repl.nreplicas + 1) {
+            fprintf(stderr, "SD: QUORUM must be between 1 and %d\n", sd_repl.nreplicas + 1);
+            exit(2);
+        }
+        if (repl_setup(&sd_repl, &sd_storage)) {
+            perror("SD: error loading replication state");
+            exit(1);
+        }
+        /* resync processes are started before any thread */
+        fflush(stdout);
+        for (i = 0; i < sd_repl.nreplicas; i++)
+            if (!fork())
+                repl_resync_run(&sd_storage, &sd_repl, i);
+        printf("SD: replicating to %d SDs | quorum %d\n", sd_repl.nreplicas, sd_repl.quorum);
+    }
 
-    if (bind(sockfd, (struct sockaddr *)&locaddr, sizeof(struct sockaddr))== -1) {
-        perror("SD: bind error");
-        exit(1);
+    if (sd_storage.metadata->features & STORAGE_F_EC) {
+        if (!(ec = ec_open(&sd_storage))) {
+            perror("SD: error loading erasure coding state");
+            exit(1);
+        }
+        nshards = ec->hdr->n;
+        printf("SD: erasure coded | %d data shards | %d parity shards\n", ec->rs.k, ec->rs.m);
+        if ((recovered = ec_recover(ec)) == -1) {
+            perror("SD: error recovering interrupted writes");
+            exit(1);
+        } else if (recovered)
+            printf("SD: %ld regions had writes in flight | parity shards to resync\n", recovered);
+        ec_close(ec);
+        /* rebuild processes, like resync ones, are started before any thread */
+        fflush(stdout);
+        for (i = 0; i < nshards; i++)
+            if (!fork())
+                ec_rebuild_run(&sd_storage, i);
     }
 
-    if (listen(sockfd, 1) == -1) {
-        perror("SD: listen error");
-        exit(1);
+    if (sd_storage.metadata->features & STORAGE_F_TIER) {
+        if (!(tier = tier_open(&sd_storage))) {
+            perror("SD: error loading tiering state");
+            exit(1);
+        }
+        printf("SD: tiered | %lu MB fast tier at %s | %u MB/s migrations\n",
+               tier->hdr->nslots * (TIER_EXTENT / 1024) / 1024, tier->hdr->path, tier->hdr->rate);
+        tier_close(tier);
+        fflush(stdout);
+        if (!fork())
+            tier_migrate_run(&sd_storage);
+    }
+
+    if (tpath) {
+        if ((sd_tracefd = trace_create(tpath)) == -1) {
+            perror("SD: error creating trace");
+            exit(1);
+        }
+        printf("SD: tracing requests to %s\n", tpath);
+    }
+
+    if (spath) {
+        printf("SD: serving stats on %s\n", spath);
+        fflush(stdout);
+        if (!fork())
+            stats_serve_run(spath);
     }
 
+    if (upath) {
+        printf("SD: shared memory clients on %s | poll %u us\n", upath, poll_us);
+        fflush(stdout);
+        if (!fork())
+            sd_shm_run(upath, poll_us);
+    }
+
+    if (nthreads) {
+        signal(SIGPIPE, SIG_IGN);
+        if (sd_reactors_run(sd_port, nthreads))
+            exit(1);
+        storage_free(&sd_storage);
+        return 0;
+    }
+
+    if ((sockfd = sd_listen(sd_port, 0)) == -1)
+        exit(1);
+
     sa.sa_handler = sigchld_handler; 
     sigemptyset(&sa.sa_mask);
     sa.sa_flags = SA_RESTART;
@@ -100,26 +580,27 @@ int main(int argc, char **argv)
 
     while(1) {  
         sin_size = sizeof(struct sockaddr_in);
-        printf("SD: accept | port=%d\n", sd_port);
+        sd_log(SD_LOG_DEBUG, "SD: accept | port=%d\n", sd_port);
         if ((new_fd = accept(sockfd, (struct sockaddr *)&remaddr, &sin_size)) == -1) {
             perror("SD: unable to accept connections");
             continue;
         }
-        printf("SD: new connection from: %s\n", inet_ntoa(remaddr.sin_addr));
+        sd_log(SD_LOG_INFO, "SD: new connection from: %s\n", inet_ntoa(remaddr.sin_addr));
 
-        pid = waitpid(WAIT_ANY, &status, WNOHANG);
-        if (errno != ECHILD)
-            kill(childpid, SIGTERM);
+        /* reap finished connections. the replica resync processes are 
+         * children too, so errno can't tell whether there is one left */
+        while ((pid = waitpid(WAIT_ANY, &status, WNOHANG)) > 0) {
+            stats_reap(pid);
+            qos_reap(pid);
+        }
 
+        sd_log_flush();
         childpid = fork();
         if (!childpid) {
             close(sockfd);
-            while(!rv) {
-                rv = storage_process(&sd_storage, new_fd);
-            }
-            printf("SD: closing connection from: %s\n", inet_ntoa(remaddr.sin_addr));
-            close(new_fd);
-            exit(0);
+            if (!(conn = sd_conn_new(new_fd)))
+                exit(1);
+            sd_conn_run(conn, inet_ntoa(remaddr.sin_addr));
         }
         close(new_fd);
 
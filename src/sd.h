@@ -1,24 +1,674 @@
+#include <stdio.h>
+#include <sys/types.h>
+#include <sys/uio.h>
 #include "proto.h"
 
 #define STORAGE_TOKEN "RBDS"
 #define STORAGE_VERSION 1
 #define STORAGE_OFFSET 4096
 #define STORAGE_SECSIZE 512
+#define STORAGE_ALIGN 4096             /* O_DIRECT alignment of regular files */
+
+/* payload buffer arena. size classes go from 4K up to the slab size, twice
+ * RBD_MAX_TRANSFER, so bounce buffers for unaligned transfers fit too */
+#define ARENA_MINSHIFT 12
+#define ARENA_CLASSES 10
+#define ARENA_SLAB (1UL << (ARENA_MINSHIFT + ARENA_CLASSES - 1))
+
+/* storage handle flags */
+#define STORAGE_DIRECT 0x01            /* bypass the host page cache */
+#define STORAGE_HUGEPAGES 0x02         /* back payload buffers with huge pages */
+
+/* optional storage features (storage_metadata_t.features) */
+#define STORAGE_F_CRC 0x01             /* CRC32C of every block, kept in FILE.crc */
+#define STORAGE_F_ZIP 0x02             /* data kept in compressed chunks, indexed 
+                                        * in FILE.zix */
+#define STORAGE_F_DEDUP 0x04           /* data kept in a shared block pool, 
+                                        * mapped in FILE.dmap */
+#define STORAGE_F_EC 0x08              /* data erasure coded across other SDs,
+                                        * listed in FILE.ec */
+#define STORAGE_F_TIER 0x10            /* hot extents moved to a faster device,
+                                        * mapped in FILE.tier */
+#define STORAGE_F_CBT 0x20             /* the epoch every block was last written
+                                        * in, kept in FILE.cbt */
+
+/* compressed chunk store. the volume is split in STORAGE_CHUNK bytes 
+ * chunks, each one stored compressed (or raw, if it does not compress 
+ * below SD_ZIP_MAXRATIO) in a slot of the data area. every chunk has two
+ * slots, allocated together at the end of the data area: a write goes to
+ * the spare one, and the entry is switched once it is on disk, so a
+ * crash leaves the old or the new chunk, never a torn one */
+#define STORAGE_CHUNK (64*1024)
+
+struct storage_chunk {
+    unsigned long long offset;     /* slot offset in the data area */
+    unsigned long long spare;      /* the other slot, written next */
+    unsigned int len;              /* stored size: STORAGE_CHUNK if raw, 0 if
+                                    * the chunk is all zeros */
+    unsigned int slot;             /* slot size, 0 if never written */
+    unsigned int pad[2];           /* to 32 bytes, so that entries do not
+                                    * straddle sectors */
+};
+
+/* provisioning modes for storage_init and storage_resize */
+#define STORAGE_SPARSE 0               /* allocate blocks on first write */
+#define STORAGE_PREALLOC 1             /* reserve blocks with fallocate */
+#define STORAGE_ZEROFILL 2             /* write zeros over the whole volume */
 
 struct storage_metadata_struct {
     char token[5];                 /* to check for valid storage files */
     unsigned int version;
     unsigned int data_offset;      /* data start offset (in bytes) */
     unsigned long size;            /* device size (in bytes) */
+    unsigned int resize_gen;       /* incremented on every resize */
+    unsigned int features;         /* STORAGE_F_* flags */
+    unsigned long zip_tail;        /* end of the used data area, with 
+                                    * STORAGE_F_ZIP */
+    unsigned long zip_leaked;      /* bytes of slots left behind by chunks
+                                    * that outgrew them */
+    char pool[1024];               /* block pool, with STORAGE_F_DEDUP */
 };
 typedef struct storage_metadata_struct storage_metadata_t;
 
+/* deduplicated block pool (see sddedup.c) */
+#define POOL_TOKEN "RBDP"
+#define POOL_VERSION 1
+#define POOL_BLOCK 4096
+
+struct pool_header {
+    char token[5];
+    unsigned int version;
+    unsigned long capacity;        /* blocks, counting the header as block 0 */
+    unsigned long nblocks;         /* blocks ever used */
+    unsigned long free;            /* first free block, 0 if none */
+    unsigned long used;            /* blocks holding data */
+    unsigned long refs;            /* volume blocks pointing to them */
+};
+
+struct pool_ref {
+    unsigned long long fp;         /* fingerprint, or next free block */
+    unsigned long refs;
+};
+
+struct sd_pool {
+    int fd;                        /* header and blocks */
+    struct pool_header *hdr;       /* shared mappings */
+    struct pool_ref *ref;
+    unsigned int *index;           /* fingerprint hash table of blocks */
+    unsigned long slots;           /* index size, a power of 2 */
+};
+
+struct arena_class {
+    void *free;                    /* free list, linked through the buffers */
+    unsigned long cached;          /* buffers in the free list */
+    unsigned long allocs;
+    unsigned long reused;          /* allocs served from the free list */
+};
+
+struct sd_arena {
+    int hugepages;
+    void **slabs;
+    int nslabs;
+    unsigned long slab_used;       /* bytes carved from the last slab */
+    struct arena_class class[ARENA_CLASSES];
+    unsigned long large;           /* allocs bigger than any class */
+    unsigned long rejected;        /* requests over RBD_MAX_TRANSFER */
+};
+
+/* synchronous replication (see sdrepl.c) */
+#define SD_MAXREPLICAS 4
+#define SD_REPL_REGION RBD_MAX_TRANSFER   /* dirty tracking and resync unit */
+
+#define REPL_SYNCED 0
+#define REPL_DEGRADED 1                /* writes are only marked dirty */
+
+/* state of a replica, shared by every SD worker and kept in FILE.rep */
+struct sd_repmap {
+    char host[64];
+    int port;
+    unsigned int state;            /* REPL_* */
+    unsigned int gen;              /* incremented when it gets back in sync */
+    unsigned long nregions;        /* regions tracked by the dirty bitmap */
+    unsigned long resynced;        /* regions copied by resyncs */
+};
+
+struct sd_repl_config {
+    int nreplicas;
+    int quorum;                    /* copies, counting the local one, needed 
+                                    * to acknowledge a write */
+    char host[SD_MAXREPLICAS][64];
+    int port[SD_MAXREPLICAS];
+    char path[1024 + 8];           /* FILE.rep */
+    void *base;                    /* shared mapping of FILE.rep */
+    unsigned long size;
+    struct sd_repmap *map[SD_MAXREPLICAS];
+    unsigned char *bits[SD_MAXREPLICAS];   /* dirty regions */
+};
+
+/* replication state of a worker */
+struct sd_repl {
+    struct sd_repl_config *cfg;
+    int lockfd;                    /* region locks, against resyncs */
+    int sockfd[SD_MAXREPLICAS];
+    unsigned int gen[SD_MAXREPLICAS];
+    unsigned int msgid;
+};
+
+/* erasure coded volumes (see sdec.c) */
+#define EC_TOKEN "RBDE"
+#define EC_VERSION 2
+#define EC_MAXSHARDS 16
+#define EC_BLOCK 4096                  /* stripe s is block s of every shard */
+#define EC_REGION (1024*1024)          /* dirty tracking and rebuild unit, of
+                                        * shard space */
+#define EC_SLOW_MS 50                  /* wait for a data shard before reading 
+                                        * around it */
+
+#define EC_UP 0
+#define EC_DOWN 1                      /* writes are only marked dirty */
+
+struct ec_shard {
+    char host[64];
+    int port;
+    unsigned int state;            /* EC_* */
+    unsigned int gen;              /* incremented when it gets back up */
+    unsigned long rebuilt;         /* regions rewritten by rebuilds */
+};
+
+/* header of FILE.ec, followed by the dirty bitmap of every shard and the
+ * writes in flight on every region */
+struct ec_header {
+    char token[5];
+    unsigned int version;
+    int k;                         /* data shards, the first ones */
+    int n;                         /* data and parity shards */
+    unsigned long nregions;
+    struct ec_shard shard[EC_MAXSHARDS];
+};
+
+/* Reed-Solomon code, the generator matrix: a row per shard (see sdgf.c) */
+struct rs_code {
+    int k, m;
+    unsigned char gen[EC_MAXSHARDS][EC_MAXSHARDS];
+};
+
+/* erasure coding state of a worker */
+struct sd_ec {
+    struct ec_header *hdr;         /* shared mapping of FILE.ec */
+    unsigned long size;
+    unsigned char *bits[EC_MAXSHARDS];  /* dirty regions */
+    unsigned int *intent;          /* writes in flight, per region */
+    int lockfd;                    /* stripe locks */
+    int sockfd[EC_MAXSHARDS];
+    unsigned int gen[EC_MAXSHARDS];
+    unsigned int msgid;
+    struct rs_code rs;
+    unsigned long maxstripes;      /* stripes that fit in the buffers */
+    unsigned char *buf[EC_MAXSHARDS];   /* a buffer per shard */
+};
+
+/* tiered volumes (see sdtier.c) */
+#define TIER_TOKEN "RBDT"
+#define TIER_VERSION 1
+#define TIER_EXTENT (1024*1024)        /* heat tracking and migration unit */
+#define TIER_RATE 16                   /* default migration limit, in MB/s */
+
+/* header of FILE.tier, followed by the extent map */
+struct tier_header {
+    char token[5];
+    unsigned int version;
+    char path[1024];               /* fast tier file or block device */
+    unsigned long nextents;        /* extents of the volume */
+    unsigned long nslots;          /* extents the fast tier holds */
+    unsigned int rate;             /* migration limit, in MB/s */
+    unsigned long promoted;        /* extents moved to the fast tier */
+    unsigned long demoted;         /* and back */
+    unsigned long fast_ios;        /* transfers served by each tier */
+    unsigned long slow_ios;
+};
+
+struct tier_extent {
+    unsigned int slot;             /* fast tier slot + 1, 0 if on the slow one */
+    unsigned int heat;             /* accesses, halved every TIER_DECAY secs */
+};
+
+/* tiering state of a worker */
+struct sd_tier {
+    struct tier_header *hdr;       /* shared mapping of FILE.tier */
+    unsigned long size;
+    struct tier_extent *map;
+    int fd;                        /* fast tier */
+    int lockfd;                    /* extent locks, against migrations */
+};
+
+/* changed block tracking (see sdcbt.c) */
+#define CBT_TOKEN "RBDB"
+#define CBT_VERSION 1
+#define CBT_BLOCK (64*1024)            /* tracking unit */
+#define CBT_DRAIN 10                   /* secs to wait for the writes of a
+                                        * closed epoch */
+
+/* header of FILE.cbt, followed by the epoch map: for every block, the
+ * epoch it was last written in, 0 if never */
+struct cbt_header {
+    char token[5];
+    unsigned int version;
+    unsigned int epoch;            /* the current one, from 1 on */
+    unsigned long nblocks;
+    unsigned int writers[2];       /* writes in flight, by epoch parity */
+};
+
+/* tracking state of a worker */
+struct sd_cbt {
+    struct cbt_header *hdr;        /* shared mapping of FILE.cbt */
+    unsigned long size;
+    unsigned int *map;
+    unsigned long nblocks;         /* mapped, fewer than hdr->nblocks after
+                                    * a resize, until mapped again */
+    int fd;
+};
+
+/* protocol traces. a worker buffers the records of the requests it
+ * attends and appends them to the trace in batches, so those of different
+ * workers interleave: they are sorted by arrival when replayed */
+#define TRACE_TOKEN "RBDTRACE"
+#define TRACE_VERSION 1
+#define TRACE_BATCH 256                /* records buffered by a worker */
+#define TRACE_MAXAGE 1000000000ULL     /* ns a record stays buffered at most */
+
+struct trace_header {
+    char token[8];
+    unsigned int version;
+    unsigned int reclen;           /* sizeof(struct trace_rec) */
+    unsigned long long realtime;   /* wall clock at the start, in ns */
+};
+
+struct trace_rec {
+    unsigned long long arrival;    /* CLOCK_MONOTONIC ns the header was decoded */
+    unsigned int service;          /* ns until it was replied */
+    unsigned int conn;             /* connection, unique in the trace */
+    unsigned int id;
+    unsigned int offset_sectors;
+    unsigned int size;             /* fsop_size */
+    unsigned char code;            /* CMD_* */
+    unsigned char reply;           /* REP_ERR, or the code if it succeeded */
+    unsigned char flags;           /* RBDMSG_* */
+    unsigned char pad;
+};
+
+/* trace state of a worker */
+struct sd_trace {
+    int fd;
+    unsigned int base;             /* of the connection numbers */
+    unsigned int nconns;
+    unsigned int n;                /* records buffered */
+    struct trace_rec recs[TRACE_BATCH];
+};
+
+/* latency histograms */
+#define HIST_SUB 32                    /* buckets per power of two */
+#define HIST_BUCKETS (2 * HIST_SUB + 58 * HIST_SUB)
+
+struct sd_hist {
+    unsigned long long count[HIST_BUCKETS];
+    unsigned long long n, max, sum;
+};
+
+/* request stats of a worker, by operation and stage. every worker has
+ * its own slot in a table shared by all of them, so that it updates it
+ * without locks; readers add up every slot as it is. slot 0 keeps the
+ * counts of the workers gone */
+#define STATS_SLOTS 128
+#define STATS_READ 0
+#define STATS_WRITE 1
+#define STATS_OTHER 2
+#define STATS_OPS 3
+#define STAGE_RECV 0                   /* from the arrival of the header to
+                                        * its processing */
+#define STAGE_PAYLOAD 1                /* receiving the payload */
+#define STAGE_DISK 2                   /* storage I/O */
+#define STAGE_REPLY 3                  /* sending the reply */
+#define STAGE_TOTAL 4
+#define STATS_STAGES 5
+
+struct sd_stats {
+    int owner;                     /* pid of a connection process, or -1 - n
+                                    * for reactor n. 0 if the slot is free */
+    unsigned long long requests[STATS_OPS];
+    unsigned long long errors[STATS_OPS];
+    unsigned long long bytes[STATS_OPS];
+    struct sd_hist hist[STATS_OPS][STATS_STAGES];   /* in ns */
+    unsigned long long zip_raw;    /* payload data sent or received with
+                                    * RBD_FEAT_ZLIB, before compression */
+    unsigned long long zip_wire;   /* and on the wire */
+    unsigned long long zip_ns;     /* cpu time compressing */
+    unsigned long long unzip_ns;   /* cpu time uncompressing */
+};
+
+/* write sessions (see sdsession.c). a table shared by every worker has
+ * the ids of the last SESSION_WRITES messages of each session, and the
+ * replies to the writes among them */
+#define SESSION_SLOTS 256
+#define SESSION_WRITES 256             /* a power of 2 */
+#define SESSION_BUSY (~0U)             /* the write is being done */
+#define SESSION_WAIT 5000              /* ms to wait for it, done elsewhere */
+
+struct sd_session_write {
+    unsigned int id;
+    unsigned int code;             /* of the reply, 0 if none */
+};
+
+struct sd_session {
+    unsigned long long id;         /* 0 if the slot is free */
+    unsigned long long used;       /* last attached, to reuse the oldest */
+    struct sd_session_write writes[SESSION_WRITES];   /* by message id */
+};
+
+/* per client QoS (see sdqos.c). a table shared by every worker has the
+ * token buckets of every client, by address, and of the whole volume, and
+ * the fair queue of the requests waiting for storage */
+#define QOS_CLIENTS 64
+#define QOS_WAITERS 256
+#define QOS_BURST_MS 100               /* default bucket size, in ms of rate */
+#define QOS_WEIGHT 100                 /* default weight in the fair queue */
+#define QOS_REQCOST 4096               /* bytes every request costs in the
+                                        * fair queue, on top of its size */
+#define QOS_ANY 0xffffffff             /* address of the default rule */
+#define QOS_RECHECK_NS 1000000ULL      /* how often a parked connection
+                                        * looks at the fair queue again */
+
+struct qos_bucket {
+    unsigned long long iops;       /* limits, 0 for none */
+    unsigned long long bps;
+    unsigned int burst_ms;
+    double ios, bytes;             /* tokens. below 0 while in debt */
+    unsigned long long refill;     /* ns, last time they were added */
+};
+
+struct sd_qos_client {
+    unsigned int addr;             /* IPv4, network order. 0 if free */
+    int pinned;                    /* set by a rule, not to be reused */
+    unsigned int weight;
+    struct qos_bucket b;
+    unsigned long long finish;     /* virtual finish of its last request */
+    unsigned long long used;       /* last attached, to reuse the oldest */
+    unsigned long long requests;
+    unsigned long long throttled;  /* requests held by the buckets */
+    unsigned long long throttle_ns;
+    unsigned long long queued_ns;  /* in the fair queue */
+};
+
+/* where a request stands in qos_try, from its first call to qos_end */
+struct qos_ticket {
+    unsigned long long start;      /* first tried, 0 if not yet */
+    unsigned long long queued;     /* joined the fair queue */
+    unsigned long long vstart;     /* its virtual start there */
+    unsigned int seq;              /* of the table, when it last waited */
+    int taken;                     /* it has its tokens */
+    int throttled;                 /* the buckets held it */
+    int slot;                      /* in the fair queue, plus 1. 0 if none */
+    int admitted;                  /* it may go to storage */
+};
+
+/* shared memory transport (see sdshm.c). a region shared by the client
+ * and the SD has a ring of bytes for each direction, that carry the same
+ * messages as a TCP connection. the Unix socket the client connected to
+ * passes the region, and then only tells when the other end is gone */
+#define SHM_MAGIC 0x4d484452           /* "RDHM" */
+#define SHM_VERSION 1
+#define SHM_RING (2*1024*1024)         /* bytes of each ring, a power of 2 */
+#define SHM_HDR 4096                   /* control page, before the rings */
+#define SHM_POLL_US 20                 /* busy polling before sleeping */
+#define SHM_CHECK_MS 100               /* between checks of the other end */
+
+struct shm_ring {
+    unsigned int head;             /* taken by the consumer up to here */
+    int head_wait;                 /* the producer sleeps on head */
+    char pad1[56];
+    unsigned int tail;             /* published by the producer up to here */
+    int tail_wait;                 /* the consumer sleeps on tail */
+    char pad2[56];
+};
+
+struct shm_region {
+    unsigned int magic;
+    unsigned int version;
+    unsigned int ring;             /* SHM_RING of the SD */
+    unsigned int pad[13];
+    struct shm_ring sq;            /* requests, from the client */
+    struct shm_ring cq;            /* replies, from the SD */
+};
+
+struct sd_shm {
+    int fd;                        /* Unix socket */
+    struct shm_region *region;
+    struct shm_ring *rx, *tx;
+    char *rxdata, *txdata;
+    unsigned int size;             /* of each ring */
+    unsigned int poll_us;
+    unsigned long long sleeps;     /* waits that went to the kernel */
+};
+
+/* log levels. messages above sd_log_level are skipped without being
+ * formatted */
+#define SD_LOG_ERR 0
+#define SD_LOG_WARN 1
+#define SD_LOG_INFO 2
+#define SD_LOG_DEBUG 3
+#define SD_LOG_BUF (16*1024)           /* buffered by a thread */
+#define SD_LOG_LINE 512                /* longest message */
+
+extern int sd_log_level;
+#define sd_log(level, ...) \
+    do { if ((level) <= sd_log_level) sd_log_write(level, __VA_ARGS__); } while (0)
+
 struct storage_struct {
-    storage_metadata_t *metadata;
-    char fpath[1024];
-    FILE *file;
+    storage_metadata_t *metadata;  /* shared mapping of the on-disk header */
+    char fpath[1024];              /* data file or block device */
+    char mpath[1024];              /* metadata sidecar file, empty if in-band */
+    int fd;                        /* data descriptor, -1 if not open */
+    int crcfd;                     /* block checksums, with STORAGE_F_CRC */
+    int zixfd;                     /* chunk index, with STORAGE_F_ZIP */
+    int dmapfd;                    /* block map, with STORAGE_F_DEDUP */
+    struct sd_pool *pool;
+    struct sd_repl *repl;          /* replicas to forward writes to, or NULL */
+    struct sd_ec *ec;              /* with STORAGE_F_EC */
+    struct sd_tier *tier;          /* with STORAGE_F_TIER */
+    struct sd_cbt *cbt;            /* with STORAGE_F_CBT */
+    struct sd_trace *trace;        /* requests attended, if traced */
+    struct sd_stats *stats;        /* slot of the worker */
+    unsigned long capacity;        /* data area size of block devices, 0 for
+                                    * files */
+    int flags;                     /* STORAGE_* handle flags */
+    unsigned int align;            /* direct I/O block size */
+    struct sd_arena *arena;        /* payload and bounce buffers */
 };
 typedef struct storage_struct storage_t;
 
-int storage_init(storage_t *, const char *, unsigned long);
+/* wire compression state and stats of a connection */
+#define SD_ZIP_MAXRATIO 87             /* max compressed size, in % of raw */
+#define SD_ZIP_MAXBACKOFF 64           /* max messages sent raw after a miss */
+
+struct sd_zip_state {
+    unsigned int skip;             /* messages to send raw without trying */
+    unsigned int backoff;
+    unsigned long tried;           /* compression attempts */
+    unsigned long skipped;         /* sent raw without trying */
+    unsigned long unzipped;        /* compressed payloads received */
+    unsigned long long raw_bytes;  /* data size before compression */
+    unsigned long long wire_bytes; /* data size on the wire */
+    unsigned long long zip_ns;     /* cpu time compressing */
+    unsigned long long unzip_ns;   /* cpu time uncompressing */
+};
+
+/* connection state. received bytes are buffered, so that one recv can
+ * pick up several queued requests.
+ *
+ * connections of reactors are non-blocking: a payload that has not fully
+ * arrived is kept apart until it has, and replies the socket does not
+ * take at once wait in txbuf, while no more requests are attended */
+#define SD_RXBUF (64*1024)
+
+struct sd_conn_struct {
+    int sockfd;
+    int nonblock;                  /* never wait for the socket */
+    unsigned int events;           /* epoll events the reactor waits for */
+    struct rbdmsg_hdr next;        /* request whose payload is arriving */
+    char *payload;                 /* its payload, NULL if none */
+    unsigned int paylen;           /* bytes of it received */
+    unsigned int payhead;          /* bytes of it taken */
+    unsigned long long staged;     /* when its header was taken */
+    char *txbuf;                   /* replies not sent yet */
+    unsigned long txsize;
+    unsigned long txhead;
+    unsigned long txtail;
+    unsigned int features;         /* RBD_FEAT_* negotiated with CMD_HELLO */
+    struct sd_zip_state zip;
+    struct sd_zip_state zip_counted;   /* zip, as last added to the stats */
+    unsigned int trace_id;         /* number in the trace, 0 until traced */
+    struct sd_session *session;    /* with RBD_FEAT_SESSION */
+    struct sd_shm *shm;            /* shared memory transport, NULL on TCP */
+    struct sd_qos_client *qos;     /* NULL without QoS */
+    struct qos_ticket ticket;      /* of the request going to storage */
+    unsigned long long parked;     /* ns a reactor is to leave the
+                                    * connection alone, held by QoS */
+    int timerfd;                   /* to end that, -1 until first parked */
+    unsigned long long session_id;
+    unsigned long long arrival;    /* when the next header began to arrive */
+    unsigned long long stage[STATS_STAGES];  /* ns of the request in each */
+    unsigned int rxhead;           /* first unprocessed byte of rxbuf */
+    unsigned int rxtail;           /* end of received data in rxbuf */
+    char rxbuf[SD_RXBUF];
+};
+typedef struct sd_conn_struct sd_conn_t;
+
+int storage_init(storage_t *, const char *, const char *, unsigned long, int);
+int storage_load(storage_t *, char *, char *);
+int storage_resize(storage_t *, unsigned long, int);
+int storage_crc_create(storage_t *);
+int storage_zip_create(storage_t *);
+int storage_dedup_create(storage_t *, const char *, storage_t *);
+void storage_zip_stats(storage_t *, FILE *);
+int storage_dup(storage_t *, storage_t *);
+int storage_open(storage_t *);
 int storage_close(storage_t *);
+int storage_free(storage_t *);
+void *storage_getbuf(storage_t *, unsigned long);
+void storage_putbuf(storage_t *, void *, unsigned long);
+int storage_read(storage_t *, void *, unsigned long, unsigned long);
+int storage_write(storage_t *, const void *, unsigned long, unsigned long);
+int storage_read_crc(storage_t *, void *, unsigned long, unsigned long, unsigned int *);
+int storage_write_crc(storage_t *, const void *, unsigned long, unsigned long, const unsigned int *);
+int storage_pio(int, void *, unsigned long, off_t, int);
+int storage_lock(int, off_t, off_t, int);
+int storage_fd_io(storage_t *, int, void *, off_t, unsigned long, int);
+void storage_sidecar(storage_t *, const char *, char *);
+int storage_dedup_io(storage_t *, char *, unsigned long, unsigned long, int);
+sd_conn_t *sd_conn_new(int);
+void sd_conn_free(sd_conn_t *);
+int storage_process(storage_t *, sd_conn_t *);
+void sd_conn_stats(sd_conn_t *, FILE *);
+
+struct sd_arena *arena_create(int);
+void arena_destroy(struct sd_arena *);
+void *arena_alloc(struct sd_arena *, unsigned long);
+void arena_free(struct sd_arena *, void *, unsigned long);
+void arena_stats(struct sd_arena *, FILE *);
+
+unsigned int crc32c(unsigned int, const void *, size_t);
+unsigned int rbd_crc(const void *, size_t);
+void rbd_crc_blocks(const void *, unsigned long, unsigned int *);
+
+unsigned long long sd_fingerprint(const void *, size_t);
+
+int repl_parse(struct sd_repl_config *, const char *);
+int repl_setup(struct sd_repl_config *, storage_t *);
+struct sd_repl *repl_new(struct sd_repl_config *);
+int repl_write(storage_t *, const void *, unsigned long, unsigned long, const unsigned int *);
+void repl_resync_run(storage_t *, struct sd_repl_config *, int);
+
+int ec_parse(struct ec_header *, const char *);
+int ec_capacity(struct ec_header *, unsigned long *);
+int storage_ec_create(storage_t *, struct ec_header *);
+struct sd_ec *ec_open(storage_t *);
+void ec_close(struct sd_ec *);
+long ec_recover(struct sd_ec *);
+int ec_io(storage_t *, char *, unsigned long, unsigned long, int);
+void ec_rebuild_run(storage_t *, int);
+void ec_stats(storage_t *, FILE *);
+
+int rs_init(struct rs_code *, int, int);
+void rs_encode(struct rs_code *, unsigned char **, size_t);
+int rs_reconstruct(struct rs_code *, unsigned char **, unsigned int, unsigned int, size_t);
+
+int storage_tier_create(storage_t *, const char *, unsigned long, unsigned int);
+struct sd_tier *tier_open(storage_t *);
+void tier_close(struct sd_tier *);
+int tier_io(storage_t *, char *, unsigned long, unsigned long, int);
+void tier_migrate_run(storage_t *);
+void tier_stats(storage_t *, FILE *);
+
+int storage_cbt_create(storage_t *, int);
+struct sd_cbt *cbt_open(storage_t *);
+void cbt_close(struct sd_cbt *);
+int cbt_grow(storage_t *, unsigned long);
+unsigned int cbt_begin(struct sd_cbt *, unsigned long, unsigned long);
+void cbt_end(struct sd_cbt *, unsigned int);
+unsigned int cbt_next(struct sd_cbt *);
+void cbt_stats(storage_t *, FILE *);
+
+int trace_create(const char *);
+struct sd_trace *trace_new(int, unsigned int);
+void trace_add(struct sd_trace *, sd_conn_t *, struct rbdmsg_hdr *, int, unsigned long long);
+void trace_flush(struct sd_trace *);
+int trace_load(const char *, struct trace_header *, struct trace_rec **, unsigned long *);
+
+unsigned long long sd_now(void);
+int stats_init(void);
+struct sd_stats *stats_claim(int);
+void stats_release(struct sd_stats *);
+void stats_reap(int);
+void stats_add(struct sd_stats *, sd_conn_t *, struct rbdmsg_hdr *, int, unsigned long long);
+void stats_report(FILE *, int);
+void stats_serve_run(const char *);
+
+int session_init(void);
+struct sd_session *session_attach(unsigned long long);
+unsigned int session_begin(struct sd_session *, unsigned long long, unsigned int);
+void session_end(struct sd_session *, unsigned long long, unsigned int, unsigned int);
+
+int qos_init(void);
+int qos_rule(const char *);
+int qos_load(const char *);
+struct sd_qos_client *qos_attach(int);
+unsigned long long qos_try(struct sd_qos_client *, unsigned long, struct qos_ticket *);
+void qos_begin(struct sd_qos_client *, unsigned long, struct qos_ticket *);
+void qos_end(struct qos_ticket *);
+void qos_reap(int);
+void qos_report(FILE *, int);
+
+int shm_listen(const char *);
+struct sd_shm *shm_accept(int, unsigned int);
+struct sd_shm *shm_connect(const char *, unsigned int);
+ssize_t shm_read(struct sd_shm *, void *, size_t, size_t);
+int shm_writev(struct sd_shm *, const struct iovec *, int);
+int shm_write(struct sd_shm *, const void *, size_t);
+void shm_close(struct sd_shm *);
+void shm_stats(struct sd_shm *, FILE *);
+
+void sd_log_write(int, const char *, ...) __attribute__((format(printf, 2, 3)));
+void sd_log_flush(void);
+
+void hist_add(struct sd_hist *, unsigned long long);
+void hist_merge(struct sd_hist *, struct sd_hist *);
+unsigned long long hist_percentile(struct sd_hist *, double);
+
+int pool_create(const char *, unsigned long);
+struct sd_pool *pool_open(const char *);
+void pool_close(struct sd_pool *);
+void pool_stats(struct sd_pool *, FILE *);
+
+unsigned long sd_zip_bound(unsigned long);
+int sd_zip(struct sd_zip_state *, const void *, unsigned long, void *, unsigned long *);
+int sd_unzip(struct sd_zip_state *, const void *, unsigned long, void *, unsigned long);
+void sd_zip_stats(struct sd_zip_state *, FILE *);
@@ -0,0 +1,145 @@
+/*
+ * Remote Block Device - Storage Daemon payload buffer arena
+ *
+ * Payload buffers are carved out of big slabs (optionally backed by huge 
+ * pages) and recycled through per size class free lists, so the request 
+ * path does not go to malloc or fault in new pages once warmed up. An 
+ * arena belongs to a single worker (process or reactor thread) and is not
+ * locked.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include "sd.h"
+
+static void *arena_map(unsigned long size, int hugepages)
+{
+    void *p = MAP_FAILED;
+
+    if (hugepages)
+        p = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                 MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    if (p == MAP_FAILED) {
+        p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (p == MAP_FAILED)
+            return NULL;
+        if (hugepages)
+            madvise(p, size, MADV_HUGEPAGE);
+    }
+    return p;
+}
+
+/* size class of a buffer of size bytes, ARENA_CLASSES if too big */
+static int arena_class(unsigned long size)
+{
+    int c = 0;
+
+    while (c < ARENA_CLASSES && (1UL << (ARENA_MINSHIFT + c)) < size)
+        c++;
+    return c;
+}
+
+struct sd_arena *arena_create(int hugepages)
+{
+    struct sd_arena *a;
+
+    a = calloc(1, sizeof(struct sd_arena));
+    if (!a)
+        return NULL;
+    a->hugepages = hugepages;
+    return a;
+}
+
+void arena_destroy(struct sd_arena *a)
+{
+    int i;
+
+    if (!a)
+        return;
+    for (i = 0; i < a->nslabs; i++)
+        munmap(a->slabs[i], ARENA_SLAB);
+    free(a->slabs);
+    free(a);
+}
+
+/* get a buffer of at least size bytes, aligned to STORAGE_ALIGN */
+void *arena_alloc(struct sd_arena *a, unsigned long size)
+{
+    struct arena_class *ac;
+    unsigned long csize;
+    void **slabs;
+    void *buf;
+    int c;
+
+    c = arena_class(size);
+    if (c == ARENA_CLASSES) {        /* bigger than any class: map it */
+        a->large++;
+        return arena_map(size, 0);
+    }
+
+    ac = &a->class[c];
+    ac->allocs++;
+    if (ac->free) {
+        buf = ac->free;
+        ac->free = *(void **)buf;
+        ac->cached--;
+        ac->reused++;
+        return buf;
+    }
+
+    csize = 1UL << (ARENA_MINSHIFT + c);
+    if (!a->nslabs || a->slab_used + csize > ARENA_SLAB) {
+        if (!(buf = arena_map(ARENA_SLAB, a->hugepages)))
+            return NULL;
+        slabs = realloc(a->slabs, (a->nslabs + 1) * sizeof(void *));
+        if (!slabs) {
+            munmap(buf, ARENA_SLAB);
+            return NULL;
+        }
+        a->slabs = slabs;
+        a->slabs[a->nslabs++] = buf;
+        a->slab_used = 0;
+    }
+    buf = (char *)a->slabs[a->nslabs - 1] + a->slab_used;
+    a->slab_used += csize;
+    return buf;
+}
+
+/* give back a buffer got from arena_alloc with the same size */
+void arena_free(struct sd_arena *a, void *buf, unsigned long size)
+{
+    struct arena_class *ac;
+    int c;
+
+    if (!buf)
+        return;
+    c = arena_class(size);
+    if (c == ARENA_CLASSES) {
+        munmap(buf, size);
+        return;
+    }
+    ac = &a->class[c];
+    *(void **)buf = ac->free;
+    ac->free = buf;
+    ac->cached++;
+}
+
+void arena_stats(struct sd_arena *a, FILE *f)
+{
+    int c;
+
+    if (!a)
+        return;
+    fprintf(f, "SD: arena | slabs %d (%lu KB%s) | large allocs %lu | rejected %lu\n", 
+            a->nslabs, a->nslabs * (ARENA_SLAB / 1024), 
+            a->hugepages ? ", hugepages" : "", a->large, a->rejected);
+    for (c = 0; c < ARENA_CLASSES; c++)
+        if (a->class[c].allocs)
+            fprintf(f, "SD: arena | class %7lu | allocs %lu | reused %lu | cached %lu\n",
+                    1UL << (ARENA_MINSHIFT + c), a->class[c].allocs, 
+                    a->class[c].reused, a->class[c].cached);
+}
@@ -0,0 +1,416 @@
+/*
+ * Remote Block Device - Storage Daemon load generator
+ *
+ * Opens CONNS connections to an SD and keeps DEPTH requests in flight on
+ * each one, for every block size given in turn. A connection has a thread
+ * that sends requests while there is room in its window, and another one
+ * that takes the replies, which come back in order, and records their
+ * latencies, in nanoseconds, to a histogram (see sdhist.c). A HOST that is
+ * a path is the shared memory socket of an SD on this host (see sdshm.c).
+ */
+
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <semaphore.h>
+
+#include "sd.h"
+
+#define BENCH_MAXCONNS 256
+#define BENCH_MAXDEPTH 256
+#define BENCH_MAXSIZES 16
+#define BENCH_SECSIZE 512
+
+struct bench_conn {
+    int fd;
+    struct sd_shm *shm;                 /* with a shared memory HOST */
+    pthread_t sender, receiver;
+    sem_t window;                       /* free slots of the queue */
+    sem_t inflight;                     /* requests sent, plus one when the
+                                         * sender stops */
+    pthread_mutex_t mutex;
+    unsigned long long sent[BENCH_MAXDEPTH];   /* times of the requests in
+                                         * flight, in order */
+    unsigned long long nsent, nrecv, errors, bytes;
+    unsigned long next;                 /* sequential offset, in sectors */
+    unsigned long long rand;
+    char *buf;
+    struct sd_hist hist;
+};
+
+static const char *host = "127.0.0.1";
+static int port = SDPORT;
+static int nconns = 1;
+static int depth = 1;
+static int wpct = 0;                    /* % of writes */
+static int random_io = 1;
+static int seconds = 10;
+static int json;
+static unsigned long sizes[BENCH_MAXSIZES];
+static int nsizes;
+
+static unsigned long dev_sectors;       /* size of the volume */
+static unsigned long bsize;             /* block size of the run */
+static volatile int stop;
+static volatile int failed;
+
+static struct bench_conn conns[BENCH_MAXCONNS];
+
+void usage(void) {
+    printf("Usage: sdbench [-h HOST] [-p PORT] [-c CONNS] [-q DEPTH] [-b SIZE[,SIZE]...]\n");
+    printf("               [-w WRITES] [-s] [-t SECONDS] [-j]\n\n");
+    printf("HOST    - SD address, or the path of its shared memory socket (sd -U).\n");
+    printf("          default: 127.0.0.1\n");
+    printf("PORT    - SD port. default: %d\n", SDPORT);
+    printf("CONNS   - connections to open. default: 1\n");
+    printf("DEPTH   - requests in flight on each connection. default: 1\n");
+    printf("SIZE    - block sizes to run with, one after the other, in bytes\n");
+    printf("          or with a k or m suffix. default: 4k\n");
+    printf("WRITES  - percentage of writes: 0 reads only, 100 writes only. \n");
+    printf("          default: 0\n");
+    printf("-s      - sequential blocks, each connection from its own part of\n");
+    printf("          the volume. default: random\n");
+    printf("SECONDS - duration of every run. default: 10\n");
+    printf("-j      - one JSON object per run, instead of a table\n");
+    exit(2);
+}
+
+static unsigned long long now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static unsigned long long xorshift(unsigned long long *x)
+{
+    *x ^= *x << 13;
+    *x ^= *x >> 7;
+    *x ^= *x << 17;
+    return *x;
+}
+
+static int full_write(struct bench_conn *c, void *buf, size_t size)
+{
+    ssize_t rv;
+
+    if (c->shm)
+        return shm_write(c->shm, buf, size);
+    while (size) {
+        if ((rv = send(c->fd, buf, size, 0)) <= 0)
+            return -1;
+        buf += rv;
+        size -= rv;
+    }
+    return 0;
+}
+
+static int full_read(struct bench_conn *c, void *buf, size_t size)
+{
+    ssize_t rv;
+
+    if (c->shm)
+        return shm_read(c->shm, buf, size, size) < 0 ? -1 : 0;
+    while (size) {
+        if ((rv = recv(c->fd, buf, size, MSG_WAITALL)) <= 0)
+            return -1;
+        buf += rv;
+        size -= rv;
+    }
+    return 0;
+}
+
+static int bench_connect(struct bench_conn *c)
+{
+    struct sockaddr_in addr;
+    int fd, yes = 1;
+
+    if (host[0] == '/')
+        return (c->shm = shm_connect(host, SHM_POLL_US)) ? 0 : -1;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = inet_addr(host);
+    if ((fd = socket(AF_INET, SOCK_STREAM, 0)) == -1)
+        return -1;
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
+        close(fd);
+        return -1;
+    }
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof(yes));
+    c->fd = fd;
+    return 0;
+}
+
+static int bench_request(struct bench_conn *c, unsigned int id, int code, unsigned long sector,
+                         void *buf, unsigned long size)
+{
+    struct rbdmsg_hdr msg;
+
+    memset(&msg, 0, sizeof(msg));
+    msg.version = PROTO_VERSION;
+    msg.type = CMD;
+    msg.code = code;
+    msg.id = id;
+    msg.fsop_offset_sectors = sector;
+    msg.fsop_size = size;
+    msg.payload_size = code == CMD_WRITE ? size : 0;
+    if (full_write(c, &msg, sizeof(msg)))
+        return -1;
+    return msg.payload_size ? full_write(c, buf, size) : 0;
+}
+
+/* size of the volume, in sectors */
+static int bench_getsz(struct bench_conn *c, unsigned long *sectors)
+{
+    struct rbdmsg_hdr rsp;
+
+    if (bench_request(c, 0, CMD_GETSZ, 0, NULL, 0) || full_read(c, &rsp, sizeof(rsp)) ||
+        rsp.payload_size != sizeof(*sectors) || full_read(c, sectors, sizeof(*sectors)))
+        return -1;
+    return 0;
+}
+
+/* sector of the next block of a connection */
+static unsigned long bench_sector(struct bench_conn *c)
+{
+    unsigned long nblocks = dev_sectors / (bsize / BENCH_SECSIZE);
+    unsigned long sector;
+
+    if (random_io)
+        return xorshift(&c->rand) % nblocks * (bsize / BENCH_SECSIZE);
+    sector = c->next;
+    c->next += bsize / BENCH_SECSIZE;
+    if (c->next + bsize / BENCH_SECSIZE > dev_sectors)
+        c->next = 0;
+    return sector;
+}
+
+static void *bench_sender(void *arg)
+{
+    struct bench_conn *c = arg;
+    unsigned long long i;
+    int write;
+
+    while (!stop) {
+        sem_wait(&c->window);
+        if (stop)
+            break;
+        write = xorshift(&c->rand) % 100 < wpct;
+        pthread_mutex_lock(&c->mutex);
+        i = c->nsent++;
+        c->sent[i % depth] = now_ns();
+        pthread_mutex_unlock(&c->mutex);
+        if (bench_request(c, i, write ? CMD_WRITE : CMD_READ, bench_sector(c), c->buf, bsize))
+            break;
+        sem_post(&c->inflight);
+    }
+    sem_post(&c->inflight);
+    return NULL;
+}
+
+static void *bench_receiver(void *arg)
+{
+    struct bench_conn *c = arg;
+    struct rbdmsg_hdr rsp;
+    unsigned long long sent;
+    char *data = malloc(RBD_MAX_TRANSFER);
+    int last;
+
+    while (1) {
+        sem_wait(&c->inflight);
+        pthread_mutex_lock(&c->mutex);
+        last = c->nrecv == c->nsent;
+        pthread_mutex_unlock(&c->mutex);
+        if (last)               /* the sender stopped */
+            break;
+
+        if (full_read(c, &rsp, sizeof(rsp)) || rsp.payload_size > RBD_MAX_TRANSFER ||
+            full_read(c, data, rsp.payload_size)) {
+            fprintf(stderr, "SDBENCH: connection lost\n");
+            failed = stop = 1;
+            break;
+        }
+        pthread_mutex_lock(&c->mutex);
+        sent = c->sent[c->nrecv++ % depth];
+        pthread_mutex_unlock(&c->mutex);
+        hist_add(&c->hist, now_ns() - sent);
+        if (rsp.code == REP_ERR)
+            c->errors++;
+        else
+            c->bytes += bsize;
+        sem_post(&c->window);
+    }
+    free(data);
+    return NULL;
+}
+
+/* run with block size bsize for the given seconds and print the results */
+static void bench_run(void)
+{
+    struct sd_hist *hist = calloc(1, sizeof(*hist));
+    unsigned long long errors = 0, bytes = 0, start;
+    double t;
+    int i;
+
+    stop = 0;
+    for (i = 0; i < nconns; i++) {
+        struct bench_conn *c = &conns[i];
+
+        memset(&c->hist, 0, sizeof(c->hist));
+        c->nsent = c->nrecv = c->errors = c->bytes = 0;
+        c->next = dev_sectors / nconns * i / (bsize / BENCH_SECSIZE) * (bsize / BENCH_SECSIZE);
+        sem_init(&c->window, 0, depth);
+        sem_init(&c->inflight, 0, 0);
+    }
+
+    start = now_ns();
+    for (i = 0; i < nconns; i++) {
+        pthread_create(&conns[i].sender, NULL, bench_sender, &conns[i]);
+        pthread_create(&conns[i].receiver, NULL, bench_receiver, &conns[i]);
+    }
+    for (i = 0; i < seconds * 10 && !stop; i++)
+        usleep(100000);
+    stop = 1;
+    for (i = 0; i < nconns; i++) {
+        sem_post(&conns[i].window);
+        pthread_join(conns[i].sender, NULL);
+        pthread_join(conns[i].receiver, NULL);
+        sem_destroy(&conns[i].window);
+        sem_destroy(&conns[i].inflight);
+        hist_merge(hist, &conns[i].hist);
+        errors += conns[i].errors;
+        bytes += conns[i].bytes;
+    }
+    t = (now_ns() - start) / 1e9;
+
+    if (json)
+        printf("{\"bsize\": %lu, \"conns\": %d, \"depth\": %d, \"writes\": %d, \"pattern\": \"%s\", "
+               "\"seconds\": %.3f, \"ios\": %llu, \"errors\": %llu, \"iops\": %.1f, \"mbs\": %.2f, "
+               "\"p50_us\": %.1f, \"p99_us\": %.1f, \"p999_us\": %.1f, \"max_us\": %.1f}\n",
+               bsize, nconns, depth, wpct, random_io ? "random" : "sequential", t, hist->n, errors,
+               hist->n / t, bytes / t / (1024 * 1024), hist_percentile(hist, 0.5) / 1e3,
+               hist_percentile(hist, 0.99) / 1e3, hist_percentile(hist, 0.999) / 1e3, hist->max / 1e3);
+    else
+        printf("%8lu %10.1f %9.2f %9.1f %9.1f %9.1f %9.1f %7llu\n", bsize, hist->n / t,
+               bytes / t / (1024 * 1024), hist_percentile(hist, 0.5) / 1e3,
+               hist_percentile(hist, 0.99) / 1e3, hist_percentile(hist, 0.999) / 1e3,
+               hist->max / 1e3, errors);
+    fflush(stdout);
+    free(hist);
+}
+
+/* parse a list of sizes, as "4k,64k,1m" */
+static int parse_sizes(char *s)
+{
+    char *tok, *end;
+    unsigned long n;
+
+    for (nsizes = 0; (tok = strtok(s, ",")) != NULL; s = NULL) {
+        n = strtoul(tok, &end, 10);
+        if (*end == 'k' || *end == 'K')
+            n *= 1024, end++;
+        else if (*end == 'm' || *end == 'M')
+            n *= 1024 * 1024, end++;
+        if (*end || !n || n % BENCH_SECSIZE || n > RBD_MAX_TRANSFER || nsizes == BENCH_MAXSIZES)
+            return -1;
+        sizes[nsizes++] = n;
+    }
+    return nsizes ? 0 : -1;
+}
+
+int main(int argc, char **argv)
+{
+    int c, i;
+
+    while ((c = getopt(argc, argv, "h:p:c:q:b:w:st:j")) != -1)
+        switch (c) {
+            case 'h':
+                host = optarg;
+                break;
+            case 'p':
+                port = atoi(optarg);
+                break;
+            case 'c':
+                nconns = atoi(optarg);
+                break;
+            case 'q':
+                depth = atoi(optarg);
+                break;
+            case 'b':
+                if (parse_sizes(optarg)) {
+                    fprintf(stderr, "SDBENCH: sizes must be multiples of %d up to %d, at most %d of them\n",
+                            BENCH_SECSIZE, RBD_MAX_TRANSFER, BENCH_MAXSIZES);
+                    return 2;
+                }
+                break;
+            case 'w':
+                wpct = atoi(optarg);
+                break;
+            case 's':
+                random_io = 0;
+                break;
+            case 't':
+                seconds = atoi(optarg);
+                break;
+            case 'j':
+                json = 1;
+                break;
+            default:
+                usage();
+        }
+    if (nconns < 1 || nconns > BENCH_MAXCONNS || depth < 1 || depth > BENCH_MAXDEPTH ||
+        wpct < 0 || wpct > 100 || seconds < 1)
+        usage();
+    if (!nsizes)
+        sizes[nsizes++] = 4096;
+
+    for (i = 0; i < nconns; i++) {
+        if (bench_connect(&conns[i])) {
+            fprintf(stderr, "SDBENCH: connecting to %s:%d: %s\n", host, port, strerror(errno));
+            return 1;
+        }
+        pthread_mutex_init(&conns[i].mutex, NULL);
+        conns[i].rand = 0x9e3779b97f4a7c15ULL * (i + 1);
+        conns[i].buf = malloc(RBD_MAX_TRANSFER);
+        memset(conns[i].buf, 0xa5, RBD_MAX_TRANSFER);
+    }
+    if (bench_getsz(&conns[0], &dev_sectors)) {
+        fprintf(stderr, "SDBENCH: error getting the volume size\n");
+        return 1;
+    }
+
+    if (!json)
+        printf("   bsize       iops      MB/s   p50(us)   p99(us)  p999(us)   max(us)  errors\n");
+    for (i = 0; i < nsizes; i++) {
+        bsize = sizes[i];
+        if (bsize / BENCH_SECSIZE > dev_sectors) {
+            fprintf(stderr, "SDBENCH: block size %lu is bigger than the volume\n", bsize);
+            return 1;
+        }
+        bench_run();
+        if (failed)
+            return 1;
+    }
+
+    for (i = 0; i < nconns; i++) {
+        bench_request(&conns[i], 0, CMD_CLOSE, 0, NULL, 0);
+        if (conns[i].shm)
+            shm_close(conns[i].shm);
+        else
+            close(conns[i].fd);
+    }
+    return 0;
+}
@@ -0,0 +1,230 @@
+/*
+ * Remote Block Device - changed block tracking
+ *
+ * A volume created with sdfile -B (or set up later with sddelta -t) keeps
+ * in FILE.cbt the epoch every CBT_BLOCK bytes block was last written in.
+ * Starting a new epoch (cbt_next) closes the current one, so the blocks
+ * changed after an epoch, and only those, can be exported by sddelta
+ * without reading the whole volume.
+ *
+ * A write marks its blocks before their data is written, and the pages of
+ * the map it changed are synced first, so after a crash a block may be
+ * counted as changed when it was not, never the other way round. Blocks
+ * already marked in the current epoch cost nothing more. Writes in flight
+ * are counted by epoch, so that cbt_next can wait until every write of the
+ * epoch it closes is done, and an export that follows reads them all.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/file.h>
+
+#include "sd.h"
+
+static unsigned long cbt_hdrsize(void)
+{
+    return (sizeof(struct cbt_header) + STORAGE_ALIGN - 1) & ~(STORAGE_ALIGN - 1);
+}
+
+/* track the changes of st from epoch 1 on. if written, every block counts
+ * as changed in epoch 1, for volumes that already hold data */
+int storage_cbt_create(storage_t *st, int written)
+{
+    struct cbt_header h;
+    char path[1024 + 8];
+    unsigned int *ones;
+    unsigned long b, n;
+    int fd, i, rv;
+
+    memset(&h, 0, sizeof(h));
+    strcpy(h.token, CBT_TOKEN);
+    h.version = CBT_VERSION;
+    h.epoch = 1;
+    h.nblocks = (st->metadata->size + CBT_BLOCK - 1) / CBT_BLOCK;
+
+    storage_sidecar(st, ".cbt", path);
+    if ((fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644)) == -1)
+        return -1;
+    rv = ftruncate(fd, cbt_hdrsize() + h.nblocks * sizeof(unsigned int)) ||
+         storage_pio(fd, &h, sizeof(h), 0, 1);
+    if (!rv && written) {
+        if (!(ones = malloc(STORAGE_ALIGN)))
+            rv = -1;
+        for (i = 0; !rv && i < STORAGE_ALIGN / sizeof(unsigned int); i++)
+            ones[i] = 1;
+        for (b = 0; !rv && b < h.nblocks; b += n) {
+            n = h.nblocks - b < STORAGE_ALIGN / sizeof(unsigned int) ?
+                h.nblocks - b : STORAGE_ALIGN / sizeof(unsigned int);
+            rv = storage_pio(fd, ones, n * sizeof(unsigned int),
+                             cbt_hdrsize() + b * sizeof(unsigned int), 1);
+        }
+        free(ones);
+    }
+    if (!rv)
+        rv = fsync(fd);
+    close(fd);
+    if (rv)
+        return -1;
+    st->metadata->features |= STORAGE_F_CBT;
+    return msync(st->metadata, sizeof(storage_metadata_t), MS_SYNC);
+}
+
+static int cbt_map(struct sd_cbt *c)
+{
+    struct stat sb;
+    void *p;
+
+    if (fstat(c->fd, &sb))
+        return -1;
+    p = mmap(NULL, sb.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, c->fd, 0);
+    if (p == MAP_FAILED)
+        return -1;
+    if (c->hdr)
+        munmap(c->hdr, c->size);
+    c->hdr = p;
+    c->size = sb.st_size;
+    c->map = (unsigned int *)((char *)p + cbt_hdrsize());
+    c->nblocks = (c->size - cbt_hdrsize()) / sizeof(unsigned int);
+    if (strncmp(c->hdr->token, CBT_TOKEN, sizeof(c->hdr->token)) ||
+        c->hdr->version != CBT_VERSION) {
+        errno = EINVAL;
+        return -1;
+    }
+    return 0;
+}
+
+struct sd_cbt *cbt_open(storage_t *st)
+{
+    char path[1024 + 8];
+    struct sd_cbt *c;
+
+    if (!(c = calloc(1, sizeof(*c))))
+        return NULL;
+    storage_sidecar(st, ".cbt", path);
+    if ((c->fd = open(path, O_RDWR)) == -1 || cbt_map(c)) {
+        cbt_close(c);
+        return NULL;
+    }
+    return c;
+}
+
+void cbt_close(struct sd_cbt *c)
+{
+    if (!c)
+        return;
+    if (c->hdr)
+        munmap(c->hdr, c->size);
+    if (c->fd != -1)
+        close(c->fd);
+    free(c);
+}
+
+/* make room in the map of st for a volume of size bytes */
+int cbt_grow(storage_t *st, unsigned long size)
+{
+    struct sd_cbt *c;
+    unsigned long nblocks = (size + CBT_BLOCK - 1) / CBT_BLOCK;
+    int rv;
+
+    if (!(c = cbt_open(st)))
+        return -1;
+    rv = ftruncate(c->fd, cbt_hdrsize() + nblocks * sizeof(unsigned int));
+    if (!rv) {
+        c->hdr->nblocks = nblocks;
+        rv = msync(c->hdr, cbt_hdrsize(), MS_SYNC);
+    }
+    cbt_close(c);
+    return rv;
+}
+
+/* a write of size bytes at offset is about to be done: mark its blocks as
+ * changed in the current epoch. returns the epoch, to give to cbt_end once
+ * it is done, or 0 if they could not be marked */
+unsigned int cbt_begin(struct sd_cbt *c, unsigned long offset, unsigned long size)
+{
+    unsigned long b, first, last, page = sysconf(_SC_PAGESIZE);
+    unsigned int e, old;
+    char *from, *to;
+    int changed = 0;
+
+    first = offset / CBT_BLOCK;
+    last = (offset + (size ? size : 1) - 1) / CBT_BLOCK;
+    while (1) {
+        e = __atomic_load_n(&c->hdr->epoch, __ATOMIC_SEQ_CST);
+        __atomic_add_fetch(&c->hdr->writers[e & 1], 1, __ATOMIC_SEQ_CST);
+        if (__atomic_load_n(&c->hdr->epoch, __ATOMIC_SEQ_CST) == e)
+            break;
+        __atomic_sub_fetch(&c->hdr->writers[e & 1], 1, __ATOMIC_SEQ_CST);
+    }
+    if (last >= c->nblocks && (last >= c->hdr->nblocks || cbt_map(c) || last >= c->nblocks)) {
+        cbt_end(c, e);
+        errno = ERANGE;
+        return 0;
+    }
+
+    for (b = first; b <= last; b++) {
+        old = __atomic_load_n(&c->map[b], __ATOMIC_RELAXED);
+        while (old < e && !__atomic_compare_exchange_n(&c->map[b], &old, e, 0,
+                                                        __ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+            ;
+        changed |= old < e;
+    }
+    if (changed) {
+        from = (char *)((unsigned long)&c->map[first] & ~(page - 1));
+        to = (char *)&c->map[last + 1];
+        if (msync(from, to - from, MS_SYNC)) {
+            cbt_end(c, e);
+            return 0;
+        }
+    }
+    return e;
+}
+
+void cbt_end(struct sd_cbt *c, unsigned int e)
+{
+    __atomic_sub_fetch(&c->hdr->writers[e & 1], 1, __ATOMIC_SEQ_CST);
+}
+
+/* close the current epoch and start a new one, once every write of the
+ * one closed is done. returns the epoch closed */
+unsigned int cbt_next(struct sd_cbt *c)
+{
+    unsigned int e;
+    int i;
+
+    flock(c->fd, LOCK_EX);
+    e = __atomic_fetch_add(&c->hdr->epoch, 1, __ATOMIC_SEQ_CST);
+    msync(c->hdr, cbt_hdrsize(), MS_SYNC);
+    for (i = 0; __atomic_load_n(&c->hdr->writers[e & 1], __ATOMIC_SEQ_CST) && i < CBT_DRAIN * 1000; i++)
+        usleep(1000);
+    /* counts left behind by a process that died in the middle of a write */
+    if (__atomic_load_n(&c->hdr->writers[e & 1], __ATOMIC_SEQ_CST)) {
+        fprintf(stderr, "SD: cbt | %u writes of epoch %u never ended\n", c->hdr->writers[e & 1], e);
+        __atomic_store_n(&c->hdr->writers[e & 1], 0, __ATOMIC_SEQ_CST);
+    }
+    flock(c->fd, LOCK_UN);
+    return e;
+}
+
+void cbt_stats(storage_t *st, FILE *f)
+{
+    unsigned long b, written = 0, current = 0;
+    struct sd_cbt *c;
+
+    if (!(st->metadata->features & STORAGE_F_CBT) || !(c = cbt_open(st)))
+        return;
+    for (b = 0; b < c->nblocks; b++) {
+        written += !!c->map[b];
+        current += c->map[b] == c->hdr->epoch;
+    }
+    fprintf(f, "SD: cbt | epoch %u | blocks %lu | written %lu | changed in this epoch %lu\n",
+            c->hdr->epoch, c->nblocks, written, current);
+    cbt_close(c);
+}
@@ -0,0 +1,124 @@
+/*
+ * Remote Block Device - CRC32C (Castagnoli) checksums
+ *
+ * Uses the SSE4.2 crc32 instruction when the CPU has it, and a 
+ * slicing-by-8 table otherwise. crc32c() follows the kernel convention
+ * (no pre/post inversion), rbd_crc() is the checksum carried in messages.
+ */
+
+#include <stddef.h>
+#include <string.h>
+
+#include "sd.h"
+
+static unsigned int crc32c_table[8][256];
+static unsigned int (*crc32c_impl)(unsigned int, const void *, size_t);
+
+static void crc32c_init_table(void)
+{
+    unsigned int crc;
+    int i, j;
+
+    for (i = 0; i < 256; i++) {
+        crc = i;
+        for (j = 0; j < 8; j++)
+            crc = (crc >> 1) ^ (0x82f63b78 & -(crc & 1));
+        crc32c_table[0][i] = crc;
+    }
+    for (i = 0; i < 256; i++)
+        for (j = 1; j < 8; j++)
+            crc32c_table[j][i] = (crc32c_table[j-1][i] >> 8) ^ 
+                                 crc32c_table[0][crc32c_table[j-1][i] & 0xff];
+}
+
+unsigned int crc32c_sw(unsigned int crc, const void *buf, size_t len)
+{
+    const unsigned char *p = buf;
+    unsigned long long v;
+
+    while (len && ((unsigned long)p & 7)) {
+        crc = crc32c_table[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+        len--;
+    }
+    while (len >= 8) {
+        memcpy(&v, p, 8);
+        v ^= crc;
+        crc = crc32c_table[7][v & 0xff] ^ crc32c_table[6][(v >> 8) & 0xff] ^
+              crc32c_table[5][(v >> 16) & 0xff] ^ crc32c_table[4][(v >> 24) & 0xff] ^
+              crc32c_table[3][(v >> 32) & 0xff] ^ crc32c_table[2][(v >> 40) & 0xff] ^
+              crc32c_table[1][(v >> 48) & 0xff] ^ crc32c_table[0][v >> 56];
+        p += 8;
+        len -= 8;
+    }
+    while (len--)
+        crc = crc32c_table[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+    return crc;
+}
+
+#if defined(__x86_64__)
+__attribute__((target("sse4.2")))
+unsigned int crc32c_hw(unsigned int crc, const void *buf, size_t len)
+{
+    const unsigned char *p = buf;
+    unsigned long long c = crc, v;
+
+    while (len && ((unsigned long)p & 7)) {
+        c = __builtin_ia32_crc32qi(c, *p++);
+        len--;
+    }
+    while (len >= 32) {
+        memcpy(&v, p, 8);      c = __builtin_ia32_crc32di(c, v);
+        memcpy(&v, p + 8, 8);  c = __builtin_ia32_crc32di(c, v);
+        memcpy(&v, p + 16, 8); c = __builtin_ia32_crc32di(c, v);
+        memcpy(&v, p + 24, 8); c = __builtin_ia32_crc32di(c, v);
+        p += 32;
+        len -= 32;
+    }
+    while (len >= 8) {
+        memcpy(&v, p, 8);
+        c = __builtin_ia32_crc32di(c, v);
+        p += 8;
+        len -= 8;
+    }
+    while (len--)
+        c = __builtin_ia32_crc32qi(c, *p++);
+    return c;
+}
+#endif
+
+/* pick the fastest implementation for this CPU */
+static unsigned int crc32c_first(unsigned int crc, const void *buf, size_t len)
+{
+    crc32c_init_table();
+    crc32c_impl = crc32c_sw;
+#if defined(__x86_64__)
+    if (__builtin_cpu_supports("sse4.2"))
+        crc32c_impl = crc32c_hw;
+#endif
+    return crc32c_impl(crc, buf, len);
+}
+
+static unsigned int (*crc32c_impl)(unsigned int, const void *, size_t) = crc32c_first;
+
+unsigned int crc32c(unsigned int crc, const void *buf, size_t len)
+{
+    return crc32c_impl(crc, buf, len);
+}
+
+unsigned int rbd_crc(const void *buf, size_t len)
+{
+    return ~crc32c(~0U, buf, len);
+}
+
+/* checksum every RBD_CRC_BLOCK bytes block of buf (the last one may be 
+ * shorter) into crcs */
+void rbd_crc_blocks(const void *buf, unsigned long size, unsigned int *crcs)
+{
+    const char *p = buf;
+    unsigned long len;
+
+    for (; size; size -= len, p += len) {
+        len = size < RBD_CRC_BLOCK ? size : RBD_CRC_BLOCK;
+        *crcs++ = rbd_crc(p, len);
+    }
+}
@@ -0,0 +1,415 @@
+/*
+ * Remote Block Device - deduplicated block pool
+ *
+ * Volumes created with sdfile -D keep no data of their own: each block of
+ * POOL_BLOCK bytes is stored once in a pool that many volumes can share,
+ * and every volume maps its blocks to pool blocks in FILE.dmap (a block
+ * number per volume block, 0 for blocks of zeros).
+ *
+ * POOL      header, then the blocks. the header takes block 0
+ * POOL.ref  fingerprint and reference count of every block. free blocks
+ *           are linked through their fingerprint
+ * POOL.fpi  fingerprint index, an open addressing hash table of blocks
+ *
+ * Fingerprints only find candidates: data is compared before sharing a
+ * block. A shared block is copied on write, one referenced once is
+ * rewritten in place. SDs of all the volumes of a pool serialize on it
+ * with flock, shared for reads and exclusive for writes. Since the data
+ * of all of them comes from the same file, identical blocks of different
+ * volumes are also cached once by the host.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#include "sd.h"
+
+static void pool_path(const char *path, const char *ext, char *buf)
+{
+    sprintf(buf, "%s%s", path, ext);
+}
+
+static int pool_touch(const char *path, off_t size)
+{
+    int fd, rv;
+
+    if ((fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644)) == -1)
+        return -1;
+    rv = ftruncate(fd, size);
+    close(fd);
+    return rv;
+}
+
+/* create a pool for size bytes of distinct data */
+int pool_create(const char *path, unsigned long size)
+{
+    struct pool_header hdr;
+    char buf[1024 + 8];
+    unsigned long slots;
+    int fd, rv;
+
+    memset(&hdr, 0, sizeof(hdr));
+    strcpy(hdr.token, POOL_TOKEN);
+    hdr.version = POOL_VERSION;
+    hdr.capacity = size / POOL_BLOCK + 1;
+    hdr.nblocks = 1;
+    for (slots = 1; slots < 2 * hdr.capacity; slots <<= 1)
+        ;
+
+    pool_path(path, ".ref", buf);
+    if (pool_touch(buf, hdr.capacity * sizeof(struct pool_ref)))
+        return -1;
+    pool_path(path, ".fpi", buf);
+    if (pool_touch(buf, slots * sizeof(unsigned int)))
+        return -1;
+
+    if ((fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644)) == -1)
+        return -1;
+    rv = storage_pio(fd, &hdr, sizeof(hdr), 0, 1);
+    if (!rv)
+        rv = ftruncate(fd, POOL_BLOCK);
+    close(fd);
+    return rv;
+}
+
+static void *pool_map(const char *path, const char *ext, unsigned long *size)
+{
+    char buf[1024 + 8];
+    struct stat sb;
+    void *p;
+    int fd;
+
+    pool_path(path, ext, buf);
+    if ((fd = open(buf, O_RDWR)) == -1)
+        return NULL;
+    if (fstat(fd, &sb) == -1 || !sb.st_size) {
+        close(fd);
+        return NULL;
+    }
+    p = mmap(NULL, sb.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    *size = sb.st_size;
+    return p == MAP_FAILED ? NULL : p;
+}
+
+struct sd_pool *pool_open(const char *path)
+{
+    struct sd_pool *p;
+    unsigned long size;
+
+    if (!(p = calloc(1, sizeof(*p))))
+        return NULL;
+    if ((p->fd = open(path, O_RDWR)) == -1)
+        goto err;
+    p->hdr = mmap(NULL, sizeof(*p->hdr), PROT_READ | PROT_WRITE, MAP_SHARED, p->fd, 0);
+    if (p->hdr == MAP_FAILED) {
+        p->hdr = NULL;
+        goto err;
+    }
+    if (strncmp(p->hdr->token, POOL_TOKEN, sizeof(p->hdr->token))) {
+        errno = EINVAL;
+        goto err;
+    }
+    if (!(p->ref = pool_map(path, ".ref", &size)) || size < p->hdr->capacity * sizeof(*p->ref))
+        goto err;
+    if (!(p->index = pool_map(path, ".fpi", &size)))
+        goto err;
+    p->slots = size / sizeof(*p->index);
+    return p;
+
+err:
+    pool_close(p);
+    return NULL;
+}
+
+void pool_close(struct sd_pool *p)
+{
+    if (!p)
+        return;
+    if (p->index)
+        munmap(p->index, p->slots * sizeof(*p->index));
+    if (p->ref)
+        munmap(p->ref, p->hdr->capacity * sizeof(*p->ref));
+    if (p->hdr)
+        munmap(p->hdr, sizeof(*p->hdr));
+    if (p->fd != -1)
+        close(p->fd);
+    free(p);
+}
+
+static int pool_lock(struct sd_pool *p, int exclusive)
+{
+    while (flock(p->fd, exclusive ? LOCK_EX : LOCK_SH) == -1)
+        if (errno != EINTR)
+            return -1;
+    return 0;
+}
+
+static void pool_unlock(struct sd_pool *p)
+{
+    flock(p->fd, LOCK_UN);
+}
+
+static int pool_block_io(struct sd_pool *p, unsigned long b, void *buf, unsigned long within, unsigned long size, int write)
+{
+    return storage_pio(p->fd, buf, size, (off_t)b * POOL_BLOCK + within, write);
+}
+
+/* block holding the same POOL_BLOCK bytes as data, 0 if none. tmp gets
+ * the candidates' data */
+static unsigned long pool_lookup(struct sd_pool *p, unsigned long long fp, const char *data, char *tmp)
+{
+    unsigned long i, b;
+
+    for (i = fp & (p->slots - 1); (b = p->index[i]); i = (i + 1) & (p->slots - 1)) {
+        if (p->ref[b].fp != fp)
+            continue;
+        if (pool_block_io(p, b, tmp, 0, POOL_BLOCK, 0))
+            return 0;
+        if (!memcmp(tmp, data, POOL_BLOCK))
+            return b;
+    }
+    return 0;
+}
+
+static void pool_insert(struct sd_pool *p, unsigned long b)
+{
+    unsigned long i;
+
+    for (i = p->ref[b].fp & (p->slots - 1); p->index[i]; i = (i + 1) & (p->slots - 1))
+        ;
+    p->index[i] = b;
+}
+
+/* remove b from the index, moving back the entries after it that would
+ * no longer be found */
+static void pool_remove(struct sd_pool *p, unsigned long b)
+{
+    unsigned long mask = p->slots - 1, i, j, home;
+
+    for (i = p->ref[b].fp & mask; p->index[i] != b; i = (i + 1) & mask)
+        if (!p->index[i])
+            return;
+    for (j = (i + 1) & mask; p->index[j]; j = (j + 1) & mask) {
+        home = p->ref[p->index[j]].fp & mask;
+        if (i <= j ? (home <= i || home > j) : (home <= i && home > j)) {
+            p->index[i] = p->index[j];
+            i = j;
+        }
+    }
+    p->index[i] = 0;
+}
+
+static unsigned long pool_alloc(struct sd_pool *p)
+{
+    unsigned long b;
+
+    if ((b = p->hdr->free))
+        p->hdr->free = p->ref[b].fp;
+    else if (p->hdr->nblocks < p->hdr->capacity)
+        b = p->hdr->nblocks++;
+    else {
+        errno = ENOSPC;
+        return 0;
+    }
+    p->hdr->used++;
+    return b;
+}
+
+/* drop a reference to b, freeing it with the last one */
+static void pool_release(struct sd_pool *p, unsigned long b)
+{
+    p->hdr->refs--;
+    if (--p->ref[b].refs)
+        return;
+    pool_remove(p, b);
+    p->ref[b].fp = p->hdr->free;
+    p->hdr->free = b;
+    p->hdr->used--;
+    fallocate(p->fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, (off_t)b * POOL_BLOCK, POOL_BLOCK);
+}
+
+static int pool_iszero(const char *buf)
+{
+    return !buf[0] && !memcmp(buf, buf + 1, POOL_BLOCK - 1);
+}
+
+/* store the POOL_BLOCK bytes of data for a volume block now mapped to
+ * *b, updating *b. must be called with the pool locked exclusively */
+static int pool_store(struct sd_pool *p, unsigned int *b, const char *data, char *tmp)
+{
+    unsigned long old = *b, new = 0;
+    unsigned long long fp;
+
+    if (!pool_iszero(data)) {
+        fp = sd_fingerprint(data, POOL_BLOCK);
+        if ((new = pool_lookup(p, fp, data, tmp))) {
+            if (new == old)
+                return 0;
+            p->ref[new].refs++;
+            p->hdr->refs++;
+        } else if (old && p->ref[old].refs == 1) {
+            /* not shared: rewrite in place */
+            pool_remove(p, old);
+            if (pool_block_io(p, old, (char *)data, 0, POOL_BLOCK, 1))
+                return -1;
+            p->ref[old].fp = fp;
+            pool_insert(p, old);
+            return 0;
+        } else {
+            if (!(new = pool_alloc(p)) || pool_block_io(p, new, (char *)data, 0, POOL_BLOCK, 1))
+                return -1;
+            p->ref[new].fp = fp;
+            p->ref[new].refs = 1;
+            p->hdr->refs++;
+            pool_insert(p, new);
+        }
+    }
+    if (old)
+        pool_release(p, old);
+    *b = new;
+    return 0;
+}
+
+/* transfer size bytes at offset of a deduplicated volume. partial block
+ * writes merge the new data with the block they replace */
+int storage_dedup_io(storage_t *st, char *buf, unsigned long offset, unsigned long size, int write)
+{
+    struct sd_pool *p = st->pool;
+    unsigned long first, nblocks, n, within, len;
+    unsigned int *map;
+    char *block = NULL, *tmp = NULL;
+    int rv;
+
+    if (!size)
+        return 0;
+    if (offset + size > st->metadata->size) {   /* would grow the map */
+        errno = ERANGE;
+        return -1;
+    }
+    first = offset / POOL_BLOCK;
+    nblocks = (offset + size - 1) / POOL_BLOCK - first + 1;
+    if (!(map = storage_getbuf(st, nblocks * sizeof(*map))))
+        return -1;
+    if (write && (!(block = storage_getbuf(st, POOL_BLOCK)) || !(tmp = storage_getbuf(st, POOL_BLOCK)))) {
+        rv = -1;
+        goto out;
+    }
+
+    if ((rv = pool_lock(p, write)))
+        goto out;
+    rv = storage_pio(st->dmapfd, map, nblocks * sizeof(*map), first * sizeof(*map), 0);
+    for (n = 0; !rv && size; n++, offset += len, buf += len, size -= len) {
+        within = offset % POOL_BLOCK;
+        len = POOL_BLOCK - within < size ? POOL_BLOCK - within : size;
+        if (!write) {
+            if (map[n])
+                rv = pool_block_io(p, map[n], buf, within, len, 0);
+            else
+                memset(buf, 0, len);
+            continue;
+        }
+        if (len < POOL_BLOCK) {
+            if (map[n])
+                rv = pool_block_io(p, map[n], block, 0, POOL_BLOCK, 0);
+            else
+                memset(block, 0, POOL_BLOCK);
+            memcpy(block + within, buf, len);
+        }
+        if (!rv)
+            rv = pool_store(p, &map[n], len < POOL_BLOCK ? block : buf, tmp);
+    }
+    /* blocks already stored are mapped even if a later one failed */
+    if (write && n)
+        rv |= storage_pio(st->dmapfd, map, n * sizeof(*map), first * sizeof(*map), 1);
+    pool_unlock(p);
+
+out:
+    if (tmp)
+        storage_putbuf(st, tmp, POOL_BLOCK);
+    if (block)
+        storage_putbuf(st, block, POOL_BLOCK);
+    storage_putbuf(st, map, nblocks * sizeof(*map));
+    return rv;
+}
+
+/* make st, a new volume, a deduplicated one on the pool at path. if src
+ * is not NULL the volume starts as a clone of it, sharing all its blocks */
+int storage_dedup_create(storage_t *st, const char *path, storage_t *src)
+{
+    struct sd_pool *p;
+    char mpath[1024 + 8];
+    unsigned int *map = NULL;
+    unsigned long nblocks, n, i, len;
+    int fd = -1, srcfd = -1, rv = -1;
+
+    if (!(p = pool_open(path)))
+        return -1;
+    if (!realpath(path, st->metadata->pool))
+        goto out;
+    storage_sidecar(st, ".dmap", mpath);
+    if ((fd = open(mpath, O_RDWR | O_CREAT | O_TRUNC, 0644)) == -1)
+        goto out;
+    nblocks = (st->metadata->size + POOL_BLOCK - 1) / POOL_BLOCK;
+    if (ftruncate(fd, nblocks * sizeof(*map)))
+        goto out;
+
+    if (src) {
+        if (!(src->metadata->features & STORAGE_F_DEDUP) || 
+            strcmp(src->metadata->pool, st->metadata->pool)) {
+            errno = EXDEV;
+            goto out;
+        }
+        storage_sidecar(src, ".dmap", mpath);
+        if ((srcfd = open(mpath, O_RDONLY)) == -1 || !(map = malloc(RBD_MAX_TRANSFER)))
+            goto out;
+        if (pool_lock(p, 1))
+            goto out;
+        n = (src->metadata->size + POOL_BLOCK - 1) / POOL_BLOCK;
+        if (n > nblocks)
+            n = nblocks;
+        for (rv = 0; !rv && n; n -= len) {
+            len = n < RBD_MAX_TRANSFER / sizeof(*map) ? n : RBD_MAX_TRANSFER / sizeof(*map);
+            if ((rv = storage_pio(srcfd, map, len * sizeof(*map), (nblocks - n) * sizeof(*map), 0)))
+                break;
+            for (i = 0; i < len; i++)
+                if (map[i]) {
+                    p->ref[map[i]].refs++;
+                    p->hdr->refs++;
+                }
+            rv = storage_pio(fd, map, len * sizeof(*map), (nblocks - n) * sizeof(*map), 1);
+        }
+        pool_unlock(p);
+        if (rv)
+            goto out;
+    }
+
+    if (!st->capacity && truncate(st->fpath, st->metadata->data_offset))
+        goto out;
+    st->metadata->features |= STORAGE_F_DEDUP;
+    rv = msync(st->metadata, sizeof(storage_metadata_t), MS_SYNC);
+
+out:
+    free(map);
+    if (srcfd != -1)
+        close(srcfd);
+    if (fd != -1)
+        close(fd);
+    pool_close(p);
+    return rv;
+}
+
+void pool_stats(struct sd_pool *p, FILE *f)
+{
+    fprintf(f, "SD: dedup pool | capacity %lu | used %lu | refs %lu | ratio %.2f\n",
+            p->hdr->capacity - 1, p->hdr->used, p->hdr->refs,
+            p->hdr->used ? (double)p->hdr->refs / p->hdr->used : 0);
+}
@@ -0,0 +1,326 @@
+/*
+ * Remote Block Device - incremental export and import
+ *
+ * Streams the blocks of a volume with changed block tracking (sdfile -B,
+ * see sdcbt.c) written after a given epoch, and applies such a stream to
+ * another volume. An export starts a new epoch first and covers the ones
+ * before it, so that writes made while it runs go to the next export; the
+ * last epoch covered is printed to stderr, to export from next time. It
+ * can run on a volume served by an SD. The data read is that of the
+ * moment it is read, so the copy is consistent once the next export is
+ * applied too.
+ *
+ * That holds on compressed chunk stores and on volumes an SD serves with
+ * O_DIRECT (sd -d) as well: chunks are read under the same OFD locks the
+ * SD rewrites them under, and a block that an SD is in the middle of
+ * rewriting, in place or read-modify-write, was marked in the new epoch
+ * before it, so the next export has it again.
+ *
+ * A stream is a delta_header and the changed extents, runs of adjacent
+ * changed blocks of RBD_MAX_TRANSFER bytes at most, each one a
+ * delta_extent followed by its data, unless it is all zeros. An extent
+ * with offset DELTA_END closes the stream.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+
+#include "sd.h"
+
+#define DELTA_TOKEN "RBDD"
+#define DELTA_VERSION 1
+#define DELTA_END (~0ULL)
+#define DELTA_ZERO 0x01                 /* all zeros, no data follows */
+
+struct delta_header {
+    char token[4];
+    unsigned int version;
+    unsigned long long size;            /* of the volume exported */
+    unsigned int from;                  /* changes after epoch from */
+    unsigned int to;                    /* up to epoch to */
+};
+
+struct delta_extent {
+    unsigned long long offset;          /* in bytes */
+    unsigned int length;
+    unsigned int flags;                 /* DELTA_* */
+    unsigned int crc;                   /* CRC32C of the data */
+    unsigned int pad;
+};
+
+storage_t sd_storage;
+
+void usage(void) {
+    printf("Usage: sddelta [-m META] -e EPOCH FILE > DELTA\n");
+    printf("       sddelta [-m META] -a FILE < DELTA\n");
+    printf("       sddelta [-m META] -n | -t | -i FILE\n\n");
+    printf("META  - metadata sidecar file of FILE, if it has one\n");
+    printf("EPOCH - export the blocks of FILE written after this epoch, 0 for\n");
+    printf("        every block ever written. a new epoch is started first, and\n");
+    printf("        the last one exported is printed to stderr, to export from\n");
+    printf("        next time\n");
+    printf("-a    - apply a DELTA to FILE, a copy of the exported volume as it\n");
+    printf("        was at the epoch the DELTA was exported from\n");
+    printf("-n    - start a new epoch, and print the one closed\n");
+    printf("-t    - track the changes of FILE, that holds data already. every\n");
+    printf("        block counts as written in epoch 1. no SD may be serving it\n");
+    printf("-i    - show the current epoch and the blocks written\n");
+    printf("FILE  - storage daemon file or block device\n");
+    exit(2);
+}
+
+static int full_write(int fd, const void *buf, size_t size)
+{
+    ssize_t rv;
+
+    while (size) {
+        if ((rv = write(fd, buf, size)) <= 0) {
+            if (rv == -1 && errno == EINTR)
+                continue;
+            return -1;
+        }
+        buf = (const char *)buf + rv;
+        size -= rv;
+    }
+    return 0;
+}
+
+/* 1 if all size bytes are read, 0 at the end of the input, -1 on errors
+ * or if it ends before */
+static int full_read(int fd, void *buf, size_t size)
+{
+    size_t done = 0;
+    ssize_t rv;
+
+    while (done < size) {
+        if ((rv = read(fd, (char *)buf + done, size - done)) < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        if (!rv)
+            break;
+        done += rv;
+    }
+    return done == size ? 1 : done ? -1 : 0;
+}
+
+static int delta_zeros(const char *buf, unsigned long size)
+{
+    unsigned long i;
+
+    for (i = 0; i < size; i++)
+        if (buf[i])
+            return 0;
+    return 1;
+}
+
+/* write the blocks of st changed after epoch from to stdout */
+static int delta_export(storage_t *st, unsigned int from)
+{
+    struct delta_header h;
+    struct delta_extent x;
+    struct sd_cbt *c = st->cbt;
+    unsigned long b, first, nblocks, extents = 0;
+    unsigned long long bytes = 0, size = st->metadata->size;
+    unsigned int to;
+    char *buf;
+
+    if (from >= c->hdr->epoch) {
+        fprintf(stderr, "SDDELTA: EPOCH must be below the current one, %u\n", c->hdr->epoch);
+        return -1;
+    }
+    if (!(buf = storage_getbuf(st, RBD_MAX_TRANSFER))) {
+        perror("SDDELTA: buffer");
+        return -1;
+    }
+    to = cbt_next(c);
+
+    memset(&h, 0, sizeof(h));
+    memcpy(h.token, DELTA_TOKEN, sizeof(h.token));
+    h.version = DELTA_VERSION;
+    h.size = size;
+    h.from = from;
+    h.to = to;
+    if (full_write(1, &h, sizeof(h)))
+        goto werr;
+
+    nblocks = (size + CBT_BLOCK - 1) / CBT_BLOCK;
+    for (b = 0; b < nblocks; ) {
+        if (c->map[b] <= from || c->map[b] > to) {
+            b++;
+            continue;
+        }
+        for (first = b++; b < nblocks && c->map[b] > from && c->map[b] <= to &&
+             (b - first) * CBT_BLOCK < RBD_MAX_TRANSFER; b++)
+            ;
+        memset(&x, 0, sizeof(x));
+        x.offset = (unsigned long long)first * CBT_BLOCK;
+        x.length = (b * CBT_BLOCK < size ? b * CBT_BLOCK : size) - x.offset;
+        if (storage_read(st, buf, x.offset, x.length)) {
+            perror("SDDELTA: reading the volume");
+            goto err;
+        }
+        if (delta_zeros(buf, x.length))
+            x.flags = DELTA_ZERO;
+        else
+            x.crc = rbd_crc(buf, x.length);
+        if (full_write(1, &x, sizeof(x)) ||
+            (!(x.flags & DELTA_ZERO) && full_write(1, buf, x.length)))
+            goto werr;
+        extents++;
+        bytes += x.length;
+    }
+    memset(&x, 0, sizeof(x));
+    x.offset = DELTA_END;
+    if (full_write(1, &x, sizeof(x)))
+        goto werr;
+    storage_putbuf(st, buf, RBD_MAX_TRANSFER);
+    fprintf(stderr, "SDDELTA: exported epochs %u to %u | %lu extents | %llu bytes\n"
+            "SDDELTA: export from epoch %u next time\n", from + 1, to, extents, bytes, to);
+    return 0;
+
+werr:
+    perror("SDDELTA: writing the delta");
+err:
+    storage_putbuf(st, buf, RBD_MAX_TRANSFER);
+    return -1;
+}
+
+/* apply the stream on stdin to st */
+static int delta_import(storage_t *st)
+{
+    struct delta_header h;
+    struct delta_extent x;
+    unsigned long extents = 0;
+    unsigned long long bytes = 0;
+    char *buf;
+    int rv;
+
+    if (full_read(0, &h, sizeof(h)) != 1 || memcmp(h.token, DELTA_TOKEN, sizeof(h.token)) ||
+        h.version != DELTA_VERSION) {
+        fprintf(stderr, "SDDELTA: not a delta stream\n");
+        return -1;
+    }
+    if (h.size > st->metadata->size) {
+        fprintf(stderr, "SDDELTA: the volume exported has %llu bytes, this one %lu\n",
+                h.size, st->metadata->size);
+        return -1;
+    }
+    if (!(buf = storage_getbuf(st, RBD_MAX_TRANSFER))) {
+        perror("SDDELTA: buffer");
+        return -1;
+    }
+
+    while ((rv = full_read(0, &x, sizeof(x))) == 1 && x.offset != DELTA_END) {
+        if (!x.length || x.length > RBD_MAX_TRANSFER || x.offset + x.length > h.size) {
+            fprintf(stderr, "SDDELTA: bad extent at %llu\n", x.offset);
+            goto err;
+        }
+        if (x.flags & DELTA_ZERO)
+            memset(buf, 0, x.length);
+        else if ((rv = full_read(0, buf, x.length)) != 1)
+            break;
+        else if (rbd_crc(buf, x.length) != x.crc) {
+            fprintf(stderr, "SDDELTA: checksum error in the extent at %llu\n", x.offset);
+            goto err;
+        }
+        if (storage_write(st, buf, x.offset, x.length)) {
+            perror("SDDELTA: writing the volume");
+            goto err;
+        }
+        extents++;
+        bytes += x.length;
+    }
+    if (rv != 1) {
+        fprintf(stderr, "SDDELTA: the stream ends before its last extent\n");
+        goto err;
+    }
+    if (st->fd != -1 && fsync(st->fd)) {
+        perror("SDDELTA: writing the volume");
+        goto err;
+    }
+    storage_putbuf(st, buf, RBD_MAX_TRANSFER);
+    fprintf(stderr, "SDDELTA: applied epochs %u to %u | %lu extents | %llu bytes\n",
+            h.from + 1, h.to, extents, bytes);
+    return 0;
+
+err:
+    storage_putbuf(st, buf, RBD_MAX_TRANSFER);
+    return -1;
+}
+
+int main(int argc, char **argv)
+{
+    char *mpath = NULL;
+    long from = -1;
+    int apply = 0, next = 0, track = 0, info = 0;
+    int c, rv;
+
+    while ((c = getopt(argc, argv, "m:e:antih")) != -1)
+        switch (c) {
+            case 'm':
+                mpath = optarg;
+                break;
+            case 'e':
+                from = atol(optarg);
+                break;
+            case 'a':
+                apply = 1;
+                break;
+            case 'n':
+                next = 1;
+                break;
+            case 't':
+                track = 1;
+                break;
+            case 'i':
+                info = 1;
+                break;
+            default:
+                usage();
+        }
+    if (argc == optind || (from >= 0) + apply + next + track + info != 1)
+        usage();
+
+    if (storage_load(&sd_storage, argv[optind], mpath)) {
+        perror("SDDELTA: unable to load SD file");
+        return 1;
+    }
+    if (info) {
+        cbt_stats(&sd_storage, stdout);
+        return 0;
+    }
+    if (track) {
+        if (sd_storage.metadata->features & STORAGE_F_CBT) {
+            fprintf(stderr, "SDDELTA: %s is tracked already\n", argv[optind]);
+            return 1;
+        }
+        if (storage_cbt_create(&sd_storage, 1)) {
+            perror("SDDELTA: unable to create the changed block map");
+            return 1;
+        }
+        return 0;
+    }
+    if (!(sd_storage.metadata->features & STORAGE_F_CBT) && !apply) {
+        fprintf(stderr, "SDDELTA: %s does not track changed blocks (see sdfile -B)\n", argv[optind]);
+        return 1;
+    }
+    if (storage_open(&sd_storage)) {
+        perror("SDDELTA: unable to open SD file");
+        return 1;
+    }
+
+    if (next) {
+        printf("%u\n", cbt_next(sd_storage.cbt));
+        rv = 0;
+    } else if (apply)
+        rv = delta_import(&sd_storage);
+    else
+        rv = delta_export(&sd_storage, from);
+    storage_free(&sd_storage);
+    return rv ? 1 : 0;
+}
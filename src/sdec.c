@@ -0,0 +1,806 @@
+/*
+ * Remote Block Device - erasure coded volumes
+ *
+ * A volume created with sdfile -E keeps no data of its own: it is split
+ * in stripes of k EC_BLOCK bytes blocks, and block j of stripe s is kept
+ * at offset s * EC_BLOCK of the j-th SD listed (a data shard). The other
+ * m SDs keep, at the same offset, Reed-Solomon parity blocks of the stripe
+ * (see sdgf.c). The volume survives the loss of any m of them, taking
+ * (k + m) / k times its size instead of the m + 1 times of replication.
+ * The SD serving it is a gateway: clients speak the usual protocol to it.
+ *
+ * Reads go to the data shards they cover. When one of them is down,
+ * fails or does not answer within EC_SLOW_MS, its stripes are rebuilt
+ * from any k shards instead. Writes are made of whole stripes, reading
+ * the partial ones at either end first. They go to every shard that is
+ * up, and are acknowledged once all of them replied, if k at least have
+ * them. Until the shards that missed it are rebuilt, a write has less 
+ * redundancy: with only k copies, losing one more shard loses it. As in
+ * RAID-5, a write that fails on more than m shards leaves the stripes it
+ * touched unreadable.
+ *
+ * The regions a write touches count it as in flight, synced before it is
+ * sent, until every shard replied. If the SD dies in between, the shards
+ * may hold a mix of old and new blocks and the parity may not match the
+ * data (the RAID-5 write hole). On restart, ec_recover marks the regions
+ * still in flight dirty on the parity shards, which are rebuilt from the
+ * data shards. A data shard that was already down when that happened 
+ * cannot be rebuilt right for those stripes.
+ *
+ * A shard that misses a write is marked down, and the EC_REGION regions
+ * the write touched are marked in its dirty bitmap (FILE.ec, shared by
+ * every worker and kept across restarts). A rebuild process per shard
+ * reconnects, recomputes the dirty regions from the other shards, writes
+ * them and marks it up again. The parity shards of a new volume start
+ * down and dirty, so they are computed from whatever the data shards hold.
+ * Stripes are locked, shared for reads and exclusive for writes and
+ * rebuilds, so that nobody sees a stripe half written.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <poll.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/prctl.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#include "sd.h"
+
+#define EC_POLL 1                   /* seconds between dirty bitmap scans */
+#define EC_RETRY 5                  /* seconds between reconnection attempts */
+#define EC_LOCKBASE (1LL << 40)     /* stripe locks offset in FILE.ec */
+
+static unsigned long ec_hdrsize(void)
+{
+    return (sizeof(struct ec_header) + STORAGE_ALIGN - 1) & ~(STORAGE_ALIGN - 1);
+}
+
+/* parse a HOST:PORT shard address. HOST must be an IPv4 address in dotted
+ * quad notation: names are not resolved */
+int ec_parse(struct ec_header *h, const char *addr)
+{
+    const char *colon = strrchr(addr, ':');
+    struct ec_shard *sh = &h->shard[h->n];
+    struct in_addr in;
+
+    if (h->n == EC_MAXSHARDS || !colon || colon == addr || colon - addr >= sizeof(sh->host))
+        return -1;
+    memcpy(sh->host, addr, colon - addr);
+    sh->host[colon - addr] = '\0';
+    if (inet_pton(AF_INET, sh->host, &in) != 1)
+        return -1;
+    if ((sh->port = atoi(colon + 1)) <= 0 || sh->port > 65535)
+        return -1;
+    h->n++;
+    return 0;
+}
+
+static int ec_connect(struct ec_header *h, int i)
+{
+    struct sockaddr_in addr;
+    int fd, yes = 1;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(h->shard[i].port);
+    if (inet_pton(AF_INET, h->shard[i].host, &addr.sin_addr) != 1) {
+        errno = EINVAL;
+        return -1;
+    }
+    if ((fd = socket(PF_INET, SOCK_STREAM, 0)) == -1)
+        return -1;
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
+        close(fd);
+        return -1;
+    }
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof(yes));
+    return fd;
+}
+
+static int ec_recvall(int fd, void *buf, unsigned long size)
+{
+    char *p = buf;
+    ssize_t rv;
+
+    while (size) {
+        rv = recv(fd, p, size, 0);
+        if (rv < 0 && errno == EINTR)
+            continue;
+        if (rv <= 0)
+            return -1;
+        p += rv;
+        size -= rv;
+    }
+    return 0;
+}
+
+/* send a request for size bytes at offset of a shard, with them if it
+ * is a write */
+static int ec_request(int fd, unsigned int id, int code, const void *buf, unsigned long offset, unsigned long size)
+{
+    struct rbdmsg_hdr msg;
+    struct iovec iov[2];
+    struct msghdr mh;
+    ssize_t rv;
+
+    memset(&msg, 0, sizeof(msg));
+    msg.version = PROTO_VERSION;
+    msg.type = CMD;
+    msg.code = code;
+    msg.id = id;
+    msg.payload_size = code == CMD_WRITE ? size : 0;
+    msg.fsop_offset_sectors = offset / STORAGE_SECSIZE;
+    msg.fsop_size = size;
+
+    iov[0].iov_base = &msg;
+    iov[0].iov_len = sizeof(msg);
+    iov[1].iov_base = (void *)buf;
+    iov[1].iov_len = msg.payload_size;
+    memset(&mh, 0, sizeof(mh));
+    mh.msg_iov = iov;
+    mh.msg_iovlen = msg.payload_size ? 2 : 1;
+    while (mh.msg_iovlen) {
+        rv = sendmsg(fd, &mh, MSG_NOSIGNAL);
+        if (rv < 0 && errno == EINTR)
+            continue;
+        if (rv <= 0)
+            return -1;
+        while (mh.msg_iovlen && rv >= mh.msg_iov->iov_len) {
+            rv -= mh.msg_iov->iov_len;
+            mh.msg_iov++;
+            mh.msg_iovlen--;
+        }
+        if (mh.msg_iovlen) {
+            mh.msg_iov->iov_base = (char *)mh.msg_iov->iov_base + rv;
+            mh.msg_iov->iov_len -= rv;
+        }
+    }
+    return 0;
+}
+
+/* receive a reply. if it is the one to request id, its size bytes of
+ * payload go to buf and 0 is returned. replies to older requests, left
+ * behind when a shard was too slow, are thrown away and 1 is returned.
+ * -1 on errors */
+static int ec_reply(int fd, unsigned int id, void *buf, unsigned long size)
+{
+    struct rbdmsg_hdr rsp;
+    char scrap[4096];
+    unsigned long len;
+
+    if (ec_recvall(fd, &rsp, sizeof(rsp)))
+        return -1;
+    if (rsp.id != id || rsp.code == REP_ERR || rsp.payload_size != size) {
+        for (len = rsp.payload_size; len; len -= size) {
+            size = len < sizeof(scrap) ? len : sizeof(scrap);
+            if (ec_recvall(fd, scrap, size))
+                return -1;
+        }
+        return rsp.id != id && (int)(id - rsp.id) > 0 ? 1 : -1;
+    }
+    return ec_recvall(fd, buf, size);
+}
+
+/* volume size the shards can hold: k times the whole blocks of the
+ * smallest one. they all must be reachable */
+int ec_capacity(struct ec_header *h, unsigned long *size)
+{
+    unsigned long sectors, smallest = ~0UL;
+    int fd, i, rv;
+
+    for (i = 0; i < h->n; i++) {
+        if ((fd = ec_connect(h, i)) == -1)
+            return -1;
+        rv = ec_request(fd, 1, CMD_GETSZ, NULL, 0, 0) || ec_reply(fd, 1, &sectors, sizeof(sectors));
+        ec_request(fd, 2, CMD_CLOSE, NULL, 0, 0);
+        close(fd);
+        if (rv) {
+            errno = EPROTO;
+            return -1;
+        }
+        if (sectors * STORAGE_SECSIZE < smallest)
+            smallest = sectors * STORAGE_SECSIZE;
+    }
+    *size = smallest / EC_BLOCK * EC_BLOCK * h->k;
+    return 0;
+}
+
+/* size of FILE.ec for h: the header, the bitmaps and the intents */
+static unsigned long ec_filesize(struct ec_header *h)
+{
+    return ec_hdrsize() + h->n * ((h->nregions + 7) / 8) + h->nregions * sizeof(unsigned int);
+}
+
+/* turn a new storage into an erasure coded volume on the shards of h */
+int storage_ec_create(storage_t *st, struct ec_header *h)
+{
+    char path[1024 + 8];
+    unsigned char ones[4096];
+    unsigned long stripes, nbytes, off, len;
+    int fd, i, rv;
+
+    if (h->k < 1 || h->k > h->n) {
+        errno = EINVAL;
+        return -1;
+    }
+    strcpy(h->token, EC_TOKEN);
+    h->version = EC_VERSION;
+    stripes = (st->metadata->size + (unsigned long)h->k * EC_BLOCK - 1) / ((unsigned long)h->k * EC_BLOCK);
+    h->nregions = (stripes * EC_BLOCK + EC_REGION - 1) / EC_REGION;
+    nbytes = (h->nregions + 7) / 8;
+    for (i = 0; i < h->n; i++) {
+        h->shard[i].state = i < h->k ? EC_UP : EC_DOWN;
+        h->shard[i].gen = 0;
+        h->shard[i].rebuilt = 0;
+    }
+
+    storage_sidecar(st, ".ec", path);
+    if ((fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644)) == -1)
+        return -1;
+    rv = ftruncate(fd, ec_filesize(h)) ||
+         storage_pio(fd, h, sizeof(*h), 0, 1);
+    /* the parity of whatever the data shards hold is computed by rebuilds */
+    memset(ones, 0xff, sizeof(ones));
+    for (i = h->k; !rv && i < h->n; i++) {
+        for (off = 0; !rv && off < nbytes; off += len) {
+            len = nbytes - off < sizeof(ones) ? nbytes - off : sizeof(ones);
+            rv = storage_pio(fd, ones, len, ec_hdrsize() + i * nbytes + off, 1);
+        }
+    }
+    close(fd);
+    if (rv)
+        return -1;
+
+    if (!st->capacity && truncate(st->fpath, st->metadata->data_offset))
+        return -1;
+    st->metadata->features |= STORAGE_F_EC;
+    return msync(st->metadata, sizeof(storage_metadata_t), MS_SYNC);
+}
+
+/* erasure coding state for a new worker, with a descriptor of its own so
+ * that its stripe locks conflict with the ones of other workers */
+struct sd_ec *ec_open(storage_t *st)
+{
+    char path[1024 + 8];
+    struct sd_ec *ec;
+    struct stat sb;
+    unsigned long nbytes;
+    unsigned char *p;
+    int i;
+
+    if (!(ec = calloc(1, sizeof(*ec))))
+        return NULL;
+    for (i = 0; i < EC_MAXSHARDS; i++)
+        ec->sockfd[i] = -1;
+    storage_sidecar(st, ".ec", path);
+    if ((ec->lockfd = open(path, O_RDWR)) == -1 || fstat(ec->lockfd, &sb))
+        goto err;
+    ec->size = sb.st_size;
+    p = mmap(NULL, ec->size, PROT_READ | PROT_WRITE, MAP_SHARED, ec->lockfd, 0);
+    if (p == MAP_FAILED)
+        goto err;
+    ec->hdr = (struct ec_header *)p;
+    nbytes = (ec->hdr->nregions + 7) / 8;
+    if (strncmp(ec->hdr->token, EC_TOKEN, sizeof(ec->hdr->token)) ||
+        ec->hdr->version != EC_VERSION || ec->size < ec_filesize(ec->hdr) ||
+        rs_init(&ec->rs, ec->hdr->k, ec->hdr->n - ec->hdr->k)) {
+        errno = EINVAL;
+        goto err;
+    }
+    for (i = 0; i < ec->hdr->n; i++)
+        ec->bits[i] = p + ec_hdrsize() + i * nbytes;
+    ec->intent = (unsigned int *)(p + ec_hdrsize() + ec->hdr->n * nbytes);
+
+    /* a whole transfer, plus the partial stripes at its ends, or a region */
+    ec->maxstripes = RBD_MAX_TRANSFER / ((unsigned long)ec->hdr->k * EC_BLOCK) + 2;
+    if (ec->maxstripes < EC_REGION / EC_BLOCK)
+        ec->maxstripes = EC_REGION / EC_BLOCK;
+    for (i = 0; i < ec->hdr->n; i++)
+        if (!(ec->buf[i] = malloc(ec->maxstripes * EC_BLOCK)))
+            goto err;
+    return ec;
+
+err:
+    ec_close(ec);
+    return NULL;
+}
+
+void ec_close(struct sd_ec *ec)
+{
+    int i;
+
+    if (!ec)
+        return;
+    for (i = 0; i < EC_MAXSHARDS; i++) {
+        if (ec->sockfd[i] != -1)
+            close(ec->sockfd[i]);
+        free(ec->buf[i]);
+    }
+    if (ec->hdr)
+        munmap(ec->hdr, ec->size);
+    if (ec->lockfd != -1)
+        close(ec->lockfd);
+    free(ec);
+}
+
+static int ec_lock(struct sd_ec *ec, unsigned long first, unsigned long n, int type)
+{
+    struct flock fl;
+
+    memset(&fl, 0, sizeof(fl));
+    fl.l_type = type;
+    fl.l_whence = SEEK_SET;
+    fl.l_start = EC_LOCKBASE + first;
+    fl.l_len = n;
+    while (fcntl(ec->lockfd, F_OFD_SETLKW, &fl) == -1)
+        if (errno != EINTR)
+            return -1;
+    return 0;
+}
+
+static void ec_unlock(struct sd_ec *ec, unsigned long first, unsigned long n)
+{
+    ec_lock(ec, first, n, F_UNLCK);
+}
+
+/* mark the regions of stripes [s, s + ns) dirty on shard i */
+static void ec_mark(struct sd_ec *ec, int i, unsigned long s, unsigned long ns)
+{
+    unsigned long n, last;
+
+    last = ((s + ns) * EC_BLOCK - 1) / EC_REGION;
+    if (last >= ec->hdr->nregions)
+        last = ec->hdr->nregions - 1;
+    for (n = s * EC_BLOCK / EC_REGION; n <= last; n++)
+        __sync_fetch_and_or(&ec->bits[i][n / 8], 1 << (n % 8));
+}
+
+/* sync len bytes at p of the mapping of FILE.ec */
+static int ec_sync(struct sd_ec *ec, void *p, unsigned long len)
+{
+    unsigned long page = (unsigned long)p & ~((unsigned long)getpagesize() - 1);
+
+    return msync((void *)page, len + (unsigned long)p - page, MS_SYNC);
+}
+
+/* count a write to stripes [s, s + ns) in flight on the regions they are
+ * in, or no longer (delta -1). it is synced before the write is sent */
+static int ec_intent(struct sd_ec *ec, unsigned long s, unsigned long ns, int delta)
+{
+    unsigned long n, first = s * EC_BLOCK / EC_REGION, last = ((s + ns) * EC_BLOCK - 1) / EC_REGION;
+
+    if (last >= ec->hdr->nregions)
+        last = ec->hdr->nregions - 1;
+    for (n = first; n <= last; n++)
+        __sync_fetch_and_add(&ec->intent[n], delta);
+    return delta > 0 ? ec_sync(ec, &ec->intent[first], (last - first + 1) * sizeof(unsigned int)) : 0;
+}
+
+/* regions with writes in flight when the SD stopped may have stripes 
+ * whose parity does not match their data. they are marked dirty on the
+ * parity shards, which go down until they are rebuilt. to be called 
+ * before any worker starts. returns the regions found */
+long ec_recover(struct sd_ec *ec)
+{
+    unsigned long n, found = 0;
+    int i;
+
+    for (n = 0; n < ec->hdr->nregions; n++) {
+        if (!ec->intent[n])
+            continue;
+        for (i = ec->rs.k; i < ec->hdr->n; i++)
+            ec->bits[i][n / 8] |= 1 << (n % 8);
+        ec->intent[n] = 0;
+        found++;
+    }
+    if (!found)
+        return 0;
+    for (i = ec->rs.k; i < ec->hdr->n; i++)
+        ec->hdr->shard[i].state = EC_DOWN;
+    if (ec_sync(ec, ec->hdr, ec->size))
+        return -1;
+    return found;
+}
+
+static void ec_degrade(struct sd_ec *ec, int i)
+{
+    if (ec->sockfd[i] != -1)
+        close(ec->sockfd[i]);
+    ec->sockfd[i] = -1;
+    if (__sync_bool_compare_and_swap(&ec->hdr->shard[i].state, EC_UP, EC_DOWN))
+        fprintf(stderr, "SD: shard %s:%d | down\n", ec->hdr->shard[i].host, ec->hdr->shard[i].port);
+}
+
+/* whether shard i is up, connecting to it if needed */
+static int ec_usable(struct sd_ec *ec, int i)
+{
+    struct ec_shard *sh = &ec->hdr->shard[i];
+
+    if (sh->state != EC_UP)
+        return 0;
+    if (ec->sockfd[i] != -1 && ec->gen[i] != sh->gen) {
+        close(ec->sockfd[i]);            /* from before it was down */
+        ec->sockfd[i] = -1;
+    }
+    if (ec->sockfd[i] == -1) {
+        ec->gen[i] = sh->gen;
+        if ((ec->sockfd[i] = ec_connect(ec->hdr, i)) == -1) {
+            ec_degrade(ec, i);
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/* send a read of len bytes at stripe s to shard i. its reply is expected
+ * with id ids[i] */
+static int ec_ask(struct sd_ec *ec, int i, unsigned long s, unsigned long len, unsigned int *ids)
+{
+    if (!ec_usable(ec, i))
+        return -1;
+    ids[i] = ++ec->msgid;
+    if (ec_request(ec->sockfd[i], ids[i], CMD_READ, NULL, s * EC_BLOCK, len)) {
+        ec_degrade(ec, i);
+        return -1;
+    }
+    return 0;
+}
+
+static long ec_ms(struct timespec *t)
+{
+    return t->tv_sec * 1000 + t->tv_nsec / 1000000;
+}
+
+/* receive the replies of the asked shards into their buffers, until the
+ * wanted shards or any k of them are in, or timeout ms passed (-1 to
+ * wait for ever) */
+static void ec_wait(struct sd_ec *ec, unsigned char **shards, unsigned long len, unsigned int *ids,
+                    unsigned int want, unsigned int *asked, unsigned int *have, unsigned int *failed,
+                    int timeout)
+{
+    struct pollfd pfd[EC_MAXSHARDS];
+    int who[EC_MAXSHARDS];
+    struct timespec now;
+    long deadline = 0;
+    int i, n, rv, left = timeout;
+
+    if (timeout >= 0) {
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        deadline = ec_ms(&now) + timeout;
+    }
+    while (*asked && (want & ~*have) && __builtin_popcount(*have) < ec->rs.k) {
+        for (n = 0, i = 0; i < ec->hdr->n; i++)
+            if (*asked & (1 << i)) {
+                pfd[n].fd = ec->sockfd[i];
+                pfd[n].events = POLLIN;
+                who[n++] = i;
+            }
+        if (timeout >= 0) {
+            clock_gettime(CLOCK_MONOTONIC, &now);
+            if ((left = deadline - ec_ms(&now)) < 0)
+                left = 0;
+        }
+        rv = poll(pfd, n, left);
+        if (rv < 0 && errno == EINTR)
+            continue;
+        if (rv <= 0)
+            return;
+        for (n--; n >= 0; n--) {
+            if (!pfd[n].revents)
+                continue;
+            i = who[n];
+            if ((rv = ec_reply(ec->sockfd[i], ids[i], shards[i], len)) == 1)
+                continue;
+            *asked &= ~(1 << i);
+            if (!rv)
+                *have |= 1 << i;
+            else {
+                ec_degrade(ec, i);
+                *failed |= 1 << i;
+            }
+        }
+    }
+}
+
+/*
+ * read stripes [s, s + ns) of the shards in want, into the buffers from
+ * stripe at on. shards that are down, fail, or do not answer within
+ * EC_SLOW_MS are rebuilt from k others, asked for the same stripes
+ */
+static int ec_fetch(struct sd_ec *ec, unsigned long s, unsigned long ns, unsigned int want, unsigned long at)
+{
+    unsigned char *shards[EC_MAXSHARDS];
+    unsigned int ids[EC_MAXSHARDS];
+    unsigned int asked = 0, have = 0, failed = 0, slow;
+    unsigned long len = ns * EC_BLOCK;
+    int i, need;
+
+    for (i = 0; i < ec->hdr->n; i++) {
+        shards[i] = ec->buf[i] + at * EC_BLOCK;
+        if (!(want & (1 << i)))
+            continue;
+        if (ec_ask(ec, i, s, len, ids))
+            failed |= 1 << i;
+        else
+            asked |= 1 << i;
+    }
+    ec_wait(ec, shards, len, ids, want, &asked, &have, &failed, EC_SLOW_MS);
+    slow = asked;
+
+    while ((want & ~have) && __builtin_popcount(have) < ec->rs.k) {
+        /* ask as many other shards as still needed, data ones first. the
+         * slow ones may still answer, but are not counted on */
+        need = ec->rs.k - __builtin_popcount(have) - __builtin_popcount(asked & ~slow);
+        for (i = 0; need > 0 && i < ec->hdr->n; i++) {
+            if ((asked | have | failed) & (1 << i))
+                continue;
+            if (ec_ask(ec, i, s, len, ids))
+                failed |= 1 << i;
+            else {
+                asked |= 1 << i;
+                need--;
+            }
+        }
+        if (!asked) {
+            fprintf(stderr, "SD: stripes %lu-%lu | only %d shards available\n",
+                    s, s + ns - 1, __builtin_popcount(have));
+            errno = EIO;
+            return -1;
+        }
+        ec_wait(ec, shards, len, ids, want, &asked, &have, &failed, -1);
+    }
+
+    if ((want & ~have) && rs_reconstruct(&ec->rs, shards, have, want & ~have, len)) {
+        errno = EIO;
+        return -1;
+    }
+    return 0;
+}
+
+/* copy size bytes at offset of the volume between buf and the shard
+ * buffers, holding stripes from s on */
+static void ec_copy(struct sd_ec *ec, char *buf, unsigned long offset, unsigned long size,
+                    unsigned long s, int write)
+{
+    unsigned long blk, off, len;
+    unsigned char *p;
+
+    for (; size; size -= len, offset += len, buf += len) {
+        blk = offset / EC_BLOCK;
+        off = offset % EC_BLOCK;
+        len = EC_BLOCK - off < size ? EC_BLOCK - off : size;
+        p = ec->buf[blk % ec->rs.k] + (blk / ec->rs.k - s) * EC_BLOCK + off;
+        if (write)
+            memcpy(p, buf, len);
+        else
+            memcpy(buf, p, len);
+    }
+}
+
+static int ec_read(struct sd_ec *ec, char *buf, unsigned long offset, unsigned long size)
+{
+    unsigned long sbytes = (unsigned long)ec->rs.k * EC_BLOCK;
+    unsigned long s = offset / sbytes, ns = (offset + size - 1) / sbytes - s + 1;
+    unsigned long blk, first = offset / EC_BLOCK, last = (offset + size - 1) / EC_BLOCK;
+    unsigned int want = 0;
+    int rv;
+
+    for (blk = first; blk <= last && blk - first < ec->rs.k; blk++)
+        want |= 1 << (blk % ec->rs.k);
+    if (ec_lock(ec, s, ns, F_RDLCK))
+        return -1;
+    if (!(rv = ec_fetch(ec, s, ns, want, 0)))
+        ec_copy(ec, buf, offset, size, s, 0);
+    ec_unlock(ec, s, ns);
+    return rv;
+}
+
+static int ec_write(struct sd_ec *ec, char *buf, unsigned long offset, unsigned long size)
+{
+    unsigned long sbytes = (unsigned long)ec->rs.k * EC_BLOCK;
+    unsigned long s = offset / sbytes, ns = (offset + size - 1) / sbytes - s + 1;
+    unsigned int data = (1 << ec->rs.k) - 1;
+    unsigned char *shards[EC_MAXSHARDS];
+    unsigned int ids[EC_MAXSHARDS];
+    int sent[EC_MAXSHARDS];
+    int i, rv = 0, copies = 0, missed = 0;
+
+    if (ec_lock(ec, s, ns, F_WRLCK))
+        return -1;
+
+    /* partial stripes at the ends */
+    if (offset % sbytes)
+        rv = ec_fetch(ec, s, 1, data, 0);
+    if (!rv && (offset + size) % sbytes && (ns > 1 || !(offset % sbytes)))
+        rv = ec_fetch(ec, s + ns - 1, 1, data, ns - 1);
+    if (rv) {
+        ec_unlock(ec, s, ns);
+        return -1;
+    }
+
+    ec_copy(ec, buf, offset, size, s, 1);
+    for (i = 0; i < ec->hdr->n; i++)
+        shards[i] = ec->buf[i];
+    rs_encode(&ec->rs, shards, ns * EC_BLOCK);
+    if (ec_intent(ec, s, ns, 1)) {
+        ec_unlock(ec, s, ns);
+        return -1;
+    }
+
+    for (i = 0; i < ec->hdr->n; i++) {
+        sent[i] = 0;
+        if (ec_usable(ec, i)) {
+            ids[i] = ++ec->msgid;
+            if (!ec_request(ec->sockfd[i], ids[i], CMD_WRITE, shards[i], s * EC_BLOCK, ns * EC_BLOCK))
+                sent[i] = 1;
+            else
+                ec_degrade(ec, i);
+        }
+        if (!sent[i]) {
+            ec_mark(ec, i, s, ns);
+            missed++;
+        }
+    }
+    for (i = 0; i < ec->hdr->n; i++) {
+        if (!sent[i])
+            continue;
+        while ((rv = ec_reply(ec->sockfd[i], ids[i], NULL, 0)) == 1)
+            ;
+        if (rv) {
+            ec_degrade(ec, i);
+            ec_mark(ec, i, s, ns);
+            missed++;
+        } else
+            copies++;
+    }
+    /* the shards that missed it must be known to be dirty before the 
+     * write stops counting as in flight */
+    if (missed)
+        ec_sync(ec, ec->hdr, ec_hdrsize() + ec->hdr->n * ((ec->hdr->nregions + 7) / 8));
+    ec_intent(ec, s, ns, -1);
+    ec_unlock(ec, s, ns);
+
+    if (copies < ec->rs.k) {
+        fprintf(stderr, "SD: write at %lu | %d shards written, %d needed\n", offset, copies, ec->rs.k);
+        errno = EIO;
+        return -1;
+    }
+    return 0;
+}
+
+/* transfer size bytes at offset of an erasure coded volume, in pieces
+ * that fit in the shard buffers */
+int ec_io(storage_t *st, char *buf, unsigned long offset, unsigned long size, int write)
+{
+    struct sd_ec *ec = st->ec;
+    unsigned long max = (ec->maxstripes - 1) * ec->rs.k * EC_BLOCK;
+    unsigned long len;
+    int rv = 0;
+
+    for (; !rv && size; size -= len, offset += len, buf += len) {
+        len = size < max ? size : max;
+        rv = write ? ec_write(ec, buf, offset, len) : ec_read(ec, buf, offset, len);
+    }
+    return rv;
+}
+
+/* dirty regions of shard i */
+static unsigned long ec_dirty(struct sd_ec *ec, int i)
+{
+    unsigned long n, dirty = 0;
+
+    for (n = 0; n < ec->hdr->nregions; n++)
+        dirty += (ec->bits[i][n / 8] >> (n % 8)) & 1;
+    return dirty;
+}
+
+/* recompute the dirty regions of shard i and write them. returns the
+ * regions still dirty, or -1 if it failed */
+static long ec_rebuild(storage_t *st, struct sd_ec *ec, int i)
+{
+    unsigned long stripes = (st->metadata->size + ec->rs.k * EC_BLOCK - 1) / (ec->rs.k * EC_BLOCK);
+    unsigned long n, s, ns;
+    unsigned char *shards[EC_MAXSHARDS];
+    int j, rv;
+
+    for (j = 0; j < ec->hdr->n; j++)
+        shards[j] = ec->buf[j];
+    for (n = 0; n < ec->hdr->nregions; n++) {
+        if (!(ec->bits[i][n / 8] & (1 << (n % 8))))
+            continue;
+        s = n * (EC_REGION / EC_BLOCK);
+        ns = stripes - s < EC_REGION / EC_BLOCK ? stripes - s : EC_REGION / EC_BLOCK;
+        if (ec_lock(ec, s, ns, F_WRLCK))
+            return -1;
+        __sync_fetch_and_and(&ec->bits[i][n / 8], ~(1 << (n % 8)));
+        /* shard i is down, so a data shard gets rebuilt by the fetch */
+        rv = ec_fetch(ec, s, ns, (1 << ec->rs.k) - 1, 0);
+        if (!rv && i >= ec->rs.k)
+            rs_encode(&ec->rs, shards, ns * EC_BLOCK);
+        if (!rv) {
+            rv = ec_request(ec->sockfd[i], ++ec->msgid, CMD_WRITE, shards[i], s * EC_BLOCK, ns * EC_BLOCK);
+            while (!rv && (rv = ec_reply(ec->sockfd[i], ec->msgid, NULL, 0)) == 1)
+                ;
+        }
+        if (rv)
+            ec_mark(ec, i, s, ns);
+        ec_unlock(ec, s, ns);
+        if (rv)
+            return -1;
+        ec->hdr->shard[i].rebuilt++;
+    }
+    return ec_dirty(ec, i);
+}
+
+/* rebuild process of shard i: brings it back up whenever it is down or
+ * has dirty regions. never returns */
+void ec_rebuild_run(storage_t *sd_st, int i)
+{
+    struct ec_shard *sh;
+    struct sd_ec *ec;
+    storage_t st;
+    long dirty;
+
+    prctl(PR_SET_PDEATHSIG, SIGTERM);
+    storage_dup(&st, sd_st);
+    if (storage_open(&st)) {
+        perror("SD: shard rebuild");
+        exit(1);
+    }
+    ec = st.ec;
+    sh = &ec->hdr->shard[i];
+
+    while (1) {
+        sleep(EC_POLL);
+        if (sh->state == EC_UP && !ec_dirty(ec, i))
+            continue;
+        if (ec->sockfd[i] == -1) {
+            if ((ec->sockfd[i] = ec_connect(ec->hdr, i)) == -1) {
+                sleep(EC_RETRY);
+                continue;
+            }
+        }
+        if ((dirty = ec_rebuild(&st, ec, i)) == -1) {
+            close(ec->sockfd[i]);
+            ec->sockfd[i] = -1;
+            continue;
+        }
+        if (!dirty && sh->state == EC_DOWN) {
+            sh->gen++;
+            __sync_synchronize();
+            sh->state = EC_UP;
+            printf("SD: shard %s:%d | up | %lu regions rebuilt\n", sh->host, sh->port, sh->rebuilt);
+            fflush(stdout);
+        }
+    }
+}
+
+void ec_stats(storage_t *st, FILE *f)
+{
+    struct sd_ec *ec;
+    int i;
+
+    if (!(st->metadata->features & STORAGE_F_EC) || !(ec = ec_open(st)))
+        return;
+    fprintf(f, "SD: erasure coded | %d data shards | %d parity shards | %lu regions\n",
+            ec->rs.k, ec->rs.m, ec->hdr->nregions);
+    for (i = 0; i < ec->hdr->n; i++)
+        fprintf(f, "SD: shard %d | %s:%d | %s | dirty %lu | rebuilt %lu\n", i,
+                ec->hdr->shard[i].host, ec->hdr->shard[i].port,
+                ec->hdr->shard[i].state == EC_UP ? "up" : "down",
+                ec_dirty(ec, i), ec->hdr->shard[i].rebuilt);
+    ec_close(ec);
+}
@@ -8,39 +8,266 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
+#include <errno.h>
+#include <string.h>
 
 #include "sd.h"
 
 storage_t sd_storage;
 
 void usage(void) {
-    printf("Usage: sdfile -s SIZE FILE\n\n");
-    printf("SIZE - block device capacity (in megabytes)\n");
-    printf("FILE - storage device filename\n");
+    printf("Usage: sdfile [-s SIZE] [-m META] [-p | -z] [-c] [-B] [-Z | -D POOL [-C SRC]] [-r] [-i] FILE\n");
+    printf("       sdfile [-s SIZE] [-m META] [-c] [-B] [-k DATA] -E HOST:PORT... FILE\n");
+    printf("       sdfile [-s SIZE] [-m META] [-p | -z] [-c] [-B] -T FAST [-f FSIZE] [-M RATE] FILE\n");
+    printf("       sdfile -P -s SIZE POOL\n\n");
+    printf("SIZE - block device capacity. accepts K, M, G and T suffixes and\n");
+    printf("       defaults to megabytes. defaults to the whole device when FILE\n");
+    printf("       is a block device\n");
+    printf("META - keep the metadata in this sidecar file instead of the head\n");
+    printf("       of FILE\n");
+    printf("-p   - preallocate the data blocks (fallocate)\n");
+    printf("-z   - fill the data blocks with zeros\n");
+    printf("-c   - keep a CRC32C of every block in FILE.crc (or META.crc) to\n");
+    printf("       detect corrupted data on reads\n");
+    printf("-B   - keep the epoch every block was last written in, in FILE.cbt\n");
+    printf("       (or META.cbt), to export only the changes with sddelta\n");
+    printf("-Z   - store the data in compressed chunks, indexed in FILE.zix\n");
+    printf("       (or META.zix). the space is allocated as chunks are written\n");
+    printf("POOL - keep the data deduplicated in this block pool, shared with\n");
+    printf("       the other volumes created on it. its blocks are mapped in\n");
+    printf("       FILE.dmap (or META.dmap)\n");
+    printf("SRC  - start as a clone of SRC, a volume on the same POOL, sharing\n");
+    printf("       all its blocks. SIZE defaults to the size of SRC\n");
+    printf("-P   - create a block pool for SIZE bytes of distinct data\n");
+    printf("HOST:PORT - keep the data erasure coded across these SDs, up to %d,\n", EC_MAXSHARDS);
+    printf("       as listed in FILE.ec (or META.ec). SIZE defaults to all they\n");
+    printf("       can hold. HOST is an IPv4 address\n");
+    printf("DATA - how many of them keep data, the rest keep parity. defaults\n");
+    printf("       to all but one\n");
+    printf("FAST - keep the hottest extents of FILE in this faster file or block\n");
+    printf("       device, mapped in FILE.tier (or META.tier)\n");
+    printf("FSIZE - fast tier capacity. defaults to the whole device when FAST\n");
+    printf("       is a block device\n");
+    printf("RATE - MB/s of extents moved between tiers at most. defaults to %d\n", TIER_RATE);
+    printf("-r   - resize (grow) an existing FILE to SIZE. running storage\n");
+    printf("       daemons notify their clients of the new size\n");
+    printf("-i   - show the size, features and space used by an existing FILE\n");
+    printf("FILE - storage device filename or block device\n");
     exit(2);
 }
 
+/* parse a size with an optional K, M, G or T suffix (megabytes if none) */
+unsigned long parse_size(const char *str)
+{
+    unsigned long long size;
+    char *end;
+
+    errno = 0;
+    size = strtoull(str, &end, 10);
+    if (errno || end == str)
+        usage();
+    switch (*end) {
+        case 'T': case 't':
+            size *= 1024;
+        case 'G': case 'g':
+            size *= 1024;
+        case 'M': case 'm': case '\0':
+            size *= 1024;
+        case 'K': case 'k':
+            size *= 1024;
+            break;
+        default:
+            usage();
+    }
+    return size;
+}
+
 int main(int argc, char **argv)
 {
-    long size;
-    char fn[1024];
+    unsigned long size = 0;
+    char *mpath = NULL;
+    char *pool = NULL;
+    char *clone = NULL;
+    storage_t src;
+    int mode = STORAGE_SPARSE;
+    int resize = 0;
+    int info = 0;
+    int crc = 0;
+    int cbt = 0;
+    int zip = 0;
+    int mkpool = 0;
+    char *fast = NULL;
+    unsigned long fsize = 0;
+    unsigned int rate = 0;
+    struct ec_header ec;
+    unsigned long capacity;
     int c;
 
-    while ((c = getopt(argc, argv, "s:")) != -1) 
+    memset(&ec, 0, sizeof(ec));
+    while ((c = getopt(argc, argv, "s:m:pzcBZD:C:PriE:k:T:f:M:")) != -1) 
         switch (c) {
+            case 'E':
+                if (ec_parse(&ec, optarg)) {
+                    fprintf(stderr, "Bad shard %s (at most %d, as IP:PORT)\n", optarg, EC_MAXSHARDS);
+                    return 2;
+                }
+                break;
+            case 'k':
+                ec.k = atoi(optarg);
+                break;
+            case 'T':
+                fast = optarg;
+                break;
+            case 'f':
+                fsize = parse_size(optarg);
+                break;
+            case 'M':
+                rate = atoi(optarg);
+                break;
+            case 'c':
+                crc = 1;
+                break;
+            case 'B':
+                cbt = 1;
+                break;
+            case 'Z':
+                zip = 1;
+                break;
+            case 'i':
+                info = 1;
+                break;
+            case 'D':
+                pool = optarg;
+                break;
+            case 'C':
+                clone = optarg;
+                break;
+            case 'P':
+                mkpool = 1;
+                break;
             case 's':
-                size = 1024*1024*atoi(optarg);
+                size = parse_size(optarg);
+                break;
+            case 'm':
+                mpath = optarg;
+                break;
+            case 'p':
+                mode = STORAGE_PREALLOC;
+                break;
+            case 'z':
+                mode = STORAGE_ZEROFILL;
+                break;
+            case 'r':
+                resize = 1;
                 break;
             default:
                 return 2;
         }
 
-    if (argc == optind) 
+    if (argc == optind || (zip && pool) || (clone && !pool) || (ec.n && (zip || pool)) ||
+        (fast && (zip || pool || ec.n))) 
         usage();
 
-    if (storage_init(&sd_storage, argv[optind], size))
-        perror("Unable to create SD File\n");
-    else
-        printf("SD File created succesfully: %s\n", argv[optind]);
+    if (mkpool) {
+        if (!size)
+            usage();
+        if (pool_create(argv[optind], size)) {
+            perror("Unable to create block pool");
+            return 1;
+        }
+        printf("Block pool created succesfully: %s\n", argv[optind]);
+        return 0;
+    }
+
+    if (info) {
+        if (storage_load(&sd_storage, argv[optind], mpath)) {
+            perror("Unable to load SD File");
+            return 1;
+        }
+        printf("%s: %lu bytes | features %x\n", argv[optind], 
+               sd_storage.metadata->size, sd_storage.metadata->features);
+        storage_zip_stats(&sd_storage, stdout);
+        if (!storage_open(&sd_storage) && sd_storage.pool)
+            pool_stats(sd_storage.pool, stdout);
+        ec_stats(&sd_storage, stdout);
+        tier_stats(&sd_storage, stdout);
+        cbt_stats(&sd_storage, stdout);
+        storage_free(&sd_storage);
+        return 0;
+    }
+
+    if (resize) {
+        if (!size)
+            usage();
+        if (storage_load(&sd_storage, argv[optind], mpath)) {
+            perror("Unable to load SD File");
+            return 1;
+        }
+        if (storage_resize(&sd_storage, size, mode)) {
+            perror("Unable to resize SD File");
+            return 1;
+        }
+        printf("SD File resized succesfully: %s (%lu bytes)\n", argv[optind], size);
+        storage_free(&sd_storage);
+        return 0;
+    }
+
+    if (clone && storage_load(&src, clone, NULL)) {
+        perror("Unable to load clone source");
+        return 1;
+    }
+    if (clone && !size)
+        size = src.metadata->size;
+
+    if (ec.n) {
+        if (!ec.k)
+            ec.k = ec.n > 1 ? ec.n - 1 : 1;
+        if (ec.k < 1 || ec.k > ec.n)
+            usage();
+        if (ec_capacity(&ec, &capacity)) {
+            perror("Unable to get the size of the shards");
+            return 1;
+        }
+        if (!size)
+            size = capacity;
+        if (size > capacity) {
+            fprintf(stderr, "The shards can hold %lu bytes at most\n", capacity);
+            return 1;
+        }
+    }
+
+    if (storage_init(&sd_storage, argv[optind], mpath, size, mode)) {
+        perror("Unable to create SD File");
+        return 1;
+    }
+    if ((crc || cbt || zip || pool || ec.n || fast) && storage_load(&sd_storage, argv[optind], mpath)) {
+        perror("Unable to load SD File");
+        return 1;
+    }
+    if (crc && storage_crc_create(&sd_storage)) {
+        perror("Unable to create SD checksums File");
+        return 1;
+    }
+    if (cbt && storage_cbt_create(&sd_storage, clone != NULL)) {
+        perror("Unable to create SD changed block map");
+        return 1;
+    }
+    if (zip && storage_zip_create(&sd_storage)) {
+        perror("Unable to create SD chunk index");
+        return 1;
+    }
+    if (pool && storage_dedup_create(&sd_storage, pool, clone ? &src : NULL)) {
+        perror("Unable to create SD block map");
+        return 1;
+    }
+    if (ec.n && storage_ec_create(&sd_storage, &ec)) {
+        perror("Unable to create SD shard list");
+        return 1;
+    }
+    if (fast && storage_tier_create(&sd_storage, fast, fsize, rate)) {
+        perror("Unable to create SD fast tier");
+        return 1;
+    }
+    printf("SD File created succesfully: %s\n", argv[optind]);
     return 0;
 }
@@ -0,0 +1,267 @@
+/*
+ * Remote Block Device - Reed-Solomon erasure coding
+ *
+ * Arithmetic in GF(2^8), modulo x^8 + x^4 + x^3 + x^2 + 1. The k data
+ * shards are kept as they are and parity shard i is the sum of the data
+ * shards multiplied by row i of a Cauchy matrix. Every square submatrix
+ * of a Cauchy matrix can be inverted, so any k of the k + m shards are
+ * enough to solve for the data, and from it for any other shard.
+ *
+ * Multiplying a buffer by a constant is the hot loop. With SSSE3 or AVX2
+ * it takes 16 or 32 bytes at a time, looking up the products of their low
+ * and high nibbles in two 16 entries tables with pshufb; the plain C
+ * version looks bytes up in the row of the constant in a product table.
+ */
+
+#include <stddef.h>
+#include <string.h>
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+#include "sd.h"
+
+#define GF_POLY 0x11d
+#define RS_SLICE 8192                  /* bytes of every shard worked on at a 
+                                        * time, so that they stay in cache */
+
+static unsigned char gf_exp[512];
+static unsigned char gf_log[256];
+static unsigned char gf_mul_table[256][256];
+static int gf_ready;
+
+static void (*gf_impl)(unsigned char *, const unsigned char *, unsigned char, size_t);
+
+static void gf_init(void)
+{
+    int i, j, x = 1;
+
+    if (gf_ready)
+        return;
+    for (i = 0; i < 255; i++) {
+        gf_exp[i] = gf_exp[i + 255] = x;
+        gf_log[x] = i;
+        x <<= 1;
+        if (x & 0x100)
+            x ^= GF_POLY;
+    }
+    for (i = 1; i < 256; i++)
+        for (j = 1; j < 256; j++)
+            gf_mul_table[i][j] = gf_exp[gf_log[i] + gf_log[j]];
+    gf_ready = 1;
+}
+
+static unsigned char gf_mul(unsigned char a, unsigned char b)
+{
+    return gf_mul_table[a][b];
+}
+
+static unsigned char gf_inv(unsigned char a)
+{
+    return gf_exp[255 - gf_log[a]];
+}
+
+/* dst ^= c * src, one byte at a time */
+static void gf_mul_add_sw(unsigned char *dst, const unsigned char *src, unsigned char c, size_t len)
+{
+    const unsigned char *row = gf_mul_table[c];
+
+    for (; len; len--)
+        *dst++ ^= row[*src++];
+}
+
+#if defined(__x86_64__)
+/* products of c with every low and every high nibble */
+static void gf_nibbles(unsigned char c, unsigned char *lo, unsigned char *hi)
+{
+    int x;
+
+    for (x = 0; x < 16; x++) {
+        lo[x] = gf_mul(c, x);
+        hi[x] = gf_mul(c, x << 4);
+    }
+}
+
+__attribute__((target("ssse3")))
+static void gf_mul_add_ssse3(unsigned char *dst, const unsigned char *src, unsigned char c, size_t len)
+{
+    unsigned char lo[16], hi[16];
+    __m128i tlo, thi, mask, v, p;
+
+    gf_nibbles(c, lo, hi);
+    tlo = _mm_loadu_si128((const __m128i *)lo);
+    thi = _mm_loadu_si128((const __m128i *)hi);
+    mask = _mm_set1_epi8(0x0f);
+    for (; len >= 16; len -= 16, src += 16, dst += 16) {
+        v = _mm_loadu_si128((const __m128i *)src);
+        p = _mm_xor_si128(_mm_shuffle_epi8(tlo, _mm_and_si128(v, mask)),
+                          _mm_shuffle_epi8(thi, _mm_and_si128(_mm_srli_epi64(v, 4), mask)));
+        _mm_storeu_si128((__m128i *)dst, _mm_xor_si128(_mm_loadu_si128((const __m128i *)dst), p));
+    }
+    gf_mul_add_sw(dst, src, c, len);
+}
+
+__attribute__((target("avx2")))
+static void gf_mul_add_avx2(unsigned char *dst, const unsigned char *src, unsigned char c, size_t len)
+{
+    unsigned char lo[16], hi[16];
+    __m256i tlo, thi, mask, v, p;
+
+    gf_nibbles(c, lo, hi);
+    tlo = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)lo));
+    thi = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)hi));
+    mask = _mm256_set1_epi8(0x0f);
+    for (; len >= 32; len -= 32, src += 32, dst += 32) {
+        v = _mm256_loadu_si256((const __m256i *)src);
+        p = _mm256_xor_si256(_mm256_shuffle_epi8(tlo, _mm256_and_si256(v, mask)),
+                             _mm256_shuffle_epi8(thi, _mm256_and_si256(_mm256_srli_epi64(v, 4), mask)));
+        _mm256_storeu_si256((__m256i *)dst, _mm256_xor_si256(_mm256_loadu_si256((const __m256i *)dst), p));
+    }
+    gf_mul_add_sw(dst, src, c, len);
+}
+#endif
+
+/* pick the fastest implementation for this CPU */
+static void gf_first(unsigned char *dst, const unsigned char *src, unsigned char c, size_t len)
+{
+    gf_impl = gf_mul_add_sw;
+#if defined(__x86_64__)
+    if (__builtin_cpu_supports("avx2"))
+        gf_impl = gf_mul_add_avx2;
+    else if (__builtin_cpu_supports("ssse3"))
+        gf_impl = gf_mul_add_ssse3;
+#endif
+    gf_impl(dst, src, c, len);
+}
+
+static void (*gf_impl)(unsigned char *, const unsigned char *, unsigned char, size_t) = gf_first;
+
+/* dst ^= c * src */
+static void gf_mul_add(unsigned char *dst, const unsigned char *src, unsigned char c, size_t len)
+{
+    size_t i;
+
+    if (!c)
+        return;
+    if (c == 1) {
+        for (i = 0; i < len; i++)
+            dst[i] ^= src[i];
+        return;
+    }
+    gf_impl(dst, src, c, len);
+}
+
+/* set up the code of k data and m parity shards */
+int rs_init(struct rs_code *rs, int k, int m)
+{
+    int i, j;
+
+    if (k < 1 || m < 0 || k + m > EC_MAXSHARDS)
+        return -1;
+    gf_init();
+    rs->k = k;
+    rs->m = m;
+    memset(rs->gen, 0, sizeof(rs->gen));
+    for (j = 0; j < k; j++)
+        rs->gen[j][j] = 1;
+    /* x_i = k + i and y_j = j never meet, so x_i + y_j is never 0 */
+    for (i = 0; i < m; i++)
+        for (j = 0; j < k; j++)
+            rs->gen[k + i][j] = gf_inv((k + i) ^ j);
+    return 0;
+}
+
+/* fill the m parity shards of len bytes from the k data shards */
+void rs_encode(struct rs_code *rs, unsigned char **shards, size_t len)
+{
+    size_t off, n;
+    int i, j;
+
+    for (off = 0; off < len; off += n) {
+        n = len - off < RS_SLICE ? len - off : RS_SLICE;
+        for (i = rs->k; i < rs->k + rs->m; i++) {
+            memset(shards[i] + off, 0, n);
+            for (j = 0; j < rs->k; j++)
+                gf_mul_add(shards[i] + off, shards[j] + off, rs->gen[i][j], n);
+        }
+    }
+}
+
+/* invert the n x n matrix a (destroyed) into inv. fails if singular */
+static int rs_invert(unsigned char a[EC_MAXSHARDS][EC_MAXSHARDS],
+                     unsigned char inv[EC_MAXSHARDS][EC_MAXSHARDS], int n)
+{
+    unsigned char t, c;
+    int i, j, r;
+
+    memset(inv, 0, EC_MAXSHARDS * EC_MAXSHARDS);
+    for (i = 0; i < n; i++)
+        inv[i][i] = 1;
+    for (i = 0; i < n; i++) {
+        for (r = i; r < n && !a[r][i]; r++)
+            ;
+        if (r == n)
+            return -1;
+        for (j = 0; j < n; j++) {
+            t = a[i][j]; a[i][j] = a[r][j]; a[r][j] = t;
+            t = inv[i][j]; inv[i][j] = inv[r][j]; inv[r][j] = t;
+        }
+        c = gf_inv(a[i][i]);
+        for (j = 0; j < n; j++) {
+            a[i][j] = gf_mul(a[i][j], c);
+            inv[i][j] = gf_mul(inv[i][j], c);
+        }
+        for (r = 0; r < n; r++) {
+            if (r == i || !(c = a[r][i]))
+                continue;
+            for (j = 0; j < n; j++) {
+                a[r][j] ^= gf_mul(a[i][j], c);
+                inv[r][j] ^= gf_mul(inv[i][j], c);
+            }
+        }
+    }
+    return 0;
+}
+
+/*
+ * compute the shards in the want mask from k of the shards in the have
+ * mask, all of len bytes. a wanted shard is a combination of the ones we
+ * have: its row of the code times the inverse of their rows
+ */
+int rs_reconstruct(struct rs_code *rs, unsigned char **shards, unsigned int have,
+                   unsigned int want, size_t len)
+{
+    unsigned char a[EC_MAXSHARDS][EC_MAXSHARDS], inv[EC_MAXSHARDS][EC_MAXSHARDS];
+    unsigned char coef[EC_MAXSHARDS][EC_MAXSHARDS];
+    int rows[EC_MAXSHARDS];
+    size_t off, len1;
+    int i, j, t, n = 0;
+
+    for (i = 0; i < rs->k + rs->m && n < rs->k; i++)
+        if (have & (1 << i))
+            rows[n++] = i;
+    if (n < rs->k)
+        return -1;
+    for (t = 0; t < n; t++)
+        memcpy(a[t], rs->gen[rows[t]], sizeof(a[t]));
+    if (rs_invert(a, inv, n))
+        return -1;
+
+    for (i = 0; i < rs->k + rs->m; i++)
+        for (t = 0; t < n; t++)
+            for (coef[i][t] = 0, j = 0; j < n; j++)
+                coef[i][t] ^= gf_mul(rs->gen[i][j], inv[j][t]);
+
+    for (off = 0; off < len; off += len1) {
+        len1 = len - off < RS_SLICE ? len - off : RS_SLICE;
+        for (i = 0; i < rs->k + rs->m; i++) {
+            if (!(want & (1 << i)) || (have & (1 << i)))
+                continue;
+            memset(shards[i] + off, 0, len1);
+            for (t = 0; t < n; t++)
+                gf_mul_add(shards[i] + off, shards[rows[t]] + off, coef[i][t], len1);
+        }
+    }
+    return 0;
+}
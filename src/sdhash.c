@@ -0,0 +1,115 @@
+/*
+ * Remote Block Device - block fingerprints
+ *
+ * 64 bits hash used to find duplicated blocks. Blocks are consumed in 64 
+ * bytes stripes by 8 accumulators, each one adding its own 64 bits word 
+ * multiplied (low by high 32 bits) after mixing it with a key, plus the 
+ * word of its neighbour. With AVX2 a stripe is two 256 bits operations; 
+ * the plain C version computes the very same hash.
+ */
+
+#include <stddef.h>
+#include <string.h>
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+#include "sd.h"
+
+#define FP_STRIPE 64
+#define FP_P1 0x9E3779B185EBCA87ULL
+#define FP_P2 0xC2B2AE3D27D4EB4FULL
+#define FP_P3 0x165667B19E3779F9ULL
+
+static const unsigned long long fp_key[8] = {
+    0xbe4ba423396cfeb8ULL, 0x1cad21f72c81017cULL, 0xdb979083e96dd4deULL, 0x1f67b3b7a4a44072ULL,
+    0x78e5c0cc4ee679cbULL, 0x2172ffcc7dd05a82ULL, 0x8e2443f7744608b8ULL, 0x4c263a81e69035e0ULL,
+};
+
+static void (*fp_impl)(unsigned long long *, const unsigned char *, size_t);
+
+static void fp_stripes_sw(unsigned long long *acc, const unsigned char *p, size_t n)
+{
+    unsigned long long d, k;
+    int i;
+
+    for (; n; n--, p += FP_STRIPE)
+        for (i = 0; i < 8; i++) {
+            memcpy(&d, p + 8 * i, 8);
+            k = d ^ fp_key[i];
+            acc[i ^ 1] += d;
+            acc[i] += (k & 0xffffffffULL) * (k >> 32);
+        }
+}
+
+#if defined(__x86_64__)
+__attribute__((target("avx2")))
+static void fp_stripes_avx2(unsigned long long *acc, const unsigned char *p, size_t n)
+{
+    __m256i a0, a1, k0, k1, d0, d1, x0, x1;
+
+    a0 = _mm256_loadu_si256((const __m256i *)acc);
+    a1 = _mm256_loadu_si256((const __m256i *)(acc + 4));
+    k0 = _mm256_loadu_si256((const __m256i *)fp_key);
+    k1 = _mm256_loadu_si256((const __m256i *)(fp_key + 4));
+    for (; n; n--, p += FP_STRIPE) {
+        d0 = _mm256_loadu_si256((const __m256i *)p);
+        d1 = _mm256_loadu_si256((const __m256i *)(p + 32));
+        x0 = _mm256_xor_si256(d0, k0);
+        x1 = _mm256_xor_si256(d1, k1);
+        /* neighbour words: swap the 64 bits halves of each 128 bits lane */
+        a0 = _mm256_add_epi64(a0, _mm256_shuffle_epi32(d0, _MM_SHUFFLE(1, 0, 3, 2)));
+        a1 = _mm256_add_epi64(a1, _mm256_shuffle_epi32(d1, _MM_SHUFFLE(1, 0, 3, 2)));
+        a0 = _mm256_add_epi64(a0, _mm256_mul_epu32(x0, _mm256_srli_epi64(x0, 32)));
+        a1 = _mm256_add_epi64(a1, _mm256_mul_epu32(x1, _mm256_srli_epi64(x1, 32)));
+    }
+    _mm256_storeu_si256((__m256i *)acc, a0);
+    _mm256_storeu_si256((__m256i *)(acc + 4), a1);
+}
+#endif
+
+/* pick the fastest implementation for this CPU */
+static void fp_first(unsigned long long *acc, const unsigned char *p, size_t n)
+{
+    fp_impl = fp_stripes_sw;
+#if defined(__x86_64__)
+    if (__builtin_cpu_supports("avx2"))
+        fp_impl = fp_stripes_avx2;
+#endif
+    fp_impl(acc, p, n);
+}
+
+static void (*fp_impl)(unsigned long long *, const unsigned char *, size_t) = fp_first;
+
+static unsigned long long fp_rotl(unsigned long long x, int r)
+{
+    return (x << r) | (x >> (64 - r));
+}
+
+unsigned long long sd_fingerprint(const void *buf, size_t len)
+{
+    unsigned long long acc[8] = { FP_P3, FP_P1, FP_P2, FP_P3, FP_P1, FP_P2, FP_P3, FP_P1 };
+    unsigned char tail[FP_STRIPE];
+    unsigned long long h;
+    int i;
+
+    fp_impl(acc, buf, len / FP_STRIPE);
+    if (len % FP_STRIPE) {
+        memset(tail, 0, sizeof(tail));
+        memcpy(tail, (const char *)buf + len - len % FP_STRIPE, len % FP_STRIPE);
+        fp_impl(acc, tail, 1);
+    }
+
+    h = len * FP_P1;
+    for (i = 0; i < 8; i++) {
+        h ^= fp_rotl((acc[i] ^ fp_key[i]) * FP_P2, 31) * FP_P1;
+        h = fp_rotl(h, 27) * FP_P1 + FP_P3;
+    }
+    h ^= h >> 33;
+    h *= FP_P2;
+    h ^= h >> 29;
+    h *= FP_P3;
+    h ^= h >> 32;
+    return h;
+}
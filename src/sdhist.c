@@ -0,0 +1,64 @@
+/*
+ * Remote Block Device - latency histograms
+ *
+ * Log-linear histograms, like HDR histograms: exact below 64, and in 32
+ * buckets per power of two above, so that percentiles are within 3% of
+ * the real value whatever their scale.
+ */
+
+#include "sd.h"
+
+static int hist_bucket(unsigned long long v)
+{
+    int shift;
+
+    if (v < 2 * HIST_SUB)
+        return v;
+    shift = 63 - __builtin_clzll(v) - 5;
+    return 2 * HIST_SUB + (shift - 1) * HIST_SUB + (v >> shift) - HIST_SUB;
+}
+
+/* middle of the values in bucket b */
+static unsigned long long hist_value(int b)
+{
+    int shift;
+
+    if (b < 2 * HIST_SUB)
+        return b;
+    shift = (b - 2 * HIST_SUB) / HIST_SUB + 1;
+    return ((unsigned long long)((b - 2 * HIST_SUB) % HIST_SUB + HIST_SUB) << shift) +
+           (1ULL << (shift - 1));
+}
+
+void hist_add(struct sd_hist *h, unsigned long long v)
+{
+    h->count[hist_bucket(v)]++;
+    h->n++;
+    h->sum += v;
+    if (v > h->max)
+        h->max = v;
+}
+
+void hist_merge(struct sd_hist *to, struct sd_hist *from)
+{
+    int b;
+
+    for (b = 0; b < HIST_BUCKETS; b++)
+        to->count[b] += from->count[b];
+    to->n += from->n;
+    to->sum += from->sum;
+    if (from->max > to->max)
+        to->max = from->max;
+}
+
+/* value at or below which a fraction p of the samples are */
+unsigned long long hist_percentile(struct sd_hist *h, double p)
+{
+    unsigned long long want = p * h->n, seen = 0;
+    int b;
+
+    for (b = 0; b < HIST_BUCKETS; b++)
+        if ((seen += h->count[b]) > want)
+            return hist_value(b) < h->max ? hist_value(b) : h->max;
+    return h->max;
+}
@@ -0,0 +1,53 @@
+/*
+ * Remote Block Device - SD log
+ *
+ * sd_log skips the messages above sd_log_level before formatting them.
+ * The rest are formatted into a buffer of the calling thread, written to
+ * stdout with a single write when it fills up, when a warning or an error
+ * comes, or when the thread is about to wait for a connection, so that
+ * logging every request does not cost a write per message.
+ */
+
+#include <stdarg.h>
+#include <unistd.h>
+
+#include "sd.h"
+
+int sd_log_level = SD_LOG_INFO;
+
+static __thread char log_buf[SD_LOG_BUF];
+static __thread unsigned int log_len;
+
+void sd_log_flush(void)
+{
+    unsigned int done = 0;
+    ssize_t rv;
+
+    fflush(stdout);             /* what was printed before goes first */
+    while (done < log_len) {
+        if ((rv = write(1, log_buf + done, log_len - done)) <= 0)
+            break;
+        done += rv;
+    }
+    log_len = 0;
+}
+
+void sd_log_write(int level, const char *fmt, ...)
+{
+    va_list ap;
+    int n;
+
+    if (SD_LOG_BUF - log_len < SD_LOG_LINE)
+        sd_log_flush();
+    va_start(ap, fmt);
+    n = vsnprintf(log_buf + log_len, SD_LOG_LINE, fmt, ap);
+    va_end(ap);
+    if (n >= SD_LOG_LINE) {     /* truncated */
+        n = SD_LOG_LINE - 1;
+        log_buf[log_len + n - 1] = '\n';
+    }
+    if (n > 0)
+        log_len += n;
+    if (level <= SD_LOG_WARN)
+        sd_log_flush();
+}
@@ -3,16 +3,23 @@
  *
  */
 
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <errno.h>
 #include <string.h>
+#include <fcntl.h>
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <sys/wait.h>
+#include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <linux/fs.h>
+#include <zlib.h>
 
 #include "sd.h"
 #include "proto.h"
@@ -29,170 +36,1406 @@ unsigned long storage_size_bytes(storage_t *st)
     return st->metadata->size;
 }
 
+/* read or write exactly size bytes at offset, retrying short transfers */
+int storage_pio(int fd, void *buf, unsigned long size, off_t offset, int write)
+{
+    ssize_t rv;
+
+    while (size) {
+        if (write)
+            rv = pwrite(fd, buf, size, offset);
+        else
+            rv = pread(fd, buf, size, offset);
+        if (rv < 0 && errno == EINTR)
+            continue;
+        if (rv < 0)
+            return -1;
+        if (rv == 0) {               /* reading past the end of a sparse file */
+            memset(buf, 0, size);
+            return 0;
+        }
+        buf = (char *)buf + rv;
+        size -= rv;
+        offset += rv;
+    }
+    return 0;
+}
+
+/* get the size (in bytes) and I/O alignment of the file or block device 
+ * open in fd */
+static int storage_geometry(int fd, unsigned long *size, unsigned int *align)
+{
+    struct stat sb;
+    unsigned long long bytes;
+    int bsize;
+
+    if (fstat(fd, &sb) == -1)
+        return -1;
+    if (!S_ISBLK(sb.st_mode)) {
+        *size = sb.st_size;
+        *align = STORAGE_ALIGN;
+        return 0;
+    }
+    if (ioctl(fd, BLKGETSIZE64, &bytes) == -1 || ioctl(fd, BLKSSZGET, &bsize) == -1)
+        return -1;
+    *size = bytes;
+    *align = bsize;
+    return 0;
+}
+
+static int storage_isblk(const char *path)
+{
+    struct stat sb;
+
+    return !stat(path, &sb) && S_ISBLK(sb.st_mode);
+}
+
+/* allocate the data area of fd between offsets from and to (in bytes)
+ * according to mode (STORAGE_SPARSE, STORAGE_PREALLOC or STORAGE_ZEROFILL).
+ * block devices need no allocation */
+static int storage_provision(int fd, int blk, off_t from, off_t to, int mode)
+{
+    char *zeros;
+    unsigned long len;
+    int rv = 0;
+
+    if (blk || to <= from)
+        return 0;
+
+    switch (mode) {
+        case STORAGE_PREALLOC:
+            if (!fallocate(fd, 0, from, to - from))
+                return 0;
+            if (errno != EOPNOTSUPP)
+                return -1;
+            /* filesystem without fallocate: fall back to writing zeros */
+        case STORAGE_ZEROFILL:
+            if (!(zeros = calloc(1, RBD_MAX_TRANSFER)))
+                return -1;
+            for (; !rv && from < to; from += len) {
+                len = to - from < RBD_MAX_TRANSFER ? to - from : RBD_MAX_TRANSFER;
+                rv = storage_pio(fd, zeros, len, from, 1);
+            }
+            free(zeros);
+            return rv;
+        default:
+            return ftruncate(fd, to);
+    }
+}
+
 /* initialize storage file
  *
- * size: size in bytes
- * path: file path
+ * size:  size in bytes. 0 means the whole block device
+ * path:  file or block device path
+ * mpath: metadata (sidecar) file path. if NULL the metadata is written at
+ *        the head of path
+ * mode:  provisioning mode for the data area (STORAGE_SPARSE, 
+ *        STORAGE_PREALLOC or STORAGE_ZEROFILL)
  */
-int storage_init(storage_t *st, const char *path, unsigned long size)
+int storage_init(storage_t *st, const char *path, const char *mpath, unsigned long size, int mode)
 {
     storage_metadata_t *stmd;
+    unsigned long devsize;
+    unsigned int align;
+    int fd, mfd, blk;
 
     strcpy(st->fpath, path);
-    st->file = fopen(path, "w+");
-    if (!st->file) return -1;
+    blk = storage_isblk(path);
+    fd = open(path, blk ? O_RDWR : O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd == -1) return -1;
 
-    stmd = malloc(sizeof(storage_metadata_t));
+    stmd = calloc(1, sizeof(storage_metadata_t));
     strcpy(stmd->token, STORAGE_TOKEN);
     stmd->version = STORAGE_VERSION;
-    stmd->data_offset = STORAGE_OFFSET;
+    stmd->data_offset = mpath ? 0 : STORAGE_OFFSET;
     stmd->size = size;
 
-    st->metadata = stmd;
-    st->file = st->file;
+    if (blk) {
+        if (storage_geometry(fd, &devsize, &align) || devsize <= stmd->data_offset)
+            goto err;
+        if (!size)
+            stmd->size = devsize - stmd->data_offset;
+        if (stmd->size > devsize - stmd->data_offset) {
+            errno = ENOSPC;
+            goto err;
+        }
+        stmd->size -= stmd->size % STORAGE_SECSIZE;
+    } else if (!size || size % STORAGE_SECSIZE) {
+        errno = EINVAL;
+        goto err;
+    }
 
-    fwrite(stmd, sizeof(storage_metadata_t), 1, st->file);
-    fseek(st->file, storage_size_bytes(st)-1, SEEK_SET);
-    fwrite("\0", 1, 1, st->file);
-    storage_close(st);
+    st->metadata = NULL;
+    st->fd = -1;
+    st->crcfd = -1;
+    st->zixfd = -1;
+    st->dmapfd = -1;
+    st->pool = NULL;
+    st->repl = NULL;
+    st->flags = 0;
+    st->align = STORAGE_ALIGN;
+    st->capacity = 0;
+    st->arena = NULL;
+    strcpy(st->mpath, mpath ? mpath : "");
+
+    if (mpath) {
+        mfd = open(mpath, O_RDWR | O_CREAT | O_TRUNC, 0644);
+        if (mfd == -1)
+            goto err;
+        if (storage_pio(mfd, stmd, sizeof(storage_metadata_t), 0, 1)) {
+            close(mfd);
+            goto err;
+        }
+        close(mfd);
+    } else if (storage_pio(fd, stmd, sizeof(storage_metadata_t), 0, 1))
+        goto err;
+
+    if (storage_provision(fd, blk, stmd->data_offset, stmd->data_offset + stmd->size, mode))
+        goto err;
+    close(fd);
+    free(stmd);
 
     return 0;
+
+err:
+    close(fd);
+    free(stmd);
+    return -1;
 }
 
-int storage_load(storage_t *st, char *path)
+/* load storage
+ *
+ * path:  file or block device path
+ * mpath: metadata (sidecar) file path. if NULL the metadata is read from 
+ *        the head of path
+ */
+int storage_load(storage_t *st, char *path, char *mpath)
 {
     storage_metadata_t *stmd;
+    unsigned long devsize;
+    unsigned int align;
+    struct stat sb;
+    int fd, mfd;
     
     strcpy(st->fpath, path);
-    st->file = fopen(st->fpath, "r+");
-    if (!st->file) return -1;
+    fd = open(st->fpath, O_RDWR);
+    if (fd == -1) return -1;
+
+    mfd = fd;
+    if (mpath && (mfd = open(mpath, O_RDWR)) == -1) {
+        close(fd);
+        return -1;
+    }
 
-    stmd = malloc(sizeof(storage_metadata_t));
-    fread(stmd, sizeof(storage_metadata_t), 1, st->file);
-    if (strcmp(stmd->token, STORAGE_TOKEN)) return -1; /* invalid file */
+    /* the header is mapped shared, so a resize made by another process 
+     * (see storage_resize) is seen at once by every running SD */
+    stmd = mmap(NULL, sizeof(storage_metadata_t), PROT_READ | PROT_WRITE, MAP_SHARED, mfd, 0);
+    if (stmd == MAP_FAILED) {
+        stmd = NULL;
+        goto err;
+    }
+    if (strncmp(stmd->token, STORAGE_TOKEN, sizeof(stmd->token)))  /* invalid file */
+        goto err;
+
+    st->flags = 0;
+    st->align = STORAGE_ALIGN;
+    st->capacity = 0;
+    if (!fstat(fd, &sb) && S_ISBLK(sb.st_mode)) {
+        /* raw devices are always accessed directly, aligned to their
+         * logical block size */
+        if (storage_geometry(fd, &devsize, &align) ||
+            stmd->data_offset + stmd->size > devsize) {
+            errno = ENOSPC;
+            goto err;
+        }
+        st->flags |= STORAGE_DIRECT;
+        st->align = align;
+        st->capacity = devsize - stmd->data_offset;
+    }
+    if (mpath)
+        close(mfd);
+    close(fd);
     
     st->metadata = stmd;
+    st->fd = -1;
+    st->crcfd = -1;
+    st->zixfd = -1;
+    st->dmapfd = -1;
+    st->pool = NULL;
+    st->repl = NULL;
+    st->ec = NULL;
+    st->tier = NULL;
+    st->cbt = NULL;
+    st->trace = NULL;
+    st->stats = NULL;
+    st->arena = NULL;
+    strcpy(st->mpath, mpath ? mpath : "");
 
-    st->file = st->file;
-    storage_close(st);
+    return 0;
 
+err:
+    if (mpath)
+        close(mfd);
+    close(fd);
+    if (stmd)
+        munmap(stmd, sizeof(storage_metadata_t));
+    return -1;
+}
+
+/* grow a storage to size bytes, provisioning the new space according to 
+ * mode. the storage may be in use by running SDs: they pick up the new 
+ * size and resize_gen from the shared header and report it to clients */
+int storage_resize(storage_t *st, unsigned long size, int mode)
+{
+    unsigned long devsize;
+    unsigned int align;
+    int fd, blk;
+
+    if (size < st->metadata->size || size % STORAGE_SECSIZE) {
+        errno = EINVAL;
+        return -1;
+    }
+    /* the shards of erasure coded volumes and the extent map of tiered 
+     * ones are sized when created */
+    if (st->metadata->features & (STORAGE_F_EC | STORAGE_F_TIER)) {
+        errno = EOPNOTSUPP;
+        return -1;
+    }
+
+    blk = storage_isblk(st->fpath);
+    if ((fd = open(st->fpath, O_RDWR)) == -1)
+        return -1;
+    if (blk && (storage_geometry(fd, &devsize, &align) ||
+                st->metadata->data_offset + size > devsize)) {
+        errno = ENOSPC;
+        close(fd);
+        return -1;
+    }
+    /* chunk stores allocate their data area as chunks are written, and 
+     * deduplicated volumes have none */
+    if (!(st->metadata->features & (STORAGE_F_ZIP | STORAGE_F_DEDUP)) &&
+        storage_provision(fd, blk, st->metadata->data_offset + st->metadata->size,
+                          st->metadata->data_offset + size, mode)) {
+        close(fd);
+        return -1;
+    }
+    close(fd);
+    if (st->metadata->features & STORAGE_F_CBT && cbt_grow(st, size))
+        return -1;
+
+    st->metadata->size = size;
+    __sync_synchronize();
+    st->metadata->resize_gen++;
+    return msync(st->metadata, sizeof(storage_metadata_t), MS_SYNC);
+}
+
+/* make dst an independent handle on the storage loaded in src, so it can
+ * be used from another thread. metadata is shared, descriptors and 
+ * buffers are not */
+int storage_dup(storage_t *dst, storage_t *src)
+{
+    memcpy(dst, src, sizeof(storage_t));
+    dst->fd = -1;
+    dst->crcfd = -1;
+    dst->zixfd = -1;
+    dst->dmapfd = -1;
+    dst->pool = NULL;
+    dst->repl = NULL;
+    dst->ec = NULL;
+    dst->tier = NULL;
+    dst->cbt = NULL;
+    dst->trace = NULL;
+    dst->stats = NULL;
+    dst->arena = NULL;
     return 0;
 }
 
+/* path of the sidecar file with extension ext, next to the metadata */
+void storage_sidecar(storage_t *st, const char *ext, char *path)
+{
+    sprintf(path, "%s%s", st->mpath[0] ? st->mpath : st->fpath, ext);
+}
+
+/* keep a CRC32C of every block of the storage in a sidecar file, so that
+ * reads can detect corrupted data. blocks written before have no checksum
+ * (stored as 0) and are not verified */
+int storage_crc_create(storage_t *st)
+{
+    char path[1024 + 8];
+    int fd;
+
+    storage_sidecar(st, ".crc", path);
+    if ((fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644)) == -1)
+        return -1;
+    close(fd);
+    st->metadata->features |= STORAGE_F_CRC;
+    return msync(st->metadata, sizeof(storage_metadata_t), MS_SYNC);
+}
+
+/* turn a new storage into a compressed chunk store, with an empty chunk
+ * index in a sidecar file. the data area is given back to the filesystem
+ * and allocated as chunks are written */
+int storage_zip_create(storage_t *st)
+{
+    char path[1024 + 8];
+    int fd;
+
+    storage_sidecar(st, ".zix", path);
+    if ((fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644)) == -1)
+        return -1;
+    close(fd);
+    if (!storage_isblk(st->fpath) && truncate(st->fpath, st->metadata->data_offset))
+        return -1;
+    st->metadata->zip_tail = 0;
+    st->metadata->zip_leaked = 0;
+    st->metadata->features |= STORAGE_F_ZIP;
+    return msync(st->metadata, sizeof(storage_metadata_t), MS_SYNC);
+}
+
+/* open the storage file for data transfers. the descriptor is kept open
+ * until storage_close */
 int storage_open(storage_t *st)
 {
-    st->file = fopen(st->fpath, "r+");
+    char path[1024 + 8];
+    int flags = O_RDWR;
+
+    if (st->fd != -1)
+        return 0;
+    if (st->flags & STORAGE_DIRECT)
+        flags |= O_DIRECT;
+    st->fd = open(st->fpath, flags);
+    if (st->fd == -1) {
+        perror("SD: storage_open");
+        return -1;
+    }
+    if (st->metadata->features & STORAGE_F_CRC) {
+        storage_sidecar(st, ".crc", path);
+        if ((st->crcfd = open(path, O_RDWR)) == -1) {
+            perror("SD: storage_open: checksums");
+            storage_close(st);
+            return -1;
+        }
+    }
+    if (st->metadata->features & STORAGE_F_ZIP) {
+        storage_sidecar(st, ".zix", path);
+        if ((st->zixfd = open(path, O_RDWR)) == -1) {
+            perror("SD: storage_open: chunk index");
+            storage_close(st);
+            return -1;
+        }
+    }
+    if (st->metadata->features & STORAGE_F_DEDUP) {
+        storage_sidecar(st, ".dmap", path);
+        if ((st->dmapfd = open(path, O_RDWR)) == -1 || !(st->pool = pool_open(st->metadata->pool))) {
+            perror("SD: storage_open: block pool");
+            storage_close(st);
+            return -1;
+        }
+    }
+    if (st->metadata->features & STORAGE_F_EC && !(st->ec = ec_open(st))) {
+        perror("SD: storage_open: shards");
+        storage_close(st);
+        return -1;
+    }
+    if (st->metadata->features & STORAGE_F_TIER && !(st->tier = tier_open(st))) {
+        perror("SD: storage_open: fast tier");
+        storage_close(st);
+        return -1;
+    }
+    if (st->metadata->features & STORAGE_F_CBT && !(st->cbt = cbt_open(st))) {
+        perror("SD: storage_open: changed block map");
+        storage_close(st);
+        return -1;
+    }
+    return 0;
 }
 
 int storage_close(storage_t *st)
 {
-    fclose(st->file);
+    if (st->fd != -1)
+        close(st->fd);
+    if (st->crcfd != -1)
+        close(st->crcfd);
+    if (st->zixfd != -1)
+        close(st->zixfd);
+    if (st->dmapfd != -1)
+        close(st->dmapfd);
+    pool_close(st->pool);
+    ec_close(st->ec);
+    tier_close(st->tier);
+    cbt_close(st->cbt);
+    st->fd = -1;
+    st->crcfd = -1;
+    st->zixfd = -1;
+    st->dmapfd = -1;
+    st->pool = NULL;
+    st->ec = NULL;
+    st->tier = NULL;
+    st->cbt = NULL;
+    return 0;
 }
 
 int storage_free(storage_t *st)
 {
     storage_close(st);
-    free(st->metadata);
+    munmap(st->metadata, sizeof(storage_metadata_t));
+    arena_destroy(st->arena);
+    return 0;
+}
+
+/* handle arena, created on first use by the worker owning the handle */
+static struct sd_arena *storage_arena(storage_t *st)
+{
+    if (!st->arena)
+        st->arena = arena_create(st->flags & STORAGE_HUGEPAGES);
+    return st->arena;
+}
+
+/* return a payload buffer of at least size bytes from the handle arena.
+ * buffers are aligned so that they can be handed to O_DIRECT transfers */
+void *storage_getbuf(storage_t *st, unsigned long size)
+{
+    if (!storage_arena(st))
+        return NULL;
+    return arena_alloc(st->arena, size);
+}
+
+void storage_putbuf(storage_t *st, void *buf, unsigned long size)
+{
+    arena_free(st->arena, buf, size);
+}
+
+/* lock len bytes at start of the file open in fd, F_RDLCK (shared) or
+ * F_WRLCK, against other descriptors, of this process or any other, or
+ * unlock them with F_UNLCK */
+int storage_lock(int fd, off_t start, off_t len, int type)
+{
+    struct flock fl;
+
+    memset(&fl, 0, sizeof(fl));
+    fl.l_type = type;
+    fl.l_whence = SEEK_SET;
+    fl.l_start = start;
+    fl.l_len = len;
+    while (fcntl(fd, F_OFD_SETLKW, &fl) == -1)
+        if (errno != EINTR)
+            return -1;
     return 0;
 }
 
+/* O_DIRECT transfer. requests that are not aligned to the storage block
+ * size (st->align) go through a bounce buffer from the arena, and writes 
+ * of partial blocks read the blocks they touch first (read-modify-write).
+ * writes lock the blocks they touch in the data file, exclusively if they
+ * read them first, so that no other write gets in between */
+static int storage_direct_io(storage_t *st, int fd, void *buf, off_t offset, unsigned long size, int write)
+{
+    off_t start, end;
+    unsigned long len;
+    char *bounce;
+    int rv = 0;
+
+    start = offset & ~(off_t)(st->align - 1);
+    end = (offset + size + st->align - 1) & ~(off_t)(st->align - 1);
+    len = end - start;
+
+    if (start == offset && len == size && !((unsigned long)buf & (st->align - 1))) {
+        if (!write)
+            return storage_pio(fd, buf, size, offset, 0);
+        if (storage_lock(fd, start, len, F_RDLCK))
+            return -1;
+        rv = storage_pio(fd, buf, size, offset, 1);
+        storage_lock(fd, start, len, F_UNLCK);
+        return rv;
+    }
+
+    if (!(bounce = storage_getbuf(st, len)))
+        return -1;
+
+    if (!write) {
+        rv = storage_pio(fd, bounce, len, start, 0);
+        if (!rv)
+            memcpy(buf, bounce + (offset - start), size);
+    } else if (!(rv = storage_lock(fd, start, len, offset == start && offset + size == end ? F_RDLCK : F_WRLCK))) {
+        if (offset != start)
+            rv = storage_pio(fd, bounce, st->align, start, 0);
+        if (!rv && offset + size != end && (offset == start || len > st->align))
+            rv = storage_pio(fd, bounce + len - st->align, st->align, end - st->align, 0);
+        if (!rv) {
+            memcpy(bounce + (offset - start), buf, size);
+            rv = storage_pio(fd, bounce, len, start, 1);
+        }
+        storage_lock(fd, start, len, F_UNLCK);
+    }
+
+    storage_putbuf(st, bounce, len);
+    return rv;
+}
+
+/* transfer size bytes at offset of fd, a file or device of the storage,
+ * directly if the storage is */
+int storage_fd_io(storage_t *st, int fd, void *buf, off_t offset, unsigned long size, int write)
+{
+    if (st->flags & STORAGE_DIRECT)
+        return storage_direct_io(st, fd, buf, offset, size, write);
+    return storage_pio(fd, buf, size, offset, write);
+}
+
+/* transfer size bytes at offset of the data area, as they are on disk */
+static int storage_data_io(storage_t *st, void *buf, unsigned long offset, unsigned long size, int write)
+{
+    return storage_fd_io(st, st->fd, buf, offset + st->metadata->data_offset, size, write);
+}
+
+static int storage_chunk_entry(storage_t *st, unsigned long n, struct storage_chunk *c, int write)
+{
+    return storage_pio(st->zixfd, c, sizeof(*c), n * sizeof(*c), write);
+}
+
+/* lock the entry of chunk n, and so its slots, against workers of every 
+ * process. a chunk is read under a read lock and rewritten under a write
+ * lock */
+static int storage_chunk_lock(storage_t *st, unsigned long n, int type)
+{
+    return storage_lock(st->zixfd, n * sizeof(struct storage_chunk), sizeof(struct storage_chunk), type);
+}
+
+/* read the whole chunk c into buf. zbuf must hold a slot */
+static int storage_chunk_load(storage_t *st, struct storage_chunk *c, char *buf, char *zbuf)
+{
+    uLongf len = STORAGE_CHUNK;
+
+    if (!c->len) {
+        memset(buf, 0, STORAGE_CHUNK);
+        return 0;
+    }
+    if (c->len == STORAGE_CHUNK)
+        return storage_data_io(st, buf, c->offset, STORAGE_CHUNK, 0);
+    if (storage_data_io(st, zbuf, c->offset, c->slot, 0))
+        return -1;
+    if (uncompress((Bytef *)buf, &len, (Bytef *)zbuf, c->len) != Z_OK || len != STORAGE_CHUNK) {
+        fprintf(stderr, "SD: corrupted chunk at %llu\n", c->offset);
+        errno = EBADMSG;
+        return -1;
+    }
+    return 0;
+}
+
+static int storage_iszero(const char *buf, unsigned long size)
+{
+    return !buf[0] && !memcmp(buf, buf + 1, size - 1);
+}
+
+/* give the blocks of a slot no longer used back to the filesystem */
+static void storage_chunk_punch(storage_t *st, unsigned long long offset, unsigned int slot)
+{
+    if (!st->capacity)
+        fallocate(st->fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, 
+                  st->metadata->data_offset + offset, slot);
+}
+
+/* store the whole chunk n, with data buf, in the spare slot of c, or in 
+ * new slots if it no longer fits. the data is synced before the entry is 
+ * switched to it, and the entry before the slot left behind is punched.
+ * zbuf must hold a slot */
+static int storage_chunk_store(storage_t *st, unsigned long n, struct storage_chunk *c, char *buf, char *zbuf)
+{
+    struct storage_chunk old = *c;
+    unsigned long wlen, need;
+    uLongf len = sd_zip_bound(STORAGE_CHUNK);
+    char *data = zbuf;
+
+    if (storage_iszero(buf, STORAGE_CHUNK)) {
+        c->len = 0;              /* the slots are kept for later writes */
+        return storage_chunk_entry(st, n, c, 1);
+    }
+    if (compress2((Bytef *)zbuf, &len, (Bytef *)buf, STORAGE_CHUNK, 1) != Z_OK ||
+        len > STORAGE_CHUNK / 100 * SD_ZIP_MAXRATIO) {
+        len = STORAGE_CHUNK;
+        data = buf;
+    }
+    wlen = need = (len + STORAGE_ALIGN - 1) & ~(unsigned long)(STORAGE_ALIGN - 1);
+    if (data == zbuf)
+        memset(zbuf + len, 0, wlen - len);
+
+    if (need > c->slot) {
+        /* chunks that outgrow their slots move to ones twice as big, so 
+         * they only move a few times. the tail is synced before any entry
+         * points past it */
+        if (c->slot && need < 2 * c->slot)
+            need = 2 * c->slot < STORAGE_CHUNK ? 2 * c->slot : STORAGE_CHUNK;
+        c->offset = __sync_fetch_and_add(&st->metadata->zip_tail, 2 * need);
+        c->spare = c->offset + need;
+        c->slot = need;
+        if (st->capacity && c->offset + 2 * need > st->capacity) {
+            errno = ENOSPC;
+            return -1;
+        }
+        if (msync(st->metadata, sizeof(storage_metadata_t), MS_SYNC))
+            return -1;
+    } else {
+        c->offset = old.spare;
+        c->spare = old.offset;
+    }
+    c->len = len;
+    if (storage_data_io(st, data, c->offset, wlen, 1) || fdatasync(st->fd) ||
+        storage_chunk_entry(st, n, c, 1) || fdatasync(st->zixfd))
+        return -1;
+
+    if (old.slot && c->slot != old.slot) {
+        __sync_fetch_and_add(&st->metadata->zip_leaked, 2 * old.slot);
+        storage_chunk_punch(st, old.offset, old.slot);
+        storage_chunk_punch(st, old.spare, old.slot);
+    } else if (old.slot)
+        storage_chunk_punch(st, old.offset, old.slot);
+    return 0;
+}
+
+/* transfer size bytes at offset of a compressed chunk store. partial 
+ * chunk writes read, uncompress and store again the whole chunk */
+static int storage_zip_io(storage_t *st, char *buf, unsigned long offset, unsigned long size, int write)
+{
+    unsigned long n, within, len, zsize;
+    struct storage_chunk c;
+    char *chunk, *zbuf;
+    int rv = 0;
+
+    zsize = (sd_zip_bound(STORAGE_CHUNK) + STORAGE_ALIGN - 1) & ~(unsigned long)(STORAGE_ALIGN - 1);
+    chunk = storage_getbuf(st, STORAGE_CHUNK);
+    zbuf = storage_getbuf(st, zsize);
+    if (!chunk || !zbuf) {
+        rv = -1;
+        goto out;
+    }
+
+    for (; !rv && size; offset += len, buf += len, size -= len) {
+        n = offset / STORAGE_CHUNK;
+        within = offset % STORAGE_CHUNK;
+        len = STORAGE_CHUNK - within < size ? STORAGE_CHUNK - within : size;
+
+        if ((rv = storage_chunk_lock(st, n, write ? F_WRLCK : F_RDLCK)))
+            break;
+        rv = storage_chunk_entry(st, n, &c, 0);
+        if (!rv && !write && c.len == STORAGE_CHUNK)
+            rv = storage_data_io(st, buf, c.offset + within, len, 0);
+        else if (!rv && !write) {
+            rv = storage_chunk_load(st, &c, chunk, zbuf);
+            memcpy(buf, chunk + within, len);
+        } else if (!rv) {
+            if (len < STORAGE_CHUNK)
+                rv = storage_chunk_load(st, &c, chunk, zbuf);
+            memcpy(chunk + within, buf, len);
+            if (!rv)
+                rv = storage_chunk_store(st, n, &c, chunk, zbuf);
+        }
+        storage_chunk_lock(st, n, F_UNLCK);
+    }
+
+out:
+    if (chunk)
+        storage_putbuf(st, chunk, STORAGE_CHUNK);
+    if (zbuf)
+        storage_putbuf(st, zbuf, zsize);
+    return rv;
+}
+
+static int storage_read_data(storage_t *st, void *buf, unsigned long offset, unsigned long size)
+{
+    if (st->zixfd != -1)
+        return storage_zip_io(st, buf, offset, size, 0);
+    if (st->pool)
+        return storage_dedup_io(st, buf, offset, size, 0);
+    if (st->ec)
+        return ec_io(st, buf, offset, size, 0);
+    if (st->tier)
+        return tier_io(st, buf, offset, size, 0);
+    return storage_data_io(st, buf, offset, size, 0);
+}
+
+static int storage_write_data(storage_t *st, const void *buf, unsigned long offset, unsigned long size)
+{
+    if (st->zixfd != -1)
+        return storage_zip_io(st, (void *)buf, offset, size, 1);
+    if (st->pool)
+        return storage_dedup_io(st, (void *)buf, offset, size, 1);
+    if (st->ec)
+        return ec_io(st, (void *)buf, offset, size, 1);
+    if (st->tier)
+        return tier_io(st, (void *)buf, offset, size, 1);
+    return storage_data_io(st, (void *)buf, offset, size, 1);
+}
+
+/* print the space used by a compressed chunk store */
+void storage_zip_stats(storage_t *st, FILE *f)
+{
+    struct storage_chunk c;
+    unsigned long n, nchunks, written = 0, zeros = 0, raw = 0;
+    unsigned long long stored = 0;
+
+    if (!(st->metadata->features & STORAGE_F_ZIP) || storage_open(st))
+        return;
+    nchunks = (st->metadata->size + STORAGE_CHUNK - 1) / STORAGE_CHUNK;
+    for (n = 0; n < nchunks; n++) {
+        if (storage_chunk_entry(st, n, &c, 0) || !c.slot)
+            continue;
+        written++;
+        zeros += !c.len;
+        raw += c.len == STORAGE_CHUNK;
+        stored += c.len;
+    }
+    fprintf(f, "SD: chunk store | chunks %lu | written %lu (%lu zeros, %lu raw) | "
+            "stored %llu | used %lu | leaked %lu | ratio %.2f\n",
+            nchunks, written, zeros, raw, stored, st->metadata->zip_tail,
+            st->metadata->zip_leaked, st->metadata->zip_tail > st->metadata->zip_leaked ? 
+            (double)written * STORAGE_CHUNK / (st->metadata->zip_tail - st->metadata->zip_leaked) : 0);
+}
+
+/* read size bytes at offset. if crcs is not NULL it gets the checksum of 
+ * every RBD_CRC_BLOCK bytes of buf. with STORAGE_F_CRC, whole blocks are 
+ * checked against their stored checksums and the read fails with EBADMSG
+ * if the data was corrupted on disk */
+int storage_read_crc(storage_t *st, void *buf, unsigned long offset, unsigned long size, unsigned int *crcs)
+{
+    unsigned int *stored, crc;
+    unsigned long first, nblocks, i;
+    int rv = 0;
+
+    if (storage_open(st))
+        return -1;
+    sd_log(SD_LOG_DEBUG, "SD: storage_read | offset: %ld | size: %ld\n", offset, size);
+    if (st->crcfd == -1 || offset % RBD_CRC_BLOCK || size < RBD_CRC_BLOCK) {
+        if (storage_read_data(st, buf, offset, size))
+            return -1;
+        if (crcs)
+            rbd_crc_blocks(buf, size, crcs);
+        return 0;
+    }
+
+    /* the data and its checksums are read under a shared lock of the
+     * checksums, so that no write is halfway through them */
+    first = offset / RBD_CRC_BLOCK;
+    nblocks = size / RBD_CRC_BLOCK;
+    if (!(stored = storage_getbuf(st, nblocks * 4 + 4)))
+        return -1;
+    if (storage_lock(st->crcfd, first * 4, nblocks * 4, F_RDLCK)) {
+        storage_putbuf(st, stored, nblocks * 4 + 4);
+        return -1;
+    }
+    rv = storage_read_data(st, buf, offset, size) ||
+         storage_pio(st->crcfd, stored, nblocks * 4, first * 4, 0);
+    storage_lock(st->crcfd, first * 4, nblocks * 4, F_UNLCK);
+    if (rv) {
+        storage_putbuf(st, stored, nblocks * 4 + 4);
+        return -1;
+    }
+    for (i = 0; i < nblocks; i++) {
+        crc = rbd_crc((char *)buf + i * RBD_CRC_BLOCK, RBD_CRC_BLOCK);
+        if (stored[i] && stored[i] != crc) {
+            fprintf(stderr, "SD: checksum error at block %lu | stored %08x | data %08x\n", 
+                    first + i, stored[i], crc);
+            errno = EBADMSG;
+            rv = -1;
+            break;
+        }
+        if (crcs)
+            crcs[i] = crc;
+    }
+    if (!rv && crcs && size % RBD_CRC_BLOCK)
+        crcs[i] = rbd_crc((char *)buf + i * RBD_CRC_BLOCK, size % RBD_CRC_BLOCK);
+    storage_putbuf(st, stored, nblocks * 4 + 4);
+    return rv;
+}
+
+/* update the stored checksums of the blocks touched by a write of size 
+ * bytes at offset. crcs, if not NULL, has the checksums of buf already 
+ * computed. blocks only partially written are read back */
+static int storage_crc_update(storage_t *st, const void *buf, unsigned long offset, unsigned long size, const unsigned int *crcs)
+{
+    unsigned long first, last, b, bstart;
+    unsigned int *sums;
+    char *block = NULL;
+    int rv = 0;
+
+    first = offset / RBD_CRC_BLOCK;
+    last = (offset + size - 1) / RBD_CRC_BLOCK;
+    if (!(sums = storage_getbuf(st, (last - first + 1) * 4)))
+        return -1;
+
+    for (b = first; !rv && b <= last; b++) {
+        bstart = b * RBD_CRC_BLOCK;
+        if (bstart >= offset && bstart + RBD_CRC_BLOCK <= offset + size) {
+            if (crcs && !(offset % RBD_CRC_BLOCK))
+                sums[b - first] = crcs[b - first];
+            else
+                sums[b - first] = rbd_crc((char *)buf + (bstart - offset), RBD_CRC_BLOCK);
+            continue;
+        }
+        if (!block && !(block = storage_getbuf(st, RBD_CRC_BLOCK))) {
+            rv = -1;
+            break;
+        }
+        rv = storage_read_data(st, block, bstart, RBD_CRC_BLOCK);
+        sums[b - first] = rbd_crc(block, RBD_CRC_BLOCK);
+    }
+
+    if (!rv)
+        rv = storage_pio(st->crcfd, sums, (last - first + 1) * 4, first * 4, 1);
+    if (block)
+        storage_putbuf(st, block, RBD_CRC_BLOCK);
+    storage_putbuf(st, sums, (last - first + 1) * 4);
+    return rv;
+}
+
+/* clear the stored checksums of n blocks from first: 0 is not checked */
+static int storage_crc_clear(storage_t *st, unsigned long first, unsigned long n)
+{
+    unsigned int *zeros;
+    int rv;
+
+    if (!(zeros = storage_getbuf(st, n * 4)))
+        return -1;
+    memset(zeros, 0, n * 4);
+    rv = storage_pio(st->crcfd, zeros, n * 4, first * 4, 1);
+    storage_putbuf(st, zeros, n * 4);
+    return rv;
+}
+
+/* write size bytes at offset. crcs, if not NULL, are the checksums of the
+ * RBD_CRC_BLOCK bytes blocks of buf, already verified by the caller.
+ *
+ * with STORAGE_F_CRC, the checksums of the blocks written are locked
+ * exclusively across the write, and cleared before the data is written,
+ * so that a crash in between leaves them unchecked rather than wrong */
+int storage_write_crc(storage_t *st, const void *buf, unsigned long offset, unsigned long size, const unsigned int *crcs)
+{
+    unsigned long first = 0, n = 0;
+    unsigned int epoch = 0;
+    int rv = -1;
+
+    if (storage_open(st))
+        return -1;
+    sd_log(SD_LOG_DEBUG, "SD: storage_write | offset: %ld | size: %ld\n", offset, size);
+    if (st->crcfd != -1 && size) {
+        first = offset / RBD_CRC_BLOCK;
+        n = (offset + size - 1) / RBD_CRC_BLOCK - first + 1;
+        if (storage_lock(st->crcfd, first * 4, n * 4, F_WRLCK))
+            return -1;
+        if (storage_crc_clear(st, first, n))
+            goto out;
+    }
+    if (st->cbt && !(epoch = cbt_begin(st->cbt, offset, size))) {
+        rv = -1;
+        goto out;
+    }
+    rv = storage_write_data(st, buf, offset, size);
+    if (epoch)
+        cbt_end(st->cbt, epoch);
+    if (!rv && n)
+        rv = storage_crc_update(st, buf, offset, size, crcs);
+
+out:
+    if (n)
+        storage_lock(st->crcfd, first * 4, n * 4, F_UNLCK);
+    return rv ? -1 : 0;
+}
+
 int storage_read(storage_t *st, void *buf, unsigned long offset, unsigned long size)
 {
-    int ret;
-    storage_open(st);
-    printf("SD: storage_read | offset: %ld | size: %ld\n", offset, size);
-    offset += st->metadata->data_offset;
-    fseek(st->file, offset, SEEK_SET);
-    ret = fread(buf, size, 1, st->file);
-    storage_close(st);
-    return ret;
+    return storage_read_crc(st, buf, offset, size, NULL);
 }
 
 int storage_write(storage_t *st, const void *buf, unsigned long offset, unsigned long size)
 {
-    storage_open(st);
-    printf("SD: storage_write | offset: %ld | size: %ld\n", offset, size);
-    offset += st->metadata->data_offset;
-    fseek(st->file, offset, SEEK_SET);
-    fwrite(buf, size, 1, st->file);
-    storage_close(st);
+    return storage_write_crc(st, buf, offset, size, NULL);
+}
+
+/* new connection state for socket sockfd */
+sd_conn_t *sd_conn_new(int sockfd)
+{
+    sd_conn_t *conn;
+
+    conn = malloc(sizeof(sd_conn_t));
+    if (!conn)
+        return NULL;
+    conn->sockfd = sockfd;
+    conn->nonblock = 0;
+    conn->events = 0;
+    conn->payload = NULL;
+    conn->paylen = 0;
+    conn->payhead = 0;
+    conn->txbuf = NULL;
+    conn->txsize = 0;
+    conn->txhead = 0;
+    conn->txtail = 0;
+    conn->features = 0;
+    memset(&conn->zip, 0, sizeof(conn->zip));
+    memset(&conn->zip_counted, 0, sizeof(conn->zip_counted));
+    conn->trace_id = 0;
+    conn->session = NULL;
+    conn->session_id = 0;
+    conn->shm = NULL;
+    conn->qos = qos_attach(sockfd);
+    memset(&conn->ticket, 0, sizeof(conn->ticket));
+    conn->parked = 0;
+    conn->timerfd = -1;
+    conn->arrival = 0;
+    conn->rxhead = 0;
+    conn->rxtail = 0;
+    return conn;
+}
+
+void sd_conn_free(sd_conn_t *conn)
+{
+    qos_end(&conn->ticket);     /* it may be parked in the fair queue */
+    if (conn->timerfd != -1)
+        close(conn->timerfd);
+    free(conn->payload);
+    free(conn->txbuf);
+    free(conn);
+}
+
+void sd_conn_stats(sd_conn_t *conn, FILE *f)
+{
+    sd_zip_stats(&conn->zip, f);
+    if (conn->shm)
+        shm_stats(conn->shm, f);
+}
+
+/* send what is left of the replies in txbuf, as much as the socket takes.
+ * 0 if it took it all or would block, -1 on errors */
+static int storage_flush(sd_conn_t *conn)
+{
+    ssize_t rv;
+
+    while (conn->txhead < conn->txtail) {
+        rv = send(conn->sockfd, conn->txbuf + conn->txhead, conn->txtail - conn->txhead, MSG_NOSIGNAL);
+        if (rv < 0 && errno == EINTR)
+            continue;
+        if (rv < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            return 0;
+        if (rv <= 0) {
+            perror("storage_process: send");
+            return -1;
+        }
+        conn->txhead += rv;
+    }
+    conn->txhead = conn->txtail = 0;
     return 0;
 }
 
-/* receive message from socket and process it
- *
- * st     - storage 
- * sockfd - socket where to extract message from
- */
-int storage_process(storage_t *st, int sockfd)
+/* keep the n buffers of iov in txbuf */
+static int storage_queue(sd_conn_t *conn, struct iovec *iov, int n)
 {
-    struct rbdmsg_hdr msg;
-    int offs, rv;
-    void *buf;
-    unsigned long size;
+    unsigned long size = 0;
+    char *p;
+    int i;
+
+    for (i = 0; i < n; i++)
+        size += iov[i].iov_len;
+    if (conn->txtail + size > conn->txsize) {
+        if (!(p = realloc(conn->txbuf, conn->txtail + size)))
+            return -1;
+        conn->txbuf = p;
+        conn->txsize = conn->txtail + size;
+    }
+    for (i = 0; i < n; i++) {
+        memcpy(conn->txbuf + conn->txtail, iov[i].iov_base, iov[i].iov_len);
+        conn->txtail += iov[i].iov_len;
+    }
+    return 0;
+}
+
+/* send a reply header and its payload, made of n buffers, with a single 
+ * sendmsg call, resuming after partial sends. on shared memory they go
+ * through the reply ring. on non-blocking connections, what the socket
+ * does not take at once is left in txbuf, to be sent by storage_flush */
+static int storage_replyv(sd_conn_t *conn, struct rbdmsg_hdr *msg, struct iovec *payload, int n)
+{
+    unsigned long long start = sd_now();
+    struct iovec iov[4];
+    struct msghdr mh;
+    ssize_t rv;
+    int i;
+
+    iov[0].iov_base = msg;
+    iov[0].iov_len = sizeof(*msg);
+    for (i = 0; i < n; i++)
+        iov[i + 1] = payload[i];
+
+    if (conn->shm) {
+        if (shm_writev(conn->shm, iov, n + 1))
+            return -1;
+        conn->stage[STAGE_REPLY] += sd_now() - start;
+        return 0;
+    }
+    if (conn->txhead < conn->txtail)      /* after the replies before */
+        return storage_queue(conn, iov, n + 1);
+
+    memset(&mh, 0, sizeof(mh));
+    mh.msg_iov = iov;
+    mh.msg_iovlen = n + 1;
+
+    while (mh.msg_iovlen) {
+        rv = sendmsg(conn->sockfd, &mh, MSG_NOSIGNAL);
+        if (rv < 0 && errno == EINTR)
+            continue;
+        if (rv < 0 && conn->nonblock && (errno == EAGAIN || errno == EWOULDBLOCK))
+            return storage_queue(conn, mh.msg_iov, mh.msg_iovlen);
+        if (rv <= 0) {
+            perror("storage_process: sendmsg");
+            return -1;
+        }
+        while (mh.msg_iovlen && rv >= mh.msg_iov->iov_len) {
+            rv -= mh.msg_iov->iov_len;
+            mh.msg_iov++;
+            mh.msg_iovlen--;
+        }
+        if (mh.msg_iovlen) {
+            mh.msg_iov->iov_base = (char *)mh.msg_iov->iov_base + rv;
+            mh.msg_iov->iov_len -= rv;
+        }
+    }
+    conn->stage[STAGE_REPLY] += sd_now() - start;
+    return 0;
+}
+
+static int storage_reply(sd_conn_t *conn, struct rbdmsg_hdr *msg, void *payload, unsigned long size)
+{
+    struct iovec iov;
+
+    iov.iov_base = payload;
+    iov.iov_len = size;
+    return storage_replyv(conn, msg, &iov, size ? 1 : 0);
+}
+
+/* copy size bytes of payload into buf: from the payload kept apart, if
+ * the request has one, or first whatever is already in the receive
+ * buffer, then the rest straight from the socket */
+static int storage_recv_payload(sd_conn_t *conn, void *buf, unsigned long size)
+{
+    unsigned long long start = sd_now();
+    unsigned long n;
+    ssize_t rv;
+
+    if (conn->payload) {
+        if (size > conn->paylen - conn->payhead)
+            return -1;
+        memcpy(buf, conn->payload + conn->payhead, size);
+        conn->payhead += size;
+        return 0;
+    }
+    n = conn->rxtail - conn->rxhead;
+    if (n > size)
+        n = size;
+    memcpy(buf, conn->rxbuf + conn->rxhead, n);
+    conn->rxhead += n;
+
+    while (n < size) {
+        if (conn->shm)
+            rv = shm_read(conn->shm, (char *)buf + n, size - n, size - n);
+        else
+            rv = recv(conn->sockfd, (char *)buf + n, size - n, MSG_WAITALL);
+        if (rv < 0 && errno == EINTR)
+            continue;
+        if (rv <= 0)
+            return -1;
+        n += rv;
+    }
+    conn->stage[STAGE_PAYLOAD] += sd_now() - start;
+    return 0;
+}
+
+/* take size bytes of payload that are not wanted */
+static int storage_skip_payload(sd_conn_t *conn, unsigned long size)
+{
+    char buf[4096];
+    unsigned long n;
+
+    for (; size; size -= n) {
+        n = size < sizeof(buf) ? size : sizeof(buf);
+        if (storage_recv_payload(conn, buf, n))
+            return -1;
+    }
+    return 0;
+}
+
+/* answer a request over RBD_MAX_TRANSFER with REP_ERR. rv is returned 
+ * to the caller of storage_process: -1 drops the connection when the 
+ * oversized payload can not be skipped */
+static int storage_reject(storage_t *st, sd_conn_t *conn, struct rbdmsg_hdr *msg, int rv)
+{
+    fprintf(stderr, "SD: rejecting request %u | payload %u | size %u | max %u\n", 
+            msg->id, msg->payload_size, msg->fsop_size, RBD_MAX_TRANSFER);
+    if (storage_arena(st))
+        st->arena->rejected++;
+    msg->code = REP_ERR;
+    msg->payload_size = 0;
+    msg->flags = 0;
+    if (storage_reply(conn, msg, NULL, 0))
+        return -1;
+    return rv;
+}
+
+/* answer a request that reaches past the end of the volume with REP_ERR,
+ * skipping its payload. the sidecar maps (checksums, tiers, changed 
+ * blocks, dedup, parity) are indexed by offset and only cover the volume */
+static int storage_range(storage_t *st, sd_conn_t *conn, struct rbdmsg_hdr *msg)
+{
+    fprintf(stderr, "SD: rejecting request %u | sector %u | size %u | past the end, %lu sectors\n",
+            msg->id, msg->fsop_offset_sectors, msg->fsop_size, storage_size(st));
+    if (storage_skip_payload(conn, msg->payload_size))
+        return -1;
+    msg->code = REP_ERR;
+    msg->payload_size = 0;
+    msg->flags = 0;
+    return storage_reply(conn, msg, NULL, 0);
+}
+
+/* features this SD can provide */
+#define SD_FEATURES (RBD_FEAT_CRC | RBD_FEAT_ZLIB | RBD_FEAT_SESSION)
+
+static int storage_cmd_read(storage_t *st, sd_conn_t *conn, struct rbdmsg_hdr *msg)
+{
+    unsigned long offs, size, crcsize, zsize = 0, zlen;
+    unsigned long long start;
+    struct iovec iov[2];
+    unsigned int *crcs = NULL;
+    void *buf, *zbuf = NULL;
+    int rv;
 
-    /* TODO: error check missing. for example: that request doesn't 
-     * extend over disk limits, etc */
+    if (msg->fsop_size > RBD_MAX_TRANSFER)
+        return storage_reject(st, conn, msg, 0);
+    offs = (unsigned long)msg->fsop_offset_sectors * STORAGE_SECSIZE;
+    size = msg->fsop_size;
+    if (offs + size > storage_size_bytes(st))
+        return storage_range(st, conn, msg);
+    crcsize = conn->features & RBD_FEAT_CRC ? RBD_CRC_SIZE(size) : 0;
 
-    rv = recv(sockfd, &msg, sizeof(msg), 0);
-    if (rv <= 0)
+    if (!(buf = storage_getbuf(st, size)))
+        return -1;
+    if (crcsize && !(crcs = storage_getbuf(st, crcsize))) {
+        storage_putbuf(st, buf, size);
         return -1;
+    }
+    msg->payload_size = 0;
+    msg->flags = 0;
+    qos_begin(conn->qos, size, &conn->ticket);
+    start = sd_now();
+    rv = storage_read_crc(st, buf, offs, size, crcs);
+    conn->stage[STAGE_DISK] += sd_now() - start;
+    qos_end(&conn->ticket);
+    if (rv) {
+        msg->code = REP_ERR;
+        rv = storage_reply(conn, msg, NULL, 0);
+        goto out;
+    }
+
+    iov[0].iov_base = buf;
+    iov[0].iov_len = size;
+    iov[1].iov_base = crcs;
+    iov[1].iov_len = crcsize;
+    if (conn->features & RBD_FEAT_ZLIB && size) {
+        zsize = sd_zip_bound(size);
+        if ((zbuf = storage_getbuf(st, zsize)) && !sd_zip(&conn->zip, buf, size, zbuf, &zlen)) {
+            iov[0].iov_base = zbuf;
+            iov[0].iov_len = zlen;
+            msg->flags |= RBDMSG_ZLIB;
+        }
+    }
+    msg->payload_size = iov[0].iov_len + crcsize;
+    rv = storage_replyv(conn, msg, iov, crcsize ? 2 : 1);
+
+out:
+    if (zbuf)
+        storage_putbuf(st, zbuf, zsize);
+    if (crcs)
+        storage_putbuf(st, crcs, crcsize);
+    storage_putbuf(st, buf, size);
+    return rv;
+}
+
+/* CMD_WRITE payloads are the data, compressed if RBDMSG_ZLIB is set, 
+ * followed by the checksums if RBD_FEAT_CRC was negotiated */
+static int storage_cmd_write(storage_t *st, sd_conn_t *conn, struct rbdmsg_hdr *msg)
+{
+    unsigned long offs, size, crcsize = 0, wsize;
+    unsigned long long start;
+    unsigned int *crcs = NULL, *rcrcs = NULL;
+    void *buf = NULL, *zbuf = NULL;
+    int i, rv = -1;
+
+    size = msg->payload_size;
+    if (conn->features & RBD_FEAT_CRC || msg->flags & RBDMSG_ZLIB)
+        size = msg->fsop_size;
+    if (conn->features & RBD_FEAT_CRC)
+        crcsize = RBD_CRC_SIZE(size);
+    if (size > RBD_MAX_TRANSFER || msg->payload_size < crcsize ||
+        (!(msg->flags & RBDMSG_ZLIB) && msg->payload_size != size + crcsize) ||
+        (msg->flags & RBDMSG_ZLIB && !(conn->features & RBD_FEAT_ZLIB)))
+        return storage_reject(st, conn, msg, -1);
+    wsize = msg->payload_size - crcsize;     /* data size on the wire */
+    offs = (unsigned long)msg->fsop_offset_sectors * STORAGE_SECSIZE;
+    if (offs + size > storage_size_bytes(st))
+        return storage_range(st, conn, msg);
+
+    if (!(buf = storage_getbuf(st, size)))
+        goto out;
+    if (crcsize && (!(crcs = storage_getbuf(st, crcsize)) || !(rcrcs = storage_getbuf(st, crcsize))))
+        goto out;
+    if (msg->flags & RBDMSG_ZLIB) {
+        if (wsize > sd_zip_bound(RBD_MAX_TRANSFER)) {
+            rv = storage_reject(st, conn, msg, -1);
+            goto out;
+        }
+        if (!(zbuf = storage_getbuf(st, wsize)))
+            goto out;
+    }
+    if (storage_recv_payload(conn, zbuf ? zbuf : buf, wsize) || 
+        storage_recv_payload(conn, rcrcs, crcsize)) {
+        perror("CMD_WRITE: recv-payload");    
+        goto out;
+    }
+
+    rv = 0;
+    if (zbuf && sd_unzip(&conn->zip, zbuf, wsize, buf, size)) {
+        fprintf(stderr, "SD: bad compressed payload in request %u\n", msg->id);
+        rv = -1;
+    }
+    if (!rv && crcsize) {
+        /* verify the received data against its checksums */
+        rbd_crc_blocks(buf, size, crcs);
+        for (i = 0; i < crcsize / 4 && crcs[i] == rcrcs[i]; i++)
+            ;
+        if (i < crcsize / 4) {
+            fprintf(stderr, "SD: checksum error in request %u | block %d\n", msg->id, i);
+            rv = -1;
+        }
+    }
+    if (!rv) {
+        qos_begin(conn->qos, size, &conn->ticket);
+        start = sd_now();
+        rv = st->repl ? repl_write(st, buf, offs, size, crcs) : storage_write_crc(st, buf, offs, size, crcs);
+        conn->stage[STAGE_DISK] += sd_now() - start;
+        qos_end(&conn->ticket);
+    }
+    msg->code = rv ? REP_ERR : msg->code;
+    msg->payload_size = 0;
+    msg->flags = 0;
+    rv = storage_reply(conn, msg, NULL, 0);
+
+out:
+    if (zbuf)
+        storage_putbuf(st, zbuf, wsize);
+    if (rcrcs)
+        storage_putbuf(st, rcrcs, crcsize);
+    if (crcs)
+        storage_putbuf(st, crcs, crcsize);
+    if (buf)
+        storage_putbuf(st, buf, size);
+    return rv;
+}
+
+/* write of a connection with a session: a write done before, whose reply
+ * the client did not get, is answered the same without doing it again */
+static int storage_session_write(storage_t *st, sd_conn_t *conn, struct rbdmsg_hdr *msg)
+{
+    unsigned int id = msg->id, code;
+    int rv;
+
+    if ((code = session_begin(conn->session, conn->session_id, id))) {
+        sd_log(SD_LOG_INFO, "SD: session %llx | write %u done before, not done again\n",
+               conn->session_id, id);
+        if (storage_skip_payload(conn, msg->payload_size))
+            return -1;
+        msg->code = code;
+        msg->payload_size = 0;
+        msg->flags = RBDMSG_REPLAYED;
+        return storage_reply(conn, msg, NULL, 0);
+    }
+    rv = storage_cmd_write(st, conn, msg);
+    /* the payload size is cleared once the write was answered, or was
+     * about to be. otherwise it was not done */
+    session_end(conn->session, conn->session_id, id, msg->payload_size ? 0 : msg->code);
+    return rv;
+}
+
+/* reply with a report of the stats of every worker, in JSON if asked
+ * for with RBDMSG_JSON */
+static int storage_cmd_stats(storage_t *st, sd_conn_t *conn, struct rbdmsg_hdr *msg)
+{
+    char *report = NULL;
+    size_t size = 0;
+    FILE *f;
+    int rv;
+
+    if (msg->payload_size)
+        return storage_reject(st, conn, msg, -1);
+    if (!(f = open_memstream(&report, &size)))
+        return -1;
+    stats_report(f, msg->flags & RBDMSG_JSON);
+    fclose(f);
+    if (size > RBD_MAX_TRANSFER)
+        size = RBD_MAX_TRANSFER;
+    msg->payload_size = size;
+    msg->flags = 0;
+    rv = storage_reply(conn, msg, report, size);
+    free(report);
+    return rv;
+}
+
+/* process one message, whose header was already taken from the receive 
+ * buffer */
+static int storage_process_msg(storage_t *st, sd_conn_t *conn, struct rbdmsg_hdr *msg)
+{
+    struct rbdmsg_hello hello;
+    unsigned long size;
+
+    /* reads and writes past the end of the volume are refused by
+     * storage_cmd_read and storage_cmd_write */
 
-    printf("SD: storage_process rv=%d | msg.id=%u | msg.code=%u\n", rv, msg.id, msg.code);
-    msg.type = REP;
+    sd_log(SD_LOG_DEBUG, "SD: storage_process | msg.id=%u | msg.code=%u\n", msg->id, msg->code);
+    msg->type = REP;
+    msg->resize_gen = st->metadata->resize_gen;
 
-    switch(msg.code) {
+    switch(msg->code) {
         case CMD_READ:
-            offs = msg.fsop_offset_sectors * STORAGE_SECSIZE;
-            msg.payload_size = msg.fsop_size;
-            if (send(sockfd, &msg, sizeof(msg), 0) <= 0) {
-                perror("storage_process: send-msghdr");
-                return -1;
-            }
-            buf = malloc(msg.fsop_size);
-            storage_read(st, buf, offs, msg.fsop_size);
-            if (send(sockfd, buf, msg.fsop_size, 0) <= 0){
-                perror("CMD_READ: send-payload");
-                free(buf);
-                return -1;
-            }
-            free(buf);
-            return 0;
+            return storage_cmd_read(st, conn, msg);
             
         case CMD_WRITE:
-            buf = malloc(msg.payload_size);
-            if (recv(sockfd, buf, msg.payload_size, MSG_WAITALL) <= 0) {
-                perror("CMD_WRITE: recv-payload");    
-                free(buf);
-                return -1;
-            }
-            offs = msg.fsop_offset_sectors * STORAGE_SECSIZE;
-            storage_write(st, buf, offs, msg.payload_size);
-            msg.payload_size = 0;
-            if (send(sockfd, &msg, sizeof(msg), 0) <= 0) {
-                perror("storage_process: send-msghdr");
-                free(buf);
-                return -1;
-            }
-            free(buf);
-            return 0;
+            if (conn->session)
+                return storage_session_write(st, conn, msg);
+            return storage_cmd_write(st, conn, msg);
 
         case CMD_GETSZ:
-            printf("SD: storage_process | CMD_GETSZ\n");
+            sd_log(SD_LOG_DEBUG, "SD: storage_process | CMD_GETSZ\n");
             size = storage_size(st);
-            msg.payload_size = sizeof(size);
-            if (send(sockfd, &msg, sizeof(msg), 0) <= 0) {
-                perror("storage_process: send-msghdr");
-                return -1;
-            }
-            if (send(sockfd, &size, sizeof(size), 0) <= 0) {
-                perror("CMD_GETSZ: send-payload");
+            msg->payload_size = sizeof(size);
+            msg->flags = 0;
+            return storage_reply(conn, msg, &size, sizeof(size));
+
+        case CMD_HELLO:
+            if (msg->payload_size != sizeof(hello) && msg->payload_size != RBD_HELLO_MINSIZE)
+                return storage_reject(st, conn, msg, -1);
+            hello.session = 0;
+            if (storage_recv_payload(conn, &hello, msg->payload_size))
                 return -1;
-            }
-            return 0;
+            conn->features = hello.features & SD_FEATURES;
+            conn->session = NULL;
+            if (conn->features & RBD_FEAT_SESSION &&
+                (!hello.session || !(conn->session = session_attach(hello.session))))
+                conn->features &= ~RBD_FEAT_SESSION;
+            conn->session_id = conn->session ? hello.session : 0;
+            sd_log(SD_LOG_INFO, "SD: storage_process | CMD_HELLO | features %x\n", conn->features);
+            hello.features = conn->features;
+            hello.max_transfer = RBD_MAX_TRANSFER;
+            msg->flags = 0;
+            return storage_reply(conn, msg, &hello, msg->payload_size);
+
+        case CMD_STATS:
+            return storage_cmd_stats(st, conn, msg);
 
         case CMD_CLOSE:
-            printf("SD: storage_process | CMD_CLOSE\n");
+            sd_log(SD_LOG_DEBUG, "SD: storage_process | CMD_CLOSE\n");
             return -1;
 
         default:
@@ -200,3 +1443,140 @@ int storage_process(storage_t *st, int sockfd)
     }
 }
 
+/* take what the connection has for us into buf. 0 if there is nothing on
+ * a non-blocking connection, -1 on errors or if the client is gone */
+static ssize_t storage_recv(sd_conn_t *conn, char *buf, unsigned long size)
+{
+    ssize_t rv;
+
+    if (conn->shm)
+        rv = shm_read(conn->shm, buf, size, 1);
+    else
+        do 
+            rv = recv(conn->sockfd, buf, size, 0);
+        while (rv < 0 && errno == EINTR);
+    if (rv < 0 && conn->nonblock && (errno == EAGAIN || errno == EWOULDBLOCK))
+        return 0;
+    return rv > 0 ? rv : -1;
+}
+
+/* the payload of the request in msg, at the head of the receive buffer,
+ * is still arriving on a non-blocking connection: keep the request apart,
+ * with what came of its payload, until the rest does. payloads over any
+ * a request may have are left to the request, which refuses them */
+static int storage_stage(sd_conn_t *conn, struct rbdmsg_hdr *msg)
+{
+    unsigned long n = conn->rxtail - conn->rxhead - sizeof(*msg);
+
+    if (!conn->nonblock || n >= msg->payload_size ||
+        msg->payload_size > sd_zip_bound(RBD_MAX_TRANSFER) + RBD_CRC_SIZE(RBD_MAX_TRANSFER))
+        return 0;
+    if (!(conn->payload = malloc(msg->payload_size)))
+        return -1;
+    conn->next = *msg;
+    conn->staged = sd_now();
+    conn->rxhead += sizeof(*msg);
+    memcpy(conn->payload, conn->rxbuf + conn->rxhead, n);
+    conn->paylen = n;
+    conn->payhead = 0;
+    conn->rxhead = conn->rxtail = 0;
+    return 1;
+}
+
+/* QoS holds the request in msg, on a non-blocking connection: leave it
+ * where it is, with the time to park the connection for in conn->parked */
+static int storage_qos_park(sd_conn_t *conn, struct rbdmsg_hdr *msg)
+{
+    if (!conn->nonblock || (msg->code != CMD_READ && msg->code != CMD_WRITE))
+        return 0;
+    conn->parked = qos_try(conn->qos, msg->fsop_size, &conn->ticket);
+    return conn->parked != 0;
+}
+
+/* receive messages from a connection and process them
+ *
+ * a single recv takes as many queued bytes as fit in the receive buffer,
+ * and every complete header in it is processed before returning. a header
+ * split across reads stays buffered until the rest arrives.
+ *
+ * on non-blocking connections the recv only takes what is there, and the
+ * requests buffered wait while replies are left to send, or while QoS
+ * holds the next one (conn->parked)
+ *
+ * st   - storage 
+ * conn - connection where to extract messages from
+ */
+int storage_process(storage_t *st, sd_conn_t *conn)
+{
+    struct rbdmsg_hdr msg, req;
+    unsigned long long now, start;
+    ssize_t rv;
+
+    conn->parked = 0;
+    if (storage_flush(conn))
+        return -1;
+    if (conn->txhead < conn->txtail)
+        return 0;
+    if (conn->rxhead == conn->rxtail)
+        conn->rxhead = conn->rxtail = 0;
+    else if (conn->rxhead && (conn->nonblock || conn->rxtail - conn->rxhead < sizeof(msg))) {
+        memmove(conn->rxbuf, conn->rxbuf + conn->rxhead, conn->rxtail - conn->rxhead);
+        conn->rxtail -= conn->rxhead;
+        conn->rxhead = 0;
+    }
+
+    sd_log_flush();             /* before waiting for the client */
+    now = sd_now();
+    if (conn->payload) {
+        if ((rv = storage_recv(conn, conn->payload + conn->paylen, conn->next.payload_size - conn->paylen)) < 0)
+            return -1;
+        conn->paylen += rv;
+    } else if (conn->rxtail < SD_RXBUF) {
+        if ((rv = storage_recv(conn, conn->rxbuf + conn->rxtail, SD_RXBUF - conn->rxtail)) < 0)
+            return -1;
+        /* a header begun in an earlier recv arrived then */
+        if (conn->rxtail == conn->rxhead)
+            conn->arrival = now;
+        conn->rxtail += rv;
+    }
+
+    while (conn->txhead == conn->txtail) {
+        if (conn->payload) {
+            if (conn->paylen < conn->next.payload_size)
+                break;
+            msg = conn->next;
+            if (storage_qos_park(conn, &msg))
+                break;
+        } else {
+            if (conn->rxtail - conn->rxhead < sizeof(msg))
+                break;
+            memcpy(&msg, conn->rxbuf + conn->rxhead, sizeof(msg));
+            if ((rv = storage_stage(conn, &msg)) < 0)
+                return -1;
+            if (rv)
+                continue;
+            if (storage_qos_park(conn, &msg))
+                break;
+            conn->rxhead += sizeof(msg);
+        }
+        req = msg;
+        start = sd_now();
+        memset(conn->stage, 0, sizeof(conn->stage));
+        if (conn->payload)
+            conn->stage[STAGE_PAYLOAD] = start - conn->staged;
+        rv = storage_process_msg(st, conn, &msg);
+        qos_end(&conn->ticket);     /* if it never got to storage */
+        if (st->stats && req.code != CMD_CLOSE)
+            stats_add(st->stats, conn, &req, rv || msg.code == REP_ERR, start);
+        if (st->trace)
+            trace_add(st->trace, conn, &req, rv ? REP_ERR : msg.code, start);
+        if (conn->payload) {
+            free(conn->payload);
+            conn->payload = NULL;
+        }
+        conn->arrival = now;
+        if (rv)
+            return -1;
+    }
+    return 0;
+}
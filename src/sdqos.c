@@ -0,0 +1,466 @@
+/*
+ * Remote Block Device - per client QoS
+ *
+ * Rules, read from the file given to sd -Q, or sent to the stats socket
+ * (sd -S) as "qos RULE" at any time, limit a client, by address, every
+ * client without a rule of its own (*), or the whole volume:
+ *
+ *     ADDR|*|volume [iops=N] [bps=N] [burst=MS] [weight=N] [depth=N]
+ *
+ * A rule replaces the one before for the same clients, and what it does
+ * not give takes its default: no limits, buckets of QOS_BURST_MS of their
+ * rate and a weight of QOS_WEIGHT. Clients on the shared memory transport
+ * count as 127.0.0.1.
+ *
+ * Before going to storage, a request takes its tokens from the buckets of
+ * its client and of the volume, and sleeps first while either one is in
+ * debt. Then, when the volume has a depth, it waits in a fair queue until
+ * fewer than depth requests are in storage and it has the earliest virtual
+ * start of those waiting (start-time fair queuing), so that clients share
+ * storage in proportion to their weights, however many requests each one
+ * sends. A request keeps its place in the queue until it is out of
+ * storage, so that the slots of a connection process that dies are taken
+ * back, with qos_reap.
+ *
+ * qos_try says how long a request has to wait, without waiting. A
+ * connection process sleeps that long in qos_begin; a reactor parks the
+ * connection instead (see sd.c), and attends its other ones meanwhile.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <limits.h>
+#include <time.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <linux/futex.h>
+
+#include "sd.h"
+
+struct qos_waiter {
+    unsigned long long start;      /* virtual start */
+    int used;
+    int busy;                      /* in storage, not waiting any more */
+    pid_t owner;                   /* worker process */
+};
+
+struct qos_table {
+    int lock;
+    unsigned int seq;              /* futex, bumped when storage has room */
+    int rules;                     /* set once any rule was given */
+    unsigned int depth;            /* requests in storage at once, 0 for any */
+    unsigned int busy;             /* requests in storage, waiters with busy
+                                    * set */
+    unsigned int waiting;          /* sleeping on seq */
+    unsigned long long vtime;      /* virtual start of the last dispatched */
+    struct sd_qos_client any;      /* rule for clients without their own */
+    struct sd_qos_client volume;
+    struct sd_qos_client client[QOS_CLIENTS];
+    struct qos_waiter waiter[QOS_WAITERS];
+};
+
+static struct qos_table *qos;
+
+static void qos_lock(void)
+{
+    while (__atomic_test_and_set(&qos->lock, __ATOMIC_ACQUIRE))
+        sched_yield();
+}
+
+static void qos_unlock(void)
+{
+    __atomic_clear(&qos->lock, __ATOMIC_RELEASE);
+}
+
+static void qos_wake(void)
+{
+    qos->seq++;
+    if (qos->waiting)
+        syscall(SYS_futex, &qos->seq, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+}
+
+/* set the limits of c to those of rule, with full buckets */
+static void qos_set(struct sd_qos_client *c, struct sd_qos_client *rule, unsigned long long now)
+{
+    c->weight = rule->weight;
+    c->b.iops = rule->b.iops;
+    c->b.bps = rule->b.bps;
+    c->b.burst_ms = rule->b.burst_ms;
+    c->b.ios = c->b.iops * c->b.burst_ms / 1000.0;
+    c->b.bytes = c->b.bps * c->b.burst_ms / 1000.0;
+    c->b.refill = now;
+}
+
+static void qos_refill(struct qos_bucket *b, unsigned long long now)
+{
+    double t = (now - b->refill) / 1e9;
+
+    b->refill = now;
+    if (b->iops && (b->ios += t * b->iops) > b->iops * b->burst_ms / 1000.0)
+        b->ios = b->iops * b->burst_ms / 1000.0;
+    if (b->bps && (b->bytes += t * b->bps) > b->bps * b->burst_ms / 1000.0)
+        b->bytes = b->bps * b->burst_ms / 1000.0;
+}
+
+/* ns until b is out of debt */
+static unsigned long long qos_debt(struct qos_bucket *b)
+{
+    double ns = 0;
+
+    if (b->iops && b->ios < 0)
+        ns = -b->ios / b->iops * 1e9;
+    if (b->bps && b->bytes < 0 && -b->bytes / b->bps * 1e9 > ns)
+        ns = -b->bytes / b->bps * 1e9;
+    return ns;
+}
+
+static void qos_take(struct qos_bucket *b, unsigned long size)
+{
+    if (b->iops)
+        b->ios -= 1;
+    if (b->bps)
+        b->bytes -= size;
+}
+
+/* map the QoS table, to be shared by the workers started after */
+int qos_init(void)
+{
+    qos = mmap(NULL, sizeof(*qos), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (qos == MAP_FAILED) {
+        qos = NULL;
+        return -1;
+    }
+    qos->any.addr = QOS_ANY;
+    qos->any.weight = QOS_WEIGHT;
+    qos->any.b.burst_ms = QOS_BURST_MS;
+    qos->volume.weight = QOS_WEIGHT;
+    qos->volume.b.burst_ms = QOS_BURST_MS;
+    return 0;
+}
+
+/* slot of the client at addr, taking a free one, or the one attached
+ * longest ago without a rule of its own, if it is new. called with the
+ * lock held */
+static struct sd_qos_client *qos_client(unsigned int addr, unsigned long long now)
+{
+    struct sd_qos_client *c, *oldest = NULL;
+    int i;
+
+    for (i = 0; i < QOS_CLIENTS; i++) {
+        c = &qos->client[i];
+        if (c->addr == addr)
+            return c;
+        if (!c->pinned && (!oldest || !c->addr || (oldest->addr && c->used < oldest->used)))
+            oldest = c;
+    }
+    if (!oldest)                /* every slot has a rule: share the default */
+        return &qos->any;
+    c = oldest;
+    memset(c, 0, sizeof(*c));
+    c->addr = addr;
+    qos_set(c, &qos->any, now);
+    return c;
+}
+
+/* apply a rule, as described above */
+int qos_rule(const char *line)
+{
+    struct sd_qos_client rule, *c;
+    unsigned long long val, now;
+    unsigned int depth = 0;
+    struct in_addr in;
+    const char *p;
+    char who[32], key[16];
+    int i, n;
+
+    if (!qos || sscanf(line, " %31s%n", who, &n) != 1)
+        goto bad;
+    memset(&rule, 0, sizeof(rule));
+    rule.weight = QOS_WEIGHT;
+    rule.b.burst_ms = QOS_BURST_MS;
+    for (p = line + n; sscanf(p, " %15[a-z]=%llu%n", key, &val, &n) == 2; p += n)
+        if (!strcmp(key, "iops"))
+            rule.b.iops = val;
+        else if (!strcmp(key, "bps"))
+            rule.b.bps = val;
+        else if (!strcmp(key, "burst") && val)
+            rule.b.burst_ms = val;
+        else if (!strcmp(key, "weight") && val)
+            rule.weight = val;
+        else if (!strcmp(key, "depth") && !strcmp(who, "volume"))
+            depth = val;
+        else
+            goto bad;
+    while (*p == ' ' || *p == '\t' || *p == '\n' || *p == '\r')
+        p++;
+    if (*p || (strcmp(who, "volume") && strcmp(who, "*") && !inet_aton(who, &in)))
+        goto bad;
+
+    now = sd_now();
+    qos_lock();
+    qos->rules = 1;
+    if (!strcmp(who, "volume")) {
+        qos_set(&qos->volume, &rule, now);
+        qos->depth = depth;
+        qos_wake();             /* there may be room now */
+    } else if (!strcmp(who, "*")) {
+        qos_set(&qos->any, &rule, now);
+        for (i = 0; i < QOS_CLIENTS; i++)
+            if (qos->client[i].addr && !qos->client[i].pinned)
+                qos_set(&qos->client[i], &rule, now);
+    } else {
+        c = qos_client(in.s_addr, now);
+        if (c != &qos->any) {
+            c->pinned = 1;
+            qos_set(c, &rule, now);
+        }
+    }
+    qos_unlock();
+    return 0;
+
+bad:
+    errno = EINVAL;
+    return -1;
+}
+
+/* apply the rules in the file at path, one per line. # begins comments */
+int qos_load(const char *path)
+{
+    char line[256], *p;
+    int n = 0;
+    FILE *f;
+
+    if (!(f = fopen(path, "r")))
+        return -1;
+    while (fgets(line, sizeof(line), f)) {
+        n++;
+        if ((p = strchr(line, '#')))
+            *p = '\0';
+        if (strspn(line, " \t\r\n") == strlen(line))
+            continue;
+        if (qos_rule(line)) {
+            fprintf(stderr, "SD: bad QoS rule at %s:%d\n", path, n);
+            fclose(f);
+            return -1;
+        }
+    }
+    fclose(f);
+    return 0;
+}
+
+/* QoS state of the client connected on fd. NULL without a table */
+struct sd_qos_client *qos_attach(int fd)
+{
+    struct sockaddr_in addr;
+    socklen_t len = sizeof(addr);
+    struct sd_qos_client *c;
+    unsigned long long now;
+    unsigned int a = htonl(INADDR_LOOPBACK);
+
+    if (!qos)
+        return NULL;
+    if (!getpeername(fd, (struct sockaddr *)&addr, &len) && addr.sin_family == AF_INET)
+        a = addr.sin_addr.s_addr;
+    now = sd_now();
+    qos_lock();
+    c = qos_client(a, now);
+    c->used = now;
+    qos_unlock();
+    return c;
+}
+
+/* a request of c for size bytes is about to go to storage: ns it has to
+ * wait until its buckets and the fair queue let it, or 0 if it may go.
+ * t, zeroed before the first call, keeps its place meanwhile */
+unsigned long long qos_try(struct sd_qos_client *c, unsigned long size, struct qos_ticket *t)
+{
+    unsigned long long now, wait;
+    struct qos_waiter *w;
+    int i, first;
+
+    if (!c || !qos->rules || t->admitted)
+        return 0;
+    now = sd_now();
+    qos_lock();
+    if (!t->start) {
+        t->start = now;
+        c->requests++;
+    }
+    if (!t->taken) {
+        qos_refill(&c->b, now);
+        qos_refill(&qos->volume.b, now);
+        wait = qos_debt(&c->b);
+        if (qos_debt(&qos->volume.b) > wait)
+            wait = qos_debt(&qos->volume.b);
+        if (wait) {
+            if (!t->throttled)
+                c->throttled++;
+            t->throttled = 1;
+            qos_unlock();
+            return wait;
+        }
+        qos_take(&c->b, size);
+        qos_take(&qos->volume.b, size);
+        c->throttle_ns += now - t->start;
+        t->taken = 1;
+        t->queued = now;
+        t->vstart = c->finish > qos->vtime ? c->finish : qos->vtime;
+        if (qos->depth)
+            c->finish = t->vstart + (size + QOS_REQCOST) * QOS_WEIGHT / c->weight;
+    }
+
+    if (!t->slot && qos->depth) {
+        for (i = 0; i < QOS_WAITERS && qos->waiter[i].used; i++)
+            ;
+        if (i == QOS_WAITERS) {     /* the queue is full: wait for room */
+            t->seq = qos->seq;
+            qos_unlock();
+            return QOS_RECHECK_NS;
+        }
+        w = &qos->waiter[i];
+        w->start = t->vstart;
+        w->used = 1;
+        w->busy = 0;
+        w->owner = getpid();
+        t->slot = i + 1;
+    }
+    if (t->slot) {
+        first = 1;
+        for (i = 0; i < QOS_WAITERS && first; i++) {
+            w = &qos->waiter[i];
+            if (i != t->slot - 1 && w->used && !w->busy && (w->start < t->vstart ||
+                                                            (w->start == t->vstart && i < t->slot - 1)))
+                first = 0;
+        }
+        if (!first || (qos->depth && qos->busy >= qos->depth)) {
+            t->seq = qos->seq;
+            qos_unlock();
+            return QOS_RECHECK_NS;
+        }
+        qos->waiter[t->slot - 1].busy = 1;
+        qos->busy++;
+        if (t->vstart > qos->vtime)
+            qos->vtime = t->vstart;
+        if (!qos->depth || qos->busy < qos->depth)
+            qos_wake();             /* the next one may go too */
+        c->queued_ns += now - t->queued;
+    }
+    t->admitted = 1;
+    qos_unlock();
+    return 0;
+}
+
+/* wait until qos_try lets the request go */
+void qos_begin(struct sd_qos_client *c, unsigned long size, struct qos_ticket *t)
+{
+    struct timespec ts;
+    unsigned long long wait;
+
+    while ((wait = qos_try(c, size, t))) {
+        if (!t->taken) {
+            ts.tv_sec = wait / 1000000000ULL;
+            ts.tv_nsec = wait % 1000000000ULL;
+            nanosleep(&ts, NULL);
+            continue;
+        }
+        /* waiting for the queue: until it moves. a wakeup since qos_try
+         * looked at it changed seq, and then there is no sleep at all */
+        ts.tv_sec = 0;
+        ts.tv_nsec = 10000000L;     /* in case a wakeup is lost */
+        qos_lock();
+        qos->waiting++;
+        qos_unlock();
+        syscall(SYS_futex, &qos->seq, FUTEX_WAIT, t->seq, &ts, NULL, 0);
+        qos_lock();
+        qos->waiting--;
+        qos_unlock();
+    }
+}
+
+/* the request of t is out of storage, or was given up before it got
+ * there: leave the fair queue, and zero t for the next one */
+void qos_end(struct qos_ticket *t)
+{
+    struct qos_waiter *w;
+
+    if (t->slot) {
+        qos_lock();
+        w = &qos->waiter[t->slot - 1];
+        if (w->busy)
+            qos->busy--;
+        memset(w, 0, sizeof(*w));
+        qos_wake();
+        qos_unlock();
+    }
+    memset(t, 0, sizeof(*t));
+}
+
+/* leave the slots of connection process pid, which may not have done it
+ * if it was killed */
+void qos_reap(int pid)
+{
+    struct qos_waiter *w;
+    int i, n = 0;
+
+    if (!qos)
+        return;
+    qos_lock();
+    for (i = 0; i < QOS_WAITERS; i++) {
+        w = &qos->waiter[i];
+        if (w->used && w->owner == pid) {
+            if (w->busy)
+                qos->busy--;
+            memset(w, 0, sizeof(*w));
+            n++;
+        }
+    }
+    if (n)
+        qos_wake();
+    qos_unlock();
+}
+
+static void qos_report_client(FILE *f, int json, const char *name, struct sd_qos_client *c)
+{
+    if (json)
+        fprintf(f, "%s{\"client\": \"%s\", \"iops\": %llu, \"bps\": %llu, \"burst_ms\": %u, "
+                "\"weight\": %u, \"requests\": %llu, \"throttled\": %llu, \"throttle_ms\": %.1f, "
+                "\"queued_ms\": %.1f}", c == &qos->volume ? "" : ", ", name, c->b.iops, c->b.bps,
+                c->b.burst_ms, c->weight, c->requests, c->throttled, c->throttle_ns / 1e6,
+                c->queued_ns / 1e6);
+    else
+        fprintf(f, "  %-15s %8llu %11llu %6u %7u %10llu %10llu %13.1f %11.1f\n", name, c->b.iops,
+                c->b.bps, c->b.burst_ms, c->weight, c->requests, c->throttled,
+                c->throttle_ns / 1e6, c->queued_ns / 1e6);
+}
+
+/* write the rules and the throttle counts of every client to f, as text
+ * or as members of a JSON object. nothing until a rule is given */
+void qos_report(FILE *f, int json)
+{
+    struct in_addr in;
+    int i;
+
+    if (!qos || !qos->rules)
+        return;
+    if (json)
+        fprintf(f, ", \"qos\": {\"depth\": %u, \"busy\": %u, \"clients\": [", qos->depth, qos->busy);
+    else
+        fprintf(f, "SD: qos | depth %u | busy %u\n"
+                "  client              iops         bps  burst  weight   requests  throttled"
+                "  throttle(ms)  queued(ms)\n", qos->depth, qos->busy);
+    qos_report_client(f, json, "volume", &qos->volume);
+    qos_report_client(f, json, "*", &qos->any);
+    for (i = 0; i < QOS_CLIENTS; i++)
+        if (qos->client[i].addr) {
+            in.s_addr = qos->client[i].addr;
+            qos_report_client(f, json, inet_ntoa(in), &qos->client[i]);
+        }
+    if (json)
+        fprintf(f, "]}");
+}
@@ -0,0 +1,393 @@
+/*
+ * Remote Block Device - synchronous replication
+ *
+ * An SD started with -R forwards every CMD_WRITE to its replicas (other
+ * SDs holding a volume of the same size) before writing it locally, and
+ * collects their replies afterwards, so the local write and the remote
+ * ones overlap. The write is acknowledged when the local copy plus the
+ * replicas that accepted it reach the quorum (-q). Reads stay local.
+ *
+ * A replica that fails is marked degraded: from then on writes only mark
+ * the SD_REPL_REGION regions they touch in its dirty bitmap (FILE.rep,
+ * shared by every worker and kept across restarts). A resync process per
+ * replica reconnects, copies the dirty regions and marks it in sync
+ * again. Writes hold a shared lock on the regions they touch while the
+ * resync holds an exclusive one on the region it copies, so a resync never
+ * sends data older than what a write already forwarded.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/mman.h>
+#include <sys/prctl.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#include "sd.h"
+
+#define SD_REPL_POLL 1              /* seconds between dirty bitmap scans */
+#define SD_REPL_RETRY 5             /* seconds between reconnection attempts */
+#define SD_REPL_LOCKBASE (1LL << 40) /* region locks offset in FILE.rep */
+
+/* parse a HOST:PORT replica address. HOST must be an IPv4 address in 
+ * dotted quad notation: names are not resolved */
+int repl_parse(struct sd_repl_config *cfg, const char *addr)
+{
+    const char *colon = strrchr(addr, ':');
+    int n = cfg->nreplicas;
+    struct in_addr in;
+
+    if (n == SD_MAXREPLICAS || !colon || colon == addr || colon - addr >= sizeof(cfg->host[n]))
+        return -1;
+    memcpy(cfg->host[n], addr, colon - addr);
+    cfg->host[n][colon - addr] = '\0';
+    if (inet_pton(AF_INET, cfg->host[n], &in) != 1)
+        return -1;
+    if ((cfg->port[n] = atoi(colon + 1)) <= 0 || cfg->port[n] > 65535)
+        return -1;
+    cfg->nreplicas++;
+    return 0;
+}
+
+/* map the replication state file of st, starting over (every region
+ * dirty) for replicas it does not know yet, or whose volume changed size */
+int repl_setup(struct sd_repl_config *cfg, storage_t *st)
+{
+    unsigned long nregions, nbytes, hdrsize;
+    struct sd_repmap *m;
+    char *p;
+    int fd, i;
+
+    nregions = (st->metadata->size + SD_REPL_REGION - 1) / SD_REPL_REGION;
+    nbytes = (nregions + 7) / 8;
+    hdrsize = (SD_MAXREPLICAS * sizeof(struct sd_repmap) + STORAGE_ALIGN - 1) & ~(STORAGE_ALIGN - 1);
+    cfg->size = hdrsize + SD_MAXREPLICAS * nbytes;
+
+    storage_sidecar(st, ".rep", cfg->path);
+    if ((fd = open(cfg->path, O_RDWR | O_CREAT, 0644)) == -1)
+        return -1;
+    if (ftruncate(fd, cfg->size)) {
+        close(fd);
+        return -1;
+    }
+    p = mmap(NULL, cfg->size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (p == MAP_FAILED)
+        return -1;
+    cfg->base = p;
+
+    for (i = 0; i < cfg->nreplicas; i++) {
+        m = cfg->map[i] = (struct sd_repmap *)p + i;
+        cfg->bits[i] = (unsigned char *)p + hdrsize + i * nbytes;
+        if (!strcmp(m->host, cfg->host[i]) && m->port == cfg->port[i] && m->nregions == nregions)
+            continue;
+        printf("SD: replica %s:%d | new, full resync\n", cfg->host[i], cfg->port[i]);
+        memset(m, 0, sizeof(*m));
+        strcpy(m->host, cfg->host[i]);
+        m->port = cfg->port[i];
+        m->nregions = nregions;
+        m->state = REPL_DEGRADED;
+        memset(cfg->bits[i], 0xff, nbytes);
+    }
+    return msync(p, cfg->size, MS_SYNC);
+}
+
+/* replication state for a new worker */
+struct sd_repl *repl_new(struct sd_repl_config *cfg)
+{
+    struct sd_repl *r;
+    int i;
+
+    if (!(r = calloc(1, sizeof(*r))))
+        return NULL;
+    r->cfg = cfg;
+    for (i = 0; i < SD_MAXREPLICAS; i++)
+        r->sockfd[i] = -1;
+    /* a descriptor of its own, so that its locks conflict with the ones
+     * of other threads */
+    if ((r->lockfd = open(cfg->path, O_RDWR)) == -1) {
+        free(r);
+        return NULL;
+    }
+    return r;
+}
+
+static int repl_lock(struct sd_repl *r, unsigned long first, unsigned long last, int type)
+{
+    struct flock fl;
+
+    memset(&fl, 0, sizeof(fl));
+    fl.l_type = type;
+    fl.l_whence = SEEK_SET;
+    fl.l_start = SD_REPL_LOCKBASE + first;
+    fl.l_len = last - first + 1;
+    while (fcntl(r->lockfd, F_OFD_SETLKW, &fl) == -1)
+        if (errno != EINTR)
+            return -1;
+    return 0;
+}
+
+static void repl_unlock(struct sd_repl *r, unsigned long first, unsigned long last)
+{
+    repl_lock(r, first, last, F_UNLCK);
+}
+
+static void repl_mark(struct sd_repl_config *cfg, int i, unsigned long first, unsigned long last)
+{
+    unsigned long n;
+
+    /* regions added by an online resize are not tracked: copy everything */
+    if (last >= cfg->map[i]->nregions) {
+        first = 0;
+        last = cfg->map[i]->nregions - 1;
+    }
+    for (n = first; n <= last; n++)
+        __sync_fetch_and_or(&cfg->bits[i][n / 8], 1 << (n % 8));
+}
+
+static int repl_connect(struct sd_repl_config *cfg, int i)
+{
+    struct sockaddr_in addr;
+    int fd, yes = 1;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(cfg->port[i]);
+    if (inet_pton(AF_INET, cfg->host[i], &addr.sin_addr) != 1) {
+        errno = EINVAL;
+        return -1;
+    }
+    if ((fd = socket(PF_INET, SOCK_STREAM, 0)) == -1)
+        return -1;
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
+        close(fd);
+        return -1;
+    }
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof(yes));
+    return fd;
+}
+
+static void repl_degrade(struct sd_repl *r, int i)
+{
+    if (r->sockfd[i] != -1)
+        close(r->sockfd[i]);
+    r->sockfd[i] = -1;
+    if (__sync_bool_compare_and_swap(&r->cfg->map[i]->state, REPL_SYNCED, REPL_DEGRADED))
+        fprintf(stderr, "SD: replica %s:%d | degraded\n", r->cfg->host[i], r->cfg->port[i]);
+}
+
+/* send a CMD_WRITE of size bytes at offset to replica i */
+static int repl_send(struct sd_repl *r, int i, const void *buf, unsigned long offset, unsigned long size)
+{
+    struct rbdmsg_hdr msg;
+    struct iovec iov[2];
+    struct msghdr mh;
+    ssize_t rv;
+
+    memset(&msg, 0, sizeof(msg));
+    msg.version = PROTO_VERSION;
+    msg.type = CMD;
+    msg.code = CMD_WRITE;
+    msg.id = ++r->msgid;
+    msg.payload_size = size;
+    msg.fsop_offset_sectors = offset / STORAGE_SECSIZE;
+    msg.fsop_size = size;
+
+    iov[0].iov_base = &msg;
+    iov[0].iov_len = sizeof(msg);
+    iov[1].iov_base = (void *)buf;
+    iov[1].iov_len = size;
+    memset(&mh, 0, sizeof(mh));
+    mh.msg_iov = iov;
+    mh.msg_iovlen = 2;
+    while (mh.msg_iovlen) {
+        rv = sendmsg(r->sockfd[i], &mh, MSG_NOSIGNAL);
+        if (rv < 0 && errno == EINTR)
+            continue;
+        if (rv <= 0)
+            return -1;
+        while (mh.msg_iovlen && rv >= mh.msg_iov->iov_len) {
+            rv -= mh.msg_iov->iov_len;
+            mh.msg_iov++;
+            mh.msg_iovlen--;
+        }
+        if (mh.msg_iovlen) {
+            mh.msg_iov->iov_base = (char *)mh.msg_iov->iov_base + rv;
+            mh.msg_iov->iov_len -= rv;
+        }
+    }
+    return 0;
+}
+
+/* wait for the reply of replica i to the write just sent */
+static int repl_recv(struct sd_repl *r, int i)
+{
+    struct rbdmsg_hdr rsp;
+    char *p = (char *)&rsp;
+    size_t got = 0;
+    ssize_t rv;
+
+    while (got < sizeof(rsp)) {
+        rv = recv(r->sockfd[i], p + got, sizeof(rsp) - got, 0);
+        if (rv < 0 && errno == EINTR)
+            continue;
+        if (rv <= 0)
+            return -1;
+        got += rv;
+    }
+    if (rsp.id != r->msgid || rsp.payload_size)
+        return -1;
+    return rsp.code == REP_ERR ? -1 : 0;
+}
+
+/* write size bytes at offset locally and on the replicas. fails if the
+ * local write fails or the quorum is not reached */
+int repl_write(storage_t *st, const void *buf, unsigned long offset, unsigned long size, const unsigned int *crcs)
+{
+    struct sd_repl *r = st->repl;
+    struct sd_repl_config *cfg = r->cfg;
+    unsigned long first, last;
+    int sent[SD_MAXREPLICAS];
+    int i, rv, copies = 1;
+
+    if (!size)
+        return storage_write_crc(st, buf, offset, size, crcs);
+    first = offset / SD_REPL_REGION;
+    last = (offset + size - 1) / SD_REPL_REGION;
+    if (repl_lock(r, first, last, F_RDLCK))
+        return -1;
+
+    for (i = 0; i < cfg->nreplicas; i++) {
+        sent[i] = 0;
+        if (cfg->map[i]->state == REPL_SYNCED) {
+            if (r->sockfd[i] != -1 && r->gen[i] != cfg->map[i]->gen) {
+                close(r->sockfd[i]);     /* from before it was degraded */
+                r->sockfd[i] = -1;
+            }
+            if (r->sockfd[i] == -1) {
+                r->gen[i] = cfg->map[i]->gen;
+                r->sockfd[i] = repl_connect(cfg, i);
+            }
+            if (r->sockfd[i] != -1 && !repl_send(r, i, buf, offset, size))
+                sent[i] = 1;
+            else
+                repl_degrade(r, i);
+        }
+        if (!sent[i])
+            repl_mark(cfg, i, first, last);
+    }
+
+    rv = storage_write_crc(st, buf, offset, size, crcs);
+
+    for (i = 0; i < cfg->nreplicas; i++) {
+        if (rv)                          /* the replicas must get the local data back */
+            repl_mark(cfg, i, first, last);
+        if (!sent[i])
+            continue;
+        if (repl_recv(r, i)) {
+            repl_degrade(r, i);
+            repl_mark(cfg, i, first, last);
+        } else
+            copies++;
+    }
+    repl_unlock(r, first, last);
+
+    if (!rv && copies < cfg->quorum) {
+        fprintf(stderr, "SD: write at %lu | %d copies, quorum is %d\n", offset, copies, cfg->quorum);
+        errno = EIO;
+        rv = -1;
+    }
+    return rv;
+}
+
+/* bytes of the dirty bitmap of replica i with some region set */
+static long repl_dirty(struct sd_repl_config *cfg, int i)
+{
+    unsigned long n;
+    long dirty = 0;
+
+    for (n = 0; n < (cfg->map[i]->nregions + 7) / 8; n++)
+        dirty += cfg->bits[i][n] != 0;
+    return dirty;
+}
+
+/* copy the dirty regions to replica i. returns the regions still dirty,
+ * or -1 if the replica failed */
+static long repl_resync(storage_t *st, struct sd_repl *r, int i, char *buf)
+{
+    struct sd_repl_config *cfg = r->cfg;
+    unsigned long n, offset, len;
+    int rv;
+
+    for (n = 0; n < cfg->map[i]->nregions; n++) {
+        if (!(cfg->bits[i][n / 8] & (1 << (n % 8))))
+            continue;
+        if (repl_lock(r, n, n, F_WRLCK))
+            return -1;
+        __sync_fetch_and_and(&cfg->bits[i][n / 8], ~(1 << (n % 8)));
+        offset = n * SD_REPL_REGION;
+        len = st->metadata->size - offset < SD_REPL_REGION ? st->metadata->size - offset : SD_REPL_REGION;
+        rv = storage_read(st, buf, offset, len);
+        if (!rv)
+            rv = repl_send(r, i, buf, offset, len) || repl_recv(r, i);
+        if (rv)
+            repl_mark(cfg, i, n, n);
+        repl_unlock(r, n, n);
+        if (rv)
+            return -1;
+        cfg->map[i]->resynced++;
+    }
+    return repl_dirty(cfg, i);
+}
+
+/* resync process of replica i: brings it back in sync whenever it has
+ * dirty regions. never returns */
+void repl_resync_run(storage_t *sd_st, struct sd_repl_config *cfg, int i)
+{
+    struct sd_repl *r;
+    storage_t st;
+    char *buf;
+    long dirty;
+
+    prctl(PR_SET_PDEATHSIG, SIGTERM);
+    storage_dup(&st, sd_st);
+    if (!(r = repl_new(cfg)) || !(buf = storage_getbuf(&st, SD_REPL_REGION))) {
+        perror("SD: replica resync");
+        exit(1);
+    }
+
+    while (1) {
+        sleep(SD_REPL_POLL);
+        if (cfg->map[i]->state == REPL_SYNCED && !repl_dirty(cfg, i))
+            continue;
+        if (r->sockfd[i] == -1) {
+            if ((r->sockfd[i] = repl_connect(cfg, i)) == -1) {
+                sleep(SD_REPL_RETRY);
+                continue;
+            }
+        }
+        if ((dirty = repl_resync(&st, r, i, buf)) == -1) {
+            close(r->sockfd[i]);
+            r->sockfd[i] = -1;
+            continue;
+        }
+        if (!dirty && cfg->map[i]->state == REPL_DEGRADED) {
+            cfg->map[i]->gen++;
+            __sync_synchronize();
+            cfg->map[i]->state = REPL_SYNCED;
+            printf("SD: replica %s:%d | in sync | %lu regions resynced\n",
+                   cfg->host[i], cfg->port[i], cfg->map[i]->resynced);
+            fflush(stdout);
+        }
+    }
+}
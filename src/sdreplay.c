@@ -0,0 +1,393 @@
+/*
+ * Remote Block Device - protocol trace replay
+ *
+ * Sends the reads and writes of a trace recorded with sd -T to an SD,
+ * on a connection per traced connection, and in the order they arrived
+ * on each one. By default every request is sent when it arrived in the
+ * trace, counted from the first one, whether the replies to the ones
+ * before are back or not; with -a each connection sends as fast as it
+ * can with DEPTH requests in flight. Writes carry a fixed pattern, since
+ * traces have no data, and requests beyond the end of a smaller volume
+ * wrap around.
+ *
+ * The latencies seen are compared with the service times in the trace,
+ * and in timed replays the lag of every request behind its time tells
+ * how faithful the replay was.
+ */
+
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <semaphore.h>
+
+#include "sd.h"
+
+#define REPLAY_MAXCONNS 256             /* traced connections beyond are folded */
+#define REPLAY_MAXDEPTH 256
+
+struct replay_conn {
+    int fd;
+    pthread_t sender, receiver;
+    unsigned long *recs;                /* indexes of its records, in order */
+    unsigned long nrecs;
+    sem_t window;
+    sem_t inflight;                     /* requests sent, plus one at the end */
+    pthread_mutex_t mutex;
+    unsigned long long sent[REPLAY_MAXDEPTH];
+    unsigned long long nsent, nrecv, errors, bytes;
+    char *buf;
+    struct sd_hist hist;                /* latencies */
+    struct sd_hist lag;                 /* behind the trace, when timed */
+};
+
+static const char *host = "127.0.0.1";
+static int port = SDPORT;
+static int asap;
+static int depth = 32;
+static int json;
+
+static struct trace_rec *trace;
+static unsigned long ntrace;
+static unsigned long dev_sectors;
+static unsigned long long t0;           /* replay start */
+static volatile int failed;
+
+static struct replay_conn conns[REPLAY_MAXCONNS];
+static int nconns;
+
+void usage(void) {
+    printf("Usage: sdreplay [-h HOST] [-p PORT] [-a] [-q DEPTH] [-j] TRACE\n");
+    printf("       sdreplay -l TRACE\n\n");
+    printf("HOST    - SD address. default: 127.0.0.1\n");
+    printf("PORT    - SD port. default: %d\n", SDPORT);
+    printf("-a      - as fast as possible, instead of at the times in the trace\n");
+    printf("DEPTH   - requests in flight on each connection with -a. default: 32\n");
+    printf("-j      - results as a JSON object, instead of a table\n");
+    printf("-l      - list the records of the trace, instead of replaying it\n");
+    printf("TRACE   - trace recorded with sd -T\n");
+    exit(2);
+}
+
+static int full_write(int fd, void *buf, size_t size)
+{
+    ssize_t rv;
+
+    while (size) {
+        if ((rv = send(fd, buf, size, 0)) <= 0)
+            return -1;
+        buf += rv;
+        size -= rv;
+    }
+    return 0;
+}
+
+static int full_read(int fd, void *buf, size_t size)
+{
+    ssize_t rv;
+
+    while (size) {
+        if ((rv = recv(fd, buf, size, MSG_WAITALL)) <= 0)
+            return -1;
+        buf += rv;
+        size -= rv;
+    }
+    return 0;
+}
+
+static int replay_connect(void)
+{
+    struct sockaddr_in addr;
+    int fd, yes = 1;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = inet_addr(host);
+    if ((fd = socket(AF_INET, SOCK_STREAM, 0)) == -1)
+        return -1;
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
+        close(fd);
+        return -1;
+    }
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof(yes));
+    return fd;
+}
+
+static int replay_request(int fd, unsigned int id, int code, unsigned long sector,
+                          void *buf, unsigned long size)
+{
+    struct rbdmsg_hdr msg;
+
+    memset(&msg, 0, sizeof(msg));
+    msg.version = PROTO_VERSION;
+    msg.type = CMD;
+    msg.code = code;
+    msg.id = id;
+    msg.fsop_offset_sectors = sector;
+    msg.fsop_size = size;
+    msg.payload_size = code == CMD_WRITE ? size : 0;
+    if (full_write(fd, &msg, sizeof(msg)))
+        return -1;
+    return msg.payload_size ? full_write(fd, buf, size) : 0;
+}
+
+static int replay_getsz(int fd, unsigned long *sectors)
+{
+    struct rbdmsg_hdr rsp;
+
+    if (replay_request(fd, 0, CMD_GETSZ, 0, NULL, 0) || full_read(fd, &rsp, sizeof(rsp)) ||
+        rsp.payload_size != sizeof(*sectors) || full_read(fd, sectors, sizeof(*sectors)))
+        return -1;
+    return 0;
+}
+
+static void *replay_sender(void *arg)
+{
+    struct replay_conn *c = arg;
+    struct trace_rec *r;
+    struct timespec ts;
+    unsigned long long due, now, i;
+    unsigned long sector, nsect;
+
+    for (i = 0; i < c->nrecs && !failed; i++) {
+        r = &trace[c->recs[i]];
+        sem_wait(&c->window);
+        now = sd_now();
+        if (!asap) {
+            due = t0 + (r->arrival - trace[0].arrival);
+            if (due > now) {
+                ts.tv_sec = due / 1000000000ULL;
+                ts.tv_nsec = due % 1000000000ULL;
+                clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL);
+                now = sd_now();
+            }
+            hist_add(&c->lag, now > due ? now - due : 0);
+        }
+        nsect = r->size / STORAGE_SECSIZE;
+        sector = r->offset_sectors;
+        if (sector + nsect > dev_sectors)
+            sector %= dev_sectors - nsect + 1;
+        pthread_mutex_lock(&c->mutex);
+        c->sent[c->nsent++ % REPLAY_MAXDEPTH] = now;
+        pthread_mutex_unlock(&c->mutex);
+        if (replay_request(c->fd, r->id, r->code, sector, c->buf, r->size))
+            break;
+        sem_post(&c->inflight);
+    }
+    sem_post(&c->inflight);
+    return NULL;
+}
+
+static void *replay_receiver(void *arg)
+{
+    struct replay_conn *c = arg;
+    struct rbdmsg_hdr rsp;
+    unsigned long long sent;
+    char *data = malloc(RBD_MAX_TRANSFER);
+    int last;
+
+    while (1) {
+        sem_wait(&c->inflight);
+        pthread_mutex_lock(&c->mutex);
+        last = c->nrecv == c->nsent;
+        pthread_mutex_unlock(&c->mutex);
+        if (last)
+            break;
+
+        if (full_read(c->fd, &rsp, sizeof(rsp)) || rsp.payload_size > RBD_MAX_TRANSFER ||
+            full_read(c->fd, data, rsp.payload_size)) {
+            fprintf(stderr, "SDREPLAY: connection lost\n");
+            failed = 1;
+            break;
+        }
+        pthread_mutex_lock(&c->mutex);
+        sent = c->sent[c->nrecv++ % REPLAY_MAXDEPTH];
+        pthread_mutex_unlock(&c->mutex);
+        hist_add(&c->hist, sd_now() - sent);
+        if (rsp.code == REP_ERR)
+            c->errors++;
+        else
+            c->bytes += rsp.fsop_size;
+        sem_post(&c->window);
+    }
+    free(data);
+    return NULL;
+}
+
+static void replay_list(struct trace_header *hdr)
+{
+    unsigned long i;
+
+    printf("# started at %llu.%09llu\n", hdr->realtime / 1000000000ULL, hdr->realtime % 1000000000ULL);
+    printf("# time(us) conn id code sector size service(us) reply\n");
+    for (i = 0; i < ntrace; i++)
+        printf("%.3f %u %u %u %u %u %.3f %u\n", (trace[i].arrival - trace[0].arrival) / 1e3,
+               trace[i].conn, trace[i].id, trace[i].code, trace[i].offset_sectors, trace[i].size,
+               trace[i].service / 1e3, trace[i].reply);
+}
+
+/* spread the reads and writes of the trace among the connections, by
+ * traced connection */
+static unsigned long replay_assign(struct sd_hist *service)
+{
+    unsigned int ids[REPLAY_MAXCONNS];
+    unsigned short *which = malloc(ntrace * sizeof(unsigned short) + 1);
+    unsigned long i, n = 0;
+    struct trace_rec *r;
+    int k;
+
+    for (i = 0; i < ntrace; i++) {
+        r = &trace[i];
+        which[i] = REPLAY_MAXCONNS;
+        if ((r->code != CMD_READ && r->code != CMD_WRITE) || r->size > RBD_MAX_TRANSFER ||
+            r->size / STORAGE_SECSIZE > dev_sectors)
+            continue;
+        for (k = 0; k < nconns && ids[k] != r->conn; k++)
+            ;
+        if (k == nconns) {
+            if (nconns < REPLAY_MAXCONNS)
+                ids[nconns++] = r->conn;
+            else
+                k = r->conn % REPLAY_MAXCONNS;
+        }
+        which[i] = k;
+        conns[k].nrecs++;
+        hist_add(service, r->service);
+        n++;
+    }
+    for (k = 0; k < nconns; k++) {
+        conns[k].recs = malloc(conns[k].nrecs * sizeof(unsigned long) + 1);
+        conns[k].nrecs = 0;
+    }
+    for (i = 0; i < ntrace; i++)
+        if ((k = which[i]) < REPLAY_MAXCONNS)
+            conns[k].recs[conns[k].nrecs++] = i;
+    free(which);
+    return n;
+}
+
+int main(int argc, char **argv)
+{
+    struct trace_header hdr;
+    struct sd_hist *hist, *lag, *service;
+    unsigned long long errors = 0, bytes = 0;
+    unsigned long n;
+    double t, span;
+    int list = 0;
+    int c, i;
+
+    while ((c = getopt(argc, argv, "h:p:aq:jl")) != -1)
+        switch (c) {
+            case 'h':
+                host = optarg;
+                break;
+            case 'p':
+                port = atoi(optarg);
+                break;
+            case 'a':
+                asap = 1;
+                break;
+            case 'q':
+                depth = atoi(optarg);
+                break;
+            case 'j':
+                json = 1;
+                break;
+            case 'l':
+                list = 1;
+                break;
+            default:
+                usage();
+        }
+    if (argc == optind || depth < 1 || depth > REPLAY_MAXDEPTH)
+        usage();
+
+    if (trace_load(argv[optind], &hdr, &trace, &ntrace)) {
+        fprintf(stderr, "SDREPLAY: error loading trace %s: %s\n", argv[optind], strerror(errno));
+        return 1;
+    }
+    if (list) {
+        replay_list(&hdr);
+        return 0;
+    }
+
+    if ((conns[0].fd = replay_connect()) == -1 || replay_getsz(conns[0].fd, &dev_sectors)) {
+        fprintf(stderr, "SDREPLAY: connecting to %s:%d: %s\n", host, port, strerror(errno));
+        return 1;
+    }
+    hist = calloc(1, sizeof(*hist));
+    lag = calloc(1, sizeof(*lag));
+    service = calloc(1, sizeof(*service));
+    n = replay_assign(service);
+    if (!n) {
+        fprintf(stderr, "SDREPLAY: no reads or writes to replay\n");
+        return 1;
+    }
+
+    for (i = 0; i < nconns; i++) {
+        if (i && (conns[i].fd = replay_connect()) == -1) {
+            fprintf(stderr, "SDREPLAY: connecting to %s:%d: %s\n", host, port, strerror(errno));
+            return 1;
+        }
+        pthread_mutex_init(&conns[i].mutex, NULL);
+        sem_init(&conns[i].window, 0, asap ? depth : REPLAY_MAXDEPTH);
+        sem_init(&conns[i].inflight, 0, 0);
+        conns[i].buf = malloc(RBD_MAX_TRANSFER);
+        memset(conns[i].buf, 0xa5, RBD_MAX_TRANSFER);
+    }
+
+    t0 = sd_now();
+    for (i = 0; i < nconns; i++) {
+        pthread_create(&conns[i].sender, NULL, replay_sender, &conns[i]);
+        pthread_create(&conns[i].receiver, NULL, replay_receiver, &conns[i]);
+    }
+    for (i = 0; i < nconns; i++) {
+        pthread_join(conns[i].sender, NULL);
+        pthread_join(conns[i].receiver, NULL);
+        hist_merge(hist, &conns[i].hist);
+        hist_merge(lag, &conns[i].lag);
+        errors += conns[i].errors;
+        bytes += conns[i].bytes;
+        replay_request(conns[i].fd, 0, CMD_CLOSE, 0, NULL, 0);
+        close(conns[i].fd);
+    }
+    t = (sd_now() - t0) / 1e9;
+    span = (trace[ntrace - 1].arrival - trace[0].arrival) / 1e9;
+
+    if (json)
+        printf("{\"requests\": %lu, \"replayed\": %llu, \"conns\": %d, \"mode\": \"%s\", "
+               "\"trace_seconds\": %.3f, \"seconds\": %.3f, \"errors\": %llu, \"iops\": %.1f, "
+               "\"mbs\": %.2f, \"p50_us\": %.1f, \"p99_us\": %.1f, \"p999_us\": %.1f, "
+               "\"max_us\": %.1f, \"traced_p50_us\": %.1f, \"traced_p99_us\": %.1f, "
+               "\"traced_p999_us\": %.1f, \"lag_p99_us\": %.1f, \"lag_max_us\": %.1f}\n",
+               n, hist->n, nconns, asap ? "asap" : "timed", span, t, errors, hist->n / t,
+               bytes / t / (1024 * 1024), hist_percentile(hist, 0.5) / 1e3,
+               hist_percentile(hist, 0.99) / 1e3, hist_percentile(hist, 0.999) / 1e3,
+               hist->max / 1e3, hist_percentile(service, 0.5) / 1e3,
+               hist_percentile(service, 0.99) / 1e3, hist_percentile(service, 0.999) / 1e3,
+               hist_percentile(lag, 0.99) / 1e3, lag->max / 1e3);
+    else {
+        printf("requests %lu on %d connections | replayed %llu | errors %llu\n", n, nconns, hist->n, errors);
+        printf("%.3f s (%.3f s traced) | %.1f iops | %.2f MB/s\n", t, span, hist->n / t,
+               bytes / t / (1024 * 1024));
+        printf("           p50(us)   p99(us)  p999(us)   max(us)\n");
+        printf("latency  %9.1f %9.1f %9.1f %9.1f\n", hist_percentile(hist, 0.5) / 1e3,
+               hist_percentile(hist, 0.99) / 1e3, hist_percentile(hist, 0.999) / 1e3, hist->max / 1e3);
+        printf("traced   %9.1f %9.1f %9.1f %9.1f\n", hist_percentile(service, 0.5) / 1e3,
+               hist_percentile(service, 0.99) / 1e3, hist_percentile(service, 0.999) / 1e3,
+               service->max / 1e3);
+        if (!asap)
+            printf("lag      %9.1f %9.1f %9.1f %9.1f\n", hist_percentile(lag, 0.5) / 1e3,
+                   hist_percentile(lag, 0.99) / 1e3, hist_percentile(lag, 0.999) / 1e3, lag->max / 1e3);
+    }
+    return failed || hist->n < n;
+}
@@ -0,0 +1,121 @@
+/*
+ * Remote Block Device - write sessions
+ *
+ * A client that loses a connection cannot tell whether the writes it was
+ * waiting for were done. With RBD_FEAT_SESSION it names a session in
+ * CMD_HELLO and keeps it, and its message ids, on the next connection,
+ * where it sends those writes again. The SD remembers the replies to the
+ * writes among the last SESSION_WRITES messages of every session, in a
+ * table mapped shared before any worker is started, so that a write sent
+ * again is answered as it was the first time instead of being done twice,
+ * whichever connection process or reactor thread did it.
+ *
+ * Every message id has its place in the ring of its session, so finding
+ * a write is a single comparison. The table is small and seldom touched
+ * for long, so a single spin lock guards it.
+ */
+
+#include <string.h>
+#include <unistd.h>
+#include <sched.h>
+#include <sys/mman.h>
+
+#include "sd.h"
+
+struct session_table {
+    int lock;
+    struct sd_session slot[SESSION_SLOTS];
+};
+
+static struct session_table *sessions;
+
+static void session_lock(void)
+{
+    while (__atomic_test_and_set(&sessions->lock, __ATOMIC_ACQUIRE))
+        sched_yield();
+}
+
+static void session_unlock(void)
+{
+    __atomic_clear(&sessions->lock, __ATOMIC_RELEASE);
+}
+
+/* map the table of sessions, to be shared by the workers started after */
+int session_init(void)
+{
+    sessions = mmap(NULL, sizeof(*sessions), PROT_READ | PROT_WRITE,
+                    MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (sessions == MAP_FAILED) {
+        sessions = NULL;
+        return -1;
+    }
+    return 0;
+}
+
+/* slot of session id, taking a free one or the one used longest ago if
+ * it is new. NULL without a table */
+struct sd_session *session_attach(unsigned long long id)
+{
+    struct sd_session *s, *oldest = NULL;
+    int i;
+
+    if (!sessions)
+        return NULL;
+    session_lock();
+    for (i = 0; i < SESSION_SLOTS; i++) {
+        s = &sessions->slot[i];
+        if (s->id == id)
+            break;
+        if (!oldest || s->used < oldest->used)
+            oldest = s;
+    }
+    if (i == SESSION_SLOTS) {
+        s = oldest;
+        memset(s, 0, sizeof(*s));
+        s->id = id;
+        sd_log(SD_LOG_INFO, "SD: session %llx | new\n", id);
+    } else
+        sd_log(SD_LOG_INFO, "SD: session %llx | resumed\n", id);
+    s->used = sd_now();
+    session_unlock();
+    return s;
+}
+
+/* about to do write msgid of session id. returns the code it was replied
+ * with if it was done before, or 0 to do it. when it is being done by
+ * another worker, waits up to SESSION_WAIT for it */
+unsigned int session_begin(struct sd_session *s, unsigned long long id, unsigned int msgid)
+{
+    struct sd_session_write *w = &s->writes[msgid & (SESSION_WRITES - 1)];
+    unsigned int code = 0;
+    int waited = 0;
+
+    session_lock();
+    while (s->id == id && w->id == msgid && w->code == SESSION_BUSY && waited++ < SESSION_WAIT) {
+        session_unlock();
+        usleep(1000);
+        session_lock();
+    }
+    if (s->id == id) {          /* the slot may have been taken since */
+        if (w->id == msgid && w->code && w->code != SESSION_BUSY)
+            code = w->code;
+        else {
+            w->id = msgid;
+            w->code = SESSION_BUSY;
+        }
+    }
+    session_unlock();
+    return code;
+}
+
+/* write msgid of session id was replied with code. 0 forgets it, for
+ * writes that were not done */
+void session_end(struct sd_session *s, unsigned long long id, unsigned int msgid, unsigned int code)
+{
+    struct sd_session_write *w = &s->writes[msgid & (SESSION_WRITES - 1)];
+
+    session_lock();
+    if (s->id == id && w->id == msgid)
+        w->code = code;
+    session_unlock();
+}
@@ -0,0 +1,325 @@
+/*
+ * Remote Block Device - shared memory transport
+ *
+ * A client on the same host as the SD connects to the Unix socket given
+ * to sd -U instead of its TCP port. The SD maps a region with two rings
+ * of bytes, requests one way and replies the other, and passes it to the
+ * client through the socket. From then on the messages are the same as
+ * on TCP, but they are copied through the rings without system calls.
+ *
+ * Each ring has a single producer and a single consumer, that only move
+ * their own position. A side that finds its ring empty (or full) polls
+ * it for a while, and then sleeps on a futex of the other position, after
+ * saying so in the ring, so that the other side only makes a system call
+ * to wake it up when it is really asleep. Sleeps end now and then to find
+ * out, through the socket, whether the other end is gone.
+ */
+
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+#include "sd.h"
+
+/* what the SD tells the client along with the region */
+struct shm_hello {
+    unsigned int magic;
+    unsigned int version;
+    unsigned int ring;
+};
+
+static unsigned long long shm_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static long shm_futex(unsigned int *addr, int op, unsigned int val, const struct timespec *ts)
+{
+    return syscall(SYS_futex, addr, op, val, ts, NULL, 0);
+}
+
+static struct sd_shm *shm_new(int fd, struct shm_region *region, int sd, unsigned int poll_us)
+{
+    struct sd_shm *shm;
+    char *data = (char *)region + SHM_HDR;
+
+    if (!(shm = calloc(1, sizeof(*shm))))
+        return NULL;
+    shm->fd = fd;
+    shm->region = region;
+    shm->size = region->ring;
+    shm->rx = sd ? &region->sq : &region->cq;
+    shm->tx = sd ? &region->cq : &region->sq;
+    shm->rxdata = sd ? data : data + region->ring;
+    shm->txdata = sd ? data + region->ring : data;
+    /* with a single CPU, polling only keeps the other side from running */
+    shm->poll_us = sysconf(_SC_NPROCESSORS_ONLN) > 1 ? poll_us : 0;
+    return shm;
+}
+
+/* wait for *word to change from seen, sleeping on it after polling it for
+ * poll_us. -1 if the other end is gone */
+static int shm_wait(struct sd_shm *shm, unsigned int *word, unsigned int seen, int *waiting)
+{
+    struct timespec ts = { 0, SHM_CHECK_MS * 1000000L };
+    struct pollfd pfd;
+    unsigned long long until;
+    int i, rv = 0;
+
+    if (shm->poll_us) {
+        until = shm_now() + shm->poll_us * 1000ULL;
+        do
+            for (i = 0; i < 64; i++)
+                if (__atomic_load_n(word, __ATOMIC_ACQUIRE) != seen)
+                    return 0;
+        while (shm_now() < until);
+    }
+
+    /* the other side checks waiting after moving word */
+    __atomic_store_n(waiting, 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(word, __ATOMIC_SEQ_CST) == seen) {
+        shm->sleeps++;
+        if (shm_futex(word, FUTEX_WAIT, seen, &ts) == -1 && errno == ETIMEDOUT) {
+            pfd.fd = shm->fd;
+            pfd.events = POLLIN | POLLRDHUP;
+            if (poll(&pfd, 1, 0) == 1 && pfd.revents & (POLLHUP | POLLRDHUP | POLLERR)) {
+                errno = ECONNRESET;
+                rv = -1;
+            }
+        }
+    }
+    __atomic_store_n(waiting, 0, __ATOMIC_RELAXED);
+    return rv;
+}
+
+/* publish *pos, and wake up the other side if it sleeps on it */
+static void shm_publish(unsigned int *pos, unsigned int val, int *waiting)
+{
+    __atomic_store_n(pos, val, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(waiting, __ATOMIC_SEQ_CST))
+        shm_futex(pos, FUTEX_WAKE, 1, NULL);
+}
+
+/* take up to size bytes, waiting until there are min of them at least.
+ * returns the bytes taken, or -1 if the other end is gone */
+ssize_t shm_read(struct sd_shm *shm, void *buf, size_t size, size_t min)
+{
+    struct shm_ring *r = shm->rx;
+    unsigned int head = r->head, tail, off, c;
+    size_t n = 0;
+
+    while (n < size) {
+        tail = __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE);
+        if (tail == head) {
+            if (n >= min)
+                break;
+            if (shm_wait(shm, &r->tail, head, &r->tail_wait))
+                return -1;
+            continue;
+        }
+        c = tail - head;
+        if (c > size - n)
+            c = size - n;
+        off = head & (shm->size - 1);
+        if (c > shm->size - off)
+            c = shm->size - off;
+        memcpy((char *)buf + n, shm->rxdata + off, c);
+        head += c;
+        n += c;
+        shm_publish(&r->head, head, &r->head_wait);
+    }
+    return n;
+}
+
+/* put n buffers in the ring, waiting for room as needed */
+int shm_writev(struct sd_shm *shm, const struct iovec *iov, int n)
+{
+    struct shm_ring *r = shm->tx;
+    unsigned int tail = r->tail, head, off, c;
+    const char *p;
+    size_t left;
+    int i;
+
+    for (i = 0; i < n; i++) {
+        p = iov[i].iov_base;
+        left = iov[i].iov_len;
+        while (left) {
+            head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+            if (tail - head == shm->size) {
+                if (shm_wait(shm, &r->head, head, &r->head_wait))
+                    return -1;
+                continue;
+            }
+            c = shm->size - (tail - head);
+            if (c > left)
+                c = left;
+            off = tail & (shm->size - 1);
+            if (c > shm->size - off)
+                c = shm->size - off;
+            memcpy(shm->txdata + off, p, c);
+            tail += c;
+            p += c;
+            left -= c;
+            shm_publish(&r->tail, tail, &r->tail_wait);
+        }
+    }
+    return 0;
+}
+
+int shm_write(struct sd_shm *shm, const void *buf, size_t size)
+{
+    struct iovec iov;
+
+    iov.iov_base = (void *)buf;
+    iov.iov_len = size;
+    return shm_writev(shm, &iov, 1);
+}
+
+/* Unix socket at path for shared memory clients */
+int shm_listen(const char *path)
+{
+    struct sockaddr_un addr;
+    int fd;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+    unlink(path);
+    if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) == -1)
+        return -1;
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1 || listen(fd, 64) == -1) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/* SD side of a client connected on fd: map a region for it and pass it */
+struct sd_shm *shm_accept(int fd, unsigned int poll_us)
+{
+    size_t len = SHM_HDR + 2 * SHM_RING;
+    char cbuf[CMSG_SPACE(sizeof(int))];
+    struct shm_region *region;
+    struct shm_hello hello;
+    struct cmsghdr *cmsg;
+    struct msghdr mh;
+    struct iovec iov;
+    struct sd_shm *shm;
+    int mfd;
+
+    if ((mfd = memfd_create("rbd-shm", MFD_CLOEXEC)) == -1)
+        return NULL;
+    if (ftruncate(mfd, len) == -1 ||
+        (region = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, mfd, 0)) == MAP_FAILED) {
+        close(mfd);
+        return NULL;
+    }
+    region->magic = SHM_MAGIC;
+    region->version = SHM_VERSION;
+    region->ring = SHM_RING;
+
+    hello.magic = SHM_MAGIC;
+    hello.version = SHM_VERSION;
+    hello.ring = SHM_RING;
+    iov.iov_base = &hello;
+    iov.iov_len = sizeof(hello);
+    memset(&mh, 0, sizeof(mh));
+    mh.msg_iov = &iov;
+    mh.msg_iovlen = 1;
+    mh.msg_control = cbuf;
+    mh.msg_controllen = sizeof(cbuf);
+    cmsg = CMSG_FIRSTHDR(&mh);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cmsg), &mfd, sizeof(int));
+    if (sendmsg(fd, &mh, MSG_NOSIGNAL) != sizeof(hello) || !(shm = shm_new(fd, region, 1, poll_us))) {
+        munmap(region, len);
+        close(mfd);
+        return NULL;
+    }
+    close(mfd);
+    return shm;
+}
+
+/* client side: connect to the SD on the Unix socket at path, and map
+ * the region it passes */
+struct sd_shm *shm_connect(const char *path, unsigned int poll_us)
+{
+    char cbuf[CMSG_SPACE(sizeof(int))];
+    struct sockaddr_un addr;
+    struct shm_region *region;
+    struct shm_hello hello;
+    struct cmsghdr *cmsg;
+    struct msghdr mh;
+    struct iovec iov;
+    struct sd_shm *shm;
+    int fd, mfd = -1;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+    if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) == -1)
+        return NULL;
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1)
+        goto err;
+
+    iov.iov_base = &hello;
+    iov.iov_len = sizeof(hello);
+    memset(&mh, 0, sizeof(mh));
+    mh.msg_iov = &iov;
+    mh.msg_iovlen = 1;
+    mh.msg_control = cbuf;
+    mh.msg_controllen = sizeof(cbuf);
+    if (recvmsg(fd, &mh, MSG_WAITALL) != sizeof(hello))
+        goto err;
+    cmsg = CMSG_FIRSTHDR(&mh);
+    if (!cmsg || cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS)
+        goto err;
+    memcpy(&mfd, CMSG_DATA(cmsg), sizeof(int));
+    if (hello.magic != SHM_MAGIC || hello.version != SHM_VERSION ||
+        !hello.ring || hello.ring & (hello.ring - 1)) {
+        errno = EPROTO;
+        goto err;
+    }
+    region = mmap(NULL, SHM_HDR + 2 * (size_t)hello.ring, PROT_READ | PROT_WRITE, MAP_SHARED, mfd, 0);
+    if (region == MAP_FAILED)
+        goto err;
+    close(mfd);
+    if (!(shm = shm_new(fd, region, 0, poll_us))) {
+        munmap(region, SHM_HDR + 2 * (size_t)hello.ring);
+        close(fd);
+        return NULL;
+    }
+    return shm;
+
+err:
+    if (mfd != -1)
+        close(mfd);
+    close(fd);
+    return NULL;
+}
+
+void shm_close(struct sd_shm *shm)
+{
+    munmap(shm->region, SHM_HDR + 2 * (size_t)shm->size);
+    close(shm->fd);
+    free(shm);
+}
+
+void shm_stats(struct sd_shm *shm, FILE *f)
+{
+    fprintf(f, "SD: shm | ring %u KB | sleeps %llu\n", shm->size / 1024, shm->sleeps);
+}
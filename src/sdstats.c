@@ -0,0 +1,256 @@
+/*
+ * Remote Block Device - request stats
+ *
+ * Every worker counts the requests it attends, by operation, and keeps
+ * histograms of the time they spend in each stage: waiting after their
+ * header arrived, receiving the payload, in storage I/O, and sending the
+ * reply. The counters of a worker are only written by it, in its slot of
+ * a table mapped shared before any worker is started, so that connection
+ * processes and reactor threads alike update them without locks or
+ * atomic operations. Reports add up every slot as it is.
+ *
+ * Reports come as text or JSON, in reply to CMD_STATS or to a connection
+ * on the Unix socket given to sd -S. A client of the socket may also send
+ * a QoS rule (see sdqos.c) to be applied before the report.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <signal.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/prctl.h>
+
+#include "sd.h"
+
+static struct sd_stats *stats_table;
+
+static const char *stats_ops[STATS_OPS] = { "read", "write", "other" };
+static const char *stats_stages[STATS_STAGES] = { "recv", "payload", "disk", "reply", "total" };
+
+unsigned long long sd_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* map the table of stats, to be shared by the workers started after */
+int stats_init(void)
+{
+    stats_table = mmap(NULL, STATS_SLOTS * sizeof(struct sd_stats), PROT_READ | PROT_WRITE,
+                       MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (stats_table == MAP_FAILED) {
+        stats_table = NULL;
+        return -1;
+    }
+    return 0;
+}
+
+/* slot for worker owner. when the table is full the worker counts on its
+ * own, and its counts join the table when it is released */
+struct sd_stats *stats_claim(int owner)
+{
+    struct sd_stats *s;
+    int i, free = 0;
+
+    for (i = 1; stats_table && i < STATS_SLOTS; i++)
+        if (__atomic_compare_exchange_n(&stats_table[i].owner, &free, owner, 0,
+                                        __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+            return &stats_table[i];
+        else
+            free = 0;
+    if ((s = calloc(1, sizeof(*s))))
+        s->owner = owner;
+    return s;
+}
+
+static void stats_merge(struct sd_stats *to, struct sd_stats *from)
+{
+    unsigned long long max;
+    struct sd_hist *h, *fh;
+    int op, st, b;
+
+    __atomic_add_fetch(&to->zip_raw, from->zip_raw, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&to->zip_wire, from->zip_wire, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&to->zip_ns, from->zip_ns, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&to->unzip_ns, from->unzip_ns, __ATOMIC_RELAXED);
+    for (op = 0; op < STATS_OPS; op++) {
+        __atomic_add_fetch(&to->requests[op], from->requests[op], __ATOMIC_RELAXED);
+        __atomic_add_fetch(&to->errors[op], from->errors[op], __ATOMIC_RELAXED);
+        __atomic_add_fetch(&to->bytes[op], from->bytes[op], __ATOMIC_RELAXED);
+        for (st = 0; st < STATS_STAGES; st++) {
+            h = &to->hist[op][st];
+            fh = &from->hist[op][st];
+            if (!fh->n)
+                continue;
+            for (b = 0; b < HIST_BUCKETS; b++)
+                if (fh->count[b])
+                    __atomic_add_fetch(&h->count[b], fh->count[b], __ATOMIC_RELAXED);
+            __atomic_add_fetch(&h->n, fh->n, __ATOMIC_RELAXED);
+            __atomic_add_fetch(&h->sum, fh->sum, __ATOMIC_RELAXED);
+            max = h->max;
+            while (fh->max > max && !__atomic_compare_exchange_n(&h->max, &max, fh->max, 0,
+                                                                 __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+                ;
+        }
+    }
+}
+
+/* a worker is gone: keep its counts in slot 0 and free its slot */
+void stats_release(struct sd_stats *s)
+{
+    if (!s)
+        return;
+    if (stats_table)
+        stats_merge(&stats_table[0], s);
+    if (stats_table && s >= stats_table && s < stats_table + STATS_SLOTS) {
+        memset((char *)s + sizeof(s->owner), 0, sizeof(*s) - sizeof(s->owner));
+        __atomic_store_n(&s->owner, 0, __ATOMIC_RELEASE);
+    } else
+        free(s);
+}
+
+/* release the slot of connection process pid, which may not have done it
+ * if it was killed */
+void stats_reap(int pid)
+{
+    int i;
+
+    for (i = 1; stats_table && i < STATS_SLOTS; i++)
+        if (stats_table[i].owner == pid)
+            stats_release(&stats_table[i]);
+}
+
+/* count request req of conn, which failed if rv, arrived at
+ * conn->arrival and was processed from start on */
+void stats_add(struct sd_stats *s, sd_conn_t *conn, struct rbdmsg_hdr *req, int rv,
+               unsigned long long start)
+{
+    unsigned long long now = sd_now();
+    int op;
+
+    op = req->code == CMD_READ ? STATS_READ : req->code == CMD_WRITE ? STATS_WRITE : STATS_OTHER;
+    s->requests[op]++;
+    if (rv)
+        s->errors[op]++;
+    else if (op != STATS_OTHER)
+        s->bytes[op] += req->fsop_size;
+    hist_add(&s->hist[op][STAGE_RECV], start - conn->arrival);
+    hist_add(&s->hist[op][STAGE_PAYLOAD], conn->stage[STAGE_PAYLOAD]);
+    hist_add(&s->hist[op][STAGE_DISK], conn->stage[STAGE_DISK]);
+    hist_add(&s->hist[op][STAGE_REPLY], conn->stage[STAGE_REPLY]);
+    hist_add(&s->hist[op][STAGE_TOTAL], now - conn->arrival);
+
+    /* what compressing its payload cost, if it was */
+    s->zip_raw += conn->zip.raw_bytes - conn->zip_counted.raw_bytes;
+    s->zip_wire += conn->zip.wire_bytes - conn->zip_counted.wire_bytes;
+    s->zip_ns += conn->zip.zip_ns - conn->zip_counted.zip_ns;
+    s->unzip_ns += conn->zip.unzip_ns - conn->zip_counted.unzip_ns;
+    conn->zip_counted = conn->zip;
+}
+
+/* write a report of every slot added up to f, as text or as JSON */
+void stats_report(FILE *f, int json)
+{
+    struct sd_stats *sum;
+    struct sd_hist *h;
+    int i, op, st, workers = 0;
+
+    if (!stats_table || !(sum = calloc(1, sizeof(*sum))))
+        return;
+    for (i = 0; i < STATS_SLOTS; i++) {
+        if (i && !stats_table[i].owner)
+            continue;
+        workers += i > 0;
+        stats_merge(sum, &stats_table[i]);
+    }
+
+    if (json)
+        fprintf(f, "{\"workers\": %d", workers);
+    else
+        fprintf(f, "SD: stats | workers %d\n", workers);
+    for (op = 0; op < STATS_OPS; op++) {
+        if (json)
+            fprintf(f, ", \"%s\": {\"requests\": %llu, \"errors\": %llu, \"bytes\": %llu",
+                    stats_ops[op], sum->requests[op], sum->errors[op], sum->bytes[op]);
+        else
+            fprintf(f, "%-6s requests %llu | errors %llu | bytes %llu\n"
+                    "       stage        mean(us)   p50(us)   p99(us)  p999(us)   max(us)\n",
+                    stats_ops[op], sum->requests[op], sum->errors[op], sum->bytes[op]);
+        for (st = 0; st < STATS_STAGES; st++) {
+            h = &sum->hist[op][st];
+            if (json)
+                fprintf(f, ", \"%s\": {\"mean_us\": %.1f, \"p50_us\": %.1f, \"p99_us\": %.1f, "
+                        "\"p999_us\": %.1f, \"max_us\": %.1f}", stats_stages[st],
+                        h->n ? h->sum / 1e3 / h->n : 0, hist_percentile(h, 0.5) / 1e3,
+                        hist_percentile(h, 0.99) / 1e3, hist_percentile(h, 0.999) / 1e3, h->max / 1e3);
+            else
+                fprintf(f, "       %-8s %11.1f %9.1f %9.1f %9.1f %9.1f\n", stats_stages[st],
+                        h->n ? h->sum / 1e3 / h->n : 0, hist_percentile(h, 0.5) / 1e3,
+                        hist_percentile(h, 0.99) / 1e3, hist_percentile(h, 0.999) / 1e3, h->max / 1e3);
+        }
+        if (json)
+            fprintf(f, "}");
+    }
+    if (json)
+        fprintf(f, ", \"zip\": {\"raw\": %llu, \"wire\": %llu, \"ratio\": %.2f, \"zip_ms\": %.1f, "
+                "\"unzip_ms\": %.1f}", sum->zip_raw, sum->zip_wire,
+                sum->zip_wire ? (double)sum->zip_raw / sum->zip_wire : 0, sum->zip_ns / 1e6,
+                sum->unzip_ns / 1e6);
+    else if (sum->zip_raw)
+        fprintf(f, "zip    raw %llu | wire %llu | ratio %.2f | zip cpu %.1f ms | unzip cpu %.1f ms\n",
+                sum->zip_raw, sum->zip_wire, (double)sum->zip_raw / sum->zip_wire,
+                sum->zip_ns / 1e6, sum->unzip_ns / 1e6);
+    qos_report(f, json);
+    if (json)
+        fprintf(f, "}\n");
+    free(sum);
+}
+
+/* stats process: answer every connection to the Unix socket at path with
+ * a report, in JSON if the client writes "json" first. "qos RULE" applies
+ * the rule first. never returns */
+void stats_serve_run(const char *path)
+{
+    struct sockaddr_un addr;
+    struct timeval tv = { 0, 200000 };
+    char req[256];
+    ssize_t n;
+    FILE *f;
+    int lfd, fd;
+
+    prctl(PR_SET_PDEATHSIG, SIGTERM);
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+    unlink(path);
+    if ((lfd = socket(AF_UNIX, SOCK_STREAM, 0)) == -1 ||
+        bind(lfd, (struct sockaddr *)&addr, sizeof(addr)) == -1 || listen(lfd, 8) == -1) {
+        perror("SD: stats socket");
+        exit(1);
+    }
+    while (1) {
+        if ((fd = accept(lfd, NULL, NULL)) == -1) {
+            if (errno != EINTR)
+                perror("SD: stats socket");
+            continue;
+        }
+        /* the request is optional: wait for it a little */
+        setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+        n = recv(fd, req, sizeof(req) - 1, 0);
+        req[n > 0 ? n : 0] = '\0';
+        if ((f = fdopen(fd, "w"))) {
+            if (!strncmp(req, "qos ", 4) && qos_rule(req + 4))
+                fprintf(f, "SD: bad qos rule: %s\n", req + 4);
+            stats_report(f, !strncmp(req, "json", 4));
+            fclose(f);
+        } else
+            close(fd);
+    }
+}
@@ -5,6 +5,7 @@
 
 #include <netdb.h>
 #include <netinet/in.h>
+#include <arpa/inet.h>
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <stdio.h>
@@ -12,14 +13,21 @@
 #include <string.h>
 #include <stdlib.h>
 #include <assert.h>
+#include <zlib.h>
+#include <time.h>
+#include <unistd.h>
+#include <semaphore.h>
 
 #include "sd.h"
 #include "proto.h"
+#include "rbdclient.h"
 
 int msg_id = 0;
+int sd_port = SDPORT;
 char test_str1[100] = "first test of storage daemon";
 char test_str2[100] = "test connecting and disconnecting the storage daemon";
 char test_str3[100] = "testing opening new connections without closing previous ones";
+char test_str4[100] = "testing checksummed transfers";
 
 union sock
 {
@@ -29,12 +37,14 @@ union sock
 
 union sock sd_sock;
 
+int test_close(int sd);
+
 int test_connect() {
     int sd;
 
     printf(">>> test_connect:\n");
     sd_sock.i.sin_family = AF_INET;
-    sd_sock.i.sin_port = htons(SDPORT);
+    sd_sock.i.sin_port = htons(sd_port);
     sd_sock.i.sin_addr.s_addr = inet_addr("127.0.0.1");
 
     sd = socket(AF_INET, SOCK_STREAM, 0);
@@ -55,6 +65,7 @@ int test_write(int sd, char *str)
     
     printf(">>> test_write: %s\n", str);
     msg.version = PROTO_VERSION;
+    msg.flags = 0;
     msg.type = CMD;
     msg.code = CMD_WRITE;
     msg.id = ++msg_id;
@@ -76,7 +87,7 @@ int test_write(int sd, char *str)
     return 0;
 }
 
-int test_read(int sd, char *expected) 
+int test_read_at(int sd, unsigned int sector, char *expected) 
 {
     int nrv, i;
     struct rbdmsg_hdr msg, rsp;
@@ -84,11 +95,12 @@ int test_read(int sd, char *expected)
 
     printf(">>> test_read: %s\n", expected);
     msg.version = PROTO_VERSION;
+    msg.flags = 0;
     msg.type = CMD;
     msg.code = CMD_READ;
     msg.id = ++msg_id;
     msg.payload_size = 0;
-    msg.fsop_offset_sectors = 50;
+    msg.fsop_offset_sectors = sector;
     msg.fsop_size = 20;
 
     write(sd, &msg, sizeof(struct rbdmsg_hdr));
@@ -104,6 +116,11 @@ int test_read(int sd, char *expected)
     return 0;
 }
 
+int test_read(int sd, char *expected)
+{
+    return test_read_at(sd, 50, expected);
+}
+
 int test_getsz(int sd) 
 {
     int nrv;
@@ -111,6 +128,7 @@ int test_getsz(int sd)
     unsigned long size;
     
     msg.version = PROTO_VERSION;
+    msg.flags = 0;
     msg.type = CMD;
     msg.code = CMD_GETSZ;
     msg.id = ++msg_id;
@@ -127,6 +145,509 @@ int test_getsz(int sd)
     return 0;
 }
 
+int test_hello(int sd, unsigned int features, unsigned long long session)
+{
+    int nrv;
+    struct rbdmsg_hdr msg, rsp;
+    struct rbdmsg_hello hello;
+
+    printf(">>> test_hello: features %x\n", features);
+    msg.version = PROTO_VERSION;
+    msg.flags = 0;
+    msg.type = CMD;
+    msg.code = CMD_HELLO;
+    msg.id = ++msg_id;
+    msg.payload_size = sizeof(hello);
+    hello.features = features;
+    hello.max_transfer = RBD_MAX_TRANSFER;
+    hello.session = session;
+
+    write(sd, &msg, sizeof(struct rbdmsg_hdr));
+    write(sd, &hello, sizeof(hello));
+    nrv = read(sd, &rsp, sizeof(struct rbdmsg_hdr));
+    nrv = read(sd, &hello, rsp.payload_size);
+
+    assert(rsp.id == msg.id);
+    assert(rsp.payload_size == sizeof(hello));
+    assert(hello.features == features);
+    printf("OK\n");
+
+    return 0;
+}
+
+/* write at sector 60 as message id of a session. if replayed, it was 
+ * written before and the SD must not write it again */
+int test_write_session(int sd, unsigned int id, char *str, int replayed)
+{
+    int nrv;
+    struct rbdmsg_hdr msg, rsp;
+    char buf[1024];
+    
+    printf(">>> test_write_session: %u %s%s\n", id, str, replayed ? " (replayed)" : "");
+    msg.version = PROTO_VERSION;
+    msg.flags = 0;
+    msg.type = CMD;
+    msg.code = CMD_WRITE;
+    msg.id = id;
+    msg.payload_size = 100;
+    msg.fsop_offset_sectors = 60;
+    msg.fsop_size = 100;
+
+    write(sd, &msg, sizeof(struct rbdmsg_hdr));
+    bzero(buf, 100);
+    strcpy(buf, str);
+    write(sd, buf, 100);
+    nrv = read(sd, &rsp, sizeof(struct rbdmsg_hdr));
+
+    assert(rsp.id == msg.id);
+    assert(rsp.code == CMD_WRITE);
+    assert(!!(rsp.flags & RBDMSG_REPLAYED) == replayed);
+    printf("OK\n");
+
+    return 0;
+}
+
+/* write with RBD_FEAT_CRC. if corrupt, the checksum sent does not match 
+ * and the SD must refuse the write */
+int test_write_crc(int sd, char *str, int corrupt)
+{
+    int nrv;
+    struct rbdmsg_hdr msg, rsp;
+    char buf[1024];
+    unsigned int crc;
+    
+    printf(">>> test_write_crc: %s%s\n", str, corrupt ? " (corrupt)" : "");
+    msg.version = PROTO_VERSION;
+    msg.flags = 0;
+    msg.type = CMD;
+    msg.code = CMD_WRITE;
+    msg.id = ++msg_id;
+    msg.payload_size = 100 + RBD_CRC_SIZE(100);
+    msg.fsop_offset_sectors = 50;
+    msg.fsop_size = 100;
+
+    bzero(buf, 100);
+    strcpy(buf, str);
+    crc = rbd_crc(buf, 100);
+    if (corrupt)
+        crc ^= 1;
+    memcpy(buf + 100, &crc, sizeof(crc));
+    write(sd, &msg, sizeof(struct rbdmsg_hdr));
+    write(sd, buf, msg.payload_size);
+    nrv = read(sd, &rsp, sizeof(struct rbdmsg_hdr));
+
+    assert(rsp.id == msg.id);
+    assert(rsp.code == (corrupt ? REP_ERR : CMD_WRITE));
+    assert(rsp.payload_size == 0);
+    printf("OK\n");
+
+    return 0;
+}
+
+int test_read_crc(int sd, char *expected) 
+{
+    int nrv;
+    struct rbdmsg_hdr msg, rsp;
+    char buf[1024];
+    unsigned int crc;
+
+    printf(">>> test_read_crc: %s\n", expected);
+    msg.version = PROTO_VERSION;
+    msg.flags = 0;
+    msg.type = CMD;
+    msg.code = CMD_READ;
+    msg.id = ++msg_id;
+    msg.payload_size = 0;
+    msg.fsop_offset_sectors = 50;
+    msg.fsop_size = 20;
+
+    write(sd, &msg, sizeof(struct rbdmsg_hdr));
+    nrv = read(sd, &rsp, sizeof(struct rbdmsg_hdr));
+    nrv = recv(sd, buf, rsp.payload_size, MSG_WAITALL);
+    memcpy(&crc, buf + 20, sizeof(crc));
+
+    assert(rsp.id == msg.id);
+    assert(rsp.payload_size == msg.fsop_size + RBD_CRC_SIZE(msg.fsop_size));
+    assert(crc == rbd_crc(buf, 20));
+    assert(strncmp(buf, expected, 20) == 0);
+    printf("OK\n");
+
+    return 0;
+}
+
+/* write 4K of a repeated string, compressed as RBD_FEAT_ZLIB allows */
+int test_write_zip(int sd, char *str)
+{
+    int nrv;
+    struct rbdmsg_hdr msg, rsp;
+    char raw[4096], buf[8192];
+    uLongf zlen = sizeof(buf);
+    int i;
+
+    printf(">>> test_write_zip: %s\n", str);
+    for (i = 0; i < sizeof(raw); i += 100)
+        strncpy(raw + i, str, sizeof(raw) - i < 100 ? sizeof(raw) - i : 100);
+    assert(compress2((Bytef *)buf, &zlen, (Bytef *)raw, sizeof(raw), 1) == Z_OK);
+
+    msg.version = PROTO_VERSION;
+    msg.flags = RBDMSG_ZLIB;
+    msg.type = CMD;
+    msg.code = CMD_WRITE;
+    msg.id = ++msg_id;
+    msg.payload_size = zlen;
+    msg.fsop_offset_sectors = 100;
+    msg.fsop_size = sizeof(raw);
+
+    write(sd, &msg, sizeof(struct rbdmsg_hdr));
+    write(sd, buf, msg.payload_size);
+    nrv = read(sd, &rsp, sizeof(struct rbdmsg_hdr));
+
+    assert(rsp.id == msg.id);
+    assert(rsp.code == CMD_WRITE);
+    printf("OK\n");
+
+    return 0;
+}
+
+/* read back what test_write_zip wrote, which must come compressed */
+int test_read_zip(int sd, char *expected)
+{
+    int nrv;
+    struct rbdmsg_hdr msg, rsp;
+    char raw[4096], buf[8192];
+    uLongf rlen = sizeof(raw);
+
+    printf(">>> test_read_zip: %s\n", expected);
+    msg.version = PROTO_VERSION;
+    msg.flags = 0;
+    msg.type = CMD;
+    msg.code = CMD_READ;
+    msg.id = ++msg_id;
+    msg.payload_size = 0;
+    msg.fsop_offset_sectors = 100;
+    msg.fsop_size = sizeof(raw);
+
+    write(sd, &msg, sizeof(struct rbdmsg_hdr));
+    nrv = read(sd, &rsp, sizeof(struct rbdmsg_hdr));
+    nrv = recv(sd, buf, rsp.payload_size, MSG_WAITALL);
+
+    assert(rsp.id == msg.id);
+    assert(rsp.flags & RBDMSG_ZLIB);
+    assert(rsp.payload_size < sizeof(raw));
+    assert(uncompress((Bytef *)raw, &rlen, (Bytef *)buf, rsp.payload_size) == Z_OK);
+    assert(rlen == sizeof(raw));
+    assert(strncmp(raw + 3000, expected, strlen(expected)) == 0);
+    printf("OK\n");
+
+    return 0;
+}
+
+/* the stats report must count the write and read made on this connection */
+int test_stats(int sd, int json)
+{
+    int nrv;
+    struct rbdmsg_hdr msg, rsp;
+    char buf[16384];
+
+    printf(">>> test_stats: %s\n", json ? "json" : "text");
+    msg.version = PROTO_VERSION;
+    msg.flags = json ? RBDMSG_JSON : 0;
+    msg.type = CMD;
+    msg.code = CMD_STATS;
+    msg.id = ++msg_id;
+    msg.payload_size = 0;
+
+    write(sd, &msg, sizeof(struct rbdmsg_hdr));
+    nrv = read(sd, &rsp, sizeof(struct rbdmsg_hdr));
+    assert(rsp.id == msg.id);
+    assert(rsp.code == CMD_STATS);
+    assert(rsp.payload_size > 0 && rsp.payload_size < sizeof(buf));
+    nrv = recv(sd, buf, rsp.payload_size, MSG_WAITALL);
+    buf[rsp.payload_size] = '\0';
+
+    if (json)
+        assert(buf[0] == '{' && strstr(buf, "\"write\": {\"requests\": "));
+    else
+        assert(strstr(buf, "write  requests ") && !strstr(buf, "write  requests 0 "));
+    printf("OK\n");
+
+    return 0;
+}
+
+static void test_send_write(int sd, unsigned int sector, char *buf, unsigned int size)
+{
+    struct rbdmsg_hdr msg;
+
+    msg.version = PROTO_VERSION;
+    msg.flags = 0;
+    msg.type = CMD;
+    msg.code = CMD_WRITE;
+    msg.id = ++msg_id;
+    msg.payload_size = size;
+    msg.fsop_offset_sectors = sector;
+    msg.fsop_size = size;
+    write(sd, &msg, sizeof(struct rbdmsg_hdr));
+    write(sd, buf, size);
+}
+
+/* write size bytes at sector and wait for the reply */
+static void test_write_at(int sd, unsigned int sector, char *buf, unsigned int size)
+{
+    struct rbdmsg_hdr rsp;
+
+    test_send_write(sd, sector, buf, size);
+    assert(recv(sd, &rsp, sizeof(rsp), MSG_WAITALL) == sizeof(rsp));
+    assert(rsp.id == msg_id && rsp.code == CMD_WRITE);
+}
+
+/* read size bytes at sector into buf */
+static void test_read_back(int sd, unsigned int sector, char *buf, unsigned int size)
+{
+    struct rbdmsg_hdr msg, rsp;
+
+    msg.version = PROTO_VERSION;
+    msg.flags = 0;
+    msg.type = CMD;
+    msg.code = CMD_READ;
+    msg.id = ++msg_id;
+    msg.payload_size = 0;
+    msg.fsop_offset_sectors = sector;
+    msg.fsop_size = size;
+    write(sd, &msg, sizeof(struct rbdmsg_hdr));
+    assert(recv(sd, &rsp, sizeof(rsp), MSG_WAITALL) == sizeof(rsp));
+    assert(rsp.id == msg.id && rsp.payload_size == size);
+    assert(recv(sd, buf, size, MSG_WAITALL) == size);
+}
+
+/* reads and writes that reach past the end of the volume are answered
+ * with REP_ERR, and the connection goes on */
+int test_range(int sd)
+{
+    struct rbdmsg_hdr msg, rsp;
+    unsigned long size;
+    char buf[4096], back[100];
+
+    printf(">>> test_range:\n");
+    msg.version = PROTO_VERSION;
+    msg.flags = 0;
+    msg.type = CMD;
+    msg.code = CMD_GETSZ;
+    msg.id = ++msg_id;
+    msg.payload_size = 0;
+    write(sd, &msg, sizeof(msg));
+    assert(recv(sd, &rsp, sizeof(rsp), MSG_WAITALL) == sizeof(rsp));
+    assert(recv(sd, &size, sizeof(size), MSG_WAITALL) == sizeof(size));
+
+    memset(buf, 'r', sizeof(buf));
+    test_send_write(sd, size - 4, buf, sizeof(buf));
+    assert(recv(sd, &rsp, sizeof(rsp), MSG_WAITALL) == sizeof(rsp));
+    assert(rsp.id == msg_id && rsp.code == REP_ERR && rsp.payload_size == 0);
+
+    msg.code = CMD_READ;
+    msg.id = ++msg_id;
+    msg.fsop_offset_sectors = size;
+    msg.fsop_size = 512;
+    write(sd, &msg, sizeof(msg));
+    assert(recv(sd, &rsp, sizeof(rsp), MSG_WAITALL) == sizeof(rsp));
+    assert(rsp.id == msg_id && rsp.code == REP_ERR && rsp.payload_size == 0);
+
+    test_read_back(sd, 0, back, sizeof(back));
+    printf("OK\n");
+
+    return 0;
+}
+
+/* writes of partial 4K blocks, sent at once on two connections, that
+ * share the block at the tail of one and the head of the other: the 
+ * read-modify-write of neither may undo the other */
+int test_unaligned(void)
+{
+    struct rbdmsg_hdr rsp;
+    char a[8704], b[512], back[9728];
+    int sa, sb, i;
+
+    printf(">>> test_unaligned:\n");
+    sa = test_connect();
+    sb = test_connect();
+    for (i = 0; i < 64; i++) {
+        memset(a, 'a' + i % 26, sizeof(a));
+        test_send_write(sa, 4096, a, sizeof(a));
+        memset(b, 'A' + i % 26, sizeof(b));
+        test_send_write(sb, 4096 + 18, b, sizeof(b));
+    }
+    for (i = 0; i < 128; i++) {
+        assert(recv(i % 2 ? sb : sa, &rsp, sizeof(rsp), MSG_WAITALL) == sizeof(rsp));
+        assert(rsp.code == CMD_WRITE);
+    }
+
+    test_read_back(sa, 4096, back, sizeof(back));
+    assert(memcmp(back, a, sizeof(a)) == 0);
+    assert(memcmp(back + 9216, b, sizeof(b)) == 0);
+    test_close(sa);
+    test_close(sb);
+    close(sa);
+    close(sb);
+    printf("OK\n");
+
+    return 0;
+}
+
+/* a volume on the block pool at path: identical blocks are stored once,
+ * a partial write of a shared block copies it, and a block is freed with
+ * its last reference */
+int test_dedup(const char *path)
+{
+    struct sd_pool *p;
+    unsigned long used, refs;
+    char a[POOL_BLOCK], b[100], back[POOL_BLOCK], zeros[POOL_BLOCK];
+    int sd;
+
+    printf(">>> test_dedup: %s\n", path);
+    p = pool_open(path);
+    assert(p);
+    used = p->hdr->used;
+    refs = p->hdr->refs;
+    sd = test_connect();
+
+    memset(a, 'd', sizeof(a));
+    sprintf(a, "dedup test block of %d at %ld", getpid(), (long)time(NULL));
+    test_write_at(sd, 8192, a, sizeof(a));
+    test_write_at(sd, 8200, a, sizeof(a));
+    assert(p->hdr->used == used + 1 && p->hdr->refs == refs + 2);
+
+    memset(b, 'b', sizeof(b));
+    test_write_at(sd, 8201, b, sizeof(b));
+    assert(p->hdr->used == used + 2 && p->hdr->refs == refs + 2);
+    test_read_back(sd, 8192, back, sizeof(back));
+    assert(memcmp(back, a, sizeof(a)) == 0);
+    memcpy(a + 512, b, sizeof(b));
+    test_read_back(sd, 8200, back, sizeof(back));
+    assert(memcmp(back, a, sizeof(a)) == 0);
+
+    memset(zeros, 0, sizeof(zeros));
+    test_write_at(sd, 8200, zeros, sizeof(zeros));
+    assert(p->hdr->used == used + 1 && p->hdr->refs == refs + 1);
+    test_write_at(sd, 8192, zeros, sizeof(zeros));
+    assert(p->hdr->used == used && p->hdr->refs == refs);
+    test_read_back(sd, 8192, back, sizeof(back));
+    assert(memcmp(back, zeros, sizeof(zeros)) == 0);
+
+    test_close(sd);
+    close(sd);
+    pool_close(p);
+    printf("OK\n");
+    return 0;
+}
+
+/* an erasure coded volume losing one of its shards, the SD with pid: 
+ * what was written before is rebuilt from the others, and writes go on */
+int test_ec(pid_t pid)
+{
+    char a[65536], b[65536], back[65536];
+    int sd, i;
+
+    printf(">>> test_ec: killing shard %d\n", (int)pid);
+    for (i = 0; i < sizeof(a); i++) {
+        a[i] = i * 7 + i / EC_BLOCK;
+        b[i] = ~a[i];
+    }
+    sd = test_connect();
+    test_write_at(sd, 16384, a, sizeof(a));
+    assert(kill(pid, SIGKILL) == 0);
+    test_read_back(sd, 16384, back, sizeof(back));
+    assert(memcmp(back, a, sizeof(a)) == 0);
+
+    test_write_at(sd, 16384 + 100, b, sizeof(b));
+    test_read_back(sd, 16384 + 100, back, sizeof(back));
+    assert(memcmp(back, b, sizeof(b)) == 0);
+    test_read_back(sd, 16384, back, 100 * STORAGE_SECSIZE);
+    assert(memcmp(back, a, 100 * STORAGE_SECSIZE) == 0);
+
+    test_close(sd);
+    close(sd);
+    printf("OK\n");
+    return 0;
+}
+
+/* wait for the migration process to move extent e to the fast tier, or
+ * out of it. it makes a pass every few seconds */
+static int test_tier_wait(struct sd_tier *t, unsigned long e, int fast)
+{
+    int i;
+
+    for (i = 0; i < 30 && !t->map[e].slot != !fast; i++)
+        sleep(1);
+    return !t->map[e].slot == !fast;
+}
+
+/* write or read back a whole extent, in 64K transfers */
+static void test_tier_io(int sd, unsigned long e, char *buf, int write)
+{
+    unsigned long off;
+
+    for (off = 0; off < TIER_EXTENT; off += 65536)
+        if (write)
+            test_write_at(sd, (e * TIER_EXTENT + off) / STORAGE_SECSIZE, buf + off, 65536);
+        else
+            test_read_back(sd, (e * TIER_EXTENT + off) / STORAGE_SECSIZE, buf + off, 65536);
+}
+
+/* a tiered volume with a fast tier of one extent: an extent used often
+ * is promoted by the migration process, and demoted when another one 
+ * gets much hotter. neither changes on the way */
+int test_tier(char *path)
+{
+    storage_t st;
+    struct sd_tier *t;
+    unsigned long warm = 32, hot = 48;
+    char *a, *b, *back;
+    int sd, i;
+
+    printf(">>> test_tier: %s\n", path);
+    memset(&st, 0, sizeof(st));
+    i = storage_load(&st, path, NULL);
+    assert(i == 0);
+    t = tier_open(&st);
+    assert(t && t->hdr->nslots == 1 && t->hdr->nextents > hot);
+    assert(!t->map[warm].slot && !t->map[hot].slot);
+    a = malloc(TIER_EXTENT);
+    b = malloc(TIER_EXTENT);
+    back = malloc(TIER_EXTENT);
+    assert(a && b && back);
+    for (i = 0; i < TIER_EXTENT; i++) {
+        a[i] = i * 3;
+        b[i] = i * 5 + 1;
+    }
+    sd = test_connect();
+
+    /* 16 writes make it hot */
+    test_tier_io(sd, warm, a, 1);
+    assert(test_tier_wait(t, warm, 1));
+    test_tier_io(sd, warm, back, 0);
+    assert(memcmp(back, a, TIER_EXTENT) == 0);
+
+    /* over twice the heat of the first one takes its place */
+    test_tier_io(sd, hot, b, 1);
+    for (i = 0; i < 100; i++)
+        test_read_back(sd, hot * TIER_EXTENT / STORAGE_SECSIZE, back, 4096);
+    assert(test_tier_wait(t, hot, 1) && !t->map[warm].slot);
+    test_tier_io(sd, warm, back, 0);
+    assert(memcmp(back, a, TIER_EXTENT) == 0);
+    test_tier_io(sd, hot, back, 0);
+    assert(memcmp(back, b, TIER_EXTENT) == 0);
+    assert(t->hdr->promoted >= 2 && t->hdr->demoted >= 1);
+
+    test_close(sd);
+    close(sd);
+    free(a);
+    free(b);
+    free(back);
+    tier_close(t);
+    storage_free(&st);
+    printf("OK\n");
+    return 0;
+}
+
 int test_close(int sd) 
 {
     int nrv;
@@ -134,6 +655,7 @@ int test_close(int sd)
     unsigned long size;
     
     msg.version = PROTO_VERSION;
+    msg.flags = 0;
     msg.type = CMD;
     msg.code = CMD_CLOSE;
     msg.id = ++msg_id;
@@ -148,15 +670,169 @@ int test_close(int sd)
     return 0;
 }
 
+/* a transfer larger than the ring through the shared memory transport at
+ * path, so that it wraps around */
+int test_shm(const char *path)
+{
+    struct rbdmsg_hdr msg, rsp;
+    struct sd_shm *shm;
+    char *buf, *back;
+    unsigned int size = RBD_MAX_TRANSFER, i, pass;
+
+    printf(">>> test_shm: %s\n", path);
+    shm = shm_connect(path, SHM_POLL_US);
+    assert(shm);
+    buf = malloc(size);
+    back = malloc(size);
+    assert(buf && back);
+    for (pass = 0; pass < 3; pass++) {
+        for (i = 0; i < size; i++)
+            buf[i] = i * 7 + pass;
+        msg.version = PROTO_VERSION;
+        msg.flags = 0;
+        msg.type = CMD;
+        msg.code = CMD_WRITE;
+        msg.id = ++msg_id;
+        msg.payload_size = size;
+        msg.fsop_offset_sectors = 2048;
+        msg.fsop_size = size;
+        assert(!shm_write(shm, &msg, sizeof(msg)) && !shm_write(shm, buf, size));
+        assert(shm_read(shm, &rsp, sizeof(rsp), sizeof(rsp)) == sizeof(rsp));
+        assert(rsp.id == msg.id && rsp.code == CMD_WRITE);
+
+        msg.code = CMD_READ;
+        msg.id = ++msg_id;
+        msg.payload_size = 0;
+        assert(!shm_write(shm, &msg, sizeof(msg)));
+        assert(shm_read(shm, &rsp, sizeof(rsp), sizeof(rsp)) == sizeof(rsp));
+        assert(rsp.id == msg.id && rsp.type == REP && rsp.payload_size == size);
+        assert(shm_read(shm, back, size, size) == size);
+        assert(memcmp(buf, back, size) == 0);
+    }
+
+    msg.code = CMD_CLOSE;
+    msg.id = ++msg_id;
+    msg.payload_size = 0;
+    assert(!shm_write(shm, &msg, sizeof(msg)));
+    shm_close(shm);
+    free(buf);
+    free(back);
+    printf("OK\n");
+
+    return 0;
+}
+
+static void test_client_done(struct rbdc_io *io)
+{
+    sem_post(io->priv);
+}
+
+/* blocks written on the completion queue, read back with callbacks, over
+ * several connections to host of the client library */
+int test_client(const char *host)
+{
+    struct rbdc_io ios[16], *done[16];
+    char *wbuf, *rbuf, buf[100];
+    sem_t sem;
+    rbdc_t *c;
+    int i, n;
+
+    printf(">>> test_client: %s\n", host);
+    c = rbdc_open(host, sd_port, 2, 4);
+    assert(c);
+    assert(rbdc_sectors(c) > 0);
+    wbuf = malloc(16 * 4096);
+    rbuf = malloc(16 * 4096);
+    assert(wbuf && rbuf);
+    for (i = 0; i < 16 * 4096; i++)
+        wbuf[i] = i * 13 + msg_id;
+
+    memset(ios, 0, sizeof(ios));
+    for (i = 0; i < 16; i++) {
+        ios[i].code = CMD_WRITE;
+        ios[i].sector = 1024 + i * 8;
+        ios[i].buf = wbuf + i * 4096;
+        ios[i].size = 4096;
+        assert(!rbdc_submit(c, &ios[i]));
+    }
+    for (n = 0; n < 16; n += i) {
+        i = rbdc_reap(c, done + n, 1, 16 - n);
+        assert(i > 0);
+    }
+    for (i = 0; i < 16; i++)
+        assert(done[i]->result == 0);
+
+    sem_init(&sem, 0, 0);
+    for (i = 0; i < 16; i++) {
+        ios[i].code = CMD_READ;
+        ios[i].buf = rbuf + i * 4096;
+        ios[i].done = test_client_done;
+        ios[i].priv = &sem;
+        assert(!rbdc_submit(c, &ios[i]));
+    }
+    for (i = 0; i < 16; i++)
+        sem_wait(&sem);
+    sem_destroy(&sem);
+    for (i = 0; i < 16; i++)
+        assert(ios[i].result == 0);
+    assert(memcmp(wbuf, rbuf, 16 * 4096) == 0);
+
+    assert(!rbdc_write(c, test_str2, 100, 1200));
+    assert(!rbdc_read(c, buf, 100, 1200));
+    assert(strcmp(buf, test_str2) == 0);
+
+    rbdc_close(c);
+    free(wbuf);
+    free(rbuf);
+    printf("OK\n");
+
+    return 0;
+}
+
 int main(int argc,char *argv[])
 {
-    int sd;
+    unsigned long long session;
+    char *shm = NULL, *pool = NULL, *tier = NULL;
+    pid_t shard = 0;
+    int sd, c;
+
+    while ((c = getopt(argc, argv, "U:D:K:T:")) != -1)
+        switch (c) {
+            case 'U':
+                shm = optarg;
+                break;
+            case 'D':
+                pool = optarg;
+                break;
+            case 'K':
+                shard = atoi(optarg);
+                break;
+            case 'T':
+                tier = optarg;
+                break;
+            default:
+                printf("Usage: sdtest [-U SOCKET] [-D POOL] [-K PID] [-T FILE] [REPLICA_PORT]\n");
+                return 2;
+        }
+
+    /* migrations of a tiered volume, first, while its fast tier is empty */
+    if (tier)
+        test_tier(tier);
+
+    /* through the shared memory transport too, if its socket is given */
+    if (shm) {
+        test_shm(shm);
+        test_client(shm);
+    }
 
     /* only one connection */
     sd = test_connect();
     test_write(sd, test_str1);
     test_read(sd, test_str1);
     test_getsz(sd);
+    test_stats(sd, 0);
+    test_stats(sd, 1);
+    test_range(sd);
     test_close(sd);
     close(sd);
 
@@ -182,6 +858,65 @@ int main(int argc,char *argv[])
     test_read(sd, test_str3);
     close(sd);
 
+    /* partial blocks, on two connections at once */
+    test_unaligned();
+
+    /* checksummed transfers */
+    sd = test_connect();
+    test_hello(sd, RBD_FEAT_CRC, 0);
+    test_write_crc(sd, test_str4, 0);
+    test_read_crc(sd, test_str4);
+    test_write_crc(sd, test_str1, 1);
+    test_read_crc(sd, test_str4);
+    test_close(sd);
+    close(sd);
+
+    /* a write sent again on a new connection of its session is not 
+     * done twice */
+    session = (unsigned long long)getpid() << 32 | time(NULL);
+    sd = test_connect();
+    test_hello(sd, RBD_FEAT_SESSION, session);
+    test_write_session(sd, 1000, test_str2, 0);
+    close(sd);
+    sd = test_connect();
+    test_hello(sd, RBD_FEAT_SESSION, session);
+    test_write_session(sd, 1000, test_str3, 1);
+    test_read_at(sd, 60, test_str2);
+    test_write_session(sd, 1001, test_str3, 0);
+    test_read_at(sd, 60, test_str3);
+    test_close(sd);
+    close(sd);
+
+    /* compressed transfers */
+    sd = test_connect();
+    test_hello(sd, RBD_FEAT_ZLIB, 0);
+    test_write_zip(sd, test_str1);
+    test_read_zip(sd, test_str1);
+    test_close(sd);
+    close(sd);
+
+    /* through the client library */
+    test_client("127.0.0.1");
+
+    /* block sharing, when the volume is on a block pool */
+    if (pool)
+        test_dedup(pool);
+
+    /* reads around a shard that is gone, when the volume is erasure coded */
+    if (shard)
+        test_ec(shard);
+
+    /* the replica SD at the port given, if any, must have got every write */
+    if (optind < argc) {
+        sd_port = atoi(argv[optind]);
+        sd = test_connect();
+        test_read(sd, test_str4);
+        test_hello(sd, RBD_FEAT_ZLIB, 0);
+        test_read_zip(sd, test_str1);
+        test_close(sd);
+        close(sd);
+    }
+
 	return 0;
 }
 
@@ -0,0 +1,137 @@
+#!/bin/sh
+# Remote Block Device - storage daemon tests
+#
+# Runs sdtest against SDs serving every kind of volume, in every mode.
+# Build sd, sdfile, sdtest, sdbench and sddelta first (make sd sdfile
+# sdtest sdbench sddelta) and run it from this directory. Ports 8207 and 8301 to 8303 must be free.
+#
+# ./sdtest.sh [DIR]     (DIR holds the volumes and logs, /tmp/sdtest by
+#                        default)
+
+dir=${1:-/tmp/sdtest}
+sd_port="8207"
+pids=""
+
+success() {
+    echo " OK"
+}
+
+fail() {
+    echo " ERROR! (see $dir)"
+    kill $pids 2>/dev/null
+    exit 1
+}
+
+testing() {
+    echo -n ">>> $1..."
+}
+
+# start an SD, logging to $dir/LOG.log: start_sd LOG OPTIONS...
+start_sd() {
+    log=$1
+    shift
+    ./sd -L 0 "$@" > $dir/$log.log 2>&1 &
+    last=$!
+    pids="$pids $last"
+    sleep 1
+}
+
+stop_sds() {
+    kill $pids 2>/dev/null
+    wait 2>/dev/null
+    pids=""
+}
+
+# wait for the SD logging to LOG to print a line matching PATTERN
+wait_log() {
+    for i in $(seq 60); do
+        grep -q "$2" $dir/$1.log && return 0
+        sleep 1
+    done
+    return 1
+}
+
+# sdtest against an SD started with SDOPTS, on a new volume created with
+# FILEOPTS: check NAME "FILEOPTS" "SDOPTS" [SDTEST OPTIONS...]
+check() {
+    name=$1
+    fopts=$2
+    sopts=$3
+    shift 3
+    testing "$name"
+    rm -f $dir/vol*
+    ./sdfile -s 64 $fopts $dir/vol >/dev/null || fail
+    start_sd sd -p $sd_port $sopts $dir/vol
+    timeout 120 ./sdtest "$@" > $dir/sdtest.log 2>&1 || fail
+    stop_sds
+    success
+}
+
+echo "storage daemon tests"
+echo
+
+rm -rf $dir
+mkdir -p $dir || exit 1
+
+check "one process per connection" "" ""
+check "reactor threads" "" "-t 2"
+check "O_DIRECT" "" "-d"
+check "O_DIRECT, reactor threads" "" "-d -t 2"
+check "checksums" "-c" "-t 2"
+check "compressed chunk store" "-Z -c" "-d"
+check "compressed chunk store, reactor threads" "-Z" "-t 2"
+check "shared memory transport" "" "-U $dir/shm" -U $dir/shm
+
+# tight enough that reactors park throttled connections now and then
+echo "volume iops=2000 burst=10 depth=2" > $dir/qos
+check "QoS" "" "-Q $dir/qos"
+check "QoS, reactor threads" "" "-t 2 -Q $dir/qos"
+
+./sdfile -P -s 64 $dir/pool >/dev/null || fail
+check "block pool" "-D $dir/pool" "" -D $dir/pool
+check "block pool, reactor threads" "-D $dir/pool" "-t 2" -D $dir/pool
+
+check "tiered volume" "-T $dir/fast -f 1" "" -T $dir/vol
+
+# a copy of a volume with changed block tracking, made with a full export
+# and then an incremental one of the writes since, ends up the same. the
+# copy tracks its changes too, so that the files have the same header.
+# sdbench is held to a few hundred writes, not to overwrite every block
+# the first export had
+testing "incremental export"
+rm -f $dir/vol* $dir/copy*
+./sdfile -B -s 64 $dir/vol >/dev/null || fail
+./sdfile -B -s 64 $dir/copy >/dev/null || fail
+echo "volume iops=200" > $dir/qos
+start_sd sd -p $sd_port -Q $dir/qos $dir/vol
+timeout 120 ./sdtest > $dir/sdtest.log 2>&1 || fail
+./sddelta -e 0 $dir/vol 2> $dir/sddelta.log > $dir/delta || fail
+./sddelta -a $dir/copy 2>> $dir/sddelta.log < $dir/delta || fail
+epoch=$(sed -n 's/.*export from epoch \([0-9]*\) next time/\1/p' $dir/sddelta.log)
+./sdbench -p $sd_port -w 100 -t 2 > $dir/sdbench.log 2>&1 || fail
+./sddelta -e $epoch $dir/vol 2>> $dir/sddelta.log > $dir/delta || fail
+./sddelta -a $dir/copy 2>> $dir/sddelta.log < $dir/delta || fail
+stop_sds
+cmp $dir/vol $dir/copy > /dev/null || fail
+success
+
+# two data shards and a parity one: data shard 1 is killed in the middle
+# of sdtest, comes back and is rebuilt. shards run a single reactor 
+# thread, so that killing them kills their connections too
+testing "erasure coded volume, losing a shard"
+rm -f $dir/vol* $dir/shard*
+for i in 1 2 3; do
+    ./sdfile -s 16 $dir/shard$i >/dev/null || fail
+    start_sd shard$i -p 830$i -t 1 $dir/shard$i
+    eval shard$i=$last
+done
+./sdfile -k 2 -E 127.0.0.1:8301 -E 127.0.0.1:8302 -E 127.0.0.1:8303 $dir/vol >/dev/null || fail
+start_sd sd -p $sd_port $dir/vol
+wait_log sd "8303 | up" || fail
+timeout 120 ./sdtest -K $shard1 > $dir/sdtest.log 2>&1 || fail
+start_sd shard1 -p 8301 -t 1 $dir/shard1
+wait_log sd "8301 | up" || fail
+kill $shard2
+timeout 120 ./sdtest > $dir/sdtest.log 2>&1 || fail
+stop_sds
+success
@@ -0,0 +1,378 @@
+/*
+ * Remote Block Device - tiered volumes
+ *
+ * A volume created with sdfile -T keeps its data in FILE as usual (the
+ * slow tier), but up to nslots of its TIER_EXTENT bytes extents live in
+ * a second, faster file or device instead (the fast tier). FILE.tier has
+ * the fast tier path and the extent map: for every extent, the fast tier
+ * slot holding it, if any, and its heat.
+ *
+ * Every transfer heats the extents it touches by one. The heat of all of
+ * them is halved every TIER_DECAY seconds, so it counts the recent
+ * accesses. A migration process, forked by the SD, looks every TIER_POLL
+ * seconds for extents of the slow tier with a heat of TIER_MINHEAT or
+ * more and moves the hottest ones to free slots. When there are none
+ * left, it moves back the coldest extents of the fast tier, as long as
+ * the new ones are clearly hotter, so that extents do not bounce. Moves
+ * are spaced to stay under the migration rate of the volume, and only
+ * lock the extent being moved, for the time it takes to copy it.
+ *
+ * An extent is copied and synced before its map entry is changed and
+ * synced, so after a crash it is found where it was or where it went, in
+ * full. The map is shared by every worker and kept across restarts.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/ioctl.h>
+#include <sys/prctl.h>
+#include <linux/fs.h>
+
+#include "sd.h"
+
+#define TIER_POLL 5                 /* seconds between migration passes */
+#define TIER_DECAY 60               /* seconds between heat halvings */
+#define TIER_MINHEAT 8              /* accesses that make an extent hot */
+#define TIER_MAXBATCH 1024          /* extents moved in a pass, at most */
+#define TIER_LOCKBASE (1LL << 40)   /* extent locks offset in FILE.tier */
+
+/* a migration candidate */
+struct tier_cand {
+    unsigned long e;
+    unsigned int heat;
+};
+
+static unsigned long tier_hdrsize(void)
+{
+    return (sizeof(struct tier_header) + STORAGE_ALIGN - 1) & ~(STORAGE_ALIGN - 1);
+}
+
+/* turn a new storage into a tiered volume, keeping hot extents in fast,
+ * a file of fsize bytes or a block device (all of it if fsize is 0).
+ * extents move at rate MB/s at most, TIER_RATE if 0 */
+int storage_tier_create(storage_t *st, const char *fast, unsigned long fsize, unsigned int rate)
+{
+    struct tier_header h;
+    char path[1024 + 8];
+    unsigned long long bytes;
+    struct stat sb;
+    int fd, rv;
+
+    if (strlen(fast) >= sizeof(h.path)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    memset(&h, 0, sizeof(h));
+    strcpy(h.token, TIER_TOKEN);
+    h.version = TIER_VERSION;
+    strcpy(h.path, fast);
+    h.nextents = (st->metadata->size + TIER_EXTENT - 1) / TIER_EXTENT;
+    h.rate = rate ? rate : TIER_RATE;
+
+    if ((fd = open(fast, O_RDWR | O_CREAT, 0644)) == -1)
+        return -1;
+    rv = fstat(fd, &sb);
+    if (!rv && S_ISBLK(sb.st_mode)) {
+        if (!(rv = ioctl(fd, BLKGETSIZE64, &bytes)) && !fsize)
+            fsize = bytes;
+        if (!rv && fsize > bytes) {
+            errno = ENOSPC;
+            rv = -1;
+        }
+    }
+    h.nslots = fsize / TIER_EXTENT;
+    if (!rv && !h.nslots) {
+        errno = EINVAL;
+        rv = -1;
+    }
+    if (!rv && !S_ISBLK(sb.st_mode))
+        rv = ftruncate(fd, h.nslots * TIER_EXTENT);
+    close(fd);
+    if (rv)
+        return -1;
+
+    /* every extent starts on the slow tier, cold */
+    storage_sidecar(st, ".tier", path);
+    if ((fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644)) == -1)
+        return -1;
+    rv = ftruncate(fd, tier_hdrsize() + h.nextents * sizeof(struct tier_extent)) ||
+         storage_pio(fd, &h, sizeof(h), 0, 1);
+    close(fd);
+    if (rv)
+        return -1;
+    st->metadata->features |= STORAGE_F_TIER;
+    return msync(st->metadata, sizeof(storage_metadata_t), MS_SYNC);
+}
+
+/* tiering state for a new worker, with a descriptor of its own so that
+ * its extent locks conflict with the ones of the migration process */
+struct sd_tier *tier_open(storage_t *st)
+{
+    char path[1024 + 8];
+    struct sd_tier *t;
+    struct stat sb;
+    int flags = O_RDWR;
+    int bsize;
+    void *p;
+
+    if (!(t = calloc(1, sizeof(*t))))
+        return NULL;
+    t->fd = -1;
+    storage_sidecar(st, ".tier", path);
+    if ((t->lockfd = open(path, O_RDWR)) == -1 || fstat(t->lockfd, &sb))
+        goto err;
+    t->size = sb.st_size;
+    p = mmap(NULL, t->size, PROT_READ | PROT_WRITE, MAP_SHARED, t->lockfd, 0);
+    if (p == MAP_FAILED)
+        goto err;
+    t->hdr = p;
+    if (strncmp(t->hdr->token, TIER_TOKEN, sizeof(t->hdr->token)) ||
+        t->size < tier_hdrsize() + t->hdr->nextents * sizeof(struct tier_extent)) {
+        errno = EINVAL;
+        goto err;
+    }
+    t->map = (struct tier_extent *)((char *)p + tier_hdrsize());
+
+    if (st->flags & STORAGE_DIRECT)
+        flags |= O_DIRECT;
+    if ((t->fd = open(t->hdr->path, flags)) == -1)
+        goto err;
+    /* direct transfers must be aligned to the blocks of both tiers */
+    if (st->flags & STORAGE_DIRECT && !fstat(t->fd, &sb) && S_ISBLK(sb.st_mode) &&
+        !ioctl(t->fd, BLKSSZGET, &bsize) && bsize > st->align)
+        st->align = bsize;
+    return t;
+
+err:
+    tier_close(t);
+    return NULL;
+}
+
+void tier_close(struct sd_tier *t)
+{
+    if (!t)
+        return;
+    if (t->fd != -1)
+        close(t->fd);
+    if (t->hdr)
+        munmap(t->hdr, t->size);
+    if (t->lockfd != -1)
+        close(t->lockfd);
+    free(t);
+}
+
+static int tier_lock(struct sd_tier *t, unsigned long e, int type)
+{
+    struct flock fl;
+
+    memset(&fl, 0, sizeof(fl));
+    fl.l_type = type;
+    fl.l_whence = SEEK_SET;
+    fl.l_start = TIER_LOCKBASE + e;
+    fl.l_len = 1;
+    while (fcntl(t->lockfd, F_OFD_SETLKW, &fl) == -1)
+        if (errno != EINTR)
+            return -1;
+    return 0;
+}
+
+/* transfer size bytes at offset of a tiered volume, extent by extent,
+ * from whichever tier holds each one */
+int tier_io(storage_t *st, char *buf, unsigned long offset, unsigned long size, int write)
+{
+    struct sd_tier *t = st->tier;
+    unsigned long e, within, len;
+    unsigned int slot;
+    int rv = 0;
+
+    for (; !rv && size; offset += len, buf += len, size -= len) {
+        e = offset / TIER_EXTENT;
+        within = offset % TIER_EXTENT;
+        len = TIER_EXTENT - within < size ? TIER_EXTENT - within : size;
+
+        if (e >= t->hdr->nextents) {
+            errno = ERANGE;
+            return -1;
+        }
+        if (tier_lock(t, e, F_RDLCK))
+            return -1;
+        __sync_fetch_and_add(&t->map[e].heat, 1);
+        if ((slot = t->map[e].slot)) {
+            __sync_fetch_and_add(&t->hdr->fast_ios, 1);
+            rv = storage_fd_io(st, t->fd, buf, (off_t)(slot - 1) * TIER_EXTENT + within, len, write);
+        } else {
+            __sync_fetch_and_add(&t->hdr->slow_ios, 1);
+            rv = storage_fd_io(st, st->fd, buf, st->metadata->data_offset + offset, len, write);
+        }
+        tier_lock(t, e, F_UNLCK);
+    }
+    return rv;
+}
+
+/* move extent e to slot of the fast tier, or back from it. buf holds an
+ * extent. waits after it as long as the migration rate asks for */
+static int tier_move(storage_t *st, struct sd_tier *t, unsigned long e, unsigned long slot,
+                     int promote, char *buf)
+{
+    unsigned long len = st->metadata->size - e * TIER_EXTENT;
+    off_t fast = (off_t)slot * TIER_EXTENT;
+    off_t slow = st->metadata->data_offset + (off_t)e * TIER_EXTENT;
+    unsigned long page;
+    int rv;
+
+    if (len > TIER_EXTENT)
+        len = TIER_EXTENT;
+    if (tier_lock(t, e, F_WRLCK))
+        return -1;
+    if (promote)
+        rv = storage_fd_io(st, st->fd, buf, slow, len, 0) ||
+             storage_fd_io(st, t->fd, buf, fast, len, 1) || fdatasync(t->fd);
+    else
+        rv = storage_fd_io(st, t->fd, buf, fast, len, 0) ||
+             storage_fd_io(st, st->fd, buf, slow, len, 1) || fdatasync(st->fd);
+    if (!rv) {
+        t->map[e].slot = promote ? slot + 1 : 0;
+        page = (unsigned long)&t->map[e] & ~((unsigned long)getpagesize() - 1);
+        rv = msync((void *)page, sizeof(struct tier_extent) + (unsigned long)&t->map[e] - page, MS_SYNC);
+    }
+    tier_lock(t, e, F_UNLCK);
+    if (rv) {
+        perror("SD: tier migration");
+        return -1;
+    }
+    if (promote)
+        __sync_fetch_and_add(&t->hdr->promoted, 1);
+    else
+        __sync_fetch_and_add(&t->hdr->demoted, 1);
+    usleep((unsigned long long)len * 1000000 / ((unsigned long long)t->hdr->rate * 1024 * 1024));
+    return 0;
+}
+
+/* add e to the n best candidates in c, kept sorted, hottest or coldest
+ * first. returns how many there are now */
+static int tier_rank(struct tier_cand *c, int count, int n, unsigned long e, unsigned int heat, int hottest)
+{
+    int i;
+
+    if (count == n && (hottest ? heat <= c[n - 1].heat : heat >= c[n - 1].heat))
+        return count;
+    if (count < n)
+        count++;
+    for (i = count - 1; i > 0 && (hottest ? c[i - 1].heat < heat : c[i - 1].heat > heat); i--)
+        c[i] = c[i - 1];
+    c[i].e = e;
+    c[i].heat = heat;
+    return count;
+}
+
+/* one migration pass, moving up to n extents to the fast tier. owner has
+ * the extent + 1 in each slot, 0 if free */
+static void tier_pass(storage_t *st, struct sd_tier *t, unsigned long *owner,
+                      struct tier_cand *hot, struct tier_cand *cold, int n, char *buf)
+{
+    struct tier_extent x;
+    unsigned long e, slot = 0;
+    int i, c = 0, nhot = 0, ncold = 0;
+
+    for (e = 0; e < t->hdr->nextents; e++) {
+        x = t->map[e];
+        if (x.slot)
+            ncold = tier_rank(cold, ncold, n, e, x.heat, 0);
+        else if (x.heat >= TIER_MINHEAT)
+            nhot = tier_rank(hot, nhot, n, e, x.heat, 1);
+    }
+
+    for (i = 0; i < nhot; i++) {
+        while (slot < t->hdr->nslots && owner[slot])
+            slot++;
+        if (slot == t->hdr->nslots) {
+            /* full: make room if the extent is clearly hotter than the
+             * coldest one there */
+            if (c == ncold || hot[i].heat < 2 * cold[c].heat + TIER_MINHEAT)
+                return;
+            slot = t->map[cold[c].e].slot - 1;
+            if (tier_move(st, t, cold[c].e, slot, 0, buf))
+                return;
+            owner[slot] = 0;
+            c++;
+        }
+        if (tier_move(st, t, hot[i].e, slot, 1, buf))
+            return;
+        owner[slot] = hot[i].e + 1;
+    }
+}
+
+/* migration process of a tiered volume. never returns */
+void tier_migrate_run(storage_t *sd_st)
+{
+    struct tier_cand *hot, *cold;
+    unsigned long *owner, e;
+    struct sd_tier *t;
+    time_t decayed;
+    storage_t st;
+    char *buf;
+    int n;
+
+    prctl(PR_SET_PDEATHSIG, SIGTERM);
+    storage_dup(&st, sd_st);
+    if (storage_open(&st)) {
+        perror("SD: tier migration");
+        exit(1);
+    }
+    t = st.tier;
+
+    /* as many extents as the rate allows in a pass */
+    n = t->hdr->rate * TIER_POLL * (1024 * 1024 / TIER_EXTENT);
+    if (n > TIER_MAXBATCH)
+        n = TIER_MAXBATCH;
+    if (n < 1)
+        n = 1;
+    owner = calloc(t->hdr->nslots, sizeof(*owner));
+    hot = calloc(n, sizeof(*hot));
+    cold = calloc(n, sizeof(*cold));
+    buf = storage_getbuf(&st, TIER_EXTENT);
+    if (!owner || !hot || !cold || !buf) {
+        perror("SD: tier migration");
+        exit(1);
+    }
+    for (e = 0; e < t->hdr->nextents; e++)
+        if (t->map[e].slot)
+            owner[t->map[e].slot - 1] = e + 1;
+
+    decayed = time(NULL);
+    while (1) {
+        sleep(TIER_POLL);
+        if (time(NULL) - decayed >= TIER_DECAY) {
+            for (e = 0; e < t->hdr->nextents; e++)
+                t->map[e].heat >>= 1;
+            decayed = time(NULL);
+        }
+        tier_pass(&st, t, owner, hot, cold, n, buf);
+    }
+}
+
+void tier_stats(storage_t *st, FILE *f)
+{
+    struct sd_tier *t;
+    unsigned long e, used = 0;
+
+    if (!(st->metadata->features & STORAGE_F_TIER) || !(t = tier_open(st)))
+        return;
+    for (e = 0; e < t->hdr->nextents; e++)
+        used += !!t->map[e].slot;
+    fprintf(f, "SD: tiered | fast tier %s | %lu of %lu extents | %u MB/s migrations\n",
+            t->hdr->path, used, t->hdr->nslots, t->hdr->rate);
+    fprintf(f, "SD: tier | promoted %lu | demoted %lu | fast ios %lu | slow ios %lu\n",
+            t->hdr->promoted, t->hdr->demoted, t->hdr->fast_ios, t->hdr->slow_ios);
+    tier_close(t);
+}
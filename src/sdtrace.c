@@ -0,0 +1,130 @@
+/*
+ * Remote Block Device - protocol traces
+ *
+ * With sd -T, every request attended is recorded in a trace file: its
+ * header fields, when it was decoded and how long it took to reply. Each
+ * worker (a connection process, or a reactor thread) buffers its records
+ * and appends TRACE_BATCH of them at a time with a single write, so that
+ * tracing costs two clock reads and a copy per request. Appends to a file
+ * opened O_APPEND do not overlap, so the workers can share it.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/stat.h>
+
+#include "sd.h"
+
+/* create an empty trace at path, and return a descriptor to append to it */
+int trace_create(const char *path)
+{
+    struct trace_header hdr;
+    struct timespec ts;
+    int fd;
+
+    if ((fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND, 0644)) == -1)
+        return -1;
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.token, TRACE_TOKEN, sizeof(hdr.token));
+    hdr.version = TRACE_VERSION;
+    hdr.reclen = sizeof(struct trace_rec);
+    clock_gettime(CLOCK_REALTIME, &ts);
+    hdr.realtime = ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+    if (write(fd, &hdr, sizeof(hdr)) != sizeof(hdr)) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/* trace state for a worker appending to fd. its connections are numbered
+ * from base on */
+struct sd_trace *trace_new(int fd, unsigned int base)
+{
+    struct sd_trace *t;
+
+    if (!(t = malloc(sizeof(*t))))
+        return NULL;
+    t->fd = fd;
+    t->base = base;
+    t->nconns = 0;
+    t->n = 0;
+    return t;
+}
+
+void trace_flush(struct sd_trace *t)
+{
+    if (!t || !t->n)
+        return;
+    if (write(t->fd, t->recs, t->n * sizeof(struct trace_rec)) == -1)
+        perror("SD: trace");
+    t->n = 0;
+}
+
+/* record request req of conn, decoded at arrival and replied with code
+ * reply. the batch is written when full, or when its first record is
+ * TRACE_MAXAGE old, so that an idle worker does not keep it for long */
+void trace_add(struct sd_trace *t, sd_conn_t *conn, struct rbdmsg_hdr *req, int reply,
+               unsigned long long arrival)
+{
+    struct trace_rec *r = &t->recs[t->n++];
+    unsigned long long now = sd_now();
+
+    if (!conn->trace_id)
+        conn->trace_id = t->base + ++t->nconns;
+    r->arrival = arrival;
+    r->service = now - arrival > ~0U ? ~0U : now - arrival;
+    r->conn = conn->trace_id;
+    r->id = req->id;
+    r->offset_sectors = req->fsop_offset_sectors;
+    r->size = req->fsop_size;
+    r->code = req->code;
+    r->reply = reply;
+    r->flags = req->flags;
+    r->pad = 0;
+    if (t->n == TRACE_BATCH || now - t->recs[0].arrival > TRACE_MAXAGE)
+        trace_flush(t);
+}
+
+static int trace_cmp(const void *a, const void *b)
+{
+    const struct trace_rec *x = a, *y = b;
+
+    return x->arrival < y->arrival ? -1 : x->arrival > y->arrival;
+}
+
+/* read the trace at path, with its records sorted by arrival */
+int trace_load(const char *path, struct trace_header *hdr, struct trace_rec **recs,
+               unsigned long *n)
+{
+    struct stat sb;
+    int fd;
+
+    if ((fd = open(path, O_RDONLY)) == -1)
+        return -1;
+    if (fstat(fd, &sb) || storage_pio(fd, hdr, sizeof(*hdr), 0, 0))
+        goto err;
+    if (memcmp(hdr->token, TRACE_TOKEN, sizeof(hdr->token)) || hdr->version != TRACE_VERSION ||
+        hdr->reclen != sizeof(struct trace_rec)) {
+        errno = EINVAL;
+        goto err;
+    }
+    *n = (sb.st_size - sizeof(*hdr)) / sizeof(struct trace_rec);
+    if (!(*recs = malloc(*n * sizeof(struct trace_rec) + 1)))
+        goto err;
+    if (storage_pio(fd, *recs, *n * sizeof(struct trace_rec), sizeof(*hdr), 0)) {
+        free(*recs);
+        goto err;
+    }
+    close(fd);
+    qsort(*recs, *n, sizeof(struct trace_rec), trace_cmp);
+    return 0;
+
+err:
+    close(fd);
+    return -1;
+}
@@ -0,0 +1,93 @@
+/*
+ * Remote Block Device - payload compression on the wire
+ *
+ * Payloads are compressed with zlib at its fastest level, the codec the
+ * kernel module also has (zlib_deflate/zlib_inflate). Compressing is only
+ * worth it for data that shrinks: a message that does not get below 
+ * SD_ZIP_MAXRATIO of its size is sent raw, and after such a message the 
+ * next ones are sent raw without trying, for a number of messages that 
+ * doubles on every failure (up to SD_ZIP_MAXBACKOFF).
+ */
+
+#include <stdio.h>
+#include <time.h>
+#include <zlib.h>
+
+#include "sd.h"
+
+static unsigned long long sd_zip_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* worst case compressed size of len bytes */
+unsigned long sd_zip_bound(unsigned long len)
+{
+    return compressBound(len);
+}
+
+/* compress len bytes of src into dst (sd_zip_bound(len) bytes long). 
+ * returns 0 and the compressed size in dlen, or -1 if the data must be 
+ * sent raw */
+int sd_zip(struct sd_zip_state *z, const void *src, unsigned long len, void *dst, unsigned long *dlen)
+{
+    unsigned long long t;
+    uLongf clen;
+    int rv;
+
+    z->raw_bytes += len;
+    if (z->skip) {
+        z->skip--;
+        z->skipped++;
+        z->wire_bytes += len;
+        return -1;
+    }
+
+    t = sd_zip_now();
+    clen = sd_zip_bound(len);
+    rv = compress2(dst, &clen, src, len, 1);
+    z->zip_ns += sd_zip_now() - t;
+    z->tried++;
+
+    if (rv != Z_OK || clen > len * SD_ZIP_MAXRATIO / 100) {
+        z->backoff = z->backoff ? z->backoff * 2 : 1;
+        if (z->backoff > SD_ZIP_MAXBACKOFF)
+            z->backoff = SD_ZIP_MAXBACKOFF;
+        z->skip = z->backoff;
+        z->wire_bytes += len;
+        return -1;
+    }
+    z->backoff = 0;
+    z->wire_bytes += clen;
+    *dlen = clen;
+    return 0;
+}
+
+/* uncompress len bytes of src into exactly dlen bytes of dst */
+int sd_unzip(struct sd_zip_state *z, const void *src, unsigned long len, void *dst, unsigned long dlen)
+{
+    unsigned long long t;
+    uLongf rlen = dlen;
+    int rv;
+
+    t = sd_zip_now();
+    rv = uncompress(dst, &rlen, src, len);
+    z->unzip_ns += sd_zip_now() - t;
+    z->raw_bytes += dlen;
+    z->wire_bytes += len;
+    z->unzipped++;
+    return rv == Z_OK && rlen == dlen ? 0 : -1;
+}
+
+void sd_zip_stats(struct sd_zip_state *z, FILE *f)
+{
+    if (!z->raw_bytes)
+        return;
+    fprintf(f, "SD: compression | raw %llu | wire %llu | ratio %.2f | compressed %lu "
+            "(%lu skipped) | zip %.3f ms | unzipped %lu (%.3f ms)\n",
+            z->raw_bytes, z->wire_bytes, (double)z->raw_bytes / z->wire_bytes, 
+            z->tried, z->skipped, z->zip_ns / 1e6, z->unzipped, z->unzip_ns / 1e6);
+}